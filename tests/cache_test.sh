@@ -0,0 +1,219 @@
+#!/bin/bash
+# Block Cache Test for TFS Distributed File System
+# Reads data written by the mock control device back through the admin socket's
+# read command and checks the block cache: misses then hits, promotion from the
+# ghost queue after a scan, hot blocks surviving a second scan, and no stale
+# content after concurrent appends to the block being read
+# No kernel module or root privileges needed (python3 is used as the admin client)
+# Run as: ./cache_test.sh [tfsd_binary]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+WORK_DIR=$(mktemp -d /tmp/tfs_cache.XXXXXX)
+LOG_FILE="tfs_cache_test.log"
+CACHE_MB=16
+FOLLOW_SECONDS=${FOLLOW_SECONDS:-5}
+INO=2                   # 模拟设备的第一个文件
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ ! -x "$TFSD" ]; then
+    log_error "tfsd binary not found: $TFSD"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+if ! command -v python3 &> /dev/null; then
+    log_info "python3 not found, skipping"
+    exit 0
+fi
+
+PID=
+cleanup() {
+    [ -n "$PID" ] && kill -TERM $PID 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# 管理套接字客户端: 每个连接一条命令
+# follow模式跟着写入的位置逐块读取, 最后再读一遍先读到不完整、之后读到完整的块, 输出偏移和CRC
+cat > "$WORK_DIR/admin.py" << 'EOF'
+import socket, sys, time
+
+def admin(path, line):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    s.sendall((line + "\n").encode())
+    out = b""
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        out += chunk
+    s.close()
+    return out.decode().strip()
+
+def read_block(path, ino, off):
+    reply = admin(path, "read %d %d 4096" % (ino, off))
+    if not reply.endswith(tuple("0123456789abcdef")) or " bytes, crc32c " not in reply:
+        sys.exit("unexpected reply: " + reply)
+    n, crc = reply.split(" bytes, crc32c ")
+    return int(n), crc
+
+path = sys.argv[1]
+if sys.argv[2] == "follow":
+    ino, deadline = int(sys.argv[3]), time.time() + float(sys.argv[4])
+    off, partial, seen = 0, False, []
+    while time.time() < deadline:
+        n, crc = read_block(path, ino, off)
+        if n == 4096:
+            if partial:
+                seen.append(off)
+            off, partial = off + 4096, False
+        elif n > 0:
+            partial = True
+    # 等写入位置远在这些块之后 (刚读到完整时中间可能还有没落盘的空洞)
+    time.sleep(1)
+    for off in seen:
+        print(off, read_block(path, ino, off)[1])
+elif sys.argv[2] == "check":
+    ino, bad = int(sys.argv[3]), 0
+    for line in sys.stdin:
+        off, crc = line.split()
+        if read_block(path, ino, int(off)) != (4096, crc):
+            bad += 1
+    print(bad)
+else:
+    print(admin(path, " ".join(sys.argv[2:])))
+EOF
+
+admin() {
+    python3 "$WORK_DIR/admin.py" "$WORK_DIR/tfsd.sock" "$@"
+}
+
+# 启动空闲的tfsd并等管理套接字可用, 参数附加在命令行后
+start_idle() {
+    (cd "$WORK_DIR" && exec "$TFSD" --mock 0 -S 4 -D ./data -H none "$@") &
+    PID=$!
+    for i in $(seq 1 100); do
+        admin metrics > /dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    log_error "Admin socket did not come up"
+    exit 1
+}
+
+stop() {
+    kill -TERM $PID 2>/dev/null
+    wait $PID
+    PID=
+}
+
+# 读缓存的计数器, 参数为指标名和标签取值
+counter() {
+    admin metrics | grep "^$1{.*\"$2\"}" | awk '{print $2}'
+}
+
+# 整块对齐的热区间R, 一个不对齐的区间, 两次互不重叠的扫描
+# 每次扫描约为缓存容量的1.25倍: 足以把R挤出A1in, 又不会把R的键挤出A1out
+RANGES=("0 65536" "5000 10000" "4194304 20971520" "27262976 20971520")
+
+log_info "Writing 500 transfers of 100000 bytes to one file"
+if ! (cd "$WORK_DIR" && "$TFSD" --mock 500 --mock-size 100000 --mock-files 1 -S 4 -D ./data -A none -H none); then
+    log_error "tfsd exited with an error"
+    exit 1
+fi
+
+# 不带缓存读出的内容作为基准
+start_idle --cache-mb 0
+declare -A REF
+for r in "${RANGES[@]}"; do
+    REF[$r]=$(admin read $INO $r)
+done
+stop
+
+FAILED=0
+expect_read() {
+    local got
+    got=$(admin read $INO $1)
+    if [ "$got" != "${REF[$1]}" ]; then
+        log_error "read $1 through the cache returned \"$got\", expected \"${REF[$1]}\""
+        FAILED=1
+    fi
+}
+
+log_info "Reading back through a $CACHE_MB MB cache"
+start_idle --cache-mb $CACHE_MB
+hot="${RANGES[0]}"
+
+expect_read "$hot"
+misses=$(counter tfsd_block_cache_lookups_total miss)
+expect_read "$hot"
+hits=$(counter tfsd_block_cache_lookups_total hit)
+expect_read "${RANGES[1]}"
+log_result "first read: $misses misses, second read: $hits hits"
+if [ "$misses" != 16 ] || [ "$hits" != 16 ]; then
+    log_error "Expected 16 misses and then 16 hits for the 64 KB range"
+    FAILED=1
+fi
+
+expect_read "${RANGES[2]}"
+expect_read "$hot"
+promoted=$(counter tfsd_block_cache_events_total promotions)
+before=$(counter tfsd_block_cache_lookups_total hit)
+expect_read "${RANGES[3]}"
+expect_read "$hot"
+survived=$(( $(counter tfsd_block_cache_lookups_total hit) - before ))
+log_result "after a scan: $promoted blocks promoted from the ghost queue, $survived still cached after a second scan"
+if [ "$promoted" -eq 0 ] || [ "$survived" -lt "$promoted" ]; then
+    log_error "Re-read blocks were not promoted or did not survive a scan"
+    FAILED=1
+fi
+stop
+
+# 边写边读: 写入位置所在的块先被读到不完整的内容放入缓存, 之后的追加必须让它失效
+# read命令在worker上执行, 两个worker才能让读取和另一个worker上的追加竞争
+log_info "Following a live writer for $FOLLOW_SECONDS s"
+rm -rf "$WORK_DIR/data"
+(cd "$WORK_DIR" && exec "$TFSD" --mock 100000000 --mock-size 100 --mock-files 1 -w 2 -S 4 -D ./data -H none \
+    --cache-mb $CACHE_MB) &
+PID=$!
+for i in $(seq 1 100); do
+    admin metrics > /dev/null 2>&1 && break
+    sleep 0.1
+done
+admin follow $INO $FOLLOW_SECONDS > "$WORK_DIR/followed"
+stale=$(counter tfsd_block_cache_events_total stale_fills)
+stop
+
+start_idle --cache-mb 0
+bad=$(admin check $INO < "$WORK_DIR/followed")
+stop
+followed=$(wc -l < "$WORK_DIR/followed")
+log_result "$followed blocks read while being appended, $bad differ after restart, $stale stale fills dropped"
+if [ "$followed" -eq 0 ] || [ "$bad" != 0 ]; then
+    log_error "Cached blocks went stale after appends"
+    FAILED=1
+fi
+if [ "$stale" -eq 0 ]; then
+    log_error "No read raced an append, stale fills were not exercised"
+    FAILED=1
+fi
+
+exit $FAILED
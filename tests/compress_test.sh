@@ -0,0 +1,111 @@
+#!/bin/bash
+# Compression Test for TFS Distributed File System
+# Writes log-like mock transfers with a directory compression rule, checks that
+# the segments hold much less than the logical data, then restarts tfsd without
+# any compression options and checks that every byte is recovered
+# Random transfers must be stored uncompressed by the entropy check
+# No kernel module or root privileges needed
+# Run as: ./compress_test.sh [tfsd_binary]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+WORK_DIR=$(mktemp -d /tmp/tfs_compress.XXXXXX)
+LOG_FILE="tfs_compress_test.log"
+TRANSFERS=${TRANSFERS:-2000}
+SIZE=${SIZE:-100000}
+SEGMENT_MB=4
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ ! -x "$TFSD" ]; then
+    log_error "tfsd binary not found: $TFSD"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+
+cleanup() {
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# 编译时没有的编码会被拒绝, 两个都没有时跳过
+CODEC=""
+for c in zstd lz4; do
+    if "$TFSD" --compress $c --help >/dev/null 2>&1; then
+        CODEC=$c
+        break
+    fi
+done
+if [ -z "$CODEC" ]; then
+    log_info "tfsd was built without lz4 and zstd, skipping"
+    exit 0
+fi
+
+# 指标中某种数据量的计数
+metric() {
+    grep "tfsd_compress_bytes_total{kind=\"$2\"}" "$1" | awk '{print $2}'
+}
+
+# 模拟文件都在根目录下, 默认不压缩, 由目录规则启用
+log_info "Writing $TRANSFERS log-like transfers of $SIZE bytes with $CODEC"
+mkdir -p "$WORK_DIR/text"
+if ! (cd "$WORK_DIR/text" && "$TFSD" --mock $TRANSFERS --mock-size $SIZE --mock-text -S $SEGMENT_MB -D ./data \
+        -A none -H none -M metrics.prom --compress-dir /=$CODEC); then
+    log_error "tfsd exited with an error"
+    exit 1
+fi
+expected=$((TRANSFERS * SIZE))
+stored=$(( $(ls "$WORK_DIR/text/data/segments" | grep -c '\.dat$') * SEGMENT_MB * 1024 * 1024 ))
+log_result "$expected bytes written, $stored bytes of segments, $(metric "$WORK_DIR/text/metrics.prom" out) compressed"
+
+FAILED=0
+if [ "$stored" -ge $((expected / 2)) ]; then
+    log_error "Text data was not compressed"
+    FAILED=1
+fi
+
+# 重启时不带压缩选项, 记录头中保存了编码
+(cd "$WORK_DIR/text" && exec "$TFSD" --mock 0 -S $SEGMENT_MB -D ./data -A none -H none) &
+pid=$!
+sleep 2
+kill -TERM $pid 2>/dev/null
+wait $pid
+live=$(grep "Storage recovered" "$WORK_DIR/text/tfsd.log" | tail -1 | sed 's/.*segments, \([0-9]*\) live bytes.*/\1/')
+log_result "after restart: $live live bytes (expected $expected)"
+if [ "$live" != "$expected" ]; then
+    log_error "Data lost after restart"
+    FAILED=1
+fi
+
+# 伪随机数据由熵检查直接跳过
+log_info "Writing $TRANSFERS random transfers of $SIZE bytes with $CODEC"
+mkdir -p "$WORK_DIR/random"
+if ! (cd "$WORK_DIR/random" && "$TFSD" --mock $TRANSFERS --mock-size $SIZE -S $SEGMENT_MB -D ./data \
+        -A none -H none -M metrics.prom --compress $CODEC); then
+    log_error "tfsd exited with an error"
+    exit 1
+fi
+skipped=$(metric "$WORK_DIR/random/metrics.prom" skipped)
+log_result "$skipped of $expected random bytes stored uncompressed"
+if [ "$skipped" != "$expected" ]; then
+    log_error "Random data was not skipped by the entropy check"
+    FAILED=1
+fi
+
+exit $FAILED
@@ -0,0 +1,76 @@
+#!/bin/bash
+# Deduplication Test for TFS Distributed File System
+# Writes mock transfers that share most of their content with --dedup, checks
+# that the segments hold much less than the logical data, then restarts tfsd
+# and checks that every byte is recovered through the chunk references
+# No kernel module or root privileges needed
+# Run as: ./dedup_test.sh [tfsd_binary]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+WORK_DIR=$(mktemp -d /tmp/tfs_dedup.XXXXXX)
+LOG_FILE="tfs_dedup_test.log"
+TRANSFERS=${TRANSFERS:-2000}
+SIZE=${SIZE:-100000}
+SEGMENT_MB=4
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ ! -x "$TFSD" ]; then
+    log_error "tfsd binary not found: $TFSD"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+
+cleanup() {
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# 模拟设备的传输都取自同一个16MB的数据池, 彼此大量重复
+log_info "Writing $TRANSFERS transfers of $SIZE bytes with deduplication"
+if ! (cd "$WORK_DIR" && "$TFSD" --mock $TRANSFERS --mock-size $SIZE -S $SEGMENT_MB -D ./data -A none -H none --dedup); then
+    log_error "tfsd exited with an error"
+    exit 1
+fi
+expected=$((TRANSFERS * SIZE))
+stored=$(( $(ls "$WORK_DIR/data/segments" | grep -c '\.dat$') * SEGMENT_MB * 1024 * 1024 ))
+log_result "$expected bytes written, $stored bytes of segments"
+
+FAILED=0
+if [ "$stored" -ge $((expected / 2)) ]; then
+    log_error "Duplicate data was not deduplicated"
+    FAILED=1
+fi
+
+# 重启后经引用记录恢复出全部数据
+(cd "$WORK_DIR" && exec "$TFSD" --mock 0 -S $SEGMENT_MB -D ./data -A none -H none --dedup) &
+pid=$!
+sleep 2
+kill -TERM $pid 2>/dev/null
+wait $pid
+live=$(grep "Storage recovered" "$WORK_DIR/tfsd.log" | tail -1 | sed 's/.*segments, \([0-9]*\) live bytes.*/\1/')
+chunks=$(grep "Deduplication:" "$WORK_DIR/tfsd.log" | tail -1 | sed 's/.*Deduplication: \([0-9]*\) chunks.*/\1/')
+log_result "after restart: $live live bytes (expected $expected), $chunks chunks indexed"
+if [ "$live" != "$expected" ]; then
+    log_error "Data lost after restart"
+    FAILED=1
+fi
+
+exit $FAILED
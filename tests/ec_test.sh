@@ -0,0 +1,106 @@
+#!/bin/bash
+# Erasure Coding Test for TFS Distributed File System
+# Writes data with the mock control device, lets tfsd erasure-code the sealed
+# segments into K+M target directories, then removes M targets and checks that
+# every byte is still recovered from the remaining shards
+# No kernel module or root privileges needed
+# Run as: ./ec_test.sh [tfsd_binary]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+WORK_DIR=$(mktemp -d /tmp/tfs_ec.XXXXXX)
+LOG_FILE="tfs_ec_test.log"
+TRANSFERS=${TRANSFERS:-2000}
+SIZE=${SIZE:-100000}
+K=${K:-4}
+M=${M:-2}
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ ! -x "$TFSD" ]; then
+    log_error "tfsd binary not found: $TFSD"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+
+cleanup() {
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+EC_ARGS=(--ec $K+$M --ec-after 0)
+for i in $(seq 0 $((K + M - 1))); do
+    EC_ARGS+=(--ec-target "$WORK_DIR/target$i")
+done
+
+# 在空闲的模拟设备上启动, 运行$1秒后退出, 输出恢复出的有效字节数
+run_idle() {
+    (cd "$WORK_DIR" && exec "$TFSD" --mock 0 -S 4 -D ./data -A none -H none "${EC_ARGS[@]}") &
+    local pid=$!
+    sleep $1
+    kill -TERM $pid 2>/dev/null
+    wait $pid
+    grep "Storage recovered" "$WORK_DIR/tfsd.log" | tail -1 | sed 's/.*segments, \([0-9]*\) live bytes.*/\1/'
+}
+
+# 同上, 但一直等到回收线程 (每5秒检查一次) 编码完所有封存段, 最多等$1秒
+# 慢机器上编码一轮可能跨多个检查周期, 不能按固定时间等
+run_until_archived() {
+    (cd "$WORK_DIR" && exec "$TFSD" --mock 0 -S 4 -D ./data -A none -H none "${EC_ARGS[@]}") &
+    local pid=$!
+    local deadline=$((SECONDS + $1))
+    sleep 1
+    while [ $SECONDS -lt $deadline ] && ls "$WORK_DIR/data/segments" | grep -q '\.dat$'; do
+        sleep 1
+    done
+    kill -TERM $pid 2>/dev/null
+    wait $pid
+}
+
+log_info "Writing $TRANSFERS transfers of $SIZE bytes"
+if ! (cd "$WORK_DIR" && "$TFSD" --mock $TRANSFERS --mock-size $SIZE -S 4 -D ./data -A none -H none); then
+    log_error "tfsd exited with an error"
+    exit 1
+fi
+expected=$((TRANSFERS * SIZE))
+
+log_info "Encoding sealed segments into $K+$M shards"
+run_until_archived ${EC_DEADLINE:-300}
+local_segments=$(ls "$WORK_DIR/data/segments" | grep -c '\.dat$')
+shards=$(ls "$WORK_DIR/target0" | grep -c '\.ec$')
+log_result "$shards segments encoded, $local_segments local segment files left"
+
+FAILED=0
+if [ "$shards" -eq 0 ] || [ "$local_segments" -ne 0 ]; then
+    log_error "Sealed segments were not erasure-coded"
+    FAILED=1
+fi
+
+# 去掉M个目标, 数据只能从剩下的分片中重建
+for i in $(seq 1 $M); do
+    rm -rf "$WORK_DIR/target$i"
+done
+live=$(run_idle 2)
+log_result "with $M targets lost: $live live bytes (expected $expected)"
+if [ "$live" != "$expected" ]; then
+    log_error "Data lost after removing $M targets"
+    FAILED=1
+fi
+
+exit $FAILED
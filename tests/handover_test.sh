@@ -0,0 +1,120 @@
+#!/bin/bash
+# Hot Upgrade Test for TFS Distributed File System
+# Starts a tfsd driven by the mock control device, takes it over with a second
+# tfsd halfway through the workload and checks that the new process finishes
+# every transfer, that only the metadata log tail is replayed during the pause
+# (the namespace was prescanned from a checkpoint), how long writers were paused,
+# and that a restart recovers all data and inodes
+# No kernel module or root privileges needed
+# Run as: ./handover_test.sh [tfsd_binary]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+WORK_DIR=$(mktemp -d /tmp/tfs_handover.XXXXXX)
+LOG_FILE="tfs_handover_test.log"
+TRANSFERS=${TRANSFERS:-40000}
+SIZE=${SIZE:-16384}
+FILES=${FILES:-30000}           # 3万个create约2 MB日志, 超过1 MB的检查点阈值
+PAUSE_LIMIT_MS=${PAUSE_LIMIT_MS:-500}
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ ! -x "$TFSD" ]; then
+    log_error "tfsd binary not found: $TFSD"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+
+OLD_PID=
+cleanup() {
+    [ -n "$OLD_PID" ] && kill -TERM $OLD_PID 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# 两个进程共用数据目录和交接套接字, 各自在自己的目录里写tfsd.log
+ARGS=(--mock-size $SIZE --mock-files $FILES -w 2 -S 16 --checkpoint-mb 1 -D ../data -A none -H ../tfsd.handover)
+mkdir -p "$WORK_DIR/old" "$WORK_DIR/new"
+
+log_info "Starting a tfsd with $TRANSFERS transfers of $SIZE bytes over $FILES files"
+(cd "$WORK_DIR/old" && exec "$TFSD" --mock $TRANSFERS "${ARGS[@]}") &
+OLD_PID=$!
+# 等文件都创建完 (日志做过检查点) 并开始传输
+for i in $(seq 1 300); do
+    grep -q "Metadata checkpoint" "$WORK_DIR/old/tfsd.log" 2>/dev/null && break
+    sleep 0.1
+done
+sleep 1
+
+log_info "Taking over with a second tfsd"
+if ! (cd "$WORK_DIR/new" && "$TFSD" --mock 1 --takeover "${ARGS[@]}"); then
+    log_error "The new tfsd exited with an error"
+    exit 1
+fi
+wait $OLD_PID
+OLD_PID=
+
+old_log="$WORK_DIR/old/tfsd.log"
+new_log="$WORK_DIR/new/tfsd.log"
+FAILED=0
+
+checkpoints=$(grep -c "Metadata checkpoint:" "$old_log")
+handed=$(grep "Processed .* transfers" "$old_log" | sed 's/.*Processed \([0-9]*\) transfers.*/\1/')
+log_result "old tfsd: $checkpoints checkpoints, $handed transfers before handing over"
+if [ "$checkpoints" -eq 0 ] || ! grep -q "Handed control device over" "$old_log"; then
+    log_error "The old tfsd did not checkpoint or did not hand over"
+    FAILED=1
+fi
+
+prescan=$(grep "Metadata prescan:" "$new_log" | sed 's/.*Metadata prescan: //')
+tail_ops=$(grep "Metadata store recovered:" "$new_log" | sed 's/.*, \([0-9]*\) log ops replayed.*/\1/')
+pause=$(grep "Takeover pause:" "$new_log" | sed 's/.*Takeover pause: //')
+pause_us=$(sed 's/resumed fetching \([0-9]*\) us.*/\1/' <<< "$pause")
+log_result "new tfsd: prescan $prescan; $tail_ops log ops replayed after the handover"
+log_result "pause: $pause"
+if [ -z "$pause_us" ] || [ "$pause_us" -gt $((PAUSE_LIMIT_MS * 1000)) ]; then
+    log_error "Writers were paused for more than $PAUSE_LIMIT_MS ms"
+    FAILED=1
+fi
+
+result=$(grep "Mock workload" "$new_log" | sed 's/.*Mock workload: //')
+log_result "workload: $result"
+if ! grep -q "^$TRANSFERS/$TRANSFERS transfers completed (0 failed)" <<< "$result"; then
+    log_error "The new tfsd did not finish the workload"
+    FAILED=1
+fi
+
+# 重新打开数据目录, 全部数据和inode都在
+mkdir -p "$WORK_DIR/check"
+(cd "$WORK_DIR/check" && exec "$TFSD" --mock 0 -D ../data -A none -H none) &
+pid=$!
+sleep 2
+kill -TERM $pid
+wait $pid
+live=$(grep "Storage recovered" "$WORK_DIR/check/tfsd.log" | sed 's/.*segments, \([0-9]*\) live bytes.*/\1/')
+inodes=$(grep "Metadata store recovered" "$WORK_DIR/check/tfsd.log" | sed 's/.*recovered: \([0-9]*\) inodes.*/\1/')
+expected=$((TRANSFERS * SIZE))
+log_result "after restart: $live live bytes (expected $expected), $inodes inodes (expected $((FILES + 1)))"
+if [ "$live" != "$expected" ] || [ "$inodes" != $((FILES + 1)) ]; then
+    log_error "Data or inodes were lost across the handover"
+    FAILED=1
+fi
+
+exit $FAILED
@@ -165,7 +165,7 @@ start_daemon() {
     # Check if daemon exists
     if [ ! -f "tfsd/tfsd" ]; then
         log_error "Daemon executable not found. Building..."
-        g++ -std=c++11 -O2 -o tfsd/tfsd tfsd/tfsd.cpp >> $LOG_FILE 2>&1
+        (cd tfsd && sh build.sh) >> $LOG_FILE 2>&1
         
         if [ ! -f "tfsd/tfsd" ]; then
             log_error "Failed to build daemon"
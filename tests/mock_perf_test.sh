@@ -0,0 +1,63 @@
+#!/bin/bash
+# Daemon-only Performance Test for TFS Distributed File System
+# Runs tfsd against its in-process mock control device, so no kernel module,
+# root privileges or mount point are needed (suitable for CI containers)
+# Run as: ./mock_perf_test.sh [tfsd_binary]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+WORK_DIR=$(mktemp -d /tmp/tfs_mock_perf.XXXXXX)
+LOG_FILE="tfs_mock_perf_test.log"
+TRANSFERS=${TRANSFERS:-100000}
+TEST_SIZES=(4096 65536 1048576) # bytes
+WORKERS=${WORKERS:-$(nproc)}
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ ! -x "$TFSD" ]; then
+    log_error "tfsd binary not found: $TFSD"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+FAILED=0
+for size in "${TEST_SIZES[@]}"; do
+    # 大传输的数据量大, 按比例减少个数
+    count=$((TRANSFERS * 4096 / size))
+    [ $count -lt 100 ] && count=100
+    run_dir="$WORK_DIR/$size"
+    mkdir -p "$run_dir"
+    log_info "Running $count transfers of $size bytes with $WORKERS workers"
+    if ! (cd "$run_dir" && "$TFSD" --mock $count --mock-size $size -w $WORKERS -D ./data -A none); then
+        log_error "tfsd exited with an error for size $size"
+        FAILED=1
+        continue
+    fi
+    result=$(grep "Mock workload" "$run_dir/tfsd.log" | sed 's/.*Mock workload: //')
+    log_result "$size bytes: $result"
+    if grep -q "(0 failed)" <<< "$result"; then
+        :
+    else
+        log_error "Transfers failed for size $size"
+        FAILED=1
+    fi
+done
+
+exit $FAILED
@@ -0,0 +1,122 @@
+#!/bin/bash
+# Device-Path Replication Test for TFS Distributed File System
+# Loads the kernel module, mounts TFS and replicates files written through the
+# mount to a loopback peer. In copy mode (enable_zero_copy=0) the segments are
+# page-backed, so the primary must send them with MSG_ZEROCOPY; in zero-copy mode
+# the writer's pinned anonymous pages are PFN-mapped and sends fall back to copying.
+# Both passes must deliver every byte to the peer
+# Requires root and a built tfs_client.ko
+# Run as: sudo ./replica_device_test.sh [tfsd_binary] [module]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+MODULE=${2:-../tfs_client/tfs_client.ko}
+WORK_DIR=$(mktemp -d /tmp/tfs_replica_dev.XXXXXX)
+MOUNT_POINT="$WORK_DIR/mnt"
+LOG_FILE="tfs_replica_device_test.log"
+COUNT=${COUNT:-32}              # 每遍写入的2MB块数
+PORT=${PORT:-17400}
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+    log_error "This test must be run as root"
+    exit 1
+fi
+if [ ! -x "$TFSD" ] || [ ! -f "$MODULE" ]; then
+    log_error "tfsd binary or kernel module not found: $TFSD, $MODULE"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+
+PEER_PID=
+PRIMARY_PID=
+cleanup() {
+    [ -n "$PRIMARY_PID" ] && kill -TERM $PRIMARY_PID 2>/dev/null
+    [ -n "$PEER_PID" ] && kill -TERM $PEER_PID 2>/dev/null
+    wait 2>/dev/null
+    mountpoint -q "$MOUNT_POINT" && umount "$MOUNT_POINT"
+    lsmod | grep -q '^tfs_client' && rmmod tfs_client
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+log_info "Loading $MODULE and mounting TFS"
+insmod "$MODULE" || exit 1
+mkdir -p "$MOUNT_POINT" "$WORK_DIR/peer" "$WORK_DIR/primary"
+mount -t tfs none "$MOUNT_POINT" || exit 1
+
+(cd "$WORK_DIR/peer" && exec "$TFSD" --mock 0 --replica-listen 127.0.0.1:$PORT -D ./data -A none -H none) &
+PEER_PID=$!
+sleep 1
+
+FAILED=0
+
+# 一遍: 设置内核的传输模式, 启动复制到对端的tfsd, 经挂载点写入一个文件, 停止后读出零拷贝发送数
+# 参数为enable_zero_copy的取值, 零拷贝发送数存入ZC
+run_pass() {
+    echo $1 > /sys/module/tfs_client/parameters/enable_zero_copy
+    (cd "$WORK_DIR/primary" && exec "$TFSD" --replica 127.0.0.1:$PORT --replica-quorum 1 \
+        -D ./data -A none -H none) &
+    PRIMARY_PID=$!
+    sleep 1
+
+    # 2MB的写入各成一段; quorum为1, 每次写入返回时对端已经确认
+    if ! dd if=/dev/urandom of="$MOUNT_POINT/file$1" bs=2M count=$COUNT 2>/dev/null; then
+        log_error "Writing through the mount failed (enable_zero_copy=$1)"
+        FAILED=1
+    fi
+    kill -TERM $PRIMARY_PID
+    wait $PRIMARY_PID
+    PRIMARY_PID=
+
+    # "- Replication: P peers up, F frames (Z zerocopy, ..."
+    ZC=$(grep -- "- Replication:" "$WORK_DIR/primary/tfsd.log" | tail -1 | sed 's/.* frames (\([0-9]*\) zerocopy.*/\1/')
+}
+
+log_info "Copy mode: replicating $COUNT 2 MB writes"
+run_pass 0
+log_result "copy mode: $ZC zerocopy sends"
+if [ -z "$ZC" ] || [ "$ZC" -eq 0 ]; then
+    log_error "Page-backed segments were not sent with MSG_ZEROCOPY"
+    FAILED=1
+fi
+
+log_info "Zero-copy mode: replicating $COUNT 2 MB writes"
+run_pass 1
+log_result "zero-copy mode: $ZC zerocopy sends (PFN-mapped pages are copied)"
+
+# 停止对端, 重新打开数据目录, 检查两遍的数据都已到达
+kill -TERM $PEER_PID
+wait $PEER_PID
+PEER_PID=
+(cd "$WORK_DIR/peer" && exec "$TFSD" --mock 0 -D ./data -A none -H none) &
+pid=$!
+sleep 1
+kill -TERM $pid
+wait $pid
+expected=$((2 * COUNT * 2097152))
+live=$(grep "Storage recovered" "$WORK_DIR/peer/tfsd.log" | tail -1 | sed 's/.*segments, \([0-9]*\) live bytes.*/\1/')
+log_result "peer: $live live bytes (expected $expected)"
+if [ "$live" != "$expected" ]; then
+    log_error "The peer is missing replicated data"
+    FAILED=1
+fi
+
+exit $FAILED
@@ -0,0 +1,101 @@
+#!/bin/bash
+# Loopback Replication Test for TFS Distributed File System
+# Starts two replica-only tfsd instances and one primary driven by the mock
+# control device, then checks that every replica recovered all transferred bytes
+# No kernel module or root privileges needed
+# Run as: ./replica_test.sh [tfsd_binary]
+
+# Color definitions
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+# Default values
+TFSD=${1:-../tfsd/tfsd}
+WORK_DIR=$(mktemp -d /tmp/tfs_replica.XXXXXX)
+LOG_FILE="tfs_replica_test.log"
+TRANSFERS=${TRANSFERS:-5000}
+SIZE=${SIZE:-200000}
+WINDOW_KB=${WINDOW_KB:-64}
+BASE_PORT=${BASE_PORT:-17300}
+PEERS=2
+
+log_info() {
+    echo -e "${GREEN}[INFO]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_error() {
+    echo -e "${RED}[ERROR]${NC} $1" | tee -a $LOG_FILE
+}
+
+log_result() {
+    echo -e "${BLUE}[RESULT]${NC} $1" | tee -a $LOG_FILE
+}
+
+if [ ! -x "$TFSD" ]; then
+    log_error "tfsd binary not found: $TFSD"
+    exit 1
+fi
+TFSD=$(realpath "$TFSD")
+
+PIDS=()
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -TERM $pid 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# 启动只接收复制数据的对端 (空闲的模拟设备)
+REPLICA_ARGS=()
+for i in $(seq 1 $PEERS); do
+    port=$((BASE_PORT + i))
+    mkdir -p "$WORK_DIR/peer$i"
+    (cd "$WORK_DIR/peer$i" && exec "$TFSD" --mock 0 --replica-listen 127.0.0.1:$port -D ./data -A none -H none) &
+    PIDS+=($!)
+    REPLICA_ARGS+=(--replica 127.0.0.1:$port)
+done
+sleep 1
+
+log_info "Replicating $TRANSFERS transfers of $SIZE bytes to $PEERS peers"
+mkdir -p "$WORK_DIR/primary"
+if ! (cd "$WORK_DIR/primary" && "$TFSD" --mock $TRANSFERS --mock-size $SIZE -W $WINDOW_KB "${REPLICA_ARGS[@]}" \
+        -D ./data -A none -H none); then
+    log_error "Primary tfsd exited with an error"
+    exit 1
+fi
+result=$(grep "Mock workload" "$WORK_DIR/primary/tfsd.log" | sed 's/.*Mock workload: //')
+log_result "primary: $result"
+
+FAILED=0
+if ! grep -q "(0 failed)" <<< "$result"; then
+    log_error "Transfers failed on the primary"
+    FAILED=1
+fi
+
+# 停止对端, 重新打开数据目录, 检查恢复出的数据量
+for pid in "${PIDS[@]}"; do
+    kill -TERM $pid
+done
+wait
+PIDS=()
+expected=$((TRANSFERS * SIZE))
+for i in $(seq 1 $PEERS); do
+    dir="$WORK_DIR/peer$i"
+    (cd "$dir" && exec "$TFSD" --mock 0 -D ./data -A none -H none) &
+    pid=$!
+    sleep 1
+    kill -TERM $pid
+    wait $pid
+    live=$(grep "Storage recovered" "$dir/tfsd.log" | tail -1 | sed 's/.*segments, \([0-9]*\) live bytes.*/\1/')
+    log_result "peer$i: $live live bytes (expected $expected)"
+    if [ "$live" != "$expected" ]; then
+        log_error "peer$i is missing replicated data"
+        FAILED=1
+    fi
+done
+
+exit $FAILED
@@ -18,44 +18,102 @@
 #include <linux/backing-dev.h>
 #include <linux/timekeeping.h>
 #include <linux/statfs.h>  // 用于kstatfs结构体
+#include <linux/rhashtable.h>
+#include <linux/xarray.h>
+#include <linux/jhash.h>
+#include <linux/seqlock.h>
+#include <linux/kref.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/llist.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
 
 #define TFS_I(inode) container_of(inode, struct tfs_inode_info, vfs_inode)
 
 // 声明全局变量
 static bool enable_zero_copy = true;
+static unsigned int max_files = 4194304;
 
 #define TFS_DEV_NAME "tfs_client"
 #define TFS_MAGIC 0x74667379  // "tfs" in hex
 #define MAX_QUEUE_SIZE 128
-#define PAGE_SHIFT_4K (12) // 4K page size
+// 单个传输段的最大长度: 一个PMD大页 (x86_64上为2MiB)
+#define TFS_MAX_SEG_SIZE PMD_SIZE
+#define TFS_MAX_SEG_PAGES (TFS_MAX_SEG_SIZE >> PAGE_SHIFT)
+
+// inode号分配: 1是tfsd命名空间的根, 其余 (包括各挂载点的根目录) 从2开始由全局IDA分配
+// tfsd只按inode号索引, 因此各挂载点之间也不能重号; 文件数上限仍按超级块计
+// 每个挂载点的根目录在tfsd中是命名空间根下名为"mnt-<inode号>"的目录, 各挂载点的文件名互不冲突
+#define TFS_ROOT_INO 1
+#define TFS_FIRST_INO 2
+
+static DEFINE_IDA(tfs_ino_ida);      // inode号位图分配器, 优先复用最小的空闲号
 
 // 定义IOCTL命令
 #define TFS_MAGIC_IOCTL 'T'
 #define TFS_GET_XFER_COUNT _IOR(TFS_MAGIC_IOCTL, 0, int)
 #define TFS_GET_XFER_INFO _IOWR(TFS_MAGIC_IOCTL, 1, struct tfs_xfer_info)
 #define TFS_RELEASE_XFER _IO(TFS_MAGIC_IOCTL, 2)
-
-// 添加详细的调试宏
-#define TFS_DEBUG 1
-
-#ifdef TFS_DEBUG
-#define tfs_debug(fmt, ...) printk(KERN_DEBUG "TFS DEBUG: " fmt, ##__VA_ARGS__)
-#else
-#define tfs_debug(fmt, ...)
-#endif
+#define TFS_GET_META_BATCH _IOWR(TFS_MAGIC_IOCTL, 3, struct tfs_meta_batch)
+#define TFS_SET_CAPACITY _IOW(TFS_MAGIC_IOCTL, 4, struct tfs_capacity)
+#define TFS_FETCH_XFERS _IOWR(TFS_MAGIC_IOCTL, 5, struct tfs_xfer_batch)
+#define TFS_COMPLETE_XFER _IOW(TFS_MAGIC_IOCTL, 6, struct tfs_xfer_done)
+
+// 已领取的传输项按ID映射: mmap偏移 = ID << TFS_XFER_MMAP_SHIFT
+// 低位为页对齐的窗口偏移, tfsd可以分多次映射一个大传输项的不同部分
+// 偏移0保留给旧的队首映射方式
+#define TFS_XFER_MMAP_SHIFT 32
+#define TFS_XFER_MMAP_PGSHIFT (TFS_XFER_MMAP_SHIFT - PAGE_SHIFT)
+#define TFS_XFER_BATCH_MAX 256
+
+// 元数据队列上限, 超过后修改命名空间的调用者等待守护进程消费
+#define TFS_META_QUEUE_MAX 65536
+#define TFS_META_BATCH_MAX 256
+
+// 调试输出由debug_level参数在运行时开关 (见tfs_set_debug_level)
+// 关闭时static key让每个tfs_debug只剩一条nop, 参数求值和printk都被跳过
+static DEFINE_STATIC_KEY_FALSE(tfs_debug_key);
+// debug_level >= 2 时同时打印函数名和行号
+static DEFINE_STATIC_KEY_FALSE(tfs_debug_where_key);
+
+#define tfs_debug(fmt, ...)                                                        \
+    do {                                                                           \
+        if (static_branch_unlikely(&tfs_debug_key)) {                              \
+            if (static_branch_unlikely(&tfs_debug_where_key))                      \
+                printk(KERN_DEBUG "TFS DEBUG[%s:%d]: " fmt,                        \
+                       __func__, __LINE__, ##__VA_ARGS__);                         \
+            else                                                                   \
+                printk(KERN_DEBUG "TFS DEBUG: " fmt, ##__VA_ARGS__);               \
+        }                                                                          \
+    } while (0)
 
 #define tfs_info(fmt, ...) printk(KERN_INFO "TFS INFO: " fmt, ##__VA_ARGS__)
 #define tfs_warn(fmt, ...) printk(KERN_WARNING "TFS WARN: " fmt, ##__VA_ARGS__)
 #define tfs_error(fmt, ...) printk(KERN_ERR "TFS ERROR: " fmt, ##__VA_ARGS__)
 
 // 传输数据结构
+// 一个传输项对应一个段: 数据位于同一个folio内的物理连续区间,
+// folio可以是普通4K页、THP大folio或hugetlb大页
 struct tfs_xfer {
-    struct page *page;
+    struct folio *folio;          // 承载数据的folio, 空文件为NULL
+    unsigned int data_off;        // 数据在folio内的字节偏移
     off_t offset;
     size_t size;
     unsigned long pfn;
+    unsigned long ino;            // 所属文件的inode号
+    unsigned long id;             // 被tfsd领取后分配的ID, 0表示仍在队列中
+    int status;                   // tfsd报告的处理结果
+    struct kref ref;              // 队列和等待中的写者各持有一个引用
     struct list_head list;
     struct completion done; // 新增：用于同步
+    u64 enqueue_ns;               // 入队时间, 用于tracepoint
+    u64 fetch_ns;                 // 被领取的时间, 0表示未经领取
+    bool pinned;                  // 零拷贝模式下固定的是用户页, 计入pinned_pages
 };
 
 // IOCTL信息结构体
@@ -63,6 +121,101 @@ struct tfs_xfer_info {
     off_t offset;                // 文件偏移
     size_t size;                 // 数据大小
     unsigned long pfn;           // 物理页帧号 (仅用于调试)
+    unsigned int page_offset;    // 数据在映射区域内的起始偏移
+    unsigned int map_size;       // mmap需要映射的长度 (页对齐)
+    unsigned long ino;           // 所属文件的inode号
+    unsigned long id;            // 领取后的传输ID, 旧接口为0
+};
+
+// TFS_FETCH_XFERS参数: 一次领取最多max_xfers个传输项
+struct tfs_xfer_batch {
+    __u64 infos;                      // 用户态struct tfs_xfer_info数组
+    __u32 max_xfers;
+    __u32 nr_xfers;                   // 输出: 实际领取的个数
+};
+
+// TFS_COMPLETE_XFER参数: 按ID完成传输项, 与领取顺序无关
+struct tfs_xfer_done {
+    __u64 id;
+    __s32 status;                     // 0或负的errno, 负值会作为write的返回值
+    __u32 reserved;
+};
+
+// tracepoint需要上面的struct tfs_xfer
+#define CREATE_TRACE_POINTS
+#include "tfs_trace.h"
+
+// 转发给tfsd的元数据操作类型
+enum tfs_meta_op_type {
+    TFS_META_CREATE = 1,
+    TFS_META_MKDIR,
+    TFS_META_UNLINK,
+    TFS_META_RMDIR,
+    TFS_META_RENAME,
+    TFS_META_SETATTR,
+    TFS_META_LINK,
+};
+
+// 单条元数据操作 (与tfsd共享的定长布局), tfsd按seq顺序应用
+struct tfs_meta_op {
+    __u64 seq;                        // 全局递增序号
+    __u32 op;                         // enum tfs_meta_op_type
+    __u32 mode;
+    __u64 ino;
+    __u64 parent_ino;
+    __u64 new_parent_ino;             // 仅RENAME
+    __u64 size;                       // 仅SETATTR
+    __u32 attr_valid;                 // 仅SETATTR, ATTR_*位
+    __u32 name_len;
+    __u32 new_name_len;               // 仅RENAME
+    char name[NAME_MAX + 1];
+    char new_name[NAME_MAX + 1];
+};
+
+// TFS_GET_META_BATCH参数: 一次取走最多max_ops条操作
+struct tfs_meta_batch {
+    __u64 ops;                        // 用户态struct tfs_meta_op数组
+    __u32 max_ops;
+    __u32 nr_ops;                     // 输出: 实际返回的条数
+};
+
+struct tfs_meta_entry {
+    struct list_head list;
+    struct tfs_meta_op op;
+};
+
+// tfsd推送的容量信息, statfs直接读取缓存, 不等待守护进程
+struct tfs_capacity {
+    __u64 total_bytes;
+    __u64 free_bytes;
+    __u64 avail_bytes;                // 非特权用户可用
+    __u32 ttl_ms;                     // 缓存有效期, 过期后请求tfsd刷新
+    __u32 reserved;
+};
+
+// 统计项, 每CPU累加, 读取时求和; 前三项是有增有减的当前值
+enum tfs_stat_item {
+    TFS_STAT_QUEUED,              // 待领取的传输项
+    TFS_STAT_INFLIGHT,            // 已领取未完成的传输项
+    TFS_STAT_PINNED_PAGES,        // 零拷贝传输固定的用户页
+    TFS_STAT_BYTES_WRITTEN,
+    TFS_STAT_BYTES_READ,
+    TFS_STAT_XFERS_DONE,
+    TFS_STAT_READ_ERRORS,
+    TFS_STAT_WRITE_ERRORS,
+    TFS_STAT_IOCTL_ERRORS,
+    TFS_STAT_MMAP_ERRORS,
+    TFS_STAT_REQUEUED,            // 控制设备关闭时放回队列的已领取传输项
+    TFS_STAT_NR,
+};
+
+// write延迟直方图 (从入队到tfsd完成): 第i个桶为[2^i, 2^(i+1))微秒,
+// 第0个桶为[0, 2)微秒, 最后一个桶不封顶
+#define TFS_LAT_BUCKETS 24
+
+struct tfs_pcpu_stats {
+    s64 items[TFS_STAT_NR];
+    u64 write_lat[TFS_LAT_BUCKETS];
 };
 
 // 全局上下文结构
@@ -73,27 +226,103 @@ struct tfs_data {
     struct miscdevice mdev;      // 杂项设备
     struct mutex mmap_lock;      // mmap锁
     struct tfs_xfer *current_xfer; // 当前映射的传输项
-    
-    // 错误统计
-    atomic_t read_errors;
-    atomic_t write_errors;
-    atomic_t ioctl_errors;
-    atomic_t mmap_errors;
+    struct xarray inflight;        // 已被tfsd领取、尚未完成的传输项, 按ID索引
+    u32 next_xfer_id;
+    atomic_t ctl_opens;            // 控制设备打开的文件数, 降为0时回收inflight
+
+    // 元数据转发队列
+    struct list_head meta_list;
+    spinlock_t meta_lock;
+    u64 meta_seq;                  // 最近分配的操作序号
+    atomic_t meta_pending;         // 已预留的队列位置
+    wait_queue_head_t meta_space_wq;
+
+    // 容量缓存, statfs在高频调用下只做一次无锁的顺序读
+    seqlock_t cap_lock;
+    struct tfs_capacity cap;
+    unsigned long cap_stamp;       // 最近一次推送的jiffies, 0表示从未推送
+    bool cap_refresh;              // 缓存已过期, 通过POLLPRI通知tfsd推送
+    
+    // 统计, 通过debugfs的tfs/<设备名>/目录查看
+    struct tfs_pcpu_stats __percpu *stats;
+    struct dentry *debugfs;
+    struct mutex rate_lock;        // 保护下面两项, 用于计算每秒传输数
+    u64 rate_stamp;
+    s64 rate_done;
 };
 
+
 // 文件系统特定数据结构
 struct tfs_fs_info {
     struct backing_dev_info bdi;
+    atomic_t nr_files;            // 当前存活的inode数 (不含根目录)
+    unsigned int max_files;       // 挂载时确定的文件数上限
+    struct llist_head dead_dirents;  // 已回收目录的索引项, 等待归还子inode引用
+    struct task_struct *reaper;   // 正在排空dead_dirents的任务
+    unsigned long root_ino;       // 根目录的inode号, 不计入nr_files
+    struct tfs_meta_entry *umount_op;  // 挂载时预留的删除根目录操作, 卸载时提交
+};
+
+// 目录项索引条目
+struct tfs_dirent {
+    struct rhash_head node;       // 名字哈希表节点
+    struct rcu_head rcu;
+    struct llist_node reap;       // 所在目录被回收后挂入dead_dirents
+    unsigned long cookie;         // readdir位置, 目录内单调递增, 永不复用
+    struct inode *inode;          // 索引持有该inode的一个引用
+    unsigned char type;           // DT_REG / DT_DIR ...
+    unsigned int len;
+    char name[];
+};
+
+// 目录索引: 名字哈希表提供O(1)查找, cookie有序的xarray提供稳定的readdir游标。
+// 新建项总是获得更大的cookie, 删除项只移除自身, 因此并发create/unlink
+// 不会让已返回给用户的readdir位置失效。
+struct tfs_dir_index {
+    struct rhashtable names;      // 名字 -> tfs_dirent
+    struct xarray cursors;        // cookie -> tfs_dirent
+    unsigned long next_cookie;    // 下一个可分配的cookie
+    unsigned long nr_entries;     // 目录项数量 (不含 . 和 ..)
 };
 
 // 文件系统inode结构
 struct tfs_inode_info {
     struct inode vfs_inode;
+    struct tfs_dir_index *dir;    // 目录索引, 仅目录inode有效
 };
 
 static struct tfs_data *tfs_ctx;
 static struct kmem_cache *tfs_inode_cachep;
 
+// 每CPU统计: 更新只写本CPU的副本, 不需要原子操作和锁
+static inline void tfs_stat_add(enum tfs_stat_item item, s64 delta)
+{
+    this_cpu_add(tfs_ctx->stats->items[item], delta);
+}
+
+static inline void tfs_stat_inc(enum tfs_stat_item item)
+{
+    tfs_stat_add(item, 1);
+}
+
+static s64 tfs_stat_read(enum tfs_stat_item item)
+{
+    s64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(tfs_ctx->stats, cpu)->items[item];
+    return sum;
+}
+
+static void tfs_stat_write_latency(u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    unsigned int bucket = us ? min_t(unsigned int, ilog2(us), TFS_LAT_BUCKETS - 1) : 0;
+
+    this_cpu_inc(tfs_ctx->stats->write_lat[bucket]);
+}
+
 // 文件系统相关操作
 static __used struct inode *tfs_alloc_inode(struct super_block *sb)
 {
@@ -112,6 +341,7 @@ static __used struct inode *tfs_alloc_inode(struct super_block *sb)
     
     tfs_debug("alloc_inode called\n");
     inode_init_once(&fsi->vfs_inode);
+    fsi->dir = NULL;
     return &fsi->vfs_inode;
 }
 
@@ -129,13 +359,229 @@ static void tfs_free_inode(struct inode *inode)
     kmem_cache_free(tfs_inode_cachep, fsi);
 }
 
+//================ 元数据转发 ========================
+
+// 预留一个队列位置并分配操作, 必须在修改命名空间之前调用,
+// 队列满时等待守护进程消费, 被信号打断则整个操作失败
+static struct tfs_meta_entry *tfs_meta_alloc(u32 op)
+{
+    struct tfs_meta_entry *e;
+
+    if (wait_event_interruptible(tfs_ctx->meta_space_wq,
+            atomic_add_unless(&tfs_ctx->meta_pending, 1, TFS_META_QUEUE_MAX)))
+        return ERR_PTR(-ERESTARTSYS);
+
+    e = kzalloc(sizeof(*e), GFP_KERNEL);
+    if (!e) {
+        atomic_dec(&tfs_ctx->meta_pending);
+        wake_up(&tfs_ctx->meta_space_wq);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    INIT_LIST_HEAD(&e->list);
+    e->op.op = op;
+    return e;
+}
+
+static void tfs_meta_free(struct tfs_meta_entry *e)
+{
+    kfree(e);
+    atomic_dec(&tfs_ctx->meta_pending);
+    wake_up(&tfs_ctx->meta_space_wq);
+}
+
+static void tfs_meta_set_name(char *dst, __u32 *len, const struct qstr *name)
+{
+    *len = name->len;
+    memcpy(dst, name->name, name->len);
+    dst[name->len] = '\0';
+}
+
+// 分配序号并入队, 不等待守护进程处理; 守护进程每次ioctl取走一批
+static void tfs_meta_submit(struct tfs_meta_entry *e)
+{
+    spin_lock(&tfs_ctx->meta_lock);
+    e->op.seq = ++tfs_ctx->meta_seq;
+    list_add_tail(&e->list, &tfs_ctx->meta_list);
+    spin_unlock(&tfs_ctx->meta_lock);
+
+    wake_up_interruptible(&tfs_ctx->wq);
+}
+
+// 一次取走一批元数据操作, 拷贝失败的部分放回队首
+static long tfs_meta_fetch_batch(struct tfs_meta_batch __user *ubatch)
+{
+    struct tfs_meta_batch batch;
+    struct tfs_meta_op __user *uops;
+    struct tfs_meta_entry *e, *tmp;
+    LIST_HEAD(local);
+    u32 max_ops, n = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+
+    max_ops = min_t(u32, batch.max_ops, TFS_META_BATCH_MAX);
+    uops = u64_to_user_ptr(batch.ops);
+
+    spin_lock(&tfs_ctx->meta_lock);
+    list_for_each_entry_safe(e, tmp, &tfs_ctx->meta_list, list) {
+        if (n++ == max_ops)
+            break;
+        list_move_tail(&e->list, &local);
+    }
+    spin_unlock(&tfs_ctx->meta_lock);
+
+    n = 0;
+    list_for_each_entry_safe(e, tmp, &local, list) {
+        if (copy_to_user(&uops[n], &e->op, sizeof(e->op)))
+            break;
+        list_del(&e->list);
+        tfs_meta_free(e);
+        n++;
+    }
+
+    if (!list_empty(&local)) {
+        spin_lock(&tfs_ctx->meta_lock);
+        list_splice(&local, &tfs_ctx->meta_list);
+        spin_unlock(&tfs_ctx->meta_lock);
+        tfs_stat_inc(TFS_STAT_IOCTL_ERRORS);
+        if (!n)
+            return -EFAULT;
+    }
+
+    batch.nr_ops = n;
+    if (put_user(batch.nr_ops, &ubatch->nr_ops))
+        return -EFAULT;
+    return 0;
+}
+
+//================ 传输项生命周期 ========================
+
+// 段数据起始页的物理页帧号
+static inline unsigned long tfs_xfer_pfn(const struct tfs_xfer *xfer)
+{
+    return folio_pfn(xfer->folio) + (xfer->data_off >> PAGE_SHIFT);
+}
+
+// 映射该段需要的长度: 从数据所在首页到末页
+static inline size_t tfs_xfer_map_size(const struct tfs_xfer *xfer)
+{
+    return PAGE_ALIGN(offset_in_page(xfer->data_off) + xfer->size);
+}
+
+static void tfs_xfer_free(struct kref *ref)
+{
+    struct tfs_xfer *xfer = container_of(ref, struct tfs_xfer, ref);
+
+    trace_tfs_xfer_release(xfer);
+    if (xfer->pinned)
+        tfs_stat_add(TFS_STAT_PINNED_PAGES, -(s64)(tfs_xfer_map_size(xfer) >> PAGE_SHIFT));
+    if (xfer->folio)
+        folio_put(xfer->folio);
+    kfree(xfer);
+}
+
+static void tfs_xfer_put(struct tfs_xfer *xfer)
+{
+    kref_put(&xfer->ref, tfs_xfer_free);
+}
+
+// 结束传输项: 记录结果, 唤醒等待的write并释放队列持有的引用
+static void tfs_xfer_finish(struct tfs_xfer *xfer, int status)
+{
+    trace_tfs_xfer_complete(xfer, status);
+    tfs_stat_inc(TFS_STAT_XFERS_DONE);
+    xfer->status = status;
+    complete(&xfer->done);
+    tfs_xfer_put(xfer);
+}
+
+// 固定用户缓冲区所在的段
+// 一次性pin住最多TFS_MAX_SEG_PAGES个页, 统计与首页同属一个folio且物理连续的页数,
+// 这样THP和hugetlb缓冲区可以整段作为一个传输项, 而不是逐个4K页排队。
+// folio内所有页共享引用计数, 因此只需保留首页的引用即可固定整个folio。
+static int tfs_pin_user_segment(const char __user *ubuf, size_t *count,
+                                struct folio **foliop, unsigned int *offp)
+{
+    unsigned long uaddr = (unsigned long)ubuf;
+    unsigned int poff = offset_in_page(uaddr);
+    struct page **pages;
+    struct folio *folio;
+    int nr_pages, pinned, contig, i;
+
+    nr_pages = min_t(size_t, DIV_ROUND_UP(poff + *count, PAGE_SIZE), TFS_MAX_SEG_PAGES);
+    pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    pinned = get_user_pages_fast(uaddr & PAGE_MASK, nr_pages, FOLL_WRITE, pages);
+    if (pinned <= 0) {
+        kvfree(pages);
+        return pinned ? pinned : -EFAULT;
+    }
+
+    folio = page_folio(pages[0]);
+    for (contig = 1; contig < pinned; contig++) {
+        if (page_folio(pages[contig]) != folio ||
+            pages[contig] != nth_page(pages[0], contig))
+            break;
+    }
+
+    // 只保留首页的引用
+    for (i = 1; i < pinned; i++)
+        put_page(pages[i]);
+
+    *offp = folio_page_idx(folio, pages[0]) * PAGE_SIZE + poff;
+    *count = min_t(size_t, *count, (size_t)contig * PAGE_SIZE - poff);
+    *foliop = folio;
+
+    tfs_debug("Pinned segment: folio order=%u, contig pages=%d, data_off=%u\n",
+              folio_order(folio), contig, *offp);
+
+    kvfree(pages);
+    return 0;
+}
+
+// 拷贝模式: 分配足够容纳数据的folio并拷贝用户数据
+// 高阶分配不重试也不告警, 内存碎片化时逐级降阶, 相应缩短本段长度, 最低退到单页
+static int tfs_copy_user_segment(const char __user *ubuf, size_t *count,
+                                 struct folio **foliop, unsigned int *offp)
+{
+    struct folio *folio;
+    unsigned int order;
+
+    *count = min_t(size_t, *count, TFS_MAX_SEG_SIZE);
+    order = get_order(*count);
+    for (;;) {
+        if (order)
+            folio = folio_alloc(GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN, order);
+        else
+            folio = folio_alloc(GFP_KERNEL, 0);
+        if (folio)
+            break;
+        if (!order)
+            return -ENOMEM;
+        order--;
+    }
+    *count = min_t(size_t, *count, PAGE_SIZE << order);
+
+    if (copy_from_user(folio_address(folio), ubuf, *count)) {
+        folio_put(folio);
+        return -EFAULT;
+    }
+
+    *foliop = folio;
+    *offp = 0;
+    return 0;
+}
+
 // 核心写入函数 - 真正的零拷贝
 static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
                              size_t count, loff_t *ppos)
 {
     struct tfs_xfer *xfer;
-    struct page *page = NULL;
-    unsigned long offset;
+    struct folio *folio = NULL;
+    unsigned int data_off = 0;
     int ret;
     struct inode *inode = file_inode(file);  // 新增：获取inode
     
@@ -144,7 +590,7 @@ static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
     if (!count) {
         // 空文件处理 - 创建特殊传输项
         tfs_debug("Empty file write detected, creating special notification\n");
-        tfs_info("Processing empty file write request at offset %lld\n", *ppos);
+        tfs_debug("Processing empty file write request at offset %lld\n", *ppos);
         
         xfer = kzalloc(sizeof(*xfer), GFP_KERNEL);
         if (!xfer) {
@@ -155,22 +601,30 @@ static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
         tfs_debug("Successfully allocated transfer structure for empty file\n");
         
         // 设置为空文件标记
-        xfer->page = NULL;  // 没有实际页面
+        xfer->folio = NULL; // 没有实际页面
         xfer->size = 0;     // 大小为0
         xfer->offset = *ppos;
         xfer->pfn = 0;      // 没有物理页帧
+        xfer->ino = inode->i_ino;
         INIT_LIST_HEAD(&xfer->list);
+        init_completion(&xfer->done);
+        kref_init(&xfer->ref); // 只有队列持有引用, 写者不等待
+        xfer->enqueue_ns = ktime_get_ns();
         
-        // 加入传输队列
+        // 加入传输队列; 写者不持有引用, 出锁后传输项可能已被完成并释放
         spin_lock(&tfs_ctx->lock);
         list_add_tail(&xfer->list, &tfs_ctx->xfer_list);
+        tfs_stat_inc(TFS_STAT_QUEUED);
+        trace_tfs_xfer_enqueue(xfer);
         tfs_debug("Added empty file transfer to queue\n");
         
-        // 获取队列中的传输项数量，用于调试
+        // 获取队列中的传输项数量，用于调试 (遍历整个队列, 仅在调试开启时进行)
         int queue_count = 0;
         struct tfs_xfer *tmp;
-        list_for_each_entry(tmp, &tfs_ctx->xfer_list, list) {
-            queue_count++;
+        if (static_branch_unlikely(&tfs_debug_key)) {
+            list_for_each_entry(tmp, &tfs_ctx->xfer_list, list) {
+                queue_count++;
+            }
         }
         spin_unlock(&tfs_ctx->lock);
         
@@ -186,7 +640,7 @@ static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
         // 唤醒用户态守护进程
         wake_up_interruptible(&tfs_ctx->wq);
         
-        tfs_info("Empty file transfer item created and queued successfully\n");
+        tfs_debug("Empty file transfer item created and queued successfully\n");
         tfs_debug("Returning success for empty file write\n");
         return 0;
     }
@@ -197,15 +651,9 @@ static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
         return -EFAULT;
     }
 
-    // 检查是否超过页面大小
-    if (count > PAGE_SIZE) {
-        count = PAGE_SIZE;
-    }
-
-    // 获取页面内偏移
-    offset = (unsigned long)ubuf & ~PAGE_MASK;
-    if (offset + count > PAGE_SIZE) {
-        count = PAGE_SIZE - offset;
+    // 单次传输最多一个段, 剩余部分由调用者继续写入
+    if (count > TFS_MAX_SEG_SIZE) {
+        count = TFS_MAX_SEG_SIZE;
     }
 
     // 分配传输结构
@@ -217,53 +665,52 @@ static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
     
     // 根据参数选择传输方式
     if (enable_zero_copy) {
-        // 零拷贝模式 - 固定用户空间页面
-        ret = get_user_pages_fast((unsigned long)ubuf & PAGE_MASK, 1, 1, &page);
+        // 零拷贝模式 - 固定用户空间页面所在的folio
+        ret = tfs_pin_user_segment(ubuf, &count, &folio, &data_off);
         tfs_debug("Using zero-copy transfer mode\n");
-    } else {
-        // 回退到传统拷贝模式
-        page = alloc_page(GFP_KERNEL);
-        if (!page) {
-            tfs_error("Failed to allocate page for copy mode\n");
+        if (ret) {
+            tfs_error("Failed to pin user pages (ret=%d)\n", ret);
             kfree(xfer);
-            return -ENOMEM;
+            return ret;
         }
-        if (copy_from_user(page_address(page), ubuf, count)) {
-            tfs_error("Failed to copy data from user\n");
-            __free_page(page);
+    } else {
+        // 回退到传统拷贝模式
+        ret = tfs_copy_user_segment(ubuf, &count, &folio, &data_off);
+        tfs_debug("Using copy transfer mode\n");
+        if (ret) {
+            tfs_error("Failed to copy data from user (ret=%d)\n", ret);
             kfree(xfer);
-            atomic_inc(&tfs_ctx->write_errors);
-            return -EFAULT;
+            if (ret == -EFAULT)
+                tfs_stat_inc(TFS_STAT_WRITE_ERRORS);
+            return ret;
         }
-        ret = 1; // 模拟成功获取页面
-        tfs_debug("Using copy transfer mode\n");
-    }
-    if (ret < 0) {
-        tfs_error("Failed to pin user page (ret=%d)\n", ret);
-        kfree(xfer);
-        return ret;
-    }
-    if (ret != 1) {
-        tfs_error("Failed to pin user page (ret=%d)\n", ret);
-        kfree(xfer);
-        return -EFAULT;
     }
 
     // 填充传输项
-    xfer->page = page;
+    xfer->folio = folio;
+    xfer->data_off = data_off;
     xfer->size = count;
     xfer->offset = *ppos;
-    xfer->pfn = page_to_pfn(page);
+    xfer->pfn = tfs_xfer_pfn(xfer);
+    xfer->ino = inode->i_ino;
+    xfer->pinned = enable_zero_copy;
     INIT_LIST_HEAD(&xfer->list);
     init_completion(&xfer->done); // 新增
+    kref_init(&xfer->ref);        // 队列的引用
+    kref_get(&xfer->ref);         // 写者等待结果的引用
 
     tfs_debug("Created xfer: offset=%lld, size=%zu, pfn=%lu\n",
               (long long)xfer->offset, xfer->size, xfer->pfn);
 
     // 加入传输队列
+    xfer->enqueue_ns = ktime_get_ns();
+    if (xfer->pinned)
+        tfs_stat_add(TFS_STAT_PINNED_PAGES, tfs_xfer_map_size(xfer) >> PAGE_SHIFT);
     spin_lock(&tfs_ctx->lock);
     list_add_tail(&xfer->list, &tfs_ctx->xfer_list);
+    tfs_stat_inc(TFS_STAT_QUEUED);
     spin_unlock(&tfs_ctx->lock);
+    trace_tfs_xfer_enqueue(xfer);
 
     // 更新文件大小
     loff_t new_size = *ppos + count;
@@ -275,9 +722,21 @@ static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
     // 唤醒用户态守护进程
     wake_up_interruptible(&tfs_ctx->wq);
 
-    // 新增：等待tfsd处理完成
-    wait_for_completion_interruptible(&xfer->done);
+    // 等待tfsd处理完成; 只有致命信号能打断等待, 此时数据尚未落盘, 返回错误而不是成功,
+    // 传输项仍由队列持有, 稍后照常完成
+    ret = wait_for_completion_killable(&xfer->done);
+    if (!ret) {
+        ret = xfer->status;
+        tfs_stat_write_latency(ktime_get_ns() - xfer->enqueue_ns);
+    }
+    trace_tfs_writer_wakeup(xfer, ret);
+    tfs_xfer_put(xfer);
+    if (ret < 0) {
+        tfs_stat_inc(TFS_STAT_WRITE_ERRORS);
+        return ret;
+    }
 
+    tfs_stat_add(TFS_STAT_BYTES_WRITTEN, count);
     *ppos += count;
     return count;
 }
@@ -286,6 +745,25 @@ static ssize_t tfs_file_write(struct file *file, const char __user *ubuf,
 static const struct inode_operations tfs_dir_inode_operations;
 static const struct file_operations tfs_dir_operations;
 
+// 从folio内偏移off处拷贝count字节到用户空间, 逐页映射以兼容highmem
+static int tfs_copy_folio_to_user(char __user *buf, struct folio *folio,
+                                  size_t off, size_t count)
+{
+    while (count) {
+        size_t chunk = min_t(size_t, count, PAGE_SIZE - offset_in_page(off));
+        void *kaddr = kmap_local_folio(folio, off);
+        unsigned long left = copy_to_user(buf, kaddr, chunk);
+
+        kunmap_local(kaddr);
+        if (left)
+            return -EFAULT;
+        buf += chunk;
+        off += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
 // 文件读取函数
 static ssize_t tfs_file_read(struct file *file, char __user *buf,
                            size_t count, loff_t *ppos)
@@ -306,7 +784,10 @@ static ssize_t tfs_file_read(struct file *file, char __user *buf,
     spin_lock(&tfs_ctx->lock);
     if (!list_empty(&tfs_ctx->xfer_list)) {
         xfer = list_first_entry(&tfs_ctx->xfer_list, struct tfs_xfer, list);
-        get_page(xfer->page); // 增加引用计数
+        if (xfer->folio)
+            folio_get(xfer->folio); // 增加引用计数
+        else
+            xfer = NULL;
     }
     spin_unlock(&tfs_ctx->lock);
 
@@ -316,33 +797,22 @@ static ssize_t tfs_file_read(struct file *file, char __user *buf,
     }
 
     // 计算实际可读字节数
-    size_t avail = xfer->size - *ppos;
-    if (avail <= 0)
+    if (*ppos >= xfer->size) {
+        folio_put(xfer->folio);
         return 0;
-    if (count > avail)
-        count = avail;
+    }
+    if (count > xfer->size - *ppos)
+        count = xfer->size - *ppos;
 
-    // 根据传输模式处理数据
-    if (enable_zero_copy) {
-        // 零拷贝模式
-        void *kaddr = kmap(xfer->page);
-        if (copy_to_user(buf, kaddr + *ppos, count)) {
-            kunmap(xfer->page);
-            put_page(xfer->page);
-            atomic_inc(&tfs_ctx->read_errors);
-            return -EFAULT;
-        }
-        kunmap(xfer->page);
-        tfs_debug("Zero-copy read completed\n");
-    } else {
-        // 传统拷贝模式
-        if (copy_to_user(buf, page_address(xfer->page) + *ppos, count)) {
-            put_page(xfer->page);
-            return -EFAULT;
-        }
-        tfs_debug("Copy mode read completed\n");
+    // 两种传输模式的数据都在folio中, 统一按folio内偏移拷贝
+    if (tfs_copy_folio_to_user(buf, xfer->folio, xfer->data_off + *ppos, count)) {
+        folio_put(xfer->folio);
+        tfs_stat_inc(TFS_STAT_READ_ERRORS);
+        return -EFAULT;
     }
-    put_page(xfer->page);
+    tfs_debug("%s read completed\n", enable_zero_copy ? "Zero-copy" : "Copy mode");
+    folio_put(xfer->folio);
+    tfs_stat_add(TFS_STAT_BYTES_READ, count);
 
     *ppos += count;
     return count;
@@ -365,27 +835,11 @@ static int tfs_file_release(struct inode *inode, struct file *file)
         mutex_lock(&tfs_ctx->mmap_lock);
         
         // 添加详细的调试信息
-        tfs_debug("Current transfer state: ctx=%px, xfer=%px, page=%px\n",
-                 tfs_ctx,
-                 tfs_ctx->current_xfer,
-                 tfs_ctx->current_xfer ? tfs_ctx->current_xfer->page : NULL);
+        tfs_debug("Current transfer state: ctx=%px, xfer=%px\n",
+                 tfs_ctx, tfs_ctx->current_xfer);
         
-        if (tfs_ctx->current_xfer) {
-            if (tfs_ctx->current_xfer->page) {
-                // 检查页面有效性
-                if (!PageHighMem(tfs_ctx->current_xfer->page) && 
-                    virt_addr_valid(page_address(tfs_ctx->current_xfer->page))) {
-                    put_page(tfs_ctx->current_xfer->page);
-                    tfs_debug("Page released successfully\n");
-                } else {
-                    tfs_error("Invalid page detected: %px\n", 
-                             tfs_ctx->current_xfer->page);
-                }
-                tfs_ctx->current_xfer->page = NULL;
-            }
-            kfree(tfs_ctx->current_xfer);
-            tfs_ctx->current_xfer = NULL;
-        }
+        // 传输项归队列所有, 这里只清除调试用的指针
+        tfs_ctx->current_xfer = NULL;
         mutex_unlock(&tfs_ctx->mmap_lock);
     }
     
@@ -409,7 +863,10 @@ static int tfs_getattr(struct mnt_idmap *idmap,
                       u32 request_mask, unsigned int flags)
 {
     struct inode *inode = d_inode(path->dentry);
-    stat->blksize = PAGE_SIZE;
+
+    generic_fillattr(idmap, inode, stat);
+    // 建议应用按段大小写入, 使THP/hugetlb缓冲区可以整段传输
+    stat->blksize = TFS_MAX_SEG_SIZE;
     stat->blocks = (inode->i_size + 511) >> 9;
     
     return 0;
@@ -420,6 +877,7 @@ static int tfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
                       struct iattr *attr)
 {
     struct inode *inode = d_inode(dentry);
+    struct tfs_meta_entry *e;
     int error;
     
     tfs_debug("setattr called for inode %lu\n", inode->i_ino);
@@ -428,16 +886,28 @@ static int tfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
     if (error)
         return error;
 
+    e = tfs_meta_alloc(TFS_META_SETATTR);
+    if (IS_ERR(e))
+        return PTR_ERR(e);
+
     if (attr->ia_valid & ATTR_SIZE) {
         error = inode_newsize_ok(inode, attr->ia_size);
-        if (error)
+        if (error) {
+            tfs_meta_free(e);
             return error;
+        }
             
         truncate_setsize(inode, attr->ia_size);
         tfs_debug("File truncated to %lld bytes\n", attr->ia_size);
     }
 
     setattr_copy(idmap, inode, attr);
+
+    e->op.ino = inode->i_ino;
+    e->op.mode = inode->i_mode;
+    e->op.size = i_size_read(inode);
+    e->op.attr_valid = attr->ia_valid;
+    tfs_meta_submit(e);
     return 0;
 }
 
@@ -447,11 +917,247 @@ static const struct inode_operations tfs_file_inode_operations = {
     .setattr = tfs_setattr,
 };
 
+//================ 目录索引 ========================
+
+// readdir cookie 0/1 留给 . 和 ..
+#define TFS_DIR_FIRST_COOKIE 2
+
+static u32 tfs_dirent_hashfn(const void *data, u32 len, u32 seed)
+{
+    const struct qstr *name = data;
+
+    return jhash(name->name, name->len, seed);
+}
+
+static u32 tfs_dirent_obj_hashfn(const void *data, u32 len, u32 seed)
+{
+    const struct tfs_dirent *de = data;
+
+    return jhash(de->name, de->len, seed);
+}
+
+static int tfs_dirent_obj_cmpfn(struct rhashtable_compare_arg *arg,
+                                const void *obj)
+{
+    const struct qstr *name = arg->key;
+    const struct tfs_dirent *de = obj;
+
+    return de->len != name->len || memcmp(de->name, name->name, de->len);
+}
+
+static const struct rhashtable_params tfs_dirent_params = {
+    .head_offset = offsetof(struct tfs_dirent, node),
+    .hashfn = tfs_dirent_hashfn,
+    .obj_hashfn = tfs_dirent_obj_hashfn,
+    .obj_cmpfn = tfs_dirent_obj_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static struct tfs_dir_index *tfs_dir_index_alloc(void)
+{
+    struct tfs_dir_index *dir;
+
+    dir = kzalloc(sizeof(*dir), GFP_KERNEL);
+    if (!dir)
+        return NULL;
+
+    if (rhashtable_init(&dir->names, &tfs_dirent_params)) {
+        kfree(dir);
+        return NULL;
+    }
+    xa_init(&dir->cursors);
+    dir->next_cookie = TFS_DIR_FIRST_COOKIE;
+    return dir;
+}
+
+// 销毁名字表时只收集目录项, 不在持有ht->mutex时iput
+static void tfs_dirent_collect(void *ptr, void *arg)
+{
+    struct tfs_dirent *de = ptr;
+    struct tfs_fs_info *sbi = arg;
+
+    llist_add(&de->reap, &sbi->dead_dirents);
+}
+
+// 归还dead_dirents中目录项持有的子inode引用
+// 子目录的回收会再次进入tfs_dir_index_free并追加自己的目录项; 同一任务内的
+// 嵌套调用直接返回, 由最外层循环继续排空, 因此深目录树不会造成递归。
+// 其他任务正在排空时也直接返回, 释放排空权后重新检查, 避免遗漏。
+static void tfs_dir_reap(struct tfs_fs_info *sbi)
+{
+    struct llist_node *batch;
+    struct tfs_dirent *de, *tmp;
+
+    do {
+        if (cmpxchg(&sbi->reaper, NULL, current))
+            return;
+
+        while ((batch = llist_del_all(&sbi->dead_dirents))) {
+            llist_for_each_entry_safe(de, tmp, batch, reap) {
+                iput(de->inode);
+                kfree(de);
+            }
+        }
+
+        smp_store_release(&sbi->reaper, NULL);
+        smp_mb();
+    } while (!llist_empty(&sbi->dead_dirents));
+}
+
+// 目录inode被回收时调用, 释放索引并归还对子inode的引用
+static void tfs_dir_index_free(struct tfs_fs_info *sbi, struct tfs_dir_index *dir)
+{
+    xa_destroy(&dir->cursors);
+    rhashtable_free_and_destroy(&dir->names, tfs_dirent_collect, sbi);
+    kfree(dir);
+    tfs_dir_reap(sbi);
+}
+
+static struct tfs_dirent *tfs_dirent_alloc(const struct qstr *name,
+                                           struct inode *inode)
+{
+    struct tfs_dirent *de;
+
+    de = kmalloc(struct_size(de, name, name->len), GFP_KERNEL);
+    if (!de)
+        return NULL;
+
+    de->inode = inode;
+    de->type = fs_umode_to_dtype(inode->i_mode);
+    de->len = name->len;
+    memcpy(de->name, name->name, name->len);
+    return de;
+}
+
+// 以下索引操作均要求持有目录的i_rwsem: 修改时独占, 查找和readdir时共享
+static struct tfs_dirent *tfs_dir_find(struct inode *dir, const struct qstr *name)
+{
+    struct tfs_dir_index *idx = TFS_I(dir)->dir;
+
+    return rhashtable_lookup_fast(&idx->names, name, tfs_dirent_params);
+}
+
+// 将已分配好的目录项挂入索引并分配新的cookie
+// replace非空时原地替换同名的旧目录项 (rename覆盖目标), 调用者负责归还其inode引用。
+// cookie槽位先行预留, 之后的名字表替换不分配内存, 因此失败时索引保持原样。
+static int tfs_dir_link_dirent(struct inode *dir, struct tfs_dirent *de,
+                               struct tfs_dirent *replace)
+{
+    struct tfs_dir_index *idx = TFS_I(dir)->dir;
+    struct qstr name = QSTR_INIT(de->name, de->len);
+    int ret;
+
+    de->cookie = idx->next_cookie;
+    ret = xa_reserve(&idx->cursors, de->cookie, GFP_KERNEL);
+    if (ret)
+        return ret;
+
+    if (replace) {
+        ret = rhashtable_replace_fast(&idx->names, &replace->node, &de->node,
+                                      tfs_dirent_params);
+        if (!WARN_ON(ret)) {
+            xa_erase(&idx->cursors, replace->cookie);
+            idx->nr_entries--;
+        }
+    } else {
+        ret = rhashtable_lookup_insert_key(&idx->names, &name, &de->node,
+                                           tfs_dirent_params);
+    }
+    if (ret) {
+        xa_release(&idx->cursors, de->cookie);
+        return ret;
+    }
+
+    // 槽位已预留, 这里不会分配内存
+    xa_store(&idx->cursors, de->cookie, de, GFP_KERNEL);
+    idx->next_cookie++;
+    idx->nr_entries++;
+    return 0;
+}
+
+static void tfs_dir_unlink_dirent(struct inode *dir, struct tfs_dirent *de)
+{
+    struct tfs_dir_index *idx = TFS_I(dir)->dir;
+
+    rhashtable_remove_fast(&idx->names, &de->node, tfs_dirent_params);
+    xa_erase(&idx->cursors, de->cookie);
+    idx->nr_entries--;
+}
+
+// 新增目录项, 成功时索引获得inode的一个引用
+static int tfs_dir_add(struct inode *dir, struct dentry *dentry,
+                       struct inode *inode)
+{
+    struct tfs_dirent *de;
+    int ret;
+
+    de = tfs_dirent_alloc(&dentry->d_name, inode);
+    if (!de)
+        return -ENOMEM;
+
+    ret = tfs_dir_link_dirent(dir, de, NULL);
+    if (ret) {
+        kfree(de);
+        return ret;
+    }
+
+    ihold(inode);
+    return 0;
+}
+
+// 删除目录项并归还索引持有的inode引用
+static void tfs_dir_remove(struct inode *dir, struct dentry *dentry)
+{
+    struct tfs_dirent *de = tfs_dir_find(dir, &dentry->d_name);
+
+    if (WARN_ON(!de))
+        return;
+
+    tfs_dir_unlink_dirent(dir, de);
+    iput(de->inode);
+    kfree_rcu(de, rcu);
+}
+
+static bool tfs_dir_empty(struct inode *dir)
+{
+    return TFS_I(dir)->dir->nr_entries == 0;
+}
+
+// 分配新inode及其inode号, 达到max_files上限时返回-ENOSPC
+static struct inode *tfs_new_inode(struct super_block *sb)
+{
+    struct tfs_fs_info *fsi = sb->s_fs_info;
+    struct inode *inode;
+    int ino;
+
+    if (!atomic_add_unless(&fsi->nr_files, 1, fsi->max_files))
+        return ERR_PTR(-ENOSPC);
+
+    ino = ida_alloc_min(&tfs_ino_ida, TFS_FIRST_INO, GFP_KERNEL);
+    if (ino < 0) {
+        atomic_dec(&fsi->nr_files);
+        return ERR_PTR(ino);
+    }
+
+    inode = new_inode(sb);
+    if (!inode) {
+        ida_free(&tfs_ino_ida, ino);
+        atomic_dec(&fsi->nr_files);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    // 此后inode号和文件计数随inode回收在tfs_evict_inode中归还
+    inode->i_ino = ino;
+    return inode;
+}
+
 // 自定义文件创建函数，确保正确的权限设置
 static int tfs_create(struct mnt_idmap *idmap, struct inode *dir, 
                      struct dentry *dentry, umode_t mode, bool excl)
 {
     struct inode *inode;
+    struct tfs_meta_entry *e;
+    int ret;
     
     tfs_debug("tfs_create called for %s with mode %o\n", dentry->d_name.name, mode);
     
@@ -462,16 +1168,21 @@ static int tfs_create(struct mnt_idmap *idmap, struct inode *dir,
     }
     
     tfs_info("Creating new file: %s with enforced mode 0666\n", dentry->d_name.name);
+
+    e = tfs_meta_alloc(TFS_META_CREATE);
+    if (IS_ERR(e))
+        return PTR_ERR(e);
     
     // 创建新的inode
-    inode = new_inode(dir->i_sb);
-    if (!inode) {
-        tfs_error("Failed to allocate new inode for %s\n", dentry->d_name.name);
-        return -ENOMEM;
+    inode = tfs_new_inode(dir->i_sb);
+    if (IS_ERR(inode)) {
+        tfs_error("Failed to allocate new inode for %s (ret=%ld)\n",
+                  dentry->d_name.name, PTR_ERR(inode));
+        tfs_meta_free(e);
+        return PTR_ERR(inode);
     }
     
     // 设置为常规文件，确保所有用户都有读写权限
-    inode->i_ino = get_next_ino();
     inode->i_mode = S_IFREG | 0666;  // 设置为666权限
     inode->i_uid = current_fsuid();
     inode->i_gid = current_fsgid();
@@ -483,9 +1194,23 @@ static int tfs_create(struct mnt_idmap *idmap, struct inode *dir,
     // 设置文件大小为0
     i_size_write(inode, 0);
     
-    // 添加到目录中
+    // 添加到目录索引中, 由索引而不是常驻dentry保持inode存活
+    ret = tfs_dir_add(dir, dentry, inode);
+    if (ret) {
+        tfs_error("Failed to index %s (ret=%d)\n", dentry->d_name.name, ret);
+        tfs_meta_free(e);
+        iput(inode);
+        return ret;
+    }
+    dir->i_mtime = dir->i_ctime = inode->i_ctime;
     d_instantiate(dentry, inode);
-    dget(dentry);
+
+    // 通知tfsd, 不等待其处理完成
+    e->op.ino = inode->i_ino;
+    e->op.parent_ino = dir->i_ino;
+    e->op.mode = inode->i_mode;
+    tfs_meta_set_name(e->op.name, &e->op.name_len, &dentry->d_name);
+    tfs_meta_submit(e);
     
     tfs_debug("File %s created successfully with inode %lu\n", 
               dentry->d_name.name, inode->i_ino);
@@ -500,16 +1225,30 @@ static int tfs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
                     struct dentry *dentry, umode_t mode)
 {
     struct inode *inode;
+    struct tfs_meta_entry *e;
+    int ret;
     
     tfs_debug("tfs_mkdir called for %s with mode %o\n", dentry->d_name.name, mode);
+
+    e = tfs_meta_alloc(TFS_META_MKDIR);
+    if (IS_ERR(e))
+        return PTR_ERR(e);
     
     // 创建新的inode
-    inode = new_inode(dir->i_sb);
-    if (!inode)
+    inode = tfs_new_inode(dir->i_sb);
+    if (IS_ERR(inode)) {
+        tfs_meta_free(e);
+        return PTR_ERR(inode);
+    }
+
+    TFS_I(inode)->dir = tfs_dir_index_alloc();
+    if (!TFS_I(inode)->dir) {
+        tfs_meta_free(e);
+        iput(inode);
         return -ENOMEM;
+    }
     
     // 设置为目录，确保所有用户都有读写执行权限
-    inode->i_ino = get_next_ino();
     inode->i_mode = S_IFDIR | 0777;  // 设置为777权限
     inode->i_uid = current_fsuid();
     inode->i_gid = current_fsgid();
@@ -522,9 +1261,21 @@ static int tfs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
     set_nlink(inode, 2);  // . 和 ..
     
     // 添加到父目录中
+    ret = tfs_dir_add(dir, dentry, inode);
+    if (ret) {
+        tfs_meta_free(e);
+        iput(inode);
+        return ret;
+    }
+    dir->i_mtime = dir->i_ctime = inode->i_ctime;
     d_instantiate(dentry, inode);
-    dget(dentry);
     inc_nlink(dir);  // 使用inc_nlink增加父目录的链接计数
+
+    e->op.ino = inode->i_ino;
+    e->op.parent_ino = dir->i_ino;
+    e->op.mode = inode->i_mode;
+    tfs_meta_set_name(e->op.name, &e->op.name_len, &dentry->d_name);
+    tfs_meta_submit(e);
     
     tfs_debug("Directory %s created successfully with inode %lu\n", 
               dentry->d_name.name, inode->i_ino);
@@ -532,25 +1283,210 @@ static int tfs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
     return 0;
 }
 
+// 通过目录索引查找, 不依赖dcache中常驻的dentry
+static struct dentry *tfs_lookup(struct inode *dir, struct dentry *dentry,
+                                 unsigned int flags)
+{
+    struct tfs_dirent *de;
+    struct inode *inode = NULL;
+
+    if (dentry->d_name.len > NAME_MAX)
+        return ERR_PTR(-ENAMETOOLONG);
+
+    de = tfs_dir_find(dir, &dentry->d_name);
+    if (de) {
+        inode = de->inode;
+        ihold(inode);
+    }
+
+    return d_splice_alias(inode, dentry);
+}
+
+static int tfs_link(struct dentry *old_dentry, struct inode *dir,
+                    struct dentry *dentry)
+{
+    struct inode *inode = d_inode(old_dentry);
+    struct tfs_meta_entry *e;
+    int ret;
+
+    e = tfs_meta_alloc(TFS_META_LINK);
+    if (IS_ERR(e))
+        return PTR_ERR(e);
+
+    ret = tfs_dir_add(dir, dentry, inode);
+    if (ret) {
+        tfs_meta_free(e);
+        return ret;
+    }
+
+    inode->i_ctime = dir->i_ctime = dir->i_mtime = current_time(inode);
+    inc_nlink(inode);
+    ihold(inode);
+    d_instantiate(dentry, inode);
+
+    e->op.ino = inode->i_ino;
+    e->op.parent_ino = dir->i_ino;
+    e->op.mode = inode->i_mode;
+    tfs_meta_set_name(e->op.name, &e->op.name_len, &dentry->d_name);
+    tfs_meta_submit(e);
+    return 0;
+}
+
+static void __tfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+
+    tfs_dir_remove(dir, dentry);
+    inode->i_ctime = dir->i_ctime = dir->i_mtime = current_time(inode);
+    drop_nlink(inode);
+}
+
+// unlink/rmdir的元数据通知
+static void tfs_meta_submit_remove(struct tfs_meta_entry *e, struct inode *dir,
+                                   struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+
+    e->op.ino = inode->i_ino;
+    e->op.parent_ino = dir->i_ino;
+    e->op.mode = inode->i_mode;
+    tfs_meta_set_name(e->op.name, &e->op.name_len, &dentry->d_name);
+    tfs_meta_submit(e);
+}
+
+static int tfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    struct tfs_meta_entry *e;
+
+    tfs_debug("tfs_unlink called for %s\n", dentry->d_name.name);
+
+    e = tfs_meta_alloc(TFS_META_UNLINK);
+    if (IS_ERR(e))
+        return PTR_ERR(e);
+
+    __tfs_unlink(dir, dentry);
+    tfs_meta_submit_remove(e, dir, dentry);
+    return 0;
+}
+
+static int tfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+    struct tfs_meta_entry *e;
+
+    if (!tfs_dir_empty(inode))
+        return -ENOTEMPTY;
+
+    e = tfs_meta_alloc(TFS_META_RMDIR);
+    if (IS_ERR(e))
+        return PTR_ERR(e);
+
+    __tfs_unlink(dir, dentry);
+    drop_nlink(inode);
+    drop_nlink(dir);
+    tfs_meta_submit_remove(e, dir, dentry);
+    return 0;
+}
+
+static int tfs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
+                      struct dentry *old_dentry, struct inode *new_dir,
+                      struct dentry *new_dentry, unsigned int flags)
+{
+    struct inode *inode = d_inode(old_dentry);
+    struct inode *target = d_inode(new_dentry);
+    int they_are_dirs = d_is_dir(old_dentry);
+    struct tfs_dirent *old_de, *new_de, *target_de = NULL;
+    struct tfs_meta_entry *e;
+    int ret;
+
+    if (flags & ~RENAME_NOREPLACE)
+        return -EINVAL;
+
+    if (target && d_is_dir(new_dentry) && !tfs_dir_empty(target))
+        return -ENOTEMPTY;
+
+    old_de = tfs_dir_find(old_dir, &old_dentry->d_name);
+    if (WARN_ON(!old_de))
+        return -ENOENT;
+
+    if (target) {
+        target_de = tfs_dir_find(new_dir, &new_dentry->d_name);
+        if (WARN_ON(!target_de))
+            return -ENOENT;
+    }
+
+    e = tfs_meta_alloc(TFS_META_RENAME);
+    if (IS_ERR(e))
+        return PTR_ERR(e);
+
+    // 名字变化需要新的目录项, 先分配好以免中途失败
+    new_de = tfs_dirent_alloc(&new_dentry->d_name, inode);
+    if (!new_de) {
+        tfs_meta_free(e);
+        return -ENOMEM;
+    }
+
+    // 新目录项挂入索引(覆盖时替换目标)是唯一可能失败的步骤, 放在修改链接计数之前
+    ret = tfs_dir_link_dirent(new_dir, new_de, target_de);
+    if (ret) {
+        tfs_meta_free(e);
+        kfree(new_de);
+        return ret;
+    }
+
+    if (target) {
+        iput(target_de->inode);
+        kfree_rcu(target_de, rcu);
+        drop_nlink(target);
+        if (they_are_dirs) {
+            drop_nlink(target);
+            drop_nlink(old_dir);
+        }
+    } else if (they_are_dirs) {
+        drop_nlink(old_dir);
+        inc_nlink(new_dir);
+    }
+
+    // 索引持有的inode引用从旧目录项转移到新目录项
+    tfs_dir_unlink_dirent(old_dir, old_de);
+    kfree_rcu(old_de, rcu);
+
+    old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
+    new_dir->i_ctime = new_dir->i_mtime = old_dir->i_ctime;
+    inode->i_ctime = old_dir->i_ctime;
+    if (target)
+        target->i_ctime = old_dir->i_ctime;
+
+    e->op.ino = inode->i_ino;
+    e->op.parent_ino = old_dir->i_ino;
+    e->op.new_parent_ino = new_dir->i_ino;
+    e->op.mode = inode->i_mode;
+    tfs_meta_set_name(e->op.name, &e->op.name_len, &old_dentry->d_name);
+    tfs_meta_set_name(e->op.new_name, &e->op.new_name_len, &new_dentry->d_name);
+    tfs_meta_submit(e);
+    return 0;
+}
+
 // 目录 inode 操作
 static const struct inode_operations tfs_dir_inode_operations = {
-    .lookup = simple_lookup,
+    .lookup = tfs_lookup,
     .create = tfs_create,  // 使用自定义的创建函数
-    .link = simple_link,
-    .unlink = simple_unlink,
+    .link = tfs_link,
+    .unlink = tfs_unlink,
     .mkdir = tfs_mkdir,    // 使用自定义的目录创建函数
-    .rmdir = simple_rmdir,
-    // 移除不支持的操作
-    .rename = simple_rename,
+    .rmdir = tfs_rmdir,
+    .rename = tfs_rename,
+    .setattr = tfs_setattr,
 };
 
 // 自定义目录迭代函数
+// ctx->pos即目录项cookie, 调用者持有共享的i_rwsem, 遍历期间索引不会被修改
 static int tfs_readdir(struct file *file, struct dir_context *ctx)
 {
     struct inode *inode = file_inode(file);
     struct tfs_inode_info *fsi = TFS_I(inode);
-    (void)fsi;  // 显式标记未使用
-    int err = 0;
+    struct tfs_dirent *de;
+    unsigned long cookie;
     
     tfs_debug("tfs_readdir called for inode %lu, pos %lld\n",
              inode->i_ino, ctx->pos);
@@ -570,50 +1506,152 @@ static int tfs_readdir(struct file *file, struct dir_context *ctx)
     if (!dir_emit_dots(file, ctx))
         return 0;
 
-    // 简单的目录项实现 - 在实际应用中应该替换为真实的目录项遍历
-    if (ctx->pos == 2) {
-        if (!dir_emit(ctx, "testfile1", 9, inode->i_ino + 1, DT_REG))
+    // 从上次停下的cookie继续, 按cookie顺序流式输出
+    xa_for_each_start(&fsi->dir->cursors, cookie, de, ctx->pos) {
+        ctx->pos = cookie;
+        if (!dir_emit(ctx, de->name, de->len, de->inode->i_ino, de->type))
             return 0;
-        ctx->pos++;
-    }
-    if (ctx->pos == 3) {
-        if (!dir_emit(ctx, "testdir1", 8, inode->i_ino + 2, DT_DIR))
-            return 0;
-        ctx->pos++;
+        ctx->pos = cookie + 1;
     }
 
-    return err;
+    return 0;
+}
+
+// cookie可能超过默认的s_maxbytes, 按最大文件大小限制seek范围
+static loff_t tfs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+    return generic_file_llseek_size(file, offset, whence,
+                                    MAX_LFS_FILESIZE, MAX_LFS_FILESIZE);
 }
 
 // 文件系统统计信息
 static int tfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
-    (void)dentry;  // 显式标记未使用
+    struct tfs_fs_info *fsi = dentry->d_sb->s_fs_info;
+    unsigned int used = atomic_read(&fsi->nr_files);
+    struct tfs_capacity cap;
+    unsigned long stamp;
+    unsigned int seq;
     
     tfs_debug("statfs called\n");
 
-    buf->f_type = TFS_MAGIC;
-    buf->f_bsize = PAGE_SIZE;
-    buf->f_blocks = 0;  // 总块数 - 实际应用中应该计算
-    buf->f_bfree = 0;   // 空闲块数
-    buf->f_bavail = 0;  // 可用块数
-    buf->f_files = 0;   // 总文件数
-    buf->f_ffree = 0;   // 空闲文件数
-    buf->f_namelen = NAME_MAX;
-    
+    // 读取tfsd推送的容量缓存
+    do {
+        seq = read_seqbegin(&tfs_ctx->cap_lock);
+        cap = tfs_ctx->cap;
+        stamp = tfs_ctx->cap_stamp;
+    } while (read_seqretry(&tfs_ctx->cap_lock, seq));
+
+    // 过期时仍返回上次的数值, 同时请求tfsd尽快刷新
+    if (stamp && time_after(jiffies, stamp + msecs_to_jiffies(cap.ttl_ms)) &&
+        !READ_ONCE(tfs_ctx->cap_refresh)) {
+        WRITE_ONCE(tfs_ctx->cap_refresh, true);
+        wake_up_interruptible(&tfs_ctx->wq);
+    }
+
+    buf->f_type = TFS_MAGIC;
+    buf->f_bsize = PAGE_SIZE;
+    buf->f_blocks = cap.total_bytes >> PAGE_SHIFT;  // 总块数
+    buf->f_bfree = cap.free_bytes >> PAGE_SHIFT;    // 空闲块数
+    buf->f_bavail = cap.avail_bytes >> PAGE_SHIFT;  // 可用块数
+    buf->f_files = fsi->max_files;   // 总文件数
+    buf->f_ffree = fsi->max_files - min(used, fsi->max_files); // 空闲文件数
+    buf->f_namelen = NAME_MAX;
+    
+    return 0;
+}
+
+// 目录文件操作
+static const struct file_operations tfs_dir_operations = {
+    .read = generic_read_dir,
+    .iterate_shared = tfs_readdir,  // 使用自定义实现
+    .llseek = tfs_dir_llseek,
+    .fsync = noop_fsync,
+};
+
+static void tfs_fill_xfer_info(const struct tfs_xfer *xfer, struct tfs_xfer_info *info)
+{
+    *info = (struct tfs_xfer_info) {
+        .offset = xfer->offset,
+        .size = xfer->size,
+        .pfn = xfer->pfn,
+        .ino = xfer->ino,
+        .id = xfer->id,
+        .page_offset = xfer->folio ? offset_in_page(xfer->data_off) : 0,
+        .map_size = xfer->folio ? tfs_xfer_map_size(xfer) : 0,
+    };
+}
+
+// 放回队首, 保持原有顺序
+static void tfs_xfer_requeue(struct tfs_xfer *xfer)
+{
+    spin_lock(&tfs_ctx->lock);
+    list_add(&xfer->list, &tfs_ctx->xfer_list);
+    tfs_stat_inc(TFS_STAT_QUEUED);
+    spin_unlock(&tfs_ctx->lock);
+}
+
+// 批量领取传输项: 从待处理队列移入inflight并分配ID,
+// 之后tfsd可以按ID并行映射和完成, 不受队列顺序约束
+static long tfs_fetch_xfers(struct tfs_xfer_batch __user *ubatch)
+{
+    struct tfs_xfer_batch batch;
+    struct tfs_xfer_info __user *uinfos;
+    struct tfs_xfer_info info;
+    struct tfs_xfer *xfer;
+    u32 max_xfers, n;
+    u32 id;
+    int ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+
+    max_xfers = min_t(u32, batch.max_xfers, TFS_XFER_BATCH_MAX);
+    uinfos = u64_to_user_ptr(batch.infos);
+
+    for (n = 0; n < max_xfers; n++) {
+        spin_lock(&tfs_ctx->lock);
+        xfer = list_first_entry_or_null(&tfs_ctx->xfer_list, struct tfs_xfer, list);
+        if (xfer) {
+            list_del_init(&xfer->list);
+            tfs_stat_add(TFS_STAT_QUEUED, -1);
+        }
+        spin_unlock(&tfs_ctx->lock);
+        if (!xfer)
+            break;
+
+        ret = xa_alloc_cyclic(&tfs_ctx->inflight, &id, xfer, xa_limit_31b,
+                              &tfs_ctx->next_xfer_id, GFP_KERNEL);
+        if (ret < 0) {
+            tfs_xfer_requeue(xfer);
+            break;
+        }
+        xfer->id = id;
+        tfs_stat_inc(TFS_STAT_INFLIGHT);
+        xfer->fetch_ns = ktime_get_ns();
+        trace_tfs_xfer_fetch(xfer);
+        tfs_fill_xfer_info(xfer, &info);
+
+        if (copy_to_user(&uinfos[n], &info, sizeof(info))) {
+            xa_erase(&tfs_ctx->inflight, id);
+            tfs_stat_add(TFS_STAT_INFLIGHT, -1);
+            xfer->id = 0;
+            tfs_xfer_requeue(xfer);
+            tfs_stat_inc(TFS_STAT_IOCTL_ERRORS);
+            ret = -EFAULT;
+            break;
+        }
+        ret = 0;
+    }
+
+    if (!n && ret < 0)
+        return ret;
+
+    if (put_user(n, &ubatch->nr_xfers))
+        return -EFAULT;
     return 0;
 }
 
-// 目录文件操作
-static const struct file_operations tfs_dir_operations = {
-    .read = generic_read_dir,
-    .iterate_shared = tfs_readdir,  // 使用自定义实现
-    .llseek = generic_file_llseek,
-    .open = dcache_dir_open,
-    .release = dcache_dir_close,
-    .fsync = noop_fsync,
-};
-
 // 字符设备操作
 static long tfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
@@ -639,7 +1677,7 @@ static long tfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         spin_unlock(&tfs_ctx->lock);
         
         if (copy_to_user((int __user *)arg, &count, sizeof(int))) {
-            atomic_inc(&tfs_ctx->ioctl_errors);
+            tfs_stat_inc(TFS_STAT_IOCTL_ERRORS);
             return -EFAULT;
         }
         return 0;
@@ -656,16 +1694,14 @@ static long tfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
                                    struct tfs_xfer, list);
             
             // 构造传输信息
-            struct tfs_xfer_info info = {
-                .offset = xfer->offset,
-                .size = xfer->size,
-                .pfn = xfer->pfn
-            };
+            struct tfs_xfer_info info;
+
+            tfs_fill_xfer_info(xfer, &info);
             
             spin_unlock(&tfs_ctx->lock);
             
             if (copy_to_user((struct tfs_xfer_info __user *)arg, &info, sizeof(info))) {
-                atomic_inc(&tfs_ctx->ioctl_errors);
+                tfs_stat_inc(TFS_STAT_IOCTL_ERRORS);
                 return -EFAULT;
             }
             return 0;
@@ -678,102 +1714,361 @@ static long tfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         if (!list_empty(&tfs_ctx->xfer_list)) {
             struct tfs_xfer *xfer = list_first_entry(&tfs_ctx->xfer_list, struct tfs_xfer, list);
             list_del(&xfer->list);
+            tfs_stat_add(TFS_STAT_QUEUED, -1);
             spin_unlock(&tfs_ctx->lock);
 
             // 唤醒等待的write
-            complete(&xfer->done);
-
-            if (xfer->page)
-                put_page(xfer->page);
-            kfree(xfer);
+            tfs_xfer_finish(xfer, 0);
         } else {
             spin_unlock(&tfs_ctx->lock);
         }
         return 0;
+
+    case TFS_GET_META_BATCH:
+        if (!arg) {
+            return -EINVAL;
+        }
+        return tfs_meta_fetch_batch((struct tfs_meta_batch __user *)arg);
+
+    case TFS_FETCH_XFERS:
+        if (!arg) {
+            return -EINVAL;
+        }
+        return tfs_fetch_xfers((struct tfs_xfer_batch __user *)arg);
+
+    case TFS_COMPLETE_XFER: {
+        struct tfs_xfer_done done;
+
+        if (copy_from_user(&done, (void __user *)arg, sizeof(done))) {
+            tfs_stat_inc(TFS_STAT_IOCTL_ERRORS);
+            return -EFAULT;
+        }
+        if (done.status > 0 || done.status < -MAX_ERRNO)
+            return -EINVAL;
+
+        xfer = xa_erase(&tfs_ctx->inflight, done.id);
+        if (!xfer)
+            return -ENOENT;
+        tfs_stat_add(TFS_STAT_INFLIGHT, -1);
+
+        tfs_xfer_finish(xfer, done.status);
+        return 0;
+    }
+
+    case TFS_SET_CAPACITY: {
+        struct tfs_capacity cap;
+
+        if (copy_from_user(&cap, (void __user *)arg, sizeof(cap))) {
+            tfs_stat_inc(TFS_STAT_IOCTL_ERRORS);
+            return -EFAULT;
+        }
+        if (!cap.ttl_ms)
+            return -EINVAL;
+
+        write_seqlock(&tfs_ctx->cap_lock);
+        tfs_ctx->cap = cap;
+        tfs_ctx->cap_stamp = jiffies ?: 1;
+        write_sequnlock(&tfs_ctx->cap_lock);
+        WRITE_ONCE(tfs_ctx->cap_refresh, false);
+        return 0;
+    }
+
     default:
         return -ENOTTY;
     }
     return 0;
 }
 
+// 映射区域的私有数据是段的首页, 映射区域持有其folio的引用, 随VMA的复制/拆分/解除映射增减
+static void tfs_vm_open(struct vm_area_struct *vma)
+{
+    folio_get(page_folio(vma->vm_private_data));
+}
+
+static void tfs_vm_close(struct vm_area_struct *vma)
+{
+    folio_put(page_folio(vma->vm_private_data));
+}
+
+// 映射偏移对应的页: 偏移的低位是窗口在段映射区域内的页偏移, VMA拆分后依然成立
+static inline struct page *tfs_vma_page(struct vm_area_struct *vma, pgoff_t pgoff)
+{
+    return nth_page((struct page *)vma->vm_private_data,
+                    pgoff & ((1UL << TFS_XFER_MMAP_PGSHIFT) - 1));
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+// 以addr开始的2MB区间能否整体用一个PMD映射, 能则返回区间的首页
+// 区间要完整落在VMA和段的folio内且物理上按2MB对齐; 按页插入的映射只支持恰为PMD阶的folio
+static struct page *tfs_vma_pmd_page(struct vm_area_struct *vma, unsigned long addr)
+{
+    struct folio *folio = page_folio(vma->vm_private_data);
+    struct page *page;
+
+    if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end || is_cow_mapping(vma->vm_flags))
+        return NULL;
+    if ((vma->vm_flags & VM_MIXEDMAP) && folio_order(folio) != HPAGE_PMD_ORDER)
+        return NULL;
+
+    page = tfs_vma_page(vma, vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT));
+    if (!IS_ALIGNED(page_to_pfn(page), HPAGE_PMD_NR) ||
+        folio_page_idx(folio, page) + HPAGE_PMD_NR > folio_nr_pages(folio))
+        return NULL;
+    return page;
+}
+
+// 大folio和大页按PMD映射, tfsd处理一个2MB的段只占一个TLB项
+static vm_fault_t tfs_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    bool write = vmf->flags & FAULT_FLAG_WRITE;
+    struct page *page;
+
+    if (order != HPAGE_PMD_ORDER)
+        return VM_FAULT_FALLBACK;
+    page = tfs_vma_pmd_page(vmf->vma, vmf->address & PMD_MASK);
+    if (!page)
+        return VM_FAULT_FALLBACK;
+
+    if (vmf->vma->vm_flags & VM_MIXEDMAP) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+        return vmf_insert_folio_pmd(vmf, page_folio(page), write);
+#else
+        return VM_FAULT_FALLBACK;
+#endif
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+    return vmf_insert_pfn_pmd(vmf, page_to_pfn(page), write);
+#else
+    return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(page_to_pfn(page)), write);
+#endif
+}
+#else
+static inline struct page *tfs_vma_pmd_page(struct vm_area_struct *vma, unsigned long addr)
+{
+    return NULL;
+}
+#endif
+
+// 缺页时映射单个页: 凑不满PMD区间的部分, 或进程禁用了THP
+static vm_fault_t tfs_vm_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct page *page = tfs_vma_page(vma, vmf->pgoff);
+    int err;
+
+    if (vma->vm_flags & VM_PFNMAP)
+        return vmf_insert_pfn(vma, vmf->address, page_to_pfn(page));
+
+    err = vm_insert_page(vma, vmf->address, page);
+    if (err && err != -EBUSY)
+        return vmf_error(err);
+    return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct tfs_vm_ops = {
+    .open = tfs_vm_open,
+    .close = tfs_vm_close,
+    .fault = tfs_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = tfs_vm_huge_fault,
+#endif
+};
+
+// 一次插入整个窗口的页: 映射的是带引用计数的普通页, get_user_pages (如MSG_ZEROCOPY) 可以固定它们
+static int tfs_vma_insert_pages(struct vm_area_struct *vma)
+{
+    struct page *page = tfs_vma_page(vma, vma->vm_pgoff);
+    unsigned long i, num = vma_pages(vma);
+    struct page **pages;
+    int ret;
+
+    pages = kvmalloc_array(num, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+    for (i = 0; i < num; i++)
+        pages[i] = nth_page(page, i);
+    ret = vm_insert_pages(vma, vma->vm_start, pages, &num);
+    kvfree(pages);
+    return ret;
+}
+
+// 查找要映射的传输项并获取其folio引用
+// 偏移为0时映射队首 (旧接口), 否则按偏移中编码的ID映射已领取的传输项,
+// win_pgoff输出窗口在段映射区域内的页偏移。
+// 在查找所用的锁内获取传输项的引用, 调用者用完后tfs_xfer_put: 出锁后并发的
+// TFS_COMPLETE_XFER可能已将其移出并释放队列的引用。
+static struct tfs_xfer *tfs_mmap_lookup(struct vm_area_struct *vma,
+                                        struct folio **foliop,
+                                        unsigned long *win_pgoff)
+{
+    struct tfs_xfer *xfer;
+
+    *foliop = NULL;
+    *win_pgoff = 0;
+
+    if (vma->vm_pgoff) {
+        unsigned long id;
+
+        *win_pgoff = vma->vm_pgoff & ((1UL << TFS_XFER_MMAP_PGSHIFT) - 1);
+        id = vma->vm_pgoff >> TFS_XFER_MMAP_PGSHIFT;
+
+        xa_lock(&tfs_ctx->inflight);
+        xfer = xa_load(&tfs_ctx->inflight, id);
+        if (xfer) {
+            kref_get(&xfer->ref);
+            if (xfer->folio) {
+                *foliop = xfer->folio;
+                folio_get(*foliop);
+            }
+        }
+        xa_unlock(&tfs_ctx->inflight);
+        return xfer;
+    }
+
+    spin_lock(&tfs_ctx->lock);
+    xfer = list_first_entry_or_null(&tfs_ctx->xfer_list, struct tfs_xfer, list);
+    if (xfer) {
+        kref_get(&xfer->ref);
+        if (xfer->folio) {
+            *foliop = xfer->folio;
+            folio_get(*foliop);
+        }
+    }
+    spin_unlock(&tfs_ctx->lock);
+    return xfer;
+}
+
 // 实现mmap操作
 static int tfs_mmap(struct file *file, struct vm_area_struct *vma)
 {
     struct tfs_xfer *xfer = NULL;
+    struct folio *folio;
     unsigned long vsize = vma->vm_end - vma->vm_start;
+    unsigned long pfn, win_pgoff;
+    size_t map_size;
+    bool insertable;
     int ret;
     
-    tfs_debug("mmap called: start=%lx, end=%lx, size=%lu\n",
-              vma->vm_start, vma->vm_end, vsize);
+    tfs_debug("mmap called: start=%lx, end=%lx, size=%lu, pgoff=%lx\n",
+              vma->vm_start, vma->vm_end, vsize, vma->vm_pgoff);
 
     if (!tfs_ctx) {
         tfs_error("tfs_ctx is NULL in mmap\n");
         return -EINVAL;
     }
 
-    // 检查请求的映射大小
-    if (vsize == 0 || vsize > PAGE_SIZE) {
+    if (vsize == 0) {
         tfs_error("Invalid mmap size: %lu\n", vsize);
         return -EINVAL;
     }
 
     // 保护对当前传输项的访问
     mutex_lock(&tfs_ctx->mmap_lock);
-    spin_lock(&tfs_ctx->lock);
-    
-    if (list_empty(&tfs_ctx->xfer_list)) {
-        spin_unlock(&tfs_ctx->lock);
-        mutex_unlock(&tfs_ctx->mmap_lock);
-        tfs_error("No xfer available for mmap\n");
-        return -EINVAL;
-    }
-    
-    xfer = list_first_entry(&tfs_ctx->xfer_list, struct tfs_xfer, list);
+
+    xfer = tfs_mmap_lookup(vma, &folio, &win_pgoff);
     if (!xfer) {
-        spin_unlock(&tfs_ctx->lock);
         mutex_unlock(&tfs_ctx->mmap_lock);
-        tfs_error("Invalid xfer in xfer_list\n");
+        tfs_error("No xfer available for mmap (pgoff=%lx)\n", vma->vm_pgoff);
         return -EINVAL;
     }
     
     // 检查是否是空文件的特殊传输项
-    if (!xfer->page) {
+    if (!folio) {
         tfs_debug("Empty file transfer detected in mmap, size=%zu\n", xfer->size);
-        spin_unlock(&tfs_ctx->lock);
         mutex_unlock(&tfs_ctx->mmap_lock);
+        tfs_xfer_put(xfer);
         // 对于空文件，我们不需要映射，但也不应该报错
         // 返回成功，但不执行实际映射
         return 0;
     }
+
+    // 持有传输项引用期间, 段的位置信息不会变化
+    pfn = tfs_xfer_pfn(xfer) + win_pgoff;
+    map_size = tfs_xfer_map_size(xfer);
     
-    get_page(xfer->page); // 增加页面引用计数
-    spin_unlock(&tfs_ctx->lock);
+    // 窗口不能超出段所在的页范围
+    if (win_pgoff >= (map_size >> PAGE_SHIFT) ||
+        vsize > map_size - (win_pgoff << PAGE_SHIFT)) {
+        mutex_unlock(&tfs_ctx->mmap_lock);
+        folio_put(folio);
+        tfs_xfer_put(xfer);
+        tfs_error("Invalid mmap window: %lu bytes at page %lu (segment map size %zu)\n",
+                  vsize, win_pgoff, map_size);
+        return -EINVAL;
+    }
 
-    // 设置VMA标志
-    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
-    vma->vm_private_data = xfer;
+    // 拷贝模式的folio和文件页可以按页插入, 固定的匿名页和hugetlb页只能按页帧映射
+    insertable = !folio_test_anon(folio) && !folio_test_hugetlb(folio);
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP | (insertable ? VM_MIXEDMAP : VM_PFNMAP | VM_IO));
+    vma->vm_private_data = folio_page(folio, xfer->data_off >> PAGE_SHIFT);
 
-    // 直接映射物理页面到用户空间
-    ret = remap_pfn_range(vma, vma->vm_start,
-                         page_to_pfn(xfer->page),
-                         vsize, vma->vm_page_prot);
+    // 窗口中有能整体按PMD映射的区间时留给缺页处理, 其余情况整个窗口一次性映射
+    if (tfs_vma_pmd_page(vma, ALIGN(vma->vm_start, PMD_SIZE)))
+        ret = 0;
+    else if (insertable)
+        ret = tfs_vma_insert_pages(vma);
+    else
+        ret = remap_pfn_range(vma, vma->vm_start, pfn, vsize, vma->vm_page_prot);
+    trace_tfs_xfer_map(xfer, vsize, ret);
     
     if (ret) {
-        tfs_error("remap_pfn_range failed: %d\n", ret);
-        atomic_inc(&tfs_ctx->mmap_errors);
-        put_page(xfer->page);
+        tfs_error("Mapping segment pages failed: %d\n", ret);
+        tfs_stat_inc(TFS_STAT_MMAP_ERRORS);
+        folio_put(folio);
     } else {
-        tfs_debug("mmap succeeded for pfn=%lu\n", page_to_pfn(xfer->page));
-        tfs_ctx->current_xfer = xfer;
+        tfs_debug("mmap succeeded for pfn=%lu, size=%lu\n", pfn, vsize);
+        // 引用在tfs_vm_close中释放
+        vma->vm_ops = &tfs_vm_ops;
+        if (!vma->vm_pgoff)
+            tfs_ctx->current_xfer = xfer;
     }
     
     mutex_unlock(&tfs_ctx->mmap_lock);
+    tfs_xfer_put(xfer);
     return ret;
 }
 
+static int tfs_open(struct inode *inode, struct file *file)
+{
+    atomic_inc(&tfs_ctx->ctl_opens);
+    return 0;
+}
+
+// 最后一个打开的控制设备关闭: tfsd退出或崩溃, 已领取但未完成的传输项按ID顺序放回队首,
+// 由下一个tfsd重新领取, 写者继续等待而不是丢失这些传输。
+// 热升级时描述符经SCM_RIGHTS传给新进程, 文件没有关闭, inflight原样保留。
 static int tfs_release(struct inode *inode, struct file *file)
 {
+    struct tfs_xfer *xfer;
+    unsigned long id;
+    LIST_HEAD(requeue);
+    int count = 0;
+
     tfs_debug("tfs_release called\n");
+
+    if (!atomic_dec_and_test(&tfs_ctx->ctl_opens))
+        return 0;
+
+    xa_for_each(&tfs_ctx->inflight, id, xfer) {
+        if (xa_erase(&tfs_ctx->inflight, id) != xfer)
+            continue;
+        tfs_stat_add(TFS_STAT_INFLIGHT, -1);
+        xfer->id = 0;
+        xfer->fetch_ns = 0;
+        list_add_tail(&xfer->list, &requeue);
+        count++;
+    }
+    if (!count)
+        return 0;
+
+    spin_lock(&tfs_ctx->lock);
+    list_splice(&requeue, &tfs_ctx->xfer_list);
+    tfs_stat_add(TFS_STAT_QUEUED, count);
+    tfs_stat_add(TFS_STAT_REQUEUED, count);
+    spin_unlock(&tfs_ctx->lock);
+    wake_up_interruptible(&tfs_ctx->wq);
+
+    tfs_info("Control device closed, requeued %d in-flight transfers\n", count);
     return 0;
 }
 
@@ -786,6 +2081,14 @@ static unsigned int tfs_poll(struct file *file, poll_table *wait)
     if (!list_empty(&tfs_ctx->xfer_list))
         mask |= POLLIN | POLLRDNORM;
     spin_unlock(&tfs_ctx->lock);
+
+    spin_lock(&tfs_ctx->meta_lock);
+    if (!list_empty(&tfs_ctx->meta_list))
+        mask |= POLLIN | POLLRDNORM;
+    spin_unlock(&tfs_ctx->meta_lock);
+
+    if (READ_ONCE(tfs_ctx->cap_refresh))
+        mask |= POLLPRI;
     
     tfs_debug("poll called, mask=%u\n", mask);
     return mask;
@@ -794,6 +2097,11 @@ static const struct file_operations tfs_chardev_ops = {
     .owner = THIS_MODULE,
     .unlocked_ioctl = tfs_ioctl,
     .mmap = tfs_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    // 2MB以上的窗口按2MB对齐放置, 大folio才能按PMD映射
+    .get_unmapped_area = thp_get_unmapped_area,
+#endif
+    .open = tfs_open,
     .release = tfs_release,
     .poll = tfs_poll,
 };
@@ -813,53 +2121,92 @@ static void tfs_put_super(struct super_block *sb)
     
     fsi = sb->s_fs_info;
     if (fsi) {
-        // 清理文件系统特定的资源
+        // 清理文件系统特定的资源, 此时所有inode都已回收
+        if (atomic_read(&fsi->nr_files))
+            tfs_warn("%d inodes still accounted at unmount\n",
+                     atomic_read(&fsi->nr_files));
         sb->s_fs_info = NULL;
         kfree(fsi);
     }
     
-    // 确保所有挂起的传输都被清理
+    // 确保所有挂起的传输都被清理, 等待中的写者收到-EIO
     if (tfs_ctx) {
         struct tfs_xfer *xfer, *tmp;
+        unsigned long id;
+        LIST_HEAD(pending);
+        int transfer_count = 0;
         
         spin_lock(&tfs_ctx->lock);
-        list_for_each_entry_safe(xfer, tmp, &tfs_ctx->xfer_list, list) {
+        list_splice_init(&tfs_ctx->xfer_list, &pending);
+        spin_unlock(&tfs_ctx->lock);
+
+        list_for_each_entry_safe(xfer, tmp, &pending, list) {
             list_del(&xfer->list);
-            if (xfer->page) {
-                if (enable_zero_copy && page_mapped(xfer->page)) {
-                    kunmap(xfer->page);
-                    tfs_debug("Unmapped zero-copy page\n");
-                }
-                put_page(xfer->page);
-                if (!enable_zero_copy) {
-                    tfs_debug("Freed copy mode page\n");
-                }
-            }
-            kfree(xfer);
-        }
-        int transfer_count = 0;
-        list_for_each_entry_safe(xfer, tmp, &tfs_ctx->xfer_list, list) {
+            tfs_stat_add(TFS_STAT_QUEUED, -1);
+            tfs_xfer_finish(xfer, -EIO);
             transfer_count++;
         }
-        spin_unlock(&tfs_ctx->lock);
+
+        xa_for_each(&tfs_ctx->inflight, id, xfer) {
+            if (xa_erase(&tfs_ctx->inflight, id) == xfer) {
+                tfs_stat_add(TFS_STAT_INFLIGHT, -1);
+                tfs_xfer_finish(xfer, -EIO);
+                transfer_count++;
+            }
+        }
         tfs_info("Cleaned up %d pending transfers\n", transfer_count);
     }
     
     tfs_debug("Superblock cleanup completed\n");
 }
 
+// 回收inode; 目录inode同时释放索引, 进而归还对子inode的引用
+static void tfs_evict_inode(struct inode *inode)
+{
+    struct tfs_inode_info *fsi = TFS_I(inode);
+
+    struct tfs_fs_info *sbi = inode->i_sb->s_fs_info;
+
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+
+    if (fsi->dir) {
+        tfs_dir_index_free(inode->i_sb->s_fs_info, fsi->dir);
+        fsi->dir = NULL;
+    }
+
+    // 归还inode号和文件计数
+    if (inode->i_ino >= TFS_FIRST_INO) {
+        ida_free(&tfs_ino_ida, inode->i_ino);
+        if (sbi && inode->i_ino != sbi->root_ino)
+            atomic_dec(&sbi->nr_files);
+    }
+}
+
 static struct super_operations tfs_super_ops = {
     .alloc_inode = tfs_alloc_inode,
     .free_inode = tfs_free_inode,
+    .evict_inode = tfs_evict_inode,
     .put_super = tfs_put_super,
     .statfs = tfs_statfs,
     .drop_inode = generic_delete_inode,
 };
 
+// 挂载根目录在tfsd中的创建/删除操作
+static void tfs_meta_set_mount_root(struct tfs_meta_entry *e, unsigned long ino)
+{
+    e->op.ino = ino;
+    e->op.parent_ino = TFS_ROOT_INO;
+    e->op.mode = S_IFDIR | 0777;
+    e->op.name_len = snprintf(e->op.name, sizeof(e->op.name), "mnt-%lu", ino);
+}
+
 static int tfs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
     struct tfs_fs_info *fsi;
+    struct tfs_meta_entry *mkdir_op, *rmdir_op;
     struct inode *inode;
+    int ino;
     
     tfs_debug("fill_super called\n");
     
@@ -869,31 +2216,71 @@ static int tfs_fill_super(struct super_block *sb, struct fs_context *fc)
         tfs_error("Failed to allocate fs_info\n");
         return -ENOMEM;
     }
+    atomic_set(&fsi->nr_files, 0);
+    init_llist_head(&fsi->dead_dirents);
+    // 0表示不限制, 受inode号范围约束
+    fsi->max_files = max_files ? min_t(unsigned int, max_files, INT_MAX - TFS_FIRST_INO) :
+                                 INT_MAX - TFS_FIRST_INO;
     
     // 设置超级块参数
     sb->s_blocksize = PAGE_SIZE;
-    sb->s_blocksize_bits = PAGE_SHIFT_4K;
+    sb->s_blocksize_bits = PAGE_SHIFT;
     sb->s_magic = TFS_MAGIC;
     sb->s_op = &tfs_super_ops;
     sb->s_time_gran = 1;
     sb->s_fs_info = fsi;
     
-    // 创建根inode
-    inode = new_inode(sb);
+    // 先预留创建和删除根目录的两个元数据操作, 卸载时不会因队列满或信号而漏发删除
+    mkdir_op = tfs_meta_alloc(TFS_META_MKDIR);
+    if (IS_ERR(mkdir_op)) {
+        sb->s_fs_info = NULL;
+        kfree(fsi);
+        return PTR_ERR(mkdir_op);
+    }
+    rmdir_op = tfs_meta_alloc(TFS_META_RMDIR);
+    if (IS_ERR(rmdir_op)) {
+        tfs_meta_free(mkdir_op);
+        sb->s_fs_info = NULL;
+        kfree(fsi);
+        return PTR_ERR(rmdir_op);
+    }
+    fsi->umount_op = rmdir_op;
+
+    // 创建根inode, 根目录的inode号同样全局唯一
+    ino = ida_alloc_min(&tfs_ino_ida, TFS_FIRST_INO, GFP_KERNEL);
+    inode = ino < 0 ? NULL : new_inode(sb);
     if (!inode) {
         tfs_error("Failed to allocate root inode\n");
+        if (ino >= 0)
+            ida_free(&tfs_ino_ida, ino);
+        tfs_meta_free(rmdir_op);
+        tfs_meta_free(mkdir_op);
+        sb->s_fs_info = NULL;
         kfree(fsi);
-        return -ENOMEM;
+        return ino < 0 ? ino : -ENOMEM;
     }
     
     // 设置inode属性，确保所有用户都有读写权限
-    inode->i_ino = 1;
+    // 此后inode号随根inode回收在tfs_evict_inode中归还
+    inode->i_ino = ino;
+    fsi->root_ino = ino;
     inode->i_mode = S_IFDIR | 0777;  // 修改为777权限
     inode->i_uid = current_fsuid();   // 使用当前用户的UID
     inode->i_gid = current_fsgid();   // 使用当前用户的GID
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
     inode->i_op = &tfs_dir_inode_operations;
     inode->i_fop = &tfs_dir_operations;
+
+    TFS_I(inode)->dir = tfs_dir_index_alloc();
+    if (!TFS_I(inode)->dir) {
+        tfs_error("Failed to allocate root directory index\n");
+        iput(inode);
+        tfs_meta_free(rmdir_op);
+        tfs_meta_free(mkdir_op);
+        sb->s_fs_info = NULL;
+        kfree(fsi);
+        return -ENOMEM;
+    }
     
     // 设置目录项计数
     set_nlink(inode, 2);  // . 和 ..
@@ -901,11 +2288,18 @@ static int tfs_fill_super(struct super_block *sb, struct fs_context *fc)
     // 创建根目录项
     sb->s_root = d_make_root(inode);
     if (!sb->s_root) {
+        // d_make_root失败时已释放inode
         tfs_error("Failed to create root dentry\n");
-        iput(inode);
+        tfs_meta_free(rmdir_op);
+        tfs_meta_free(mkdir_op);
+        sb->s_fs_info = NULL;
         kfree(fsi);
         return -ENOMEM;
     }
+
+    tfs_meta_set_mount_root(mkdir_op, ino);
+    tfs_meta_set_mount_root(rmdir_op, ino);
+    tfs_meta_submit(mkdir_op);
     
     tfs_debug("Superblock filled successfully\n");
     return 0;
@@ -937,27 +2331,166 @@ static int tfs_init_fs_context(struct fs_context *fc)
     return 0;
 }
 
+// 卸载: 先通知tfsd删除挂载根目录 (连同其下的文件), 再回收inode,
+// 这样之后复用这些inode号的操作在序号上总排在删除之后
+static void tfs_kill_sb(struct super_block *sb)
+{
+    struct tfs_fs_info *fsi = sb->s_fs_info;
+
+    if (fsi && fsi->umount_op) {
+        tfs_meta_submit(fsi->umount_op);
+        fsi->umount_op = NULL;
+    }
+    kill_anon_super(sb);
+}
+
 // 文件系统类型定义
 static struct file_system_type tfs_fs_type = {
     .owner = THIS_MODULE,
     .name = "tfs",
     .init_fs_context = tfs_init_fs_context,
-    .kill_sb = kill_anon_super,
+    .kill_sb = tfs_kill_sb,
 };
 
 
 // 模块参数定义
-static unsigned int max_files = 1000;
 module_param(max_files, uint, 0644);
-MODULE_PARM_DESC(max_files, "Maximum number of files supported");
+MODULE_PARM_DESC(max_files, "Maximum number of files per mount, applied at mount time (0 = unlimited)");
+
+// 0: 关闭, 1: 调试输出, 2及以上: 调试输出带函数名和行号
+// 可在加载时指定, 也可运行时写/sys/module/tfs_client/parameters/debug_level
+static unsigned int debug_level;
+
+static void tfs_apply_debug_level(unsigned int level)
+{
+    if (level >= 1)
+        static_branch_enable(&tfs_debug_key);
+    else
+        static_branch_disable(&tfs_debug_key);
+
+    if (level >= 2)
+        static_branch_enable(&tfs_debug_where_key);
+    else
+        static_branch_disable(&tfs_debug_where_key);
+}
+
+static int tfs_set_debug_level(const char *val, const struct kernel_param *kp)
+{
+    unsigned int level;
+    int ret;
+
+    ret = kstrtouint(val, 0, &level);
+    if (ret)
+        return ret;
+    if (level > 3)
+        return -EINVAL;
+
+    *(unsigned int *)kp->arg = level;
+    tfs_apply_debug_level(level);
+    return 0;
+}
+
+static const struct kernel_param_ops tfs_debug_level_ops = {
+    .set = tfs_set_debug_level,
+    .get = param_get_uint,
+};
 
-static unsigned int debug_level = 1;
-module_param(debug_level, uint, 0644);
-MODULE_PARM_DESC(debug_level, "Debug level (0-3)");
+module_param_cb(debug_level, &tfs_debug_level_ops, &debug_level, 0644);
+MODULE_PARM_DESC(debug_level, "Debug level (0 = off, 1 = debug, 2-3 = debug with location), writable at runtime");
 
 module_param(enable_zero_copy, bool, 0644);
 MODULE_PARM_DESC(enable_zero_copy, "Enable zero-copy transfers");
 
+//================ 统计 (debugfs) ========================
+
+// /sys/kernel/debug/tfs/<设备名>/ 下的只读文件:
+//   stats          计数器当前值和两次读取之间的每秒传输数
+//   write_latency  write延迟直方图
+static struct dentry *tfs_debugfs_root;
+
+static const char * const tfs_stat_names[TFS_STAT_NR] = {
+    [TFS_STAT_QUEUED] = "queue_depth",
+    [TFS_STAT_INFLIGHT] = "inflight",
+    [TFS_STAT_PINNED_PAGES] = "pinned_pages",
+    [TFS_STAT_BYTES_WRITTEN] = "bytes_written",
+    [TFS_STAT_BYTES_READ] = "bytes_read",
+    [TFS_STAT_XFERS_DONE] = "xfers_done",
+    [TFS_STAT_READ_ERRORS] = "read_errors",
+    [TFS_STAT_WRITE_ERRORS] = "write_errors",
+    [TFS_STAT_IOCTL_ERRORS] = "ioctl_errors",
+    [TFS_STAT_MMAP_ERRORS] = "mmap_errors",
+    [TFS_STAT_REQUEUED] = "requeued",
+};
+
+static int tfs_stats_show(struct seq_file *m, void *v)
+{
+    u64 now = ktime_get_ns();
+    u64 rate = 0;
+    s64 done = 0;
+    int i;
+
+    for (i = 0; i < TFS_STAT_NR; i++) {
+        s64 val = tfs_stat_read(i);
+
+        if (i == TFS_STAT_XFERS_DONE)
+            done = val;
+        seq_printf(m, "%-16s %lld\n", tfs_stat_names[i], val);
+    }
+
+    // 每秒传输数按与上一次读取之间的间隔计算, 定期读取即可得到当前速率
+    mutex_lock(&tfs_ctx->rate_lock);
+    if (now > tfs_ctx->rate_stamp && done >= tfs_ctx->rate_done)
+        rate = div64_u64((u64)(done - tfs_ctx->rate_done) * NSEC_PER_SEC,
+                         now - tfs_ctx->rate_stamp);
+    tfs_ctx->rate_stamp = now;
+    tfs_ctx->rate_done = done;
+    mutex_unlock(&tfs_ctx->rate_lock);
+
+    seq_printf(m, "%-16s %llu\n", "xfers_per_sec", rate);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tfs_stats);
+
+static int tfs_write_latency_show(struct seq_file *m, void *v)
+{
+    u64 counts[TFS_LAT_BUCKETS] = {};
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        struct tfs_pcpu_stats *st = per_cpu_ptr(tfs_ctx->stats, cpu);
+
+        for (i = 0; i < TFS_LAT_BUCKETS; i++)
+            counts[i] += st->write_lat[i];
+    }
+
+    seq_puts(m, "            usecs             : count\n");
+    for (i = 0; i < TFS_LAT_BUCKETS; i++) {
+        u64 lo = i ? 1ULL << i : 0;
+
+        if (i == TFS_LAT_BUCKETS - 1)
+            seq_printf(m, "%12llu -> %-12s : %llu\n", lo, "inf", counts[i]);
+        else
+            seq_printf(m, "%12llu -> %-12llu : %llu\n", lo, (2ULL << i) - 1, counts[i]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tfs_write_latency);
+
+// debugfs失败不影响模块功能, 按惯例不检查返回值
+static void tfs_debugfs_init(void)
+{
+    tfs_debugfs_root = debugfs_create_dir("tfs", NULL);
+    tfs_ctx->debugfs = debugfs_create_dir(tfs_ctx->mdev.name, tfs_debugfs_root);
+    debugfs_create_file("stats", 0444, tfs_ctx->debugfs, NULL, &tfs_stats_fops);
+    debugfs_create_file("write_latency", 0444, tfs_ctx->debugfs, NULL, &tfs_write_latency_fops);
+}
+
+static void tfs_debugfs_exit(void)
+{
+    debugfs_remove_recursive(tfs_debugfs_root);
+    tfs_debugfs_root = NULL;
+}
+
 //================ 模块初始化 ========================
 
 // 错误统计显示函数
@@ -966,10 +2499,10 @@ static void tfs_print_error_stats(void)
     if (!tfs_ctx) return;
     
     tfs_info("TFS Error Statistics:\n");
-    tfs_info("- Read errors: %d\n", atomic_read(&tfs_ctx->read_errors));
-    tfs_info("- Write errors: %d\n", atomic_read(&tfs_ctx->write_errors));
-    tfs_info("- IOCTL errors: %d\n", atomic_read(&tfs_ctx->ioctl_errors));
-    tfs_info("- MMAP errors: %d\n", atomic_read(&tfs_ctx->mmap_errors));
+    tfs_info("- Read errors: %lld\n", tfs_stat_read(TFS_STAT_READ_ERRORS));
+    tfs_info("- Write errors: %lld\n", tfs_stat_read(TFS_STAT_WRITE_ERRORS));
+    tfs_info("- IOCTL errors: %lld\n", tfs_stat_read(TFS_STAT_IOCTL_ERRORS));
+    tfs_info("- MMAP errors: %lld\n", tfs_stat_read(TFS_STAT_MMAP_ERRORS));
 }
 
 static int __init tfs_init(void)
@@ -997,12 +2530,28 @@ static int __init tfs_init(void)
         return -ENOMEM;
     }
 
+    tfs_ctx->stats = alloc_percpu(struct tfs_pcpu_stats);
+    if (!tfs_ctx->stats) {
+        tfs_error("Failed to allocate statistics\n");
+        kfree(tfs_ctx);
+        kmem_cache_destroy(tfs_inode_cachep);
+        return -ENOMEM;
+    }
+    mutex_init(&tfs_ctx->rate_lock);
+    tfs_ctx->rate_stamp = ktime_get_ns();
+
     // 初始化队列和锁
     INIT_LIST_HEAD(&tfs_ctx->xfer_list);
     spin_lock_init(&tfs_ctx->lock);
     init_waitqueue_head(&tfs_ctx->wq);
     mutex_init(&tfs_ctx->mmap_lock);
     tfs_ctx->current_xfer = NULL;
+    INIT_LIST_HEAD(&tfs_ctx->meta_list);
+    spin_lock_init(&tfs_ctx->meta_lock);
+    init_waitqueue_head(&tfs_ctx->meta_space_wq);
+    seqlock_init(&tfs_ctx->cap_lock);
+    xa_init_flags(&tfs_ctx->inflight, XA_FLAGS_ALLOC1);
+    atomic_set(&tfs_ctx->ctl_opens, 0);
 
     // 创建设备节点
     tfs_ctx->mdev.minor = MISC_DYNAMIC_MINOR;
@@ -1013,6 +2562,7 @@ static int __init tfs_init(void)
     ret = misc_register(&tfs_ctx->mdev);
     if (ret) {
         tfs_error("misc_register failed: %d\n", ret);
+        free_percpu(tfs_ctx->stats);
         kfree(tfs_ctx);
         kmem_cache_destroy(tfs_inode_cachep);
         return ret;
@@ -1023,24 +2573,21 @@ static int __init tfs_init(void)
     if (ret) {
         tfs_error("register_filesystem failed: %d\n", ret);
         misc_deregister(&tfs_ctx->mdev);
+        free_percpu(tfs_ctx->stats);
         kfree(tfs_ctx);
         kmem_cache_destroy(tfs_inode_cachep);
         return ret;
     }
 
+    tfs_debugfs_init();
+
     tfs_info("TFS module loaded successfully with parameters:\n");
     tfs_info("- max_files: %u\n", max_files);
     tfs_info("- debug_level: %u\n", debug_level);
     tfs_info("- enable_zero_copy: %d\n", enable_zero_copy);
     
-    // 根据debug_level设置调试输出
-    if (debug_level == 0) {
-        #undef TFS_DEBUG
-        #define TFS_DEBUG 0
-    } else if (debug_level > 1) {
-        #undef tfs_debug
-        #define tfs_debug(fmt, ...) printk(KERN_DEBUG "TFS DEBUG[%s:%d]: " fmt, __func__, __LINE__, ##__VA_ARGS__)
-    }
+    // 加载时指定的debug_level已由参数回调应用, 这里再同步一次以防万一
+    tfs_apply_debug_level(debug_level);
     
     return 0;
 }
@@ -1057,6 +2604,8 @@ static void __exit tfs_exit(void)
     
     // 检查全局上下文是否存在
     if (tfs_ctx) {
+        tfs_debugfs_exit();
+
         // 取消杂项设备注册
         misc_deregister(&tfs_ctx->mdev);
         
@@ -1064,16 +2613,35 @@ static void __exit tfs_exit(void)
         spin_lock(&tfs_ctx->lock);
         list_for_each_entry_safe(xfer, tmp, &tfs_ctx->xfer_list, list) {
             list_del(&xfer->list);
-            if (xfer->page) {
-                if (page_mapped(xfer->page))
-                    kunmap(xfer->page);
-                put_page(xfer->page);
-            }
-            kfree(xfer);
+            tfs_stat_add(TFS_STAT_QUEUED, -1);
+            tfs_xfer_finish(xfer, -EIO);
         }
         spin_unlock(&tfs_ctx->lock);
+
+        {
+            unsigned long id;
+
+            xa_for_each(&tfs_ctx->inflight, id, xfer) {
+                xa_erase(&tfs_ctx->inflight, id);
+                tfs_stat_add(TFS_STAT_INFLIGHT, -1);
+                tfs_xfer_finish(xfer, -EIO);
+            }
+            xa_destroy(&tfs_ctx->inflight);
+        }
+
+        // 丢弃未被守护进程取走的元数据操作
+        {
+            struct tfs_meta_entry *e, *etmp;
+
+            list_for_each_entry_safe(e, etmp, &tfs_ctx->meta_list, list) {
+                list_del(&e->list);
+                kfree(e);
+            }
+        }
         
-        // 释放上下文
+        // 显示错误统计, 之后释放上下文
+        tfs_print_error_stats();
+        free_percpu(tfs_ctx->stats);
         kfree(tfs_ctx);
         tfs_ctx = NULL;
     }
@@ -1084,8 +2652,6 @@ static void __exit tfs_exit(void)
         tfs_inode_cachep = NULL;
     }
     
-    // 显示错误统计
-    tfs_print_error_stats();
     tfs_info("TFS module unloaded\n");
 }
 
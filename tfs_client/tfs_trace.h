@@ -0,0 +1,182 @@
+// 传输项生命周期的tracepoint
+// 依赖tfs_client.c中的struct tfs_xfer定义, 只能由tfs_client.c包含。
+// 时间均为ktime_get_ns(), 各事件另外给出距上一阶段的间隔, 例如:
+//   perf record -e 'tfs:*' -a -- sleep 10
+//   echo 1 > /sys/kernel/tracing/events/tfs/enable
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tfs
+
+#if !defined(_TFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// 写者把传输项加入待处理队列
+TRACE_EVENT(tfs_xfer_enqueue,
+    TP_PROTO(const struct tfs_xfer *xfer),
+    TP_ARGS(xfer),
+
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(loff_t, offset)
+        __field(size_t, size)
+        __field(unsigned int, order)
+        __field(u64, enqueue_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->ino = xfer->ino;
+        __entry->offset = xfer->offset;
+        __entry->size = xfer->size;
+        __entry->order = xfer->folio ? folio_order(xfer->folio) : 0;
+        __entry->enqueue_ns = xfer->enqueue_ns;
+    ),
+
+    TP_printk("ino=%lu offset=%lld size=%zu order=%u enqueue_ns=%llu",
+              __entry->ino, __entry->offset, __entry->size, __entry->order,
+              __entry->enqueue_ns)
+);
+
+// tfsd通过TFS_FETCH_XFERS领取, queue_ns为排队时间
+TRACE_EVENT(tfs_xfer_fetch,
+    TP_PROTO(const struct tfs_xfer *xfer),
+    TP_ARGS(xfer),
+
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(loff_t, offset)
+        __field(size_t, size)
+        __field(unsigned long, id)
+        __field(u64, fetch_ns)
+        __field(u64, queue_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->ino = xfer->ino;
+        __entry->offset = xfer->offset;
+        __entry->size = xfer->size;
+        __entry->id = xfer->id;
+        __entry->fetch_ns = xfer->fetch_ns;
+        __entry->queue_ns = xfer->fetch_ns - xfer->enqueue_ns;
+    ),
+
+    TP_printk("ino=%lu offset=%lld size=%zu id=%lu fetch_ns=%llu queue_ns=%llu",
+              __entry->ino, __entry->offset, __entry->size, __entry->id,
+              __entry->fetch_ns, __entry->queue_ns)
+);
+
+// tfsd映射传输项的数据, ret为mmap的结果
+TRACE_EVENT(tfs_xfer_map,
+    TP_PROTO(const struct tfs_xfer *xfer, unsigned long map_size, int ret),
+    TP_ARGS(xfer, map_size, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(loff_t, offset)
+        __field(size_t, size)
+        __field(unsigned long, id)
+        __field(unsigned long, map_size)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->ino = xfer->ino;
+        __entry->offset = xfer->offset;
+        __entry->size = xfer->size;
+        __entry->id = xfer->id;
+        __entry->map_size = map_size;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("ino=%lu offset=%lld size=%zu id=%lu map_size=%lu ret=%d",
+              __entry->ino, __entry->offset, __entry->size, __entry->id,
+              __entry->map_size, __entry->ret)
+);
+
+// tfsd报告处理结果, service_ns为从领取到完成的时间 (旧接口未经领取时为0)
+TRACE_EVENT(tfs_xfer_complete,
+    TP_PROTO(const struct tfs_xfer *xfer, int status),
+    TP_ARGS(xfer, status),
+
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(loff_t, offset)
+        __field(size_t, size)
+        __field(unsigned long, id)
+        __field(int, status)
+        __field(u64, service_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->ino = xfer->ino;
+        __entry->offset = xfer->offset;
+        __entry->size = xfer->size;
+        __entry->id = xfer->id;
+        __entry->status = status;
+        __entry->service_ns = xfer->fetch_ns ? ktime_get_ns() - xfer->fetch_ns : 0;
+    ),
+
+    TP_printk("ino=%lu offset=%lld size=%zu id=%lu status=%d service_ns=%llu",
+              __entry->ino, __entry->offset, __entry->size, __entry->id,
+              __entry->status, __entry->service_ns)
+);
+
+// 等待中的写者被唤醒, total_ns为从入队到write返回的时间
+TRACE_EVENT(tfs_writer_wakeup,
+    TP_PROTO(const struct tfs_xfer *xfer, int ret),
+    TP_ARGS(xfer, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(loff_t, offset)
+        __field(size_t, size)
+        __field(int, ret)
+        __field(u64, total_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->ino = xfer->ino;
+        __entry->offset = xfer->offset;
+        __entry->size = xfer->size;
+        __entry->ret = ret;
+        __entry->total_ns = ktime_get_ns() - xfer->enqueue_ns;
+    ),
+
+    TP_printk("ino=%lu offset=%lld size=%zu ret=%d total_ns=%llu",
+              __entry->ino, __entry->offset, __entry->size, __entry->ret,
+              __entry->total_ns)
+);
+
+// 最后一个引用释放, folio解除固定, life_ns为传输项的整个生存期
+TRACE_EVENT(tfs_xfer_release,
+    TP_PROTO(const struct tfs_xfer *xfer),
+    TP_ARGS(xfer),
+
+    TP_STRUCT__entry(
+        __field(unsigned long, ino)
+        __field(loff_t, offset)
+        __field(size_t, size)
+        __field(unsigned long, id)
+        __field(u64, life_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->ino = xfer->ino;
+        __entry->offset = xfer->offset;
+        __entry->size = xfer->size;
+        __entry->id = xfer->id;
+        __entry->life_ns = ktime_get_ns() - xfer->enqueue_ns;
+    ),
+
+    TP_printk("ino=%lu offset=%lld size=%zu id=%lu life_ns=%llu",
+              __entry->ino, __entry->offset, __entry->size, __entry->id,
+              __entry->life_ns)
+);
+
+#endif /* _TFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tfs_trace
+#include <trace/define_trace.h>
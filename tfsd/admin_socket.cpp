@@ -0,0 +1,306 @@
+#include "admin_socket.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+AdminSocket::AdminSocket(EventLoop& loop) : loop_(loop) {
+    add_command("help", "List available commands", [this](const std::vector<std::string>&) {
+        std::string out;
+        for (const auto& kv : commands_) {
+            out += kv.first + " - " + kv.second.help + "\n";
+        }
+        return out;
+    });
+}
+
+AdminSocket::~AdminSocket() {
+    close();
+}
+
+AdminSocket::Replies::~Replies() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool AdminSocket::open(const std::string& path, std::string* err) {
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        *err = "socket path too long: " + path;
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *err = "socket: " + std::string(strerror(errno));
+        return false;
+    }
+    // 上次运行残留的套接字文件
+    unlink(path.c_str());
+    // 只允许同一用户访问
+    mode_t old_mask = umask(077);
+    int ret = bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(old_mask);
+    if (ret != 0 || listen(fd, 16) != 0) {
+        *err = "bind/listen " + path + ": " + std::string(strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    std::shared_ptr<Replies> replies(new Replies);
+    replies->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (replies->fd < 0) {
+        *err = "eventfd: " + std::string(strerror(errno));
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    listen_fd_ = fd;
+    path_ = path;
+    closing_ = false;
+    replies_ = std::move(replies);
+    arm_listen();
+    arm_replies();
+    return true;
+}
+
+void AdminSocket::close() {
+    if (listen_fd_ < 0) {
+        return;
+    }
+    closing_ = true;
+    // fd在被取消的poll回调里关闭, 避免内核里还挂着对它的poll
+    if (listen_poll_ != 0) {
+        loop_.cancel(listen_poll_);
+    } else {
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+    }
+    // 之后完成的异步命令只写入已无人读取的replies_, eventfd随最后一个引用关闭
+    if (replies_poll_ != 0) {
+        loop_.cancel(replies_poll_);
+    }
+    replies_.reset();
+    for (auto it = clients_.begin(); it != clients_.end();) {
+        int fd = it->first;
+        uint64_t poll = it->second.poll;
+        ++it;
+        if (poll != 0) {
+            loop_.cancel(poll);
+        } else {
+            drop_client(fd);
+        }
+    }
+    unlink(path_.c_str());
+}
+
+void AdminSocket::add_command(const std::string& name, const std::string& help, Handler handler) {
+    commands_[name] = Command{help, std::move(handler), nullptr};
+}
+
+void AdminSocket::add_async_command(const std::string& name, const std::string& help, AsyncHandler handler) {
+    commands_[name] = Command{help, nullptr, std::move(handler)};
+}
+
+void AdminSocket::arm_listen() {
+    listen_poll_ = loop_.poll_add(listen_fd_, POLLIN, [this](int res) {
+        listen_poll_ = 0;
+        if (closing_) {
+            ::close(listen_fd_);
+            listen_fd_ = -1;
+            return;
+        }
+        if (res > 0) {
+            on_accept();
+        }
+        arm_listen();
+    });
+}
+
+void AdminSocket::on_accept() {
+    for (;;) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        if (clients_.size() >= kMaxClients) {
+            ::close(fd);
+            continue;
+        }
+        clients_[fd].id = ++next_client_;
+        arm_client(fd, POLLIN);
+    }
+}
+
+void AdminSocket::arm_client(int fd, short events) {
+    uint64_t token = loop_.poll_add(fd, events, [this, fd](int res) {
+        on_client(fd, res);
+    });
+    if (token == 0) {
+        drop_client(fd);
+        return;
+    }
+    clients_[fd].poll = token;
+}
+
+void AdminSocket::on_client(int fd, int res) {
+    auto it = clients_.find(fd);
+    if (it == clients_.end()) {
+        return;
+    }
+    Client& c = it->second;
+    c.poll = 0;
+    if (closing_ || res < 0) {
+        drop_client(fd);
+        return;
+    }
+
+    if (c.out.empty()) {
+        // 读取命令行, 读到换行或对端关闭写方向即执行
+        char buf[256];
+        bool eof = false;
+        for (;;) {
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if (n > 0) {
+                c.in.append(buf, n);
+                if (c.in.size() > kMaxRequest) {
+                    drop_client(fd);
+                    return;
+                }
+                continue;
+            }
+            if (n == 0) {
+                eof = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN) {
+                drop_client(fd);
+                return;
+            }
+            break;
+        }
+        size_t nl = c.in.find('\n');
+        if (nl == std::string::npos && !eof) {
+            arm_client(fd, POLLIN);
+            return;
+        }
+        if (!dispatch(fd, c.in.substr(0, nl), &c.out)) {
+            c.waiting = true;
+            return;
+        }
+        if (c.out.empty() || c.out.back() != '\n') {
+            c.out += '\n';
+        }
+    }
+    send_reply(fd);
+}
+
+void AdminSocket::send_reply(int fd) {
+    Client& c = clients_[fd];
+    // 回复可能超过套接字缓冲区, 写不完就等可写
+    while (c.sent < c.out.size()) {
+        ssize_t n = send(fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                arm_client(fd, POLLOUT);
+                return;
+            }
+            break;
+        }
+        c.sent += n;
+    }
+    drop_client(fd);
+}
+
+void AdminSocket::drop_client(int fd) {
+    clients_.erase(fd);
+    ::close(fd);
+}
+
+void AdminSocket::arm_replies() {
+    std::shared_ptr<Replies> replies = replies_;
+    replies_poll_ = loop_.poll_add(replies->fd, POLLIN, [this, replies](int res) {
+        replies_poll_ = 0;
+        if (closing_ || res < 0) {
+            return;
+        }
+        on_replies();
+        arm_replies();
+    });
+}
+
+void AdminSocket::on_replies() {
+    uint64_t count;
+    ssize_t n = ::read(replies_->fd, &count, sizeof(count));
+    (void)n;
+    std::vector<std::pair<uint64_t, std::string>> done;
+    {
+        std::lock_guard<std::mutex> lock(replies_->lock);
+        done.swap(replies_->done);
+    }
+    for (auto& r : done) {
+        // 客户端只有几个, 直接按id查找
+        auto it = clients_.begin();
+        while (it != clients_.end() && it->second.id != r.first) {
+            ++it;
+        }
+        if (it == clients_.end() || !it->second.waiting) {
+            continue;
+        }
+        Client& c = it->second;
+        c.waiting = false;
+        c.out = std::move(r.second);
+        if (c.out.empty() || c.out.back() != '\n') {
+            c.out += '\n';
+        }
+        send_reply(it->first);
+    }
+}
+
+bool AdminSocket::dispatch(int fd, const std::string& line, std::string* out) {
+    std::istringstream in(line);
+    std::vector<std::string> words;
+    std::string word;
+    while (in >> word) {
+        words.push_back(word);
+    }
+    if (words.empty()) {
+        *out = "error: empty command";
+        return true;
+    }
+    auto it = commands_.find(words[0]);
+    if (it == commands_.end()) {
+        *out = "error: unknown command '" + words[0] + "', try 'help'";
+        return true;
+    }
+    words.erase(words.begin());
+    if (!it->second.async) {
+        *out = it->second.handler(words);
+        return true;
+    }
+
+    // Reply只持有共享的回复队列, 晚于套接字关闭调用也安全
+    std::shared_ptr<Replies> replies = replies_;
+    uint64_t id = clients_[fd].id;
+    it->second.async(words, [replies, id](std::string text) {
+        std::lock_guard<std::mutex> lock(replies->lock);
+        replies->done.emplace_back(id, std::move(text));
+        // 计数只用来唤醒主线程, 不会累积到溢出
+        uint64_t one = 1;
+        ssize_t n = write(replies->fd, &one, sizeof(one));
+        (void)n;
+    });
+    return false;
+}
@@ -0,0 +1,92 @@
+#ifndef TFSD_ADMIN_SOCKET_H
+#define TFSD_ADMIN_SOCKET_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "event_loop.h"
+
+// tfsd的本地管理接口
+// Unix域流套接字, 客户端每个连接发送一行命令 (空白分隔), 收到文本回复后连接被关闭,
+// 例如: echo "sample every 100" | socat - UNIX-CONNECT:./tfsd.sock
+// 连接的接受、读写都挂在主线程的事件循环上, 命令处理函数也在主线程执行;
+// 耗时的命令注册为异步命令, 交给其他线程执行, 回复经eventfd回到主线程发出。
+class AdminSocket {
+public:
+    using Handler = std::function<std::string(const std::vector<std::string>& args)>;
+    // 异步命令的回复, 可在任意线程调用, 只调用一次; 客户端已断开或套接字已关闭时被丢弃
+    using Reply = std::function<void(std::string text)>;
+    using AsyncHandler = std::function<void(const std::vector<std::string>& args, Reply reply)>;
+
+    explicit AdminSocket(EventLoop& loop);
+    ~AdminSocket();
+
+    AdminSocket(const AdminSocket&) = delete;
+    AdminSocket& operator=(const AdminSocket&) = delete;
+
+    // 已存在的同名套接字文件会被替换
+    bool open(const std::string& path, std::string* err);
+    // 停止接受连接并关闭所有客户端, 之后仍需运行事件循环收回被取消的poll
+    void close();
+
+    // 命令名为第一个词, args不含命令名
+    void add_command(const std::string& name, const std::string& help, Handler handler);
+    // 处理函数在主线程调用, 应尽快把工作交出去, 之后调用reply
+    void add_async_command(const std::string& name, const std::string& help, AsyncHandler handler);
+
+private:
+    static const size_t kMaxClients = 16;
+    static const size_t kMaxRequest = 1024;
+
+    struct Client {
+        uint64_t id = 0;           // 区分复用同一fd的连接
+        bool waiting = false;      // 等待异步命令的回复
+        std::string in;
+        std::string out;
+        size_t sent = 0;
+        uint64_t poll = 0;
+    };
+
+    struct Command {
+        std::string help;
+        Handler handler;
+        AsyncHandler async;
+    };
+
+    // 异步命令完成的回复, 由Reply和主线程共享, 套接字关闭后仍可能被其他线程写入
+    struct Replies {
+        std::mutex lock;
+        std::vector<std::pair<uint64_t, std::string>> done;    // 客户端id和回复
+        int fd = -1;                                            // eventfd, 有回复时可读
+        ~Replies();
+    };
+
+    void arm_listen();
+    void on_accept();
+    void arm_client(int fd, short events);
+    void on_client(int fd, int res);
+    void drop_client(int fd);
+    void send_reply(int fd);
+    void arm_replies();
+    void on_replies();
+    // 同步命令返回true并输出回复; 异步命令返回false, 回复稍后由on_replies发出
+    bool dispatch(int fd, const std::string& line, std::string* out);
+
+    EventLoop& loop_;
+    std::string path_;
+    int listen_fd_ = -1;
+    uint64_t listen_poll_ = 0;
+    bool closing_ = false;
+    std::map<int, Client> clients_;
+    uint64_t next_client_ = 0;
+    std::map<std::string, Command> commands_;
+    std::shared_ptr<Replies> replies_;
+    uint64_t replies_poll_ = 0;
+};
+
+#endif // TFSD_ADMIN_SOCKET_H
@@ -0,0 +1,206 @@
+#include "block_cache.h"
+
+#include <cstring>
+
+namespace {
+
+// murmur3的fmix64
+uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+} // namespace
+
+BlockCache::BlockCache(size_t capacity_bytes) {
+    size_t blocks = capacity_bytes / kBlockSize;
+    size_t per_shard = blocks / kShards > 0 ? blocks / kShards : 1;
+    for (Shard& s : shards_) {
+        s.capacity = per_shard;
+        // 2Q论文推荐的比例: A1in占容量的1/4, A1out记住相当于容量1/2的键
+        s.in_limit = per_shard / 4 > 0 ? per_shard / 4 : 1;
+        s.out_limit = per_shard / 2 > 0 ? per_shard / 2 : 1;
+        s.entries.reserve(per_shard);
+    }
+    for (auto& e : epochs_) {
+        e.store(0, std::memory_order_relaxed);
+    }
+}
+
+size_t BlockCache::hash(const Key& k) {
+    return static_cast<size_t>(mix64(k.ino * 0x9E3779B97F4A7C15ULL ^ k.block));
+}
+
+uint64_t BlockCache::epoch(uint64_t ino) const {
+    return epochs_[mix64(ino) % kEpochStripes].load(std::memory_order_acquire);
+}
+
+bool BlockCache::lookup(uint64_t ino, uint64_t block, size_t skip, size_t len, char* out) {
+    Key key{ino, block};
+    Shard& s = shard_of(key);
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.map.find(key);
+        if (it != s.map.end()) {
+            uint32_t id = it->second;
+            Entry& e = s.entries[id];
+            // A1in中的块再次命中不移动: 短时间内的重复访问不代表长期热度
+            if (e.queue == Queue::Main) {
+                unlink(s, s.main, id);
+                push_front(s, s.main, id);
+            }
+            memcpy(out, e.data.get() + skip, len);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void BlockCache::insert(uint64_t ino, uint64_t block, const char* data, uint64_t epoch) {
+    Key key{ino, block};
+    Shard& s = shard_of(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    // invalidate先推进epoch再删除, 这里在分片锁内检查, 不会漏掉与之交错的失效
+    if (epochs_[mix64(ino) % kEpochStripes].load(std::memory_order_acquire) != epoch) {
+        stale_fills_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (s.map.count(key)) {
+        return;    // 并发的读取已经放入
+    }
+    uint32_t id = reclaim(s);
+    Entry& e = s.entries[id];
+    e.key = key;
+    memcpy(e.data.get(), data, kBlockSize);
+    auto g = s.ghosts.find(key);
+    if (g != s.ghosts.end()) {
+        s.ghosts.erase(g);
+        e.queue = Queue::Main;
+        push_front(s, s.main, id);
+        promotions_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        e.queue = Queue::In;
+        push_front(s, s.in, id);
+    }
+    s.map.emplace(key, id);
+    resident_.fetch_add(kBlockSize, std::memory_order_relaxed);
+}
+
+void BlockCache::invalidate(uint64_t ino, uint64_t first, uint64_t count) {
+    epochs_[mix64(ino) % kEpochStripes].fetch_add(1, std::memory_order_acq_rel);
+    if (resident_.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    for (uint64_t b = first; b < first + count; b++) {
+        Key key{ino, b};
+        Shard& s = shard_of(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.map.find(key);
+        if (it != s.map.end()) {
+            remove(s, it->second);
+        }
+    }
+}
+
+BlockCache::Stats BlockCache::stats() const {
+    Stats st;
+    for (const Shard& s : shards_) {
+        st.capacity_bytes += s.capacity * kBlockSize;
+    }
+    st.resident_bytes = resident_.load(std::memory_order_relaxed);
+    st.hits = hits_.load(std::memory_order_relaxed);
+    st.misses = misses_.load(std::memory_order_relaxed);
+    st.evictions = evictions_.load(std::memory_order_relaxed);
+    st.promotions = promotions_.load(std::memory_order_relaxed);
+    st.stale_fills = stale_fills_.load(std::memory_order_relaxed);
+    return st;
+}
+
+void BlockCache::unlink(Shard& s, List& list, uint32_t id) {
+    Entry& e = s.entries[id];
+    if (e.prev != kNil) {
+        s.entries[e.prev].next = e.next;
+    } else {
+        list.head = e.next;
+    }
+    if (e.next != kNil) {
+        s.entries[e.next].prev = e.prev;
+    } else {
+        list.tail = e.prev;
+    }
+    e.prev = e.next = kNil;
+    list.size--;
+}
+
+void BlockCache::push_front(Shard& s, List& list, uint32_t id) {
+    Entry& e = s.entries[id];
+    e.prev = kNil;
+    e.next = list.head;
+    if (list.head != kNil) {
+        s.entries[list.head].prev = id;
+    } else {
+        list.tail = id;
+    }
+    list.head = id;
+    list.size++;
+}
+
+// 取一个空闲槽: 先用空闲链表, 未满时新分配, 否则按2Q淘汰
+// A1in超过上限时淘汰A1in的队尾并记入A1out, 否则淘汰Am的LRU端
+uint32_t BlockCache::reclaim(Shard& s) {
+    if (!s.free.empty()) {
+        uint32_t id = s.free.back();
+        s.free.pop_back();
+        return id;
+    }
+    if (s.entries.size() < s.capacity) {
+        s.entries.emplace_back();
+        s.entries.back().data.reset(new char[kBlockSize]);
+        return static_cast<uint32_t>(s.entries.size() - 1);
+    }
+    uint32_t victim;
+    if (s.in.size > s.in_limit || s.main.size == 0) {
+        victim = s.in.tail;
+        unlink(s, s.in, victim);
+        remember(s, s.entries[victim].key);
+    } else {
+        victim = s.main.tail;
+        unlink(s, s.main, victim);
+    }
+    Entry& e = s.entries[victim];
+    s.map.erase(e.key);
+    e.queue = Queue::Free;
+    resident_.fetch_sub(kBlockSize, std::memory_order_relaxed);
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+    return victim;
+}
+
+void BlockCache::remember(Shard& s, const Key& key) {
+    uint64_t seq = ++s.ghost_seq;
+    s.ghosts[key] = seq;
+    s.ghost_fifo.emplace_back(key, seq);
+    // 被提升的键在队列里留下失效项, 队列长度也要限制
+    while (s.ghosts.size() > s.out_limit || s.ghost_fifo.size() > 2 * s.out_limit) {
+        const auto& front = s.ghost_fifo.front();
+        auto g = s.ghosts.find(front.first);
+        if (g != s.ghosts.end() && g->second == front.second) {
+            s.ghosts.erase(g);
+        }
+        s.ghost_fifo.pop_front();
+    }
+}
+
+void BlockCache::remove(Shard& s, uint32_t id) {
+    Entry& e = s.entries[id];
+    unlink(s, e.queue == Queue::Main ? s.main : s.in, id);
+    s.map.erase(e.key);
+    e.queue = Queue::Free;
+    s.free.push_back(id);
+    resident_.fetch_sub(kBlockSize, std::memory_order_relaxed);
+}
@@ -0,0 +1,119 @@
+#ifndef TFSD_BLOCK_CACHE_H
+#define TFSD_BLOCK_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// 读缓存: 以 (inode, 文件块号) 为键缓存4KB的文件块内容 (已校验、已解压, 空洞为0)
+// 按键的哈希分成多个分片, 每个分片各自加锁, 并发读取很少落在同一把锁上。
+// 分片内按2Q淘汰: 第一次读到的块进入FIFO队列A1in, 被挤出时只把键记入幽灵队列A1out;
+// 在A1out中再次被读到的块才进入LRU队列Am。一次性的顺序扫描只会冲刷A1in, 不会挤掉Am中的热块。
+// 块内容的一致性由调用方维护: 写入和截断时invalidate涉及的块, 读取时先取epoch,
+// 之后有失效发生的话insert被拒绝, 避免把失效之前读到的旧内容放回缓存。
+class BlockCache {
+public:
+    static const size_t kBlockSize = 4096;
+
+    struct Stats {
+        uint64_t capacity_bytes = 0;
+        uint64_t resident_bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t promotions = 0;       // 在A1out中再次读到, 进入Am
+        uint64_t stale_fills = 0;      // 读取期间发生了失效, 未放入缓存
+    };
+
+    explicit BlockCache(size_t capacity_bytes);
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    // 命中时把块中[skip, skip + len)拷到out
+    bool lookup(uint64_t ino, uint64_t block, size_t skip, size_t len, char* out);
+    // data为整块内容; epoch为读取索引时epoch(ino)的值
+    void insert(uint64_t ino, uint64_t block, const char* data, uint64_t epoch);
+
+    // 同一inode的失效计数 (按inode哈希分条)
+    uint64_t epoch(uint64_t ino) const;
+    // 从first开始的count个文件块失效; count为0时只推进epoch (缓存中的块已不可达)
+    void invalidate(uint64_t ino, uint64_t first, uint64_t count);
+
+    Stats stats() const;
+
+private:
+    static const size_t kShards = 16;
+    static const size_t kEpochStripes = 64;
+    static const uint32_t kNil = UINT32_MAX;
+
+    struct Key {
+        uint64_t ino;
+        uint64_t block;
+
+        bool operator==(const Key& o) const { return ino == o.ino && block == o.block; }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& k) const { return hash(k); }
+    };
+
+    enum class Queue : uint8_t { Free, In, Main };
+
+    struct Entry {
+        Key key;
+        uint32_t prev = kNil;
+        uint32_t next = kNil;
+        Queue queue = Queue::Free;
+        std::unique_ptr<char[]> data;
+    };
+
+    // 双向链表, 头部为最新
+    struct List {
+        uint32_t head = kNil;
+        uint32_t tail = kNil;
+        size_t size = 0;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        size_t capacity = 0;       // 块数
+        size_t in_limit = 0;       // A1in的上限
+        size_t out_limit = 0;      // A1out的上限 (只有键)
+        std::vector<Entry> entries;    // 按需增长到capacity, 之后复用
+        std::vector<uint32_t> free;
+        std::unordered_map<Key, uint32_t, KeyHash> map;
+        List in;
+        List main;
+        // 幽灵队列: 键 -> 入队序号, 序号不符的队列项已失效
+        std::unordered_map<Key, uint64_t, KeyHash> ghosts;
+        std::deque<std::pair<Key, uint64_t>> ghost_fifo;
+        uint64_t ghost_seq = 0;
+    };
+
+    static size_t hash(const Key& k);
+    Shard& shard_of(const Key& k) { return shards_[(hash(k) >> 32) % kShards]; }
+
+    // 以下需持有分片的锁
+    static void unlink(Shard& s, List& list, uint32_t id);
+    static void push_front(Shard& s, List& list, uint32_t id);
+    uint32_t reclaim(Shard& s);
+    void remember(Shard& s, const Key& key);
+    void remove(Shard& s, uint32_t id);
+
+    Shard shards_[kShards];
+    std::atomic<uint64_t> epochs_[kEpochStripes];
+    std::atomic<uint64_t> resident_{0};
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+    std::atomic<uint64_t> promotions_{0};
+    std::atomic<uint64_t> stale_fills_{0};
+};
+
+#endif // TFSD_BLOCK_CACHE_H
@@ -1 +1,19 @@
-g++ -std=c++11 -O2 -o tfsd tfsd.cpp
+#!/bin/sh
+# 有liburing时使用io_uring事件循环, 否则退化为poll
+if [ -f /usr/include/liburing.h ]; then
+    URING_FLAGS="-luring"
+else
+    URING_FLAGS="-DNO_IO_URING"
+fi
+# lz4/zstd可选, 缺少时对应的压缩编码不可用
+if [ -f /usr/include/lz4.h ]; then
+    LZ4_FLAGS="-llz4"
+else
+    LZ4_FLAGS="-DNO_LZ4"
+fi
+if [ -f /usr/include/zstd.h ]; then
+    ZSTD_FLAGS="-lzstd"
+else
+    ZSTD_FLAGS="-DNO_ZSTD"
+fi
+g++ -std=c++17 -O2 -pthread -o tfsd tfsd.cpp meta_store.cpp work_pool.cpp event_loop.cpp storage_engine.cpp crc32c.cpp logger.cpp diag_sampler.cpp admin_socket.cpp metrics.cpp ctl_channel.cpp handover.cpp replication.cpp gf256.cpp erasure_store.cpp sha256.cpp cdc.cpp chunk_index.cpp compress.cpp block_cache.cpp $URING_FLAGS $LZ4_FLAGS $ZSTD_FLAGS
@@ -0,0 +1,92 @@
+#include "cdc.h"
+
+#include <algorithm>
+
+namespace {
+
+// 平均长度8KB: 之前要求高15位为0, 之后要求高11位为0
+const uint64_t kMaskS = ~0ull << (64 - 15);
+const uint64_t kMaskL = ~0ull << (64 - 11);
+const size_t kWindow = 64;
+
+struct Gear {
+    uint64_t g[256];
+
+    // 固定种子的splitmix64, 切点因此在各次运行、各节点之间一致
+    Gear() {
+        uint64_t x = 0x54465344ull;   // "TFSD"
+        for (int i = 0; i < 256; i++) {
+            x += 0x9e3779b97f4a7c15ull;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            g[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+const Gear& gear() {
+    static const Gear t;
+    return t;
+}
+
+// 位置i的哈希覆盖[i - 63, i], 从i - 64开始累加即与之前的数据无关
+uint64_t warm_up(const uint8_t* p, size_t pos) {
+    const uint64_t* g = gear().g;
+    uint64_t h = 0;
+    for (size_t i = pos > kWindow ? pos - kWindow : 0; i < pos; i++) {
+        h = (h << 1) + g[p[i]];
+    }
+    return h;
+}
+
+// 在[i, stop)中找满足mask的第一个位置, 找到时i为切点 (该位置之后), h为到i为止的哈希
+// 每次前进两个字节: h2由h直接算出而不经过h1, 移位加法的依赖链缩短一半
+bool scan(const uint8_t* p, size_t& i, size_t stop, uint64_t& h, uint64_t mask) {
+    const uint64_t* g = gear().g;
+    for (; i + 2 <= stop; i += 2) {
+        uint64_t a = g[p[i]];
+        uint64_t b = g[p[i + 1]];
+        uint64_t h1 = (h << 1) + a;
+        uint64_t h2 = (h << 2) + ((a << 1) + b);
+        if (__builtin_expect(!(h1 & mask) | !(h2 & mask), 0)) {
+            i += (h1 & mask) ? 2 : 1;
+            return true;
+        }
+        h = h2;
+    }
+    for (; i < stop; i++) {
+        h = (h << 1) + g[p[i]];
+        if ((h & mask) == 0) {
+            i++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 从start开始的一个块的长度
+size_t next_cut(const uint8_t* p, size_t len, size_t start) {
+    size_t remain = len - start;
+    if (remain <= kCdcMinSize) {
+        return remain;
+    }
+    size_t normal = start + std::min(remain, kCdcAvgSize);
+    size_t end = start + std::min(remain, kCdcMaxSize);
+    size_t i = start + kCdcMinSize;
+    uint64_t h = warm_up(p, i);
+    if (scan(p, i, normal, h, kMaskS) || scan(p, i, end, h, kMaskL)) {
+        return i - start;
+    }
+    return end - start;
+}
+
+} // namespace
+
+void cdc_chunk(const uint8_t* data, size_t len, std::vector<uint32_t>* sizes) {
+    for (size_t pos = 0; pos < len;) {
+        size_t n = next_cut(data, len, pos);
+        sizes->push_back(static_cast<uint32_t>(n));
+        pos += n;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef TFSD_CDC_H
+#define TFSD_CDC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// 基于内容的分块 (FastCDC): Gear滚动哈希 h = (h << 1) + G[b], 哈希只取决于最近64字节,
+// 高位满足掩码的位置作为切点, 插入或删除数据只影响附近的切点。
+// 块长在[kCdcMinSize, kCdcMaxSize]之间, 平均约kCdcAvgSize; 归一化分块: 平均长度之前
+// 用更严的掩码, 之后用更松的掩码, 块长集中在平均值附近。
+// 每块的前kCdcMinSize字节不可能是切点, 直接跳过, 只从切点前64字节开始算哈希。
+
+const size_t kCdcMinSize = 2048;
+const size_t kCdcAvgSize = 8192;
+const size_t kCdcMaxSize = 65536;
+
+// 把data切成块, sizes输出各块的长度 (之和为len)
+void cdc_chunk(const uint8_t* data, size_t len, std::vector<uint32_t>* sizes);
+
+#endif // TFSD_CDC_H
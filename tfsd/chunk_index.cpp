@@ -0,0 +1,101 @@
+#include "chunk_index.h"
+#include "sha256.h"
+
+#include <cstring>
+
+namespace {
+
+const size_t kInitialSlots = 1024;
+
+} // namespace
+
+Fingerprint fingerprint(const void* data, size_t len) {
+    uint8_t digest[32];
+    sha256(data, len, digest);
+    Fingerprint fp;
+    memcpy(fp.w, digest, sizeof(fp.w));
+    return fp;
+}
+
+ChunkIndex::ChunkIndex() : slots_(kInitialSlots, Slot{0, kNone}), mask_(kInitialSlots - 1) {}
+
+uint32_t ChunkIndex::find(const Fingerprint& fp) const {
+    uint32_t t = tag(fp);
+    for (size_t i = home(fp);; i = (i + 1) & mask_) {
+        const Slot& s = slots_[i];
+        if (s.id == kNone) {
+            return kNone;
+        }
+        if (s.tag == t && chunks_[s.id].fp == fp) {
+            return s.id;
+        }
+    }
+}
+
+uint32_t ChunkIndex::insert(const Chunk& chunk) {
+    if ((count_ + 1) * 4 > slots_.size() * 3) {
+        grow();
+    }
+    uint32_t id;
+    if (!free_.empty()) {
+        id = free_.back();
+        free_.pop_back();
+        chunks_[id] = chunk;
+    } else {
+        id = static_cast<uint32_t>(chunks_.size());
+        chunks_.push_back(chunk);
+    }
+    chunks_[id].refs = 0;
+    place(id);
+    count_++;
+    return id;
+}
+
+void ChunkIndex::place(uint32_t id) {
+    const Fingerprint& fp = chunks_[id].fp;
+    size_t i = home(fp);
+    while (slots_[i].id != kNone) {
+        i = (i + 1) & mask_;
+    }
+    slots_[i] = Slot{tag(fp), id};
+}
+
+void ChunkIndex::grow() {
+    std::vector<Slot> old(slots_.size() * 2, Slot{0, kNone});
+    old.swap(slots_);
+    mask_ = slots_.size() - 1;
+    for (const Slot& s : old) {
+        if (s.id != kNone) {
+            place(s.id);
+        }
+    }
+}
+
+void ChunkIndex::unref(uint32_t id) {
+    if (--chunks_[id].refs > 0) {
+        return;
+    }
+    const Fingerprint& fp = chunks_[id].fp;
+    size_t i = home(fp);
+    while (slots_[i].id != id) {
+        i = (i + 1) & mask_;
+    }
+
+    // 后移删除: 之后连续的槽位中, 起始位置不在(i, j]之间的可以前移填补空位
+    for (size_t j = (i + 1) & mask_; slots_[j].id != kNone; j = (j + 1) & mask_) {
+        size_t k = home(chunks_[slots_[j].id].fp);
+        bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            slots_[i] = slots_[j];
+            i = j;
+        }
+    }
+    slots_[i].id = kNone;
+    free_.push_back(id);
+    count_--;
+}
+
+size_t ChunkIndex::memory() const {
+    return slots_.capacity() * sizeof(Slot) + chunks_.capacity() * sizeof(Chunk) +
+           free_.capacity() * sizeof(uint32_t);
+}
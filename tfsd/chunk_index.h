@@ -0,0 +1,68 @@
+#ifndef TFSD_CHUNK_INDEX_H
+#define TFSD_CHUNK_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// 去重块的指纹: 块内容SHA-256的前128位
+struct Fingerprint {
+    uint64_t w[2];
+
+    bool operator==(const Fingerprint& o) const { return w[0] == o.w[0] && w[1] == o.w[1]; }
+};
+
+Fingerprint fingerprint(const void* data, size_t len);
+
+// 指纹 -> 块 的去重索引, 块带引用计数, 计数降到0时删除
+// 开放寻址线性探测, 槽位只有8字节 (指纹的32位标签 + 块号), 标签不符时不访问块表;
+// 负载超过3/4时翻倍, 删除时把后续槽位前移而不留墓碑。块号在块删除后复用。
+// 不加锁, 由调用方互斥
+class ChunkIndex {
+public:
+    static const uint32_t kNone = UINT32_MAX;
+
+    struct Chunk {
+        Fingerprint fp;
+        uint64_t data_pos;         // 块数据在段内的位置
+        uint64_t rec_pos;          // 所在记录的起始位置
+        uint32_t seg;
+        uint32_t len;
+        uint32_t refs;
+    };
+
+    ChunkIndex();
+
+    // 没有时返回kNone
+    uint32_t find(const Fingerprint& fp) const;
+    // 指纹必须不在索引中, 新块的引用计数为0, 调用方随即ref
+    uint32_t insert(const Chunk& chunk);
+    const Chunk& at(uint32_t id) const { return chunks_[id]; }
+    // 块号当前是否有效 (已删除的块号引用计数为0)
+    bool alive(uint32_t id) const { return id < chunks_.size() && chunks_[id].refs > 0; }
+
+    void ref(uint32_t id) { chunks_[id].refs++; }
+    void unref(uint32_t id);
+
+    size_t size() const { return count_; }
+    size_t memory() const;
+
+private:
+    struct Slot {
+        uint32_t tag;
+        uint32_t id;               // kNone表示空槽
+    };
+
+    size_t home(const Fingerprint& fp) const { return fp.w[0] & mask_; }
+    static uint32_t tag(const Fingerprint& fp) { return static_cast<uint32_t>(fp.w[1]); }
+    void place(uint32_t id);
+    void grow();
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t count_ = 0;
+    std::vector<Chunk> chunks_;
+    std::vector<uint32_t> free_;
+};
+
+#endif // TFSD_CHUNK_INDEX_H
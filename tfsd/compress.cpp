@@ -0,0 +1,190 @@
+#include "compress.h"
+
+#include <cmath>
+#include <cstdlib>
+
+#ifndef NO_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifndef NO_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+// 抽样: 均匀取至多16段, 每段256字节
+const size_t kSampleRun = 256;
+const size_t kSampleRuns = 16;
+// 文本、日志一般在5 bit/字节以下; 已压缩、加密的数据接近8
+const double kMaxEntropy = 7.5;
+
+#ifndef NO_ZSTD
+// 每个线程复用自己的上下文, 避免每条记录都重新分配zstd的工作内存
+struct ZstdContexts {
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+
+    ~ZstdContexts() {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+};
+
+ZstdContexts& zstd_contexts() {
+    thread_local ZstdContexts ctx;
+    return ctx;
+}
+#endif
+
+} // namespace
+
+bool parse_compress_policy(const std::string& spec, CompressPolicy* out, std::string* err) {
+    if (spec == "off" || spec == "none") {
+        *out = CompressPolicy();
+        return true;
+    }
+    size_t colon = spec.find(':');
+    std::string name = spec.substr(0, colon);
+    CompressPolicy p;
+    int min_level, max_level;
+    if (name == "lz4") {
+        p.codec = Codec::Lz4;
+        p.level = 1;
+        min_level = 1;
+        max_level = 12;
+    } else if (name == "zstd") {
+        p.codec = Codec::Zstd;
+        p.level = 3;
+        min_level = -7;
+        max_level = 22;
+    } else {
+        *err = "unknown codec " + name + " (expected lz4, zstd or off)";
+        return false;
+    }
+    if (colon != std::string::npos) {
+        const char* s = spec.c_str() + colon + 1;
+        char* end = nullptr;
+        long level = strtol(s, &end, 10);
+        if (*s == '\0' || *end != '\0' || level < min_level || level > max_level || level == 0) {
+            *err = "invalid " + name + " level " + std::string(s) + " (" + std::to_string(min_level) + ".." +
+                   std::to_string(max_level) + ", not 0)";
+            return false;
+        }
+        p.level = static_cast<int>(level);
+    }
+    if (!codec_available(p.codec)) {
+        *err = "tfsd was built without " + name;
+        return false;
+    }
+    *out = p;
+    return true;
+}
+
+std::string describe_compress_policy(const CompressPolicy& policy) {
+    switch (policy.codec) {
+    case Codec::Lz4:
+        return "lz4:" + std::to_string(policy.level);
+    case Codec::Zstd:
+        return "zstd:" + std::to_string(policy.level);
+    default:
+        return "off";
+    }
+}
+
+bool codec_available(Codec codec) {
+    switch (codec) {
+    case Codec::None:
+        return true;
+#ifndef NO_LZ4
+    case Codec::Lz4:
+        return true;
+#endif
+#ifndef NO_ZSTD
+    case Codec::Zstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+std::string available_codecs() {
+    std::string s;
+    if (codec_available(Codec::Lz4)) {
+        s += "lz4";
+    }
+    if (codec_available(Codec::Zstd)) {
+        s += s.empty() ? "zstd" : " zstd";
+    }
+    return s.empty() ? "none" : s;
+}
+
+// 香农熵 -sum(p * log2 p), 直方图只统计抽样的字节
+bool compressible(const char* data, size_t len) {
+    uint32_t hist[256] = {};
+    size_t total = 0;
+    if (len <= kSampleRun * kSampleRuns) {
+        for (size_t i = 0; i < len; i++) {
+            hist[static_cast<uint8_t>(data[i])]++;
+        }
+        total = len;
+    } else {
+        size_t stride = len / kSampleRuns;
+        for (size_t r = 0; r < kSampleRuns; r++) {
+            const char* p = data + r * stride;
+            for (size_t i = 0; i < kSampleRun; i++) {
+                hist[static_cast<uint8_t>(p[i])]++;
+            }
+        }
+        total = kSampleRun * kSampleRuns;
+    }
+    if (total == 0) {
+        return false;
+    }
+    double entropy = 0;
+    for (uint32_t c : hist) {
+        if (c > 0) {
+            double p = static_cast<double>(c) / total;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy < kMaxEntropy;
+}
+
+size_t compress(const CompressPolicy& policy, const char* src, size_t len, char* dst, size_t cap) {
+    switch (policy.codec) {
+#ifndef NO_LZ4
+    case Codec::Lz4: {
+        int n = policy.level <= 1
+                    ? LZ4_compress_default(src, dst, static_cast<int>(len), static_cast<int>(cap))
+                    : LZ4_compress_HC(src, dst, static_cast<int>(len), static_cast<int>(cap), policy.level);
+        return n > 0 ? static_cast<size_t>(n) : 0;
+    }
+#endif
+#ifndef NO_ZSTD
+    case Codec::Zstd: {
+        size_t n = ZSTD_compressCCtx(zstd_contexts().cctx, dst, cap, src, len, policy.level);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+bool decompress(Codec codec, const char* src, size_t len, char* dst, size_t raw_len) {
+    switch (codec) {
+#ifndef NO_LZ4
+    case Codec::Lz4:
+        return LZ4_decompress_safe(src, dst, static_cast<int>(len), static_cast<int>(raw_len)) ==
+               static_cast<int>(raw_len);
+#endif
+#ifndef NO_ZSTD
+    case Codec::Zstd:
+        return ZSTD_decompressDCtx(zstd_contexts().dctx, dst, raw_len, src, len) == raw_len;
+#endif
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef TFSD_COMPRESS_H
+#define TFSD_COMPRESS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 落盘前的数据压缩, 在调用append的线程 (传输worker) 中完成, 不占用写线程
+// LZ4和zstd都是可选依赖, 编译时找不到的编码不可用 (NO_LZ4 / NO_ZSTD)。
+// LZ4级别1为快速模式, 2-12为HC模式; zstd级别与zstd命令行一致, 负数为快速级别。
+
+enum class Codec : uint16_t {
+    None = 0,
+    Lz4 = 1,
+    Zstd = 2,
+};
+
+struct CompressPolicy {
+    Codec codec = Codec::None;
+    int level = 0;
+};
+
+// "off", "lz4", "lz4:9", "zstd", "zstd:-3" 等, 省略级别时lz4为1, zstd为3
+bool parse_compress_policy(const std::string& spec, CompressPolicy* out, std::string* err);
+std::string describe_compress_policy(const CompressPolicy& policy);
+
+bool codec_available(Codec codec);
+// 编译进来的编码, 用于日志
+std::string available_codecs();
+
+// 抽样估计字节熵, 已压缩或加密的数据不值得再压缩
+bool compressible(const char* data, size_t len);
+
+// 输出超过cap时失败, 返回0; 成功返回压缩后的长度
+size_t compress(const CompressPolicy& policy, const char* src, size_t len, char* dst, size_t cap);
+// 解压结果必须恰好是raw_len字节
+bool decompress(Codec codec, const char* src, size_t len, char* dst, size_t raw_len);
+
+#endif // TFSD_COMPRESS_H
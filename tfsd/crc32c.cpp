@@ -0,0 +1,282 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+const uint32_t kPoly = 0x82f63b78;          // CRC32C多项式 (反射形式)
+
+// 三路交错的条带长度: 长条带用于大块数据, 短条带处理剩余部分
+const size_t kLong = 8192;
+const size_t kShort = 256;
+
+// GF(2)上32x32矩阵乘向量
+uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// 构造"在crc后追加len个零字节"的线性算子
+void zeros_op(uint32_t* even, size_t len) {
+    uint32_t odd[32];
+    odd[0] = kPoly;                          // 一个零比特的算子
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);            // 两个零比特
+    gf2_matrix_square(odd, even);            // 四个零比特
+
+    // 反复平方得到1, 2, 4...字节的算子, 按len的二进制位累乘
+    uint32_t result[32];
+    bool have = false;
+    for (;;) {
+        gf2_matrix_square(even, odd);
+        if (len & 1) {
+            if (have) {
+                uint32_t tmp[32];
+                for (int n = 0; n < 32; n++) {
+                    tmp[n] = gf2_matrix_times(even, result[n]);
+                }
+                memcpy(result, tmp, sizeof(tmp));
+            } else {
+                memcpy(result, even, sizeof(result));
+                have = true;
+            }
+        }
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+        memcpy(odd, even, sizeof(odd));
+    }
+    memcpy(even, result, sizeof(result));
+}
+
+// 把算子展开成按字节查的表, 移位一次只需四次查表
+struct ShiftTable {
+    uint32_t t[4][256];
+
+    explicit ShiftTable(size_t len) {
+        uint32_t op[32];
+        zeros_op(op, len);
+        for (uint32_t n = 0; n < 256; n++) {
+            t[0][n] = gf2_matrix_times(op, n);
+            t[1][n] = gf2_matrix_times(op, n << 8);
+            t[2][n] = gf2_matrix_times(op, n << 16);
+            t[3][n] = gf2_matrix_times(op, n << 24);
+        }
+    }
+
+    uint32_t shift(uint32_t crc) const {
+        return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+    }
+};
+
+struct SliceTable {
+    uint32_t t[8][256];
+
+    SliceTable() {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t crc = n;
+            for (int k = 0; k < 8; k++) {
+                crc = crc & 1 ? (crc >> 1) ^ kPoly : crc >> 1;
+            }
+            t[0][n] = crc;
+        }
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t crc = t[0][n];
+            for (int k = 1; k < 8; k++) {
+                crc = t[0][crc & 0xff] ^ (crc >> 8);
+                t[k][n] = crc;
+            }
+        }
+    }
+};
+
+const SliceTable& slice_table() {
+    static const SliceTable table;
+    return table;
+}
+
+// 查表实现, 每次处理8字节
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t len) {
+    const SliceTable& tb = slice_table();
+    const unsigned char* next = static_cast<const unsigned char*>(data);
+    uint32_t c = ~crc;
+
+    while (len && (reinterpret_cast<uintptr_t>(next) & 7)) {
+        c = tb.t[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, next, 8);
+        w ^= c;
+        c = tb.t[7][w & 0xff] ^ tb.t[6][(w >> 8) & 0xff] ^ tb.t[5][(w >> 16) & 0xff] ^
+            tb.t[4][(w >> 24) & 0xff] ^ tb.t[3][(w >> 32) & 0xff] ^ tb.t[2][(w >> 40) & 0xff] ^
+            tb.t[1][(w >> 48) & 0xff] ^ tb.t[0][w >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = tb.t[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+#if defined(__x86_64__)
+const ShiftTable& long_shift() {
+    static const ShiftTable table(kLong);
+    return table;
+}
+
+const ShiftTable& short_shift() {
+    static const ShiftTable table(kShort);
+    return table;
+}
+
+// crc32指令延迟3个周期、吞吐1个周期, 三条互不依赖的流并行计算后再合并
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* next = static_cast<const unsigned char*>(data);
+    uint64_t crc0 = static_cast<uint32_t>(~crc);
+
+    while (len && (reinterpret_cast<uintptr_t>(next) & 7)) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *next++);
+        len--;
+    }
+
+    const ShiftTable& lshift = long_shift();
+    while (len >= kLong * 3) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char* end = next + kLong;
+        do {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, next, 8);
+            memcpy(&w1, next + kLong, 8);
+            memcpy(&w2, next + kLong * 2, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            next += 8;
+        } while (next < end);
+        crc0 = lshift.shift(static_cast<uint32_t>(crc0)) ^ crc1;
+        crc0 = lshift.shift(static_cast<uint32_t>(crc0)) ^ crc2;
+        next += kLong * 2;
+        len -= kLong * 3;
+    }
+
+    const ShiftTable& sshift = short_shift();
+    while (len >= kShort * 3) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char* end = next + kShort;
+        do {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, next, 8);
+            memcpy(&w1, next + kShort, 8);
+            memcpy(&w2, next + kShort * 2, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            next += 8;
+        } while (next < end);
+        crc0 = sshift.shift(static_cast<uint32_t>(crc0)) ^ crc1;
+        crc0 = sshift.shift(static_cast<uint32_t>(crc0)) ^ crc2;
+        next += kShort * 2;
+        len -= kShort * 3;
+    }
+
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, next, 8);
+        crc0 = _mm_crc32_u64(crc0, w);
+        next += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *next++);
+    }
+    return ~static_cast<uint32_t>(crc0);
+}
+#endif
+
+using CrcFn = uint32_t (*)(uint32_t, const void*, size_t);
+
+struct Dispatch {
+    CrcFn fn = crc32c_sw;
+    const char* name = "table";
+
+    Dispatch() {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) {
+            fn = crc32c_hw;
+            name = "sse4.2";
+            // 提前构造移位表, 避免第一次校验时卡顿
+            long_shift();
+            short_shift();
+        }
+#endif
+    }
+};
+
+const Dispatch& dispatch() {
+    static const Dispatch d;
+    return d;
+}
+
+} // namespace
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    return dispatch().fn(crc, data, len);
+}
+
+uint32_t crc32c_copy(uint32_t crc, void* dst, const void* src, size_t len) {
+    // 分块拷贝, 每块拷完立即在仍在缓存中的目标上计算
+    const size_t kChunk = 64 * 1024;
+    char* d = static_cast<char*>(dst);
+    const char* s = static_cast<const char*>(src);
+    CrcFn fn = dispatch().fn;
+    while (len > 0) {
+        size_t n = len < kChunk ? len : kChunk;
+        memcpy(d, s, n);
+        crc = fn(crc, d, n);
+        d += n;
+        s += n;
+        len -= n;
+    }
+    return crc;
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    if (len2 == 0) {
+        return crc1;
+    }
+    uint32_t op[32];
+    zeros_op(op, len2);
+    return gf2_matrix_times(op, crc1) ^ crc2;
+}
+
+const char* crc32c_impl() {
+    return dispatch().name;
+}
@@ -0,0 +1,23 @@
+#ifndef TFSD_CRC32C_H
+#define TFSD_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli), 用于传输数据和存储记录的端到端校验
+// x86-64上CPU支持SSE4.2时使用crc32指令并三路交错以掩盖指令延迟,
+// 否则使用查表 (slicing-by-8) 实现, 实现在首次调用前按CPU特性选定。
+
+// 在crc的基础上继续计算, 初始值为0
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+// 拷贝的同时计算校验, 数据只过一遍缓存
+uint32_t crc32c_copy(uint32_t crc, void* dst, const void* src, size_t len);
+
+// 已知crc1 = crc32c(A), crc2 = crc32c(B), 返回crc32c(A || B), len2为B的长度
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+// 当前使用的实现, 用于日志
+const char* crc32c_impl();
+
+#endif // TFSD_CRC32C_H
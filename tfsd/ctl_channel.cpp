@@ -0,0 +1,345 @@
+#include "ctl_channel.h"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+DeviceCtlChannel::~DeviceCtlChannel() {
+    close();
+}
+
+bool DeviceCtlChannel::open(std::string* err) {
+    fd_ = ::open(path_.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd_ < 0) {
+        *err = path_ + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void DeviceCtlChannel::close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+int DeviceCtlChannel::ioctl(unsigned long cmd, void* arg) {
+    return ::ioctl(fd_, cmd, arg);
+}
+
+void* DeviceCtlChannel::map(size_t len, off_t offset) {
+    return mmap(NULL, len, PROT_READ, MAP_SHARED, fd_, offset);
+}
+
+int DeviceCtlChannel::unmap(void* addr, size_t len) {
+    return munmap(addr, len);
+}
+
+MockCtlChannel::~MockCtlChannel() {
+    close();
+}
+
+bool MockCtlChannel::open(std::string* err) {
+    if (opts_.size == 0 || (opts_.files == 0 && opts_.transfers > 0)) {
+        *err = "mock transfer size and file count must be positive";
+        return false;
+    }
+    // 没有传输时不创建文件, 描述符一直不可读 (只作为空闲设备, 如只接收复制数据的对端)
+    if (opts_.transfers == 0) {
+        opts_.files = 0;
+    }
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    map_size_ = (opts_.size + page - 1) / page * page;
+
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    data_fd_ = memfd_create("tfsd-mock", MFD_CLOEXEC);
+    if (event_fd_ < 0 || data_fd_ < 0 || ftruncate(data_fd_, kPoolSize + map_size_) != 0) {
+        *err = "mock channel: " + std::string(strerror(errno));
+        close();
+        return false;
+    }
+
+    // 默认是伪随机数据, 不会被压缩意外放大吞吐; 各传输取自同一数据池, 彼此内容大量重复
+    // text时每行是一条字段取值随机的访问日志, 用于测试压缩
+    std::vector<uint64_t> block(1 << 16);
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    auto next = [&x]() {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
+    };
+    static const char* const kLevels[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+    static const char* const kPaths[] = {"/api/v1/items", "/api/v1/users", "/api/v1/orders", "/healthz"};
+    std::string text;
+    for (size_t done = 0; done < kPoolSize + map_size_; done += block.size() * sizeof(uint64_t)) {
+        char* bytes = reinterpret_cast<char*>(block.data());
+        size_t cap = block.size() * sizeof(uint64_t);
+        if (opts_.text) {
+            while (text.size() < cap) {
+                char line[160];
+                uint64_t r = next();
+                int n = snprintf(line, sizeof(line),
+                                 "2026-03-01T12:%02u:%02u.%06uZ %s worker-%u request id=%u path=%s/%u status=%u "
+                                 "latency_us=%u\n",
+                                 static_cast<unsigned>(r % 60), static_cast<unsigned>((r >> 6) % 60),
+                                 static_cast<unsigned>((r >> 12) % 1000000), kLevels[(r >> 32) % 5],
+                                 static_cast<unsigned>((r >> 35) % 16), static_cast<unsigned>(next() % 10000000),
+                                 kPaths[(r >> 40) % 4], static_cast<unsigned>((r >> 42) % 100000),
+                                 (r >> 59) % 8 ? 200 : 500, static_cast<unsigned>((r >> 44) % 50000));
+                text.append(line, n);
+            }
+            memcpy(bytes, text.data(), cap);
+            text.erase(0, cap);
+        } else {
+            for (uint64_t& v : block) {
+                v = next();
+            }
+        }
+        size_t len = std::min(cap, kPoolSize + map_size_ - done);
+        if (pwrite(data_fd_, bytes, len, done) != static_cast<ssize_t>(len)) {
+            *err = "mock channel: fill data: " + std::string(strerror(errno));
+            close();
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    update_readiness();
+    return true;
+}
+
+void MockCtlChannel::close() {
+    if (event_fd_ >= 0) {
+        ::close(event_fd_);
+        event_fd_ = -1;
+    }
+    if (data_fd_ >= 0) {
+        ::close(data_fd_);
+        data_fd_ = -1;
+    }
+    // 已生成的传输状态保留, 重新打开后继续
+    std::lock_guard<std::mutex> lock(mutex_);
+    readable_ = false;
+}
+
+int MockCtlChannel::ioctl(unsigned long cmd, void* arg) {
+    int ret;
+    switch (cmd) {
+    case TFS_FETCH_XFERS:
+        ret = fetch(static_cast<tfs_xfer_batch*>(arg));
+        break;
+    case TFS_COMPLETE_XFER:
+        ret = complete(static_cast<const tfs_xfer_done*>(arg));
+        break;
+    case TFS_GET_META_BATCH:
+        ret = meta_batch(static_cast<tfs_meta_batch*>(arg));
+        break;
+    case TFS_SET_CAPACITY:
+        ret = 0;
+        break;
+    case TFS_GET_XFER_COUNT: {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t queued = opts_.transfers - stats_.generated;
+        *static_cast<int*>(arg) = static_cast<int>(std::min<uint64_t>(queued, INT_MAX));
+        ret = 0;
+        break;
+    }
+    default:
+        // 队首映射的旧接口不模拟
+        ret = -ENOTTY;
+        break;
+    }
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int MockCtlChannel::fetch(tfs_xfer_batch* batch) {
+    tfs_xfer_info* infos = reinterpret_cast<tfs_xfer_info*>(batch->infos);
+    uint32_t n = 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // 文件都创建之后才有数据, 与内核中传输总在create之后入队一致
+    if (next_meta_ < opts_.files) {
+        batch->nr_xfers = 0;
+        return 0;
+    }
+    while (n < batch->max_xfers && stats_.generated < opts_.transfers) {
+        uint64_t id = next_id_++;
+        uint64_t ino = TFS_ROOT_INO + 1 + (id % opts_.files);
+        tfs_xfer_info& info = infos[n++];
+        info = {};
+        info.offset = static_cast<off_t>(file_size_[ino]);
+        info.size = opts_.size;
+        info.pfn = id;
+        info.page_offset = 0;
+        info.map_size = static_cast<unsigned int>(map_size_);
+        info.ino = ino;
+        info.id = id;
+        file_size_[ino] += opts_.size;
+        inflight_[id] = info;
+        stats_.generated++;
+    }
+    batch->nr_xfers = n;
+    update_readiness();
+    return 0;
+}
+
+int MockCtlChannel::complete(const tfs_xfer_done* done) {
+    if (done->status > 0) {
+        return -EINVAL;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = inflight_.find(done->id);
+    if (it == inflight_.end()) {
+        return -ENOENT;
+    }
+    if (done->status == 0) {
+        stats_.bytes += it->second.size;
+    } else {
+        stats_.failed++;
+    }
+    inflight_.erase(it);
+    stats_.completed++;
+    update_readiness();
+    return 0;
+}
+
+int MockCtlChannel::meta_batch(tfs_meta_batch* batch) {
+    tfs_meta_op* ops = reinterpret_cast<tfs_meta_op*>(batch->ops);
+    uint32_t n = 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (n < batch->max_ops && next_meta_ < opts_.files) {
+        tfs_meta_op& op = ops[n++];
+        memset(&op, 0, sizeof(op));
+        op.seq = next_meta_ + 1;
+        op.op = TFS_META_CREATE;
+        op.mode = S_IFREG | 0644;
+        op.ino = TFS_ROOT_INO + 1 + next_meta_;
+        op.parent_ino = TFS_ROOT_INO;
+        op.name_len = snprintf(op.name, sizeof(op.name), "mock-%u", next_meta_);
+        next_meta_++;
+    }
+    batch->nr_ops = n;
+    update_readiness();
+    return 0;
+}
+
+void* MockCtlChannel::map(size_t len, off_t offset) {
+    uint64_t id = static_cast<uint64_t>(offset) >> TFS_XFER_MMAP_SHIFT;
+    size_t window = static_cast<size_t>(offset & ((1ull << TFS_XFER_MMAP_SHIFT) - 1));
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (inflight_.count(id) == 0 || window >= map_size_ || len > map_size_ - window) {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+    }
+    return mmap(NULL, len, PROT_READ, MAP_SHARED, data_fd_, pool_offset(id) + static_cast<off_t>(window));
+}
+
+int MockCtlChannel::unmap(void* addr, size_t len) {
+    return munmap(addr, len);
+}
+
+bool MockCtlChannel::exhausted() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return opts_.transfers > 0 && stats_.completed == opts_.transfers;
+}
+
+namespace {
+
+// 交给新进程的模拟设备状态, 之后是files个(inode, 长度)
+struct MockState {
+    uint64_t transfers;
+    uint64_t size;
+    uint32_t files;
+    uint32_t text;
+    uint64_t next_id;
+    uint64_t next_meta;
+    uint64_t generated;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t bytes;
+};
+
+} // namespace
+
+std::string MockCtlChannel::save_state() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    MockState ms = {opts_.transfers, opts_.size, opts_.files, opts_.text, next_id_, next_meta_,
+                    stats_.generated, stats_.completed, stats_.failed, stats_.bytes};
+    std::string state(reinterpret_cast<const char*>(&ms), sizeof(ms));
+    for (const auto& f : file_size_) {
+        uint64_t entry[2] = {f.first, f.second};
+        state.append(reinterpret_cast<const char*>(entry), sizeof(entry));
+    }
+    return state;
+}
+
+bool MockCtlChannel::restore_state(const std::string& state, std::string* err) {
+    MockState ms;
+    if (state.size() < sizeof(ms) || (state.size() - sizeof(ms)) % (2 * sizeof(uint64_t)) != 0) {
+        *err = "invalid mock state (" + std::to_string(state.size()) + " bytes)";
+        return false;
+    }
+    memcpy(&ms, state.data(), sizeof(ms));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // 负载的形状以旧进程为准, 新进程命令行上的--mock选项被覆盖
+    opts_.transfers = ms.transfers;
+    opts_.size = ms.size;
+    opts_.files = ms.files;
+    opts_.text = ms.text != 0;
+    next_id_ = ms.next_id;
+    next_meta_ = static_cast<unsigned>(ms.next_meta);
+    stats_ = Stats{ms.generated, ms.completed, ms.failed, ms.bytes};
+    file_size_.clear();
+    for (size_t pos = sizeof(ms); pos < state.size(); pos += 2 * sizeof(uint64_t)) {
+        uint64_t entry[2];
+        memcpy(entry, &state[pos], sizeof(entry));
+        file_size_[entry[0]] = entry[1];
+    }
+    return true;
+}
+
+MockCtlChannel::Stats MockCtlChannel::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void MockCtlChannel::update_readiness() {
+    // 剩余的传输都已领取但还没完成时, 没有什么可领取的, 不可读
+    bool pending = next_meta_ < opts_.files || stats_.generated < opts_.transfers ||
+                   (opts_.transfers > 0 && stats_.completed == opts_.transfers);
+    if (event_fd_ < 0 || pending == readable_) {
+        return;
+    }
+    uint64_t value = 1;
+    if (pending) {
+        if (write(event_fd_, &value, sizeof(value)) == sizeof(value)) {
+            readable_ = true;
+        }
+    } else if (read(event_fd_, &value, sizeof(value)) == sizeof(value)) {
+        readable_ = false;
+    }
+}
+
+off_t MockCtlChannel::pool_offset(uint64_t id) const {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return static_cast<off_t>((id * 13 * page) % kPoolSize);
+}
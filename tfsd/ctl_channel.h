@@ -0,0 +1,130 @@
+#ifndef TFSD_CTL_CHANNEL_H
+#define TFSD_CTL_CHANNEL_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "tfs_proto.h"
+
+// tfsd与内核模块之间的控制通道
+// 调用方式与直接操作/dev/tfs_ctl相同: ioctl/map返回值和errno的约定同ioctl(2)/mmap(2),
+// fd()可挂到事件循环上, POLLIN表示有传输或元数据待领取, POLLPRI表示需要刷新容量。
+// ioctl、map和unmap可在任意线程并发调用, open/close只能在主线程调用。
+class CtlChannel {
+public:
+    virtual ~CtlChannel() = default;
+
+    virtual bool open(std::string* err) = 0;
+    virtual void close() = 0;
+    virtual int fd() const = 0;
+
+    virtual int ioctl(unsigned long cmd, void* arg) = 0;
+    virtual void* map(size_t len, off_t offset) = 0;
+    virtual int unmap(void* addr, size_t len) = 0;
+
+    virtual std::string name() const = 0;
+    // 负载已全部处理完, 之后不会再有新的传输 (真实设备永远为false)
+    virtual bool exhausted() const { return false; }
+
+    // 热升级时随描述符交给新进程的状态; 真实设备的状态都在内核中, 为空
+    // 只在已领取的传输全部完成后调用
+    virtual std::string save_state() const { return std::string(); }
+    // 新进程在open之前恢复旧进程交来的状态
+    virtual bool restore_state(const std::string& state, std::string* err) { return true; }
+};
+
+// 内核模块提供的控制设备
+class DeviceCtlChannel : public CtlChannel {
+public:
+    // fd非负时直接使用已打开的设备 (热升级时从旧进程接过), 不必再调用open
+    explicit DeviceCtlChannel(const std::string& path, int fd = -1) : path_(path), fd_(fd) {}
+    ~DeviceCtlChannel() override;
+
+    bool open(std::string* err) override;
+    void close() override;
+    int fd() const override { return fd_; }
+
+    int ioctl(unsigned long cmd, void* arg) override;
+    void* map(size_t len, off_t offset) override;
+    int unmap(void* addr, size_t len) override;
+
+    std::string name() const override { return path_; }
+
+private:
+    std::string path_;
+    int fd_ = -1;
+};
+
+// 进程内模拟的控制设备, 用于在没有内核模块的环境中测试和压测tfsd
+// 启动时为files个文件生成CREATE元数据, 然后按ID顺序生成transfers个传输,
+// 每个传输size字节, 依次追加到各文件末尾。传输数据来自一块预先填充伪随机数据 (或日志文本) 的memfd,
+// map按与内核相同的偏移编码 (ID和窗口) 映射其中一段, 因此领取、映射、完成的路径与真实设备一致。
+// 描述符是一个eventfd: 还有未领取的传输或元数据时可读; 全部完成后也保持可读, 让主循环醒来退出。
+// transfers为0时是一个永远空闲的设备, 不生成任何工作, 也不会耗尽。
+// 热升级时交出的是生成进度 (选项、下一个ID、各文件长度和计数), 新进程从同一位置继续生成,
+// 数据池按同样的种子重新填充, 交出的eventfd不使用。
+class MockCtlChannel : public CtlChannel {
+public:
+    struct Options {
+        uint64_t transfers = 1000000;
+        size_t size = 4096;
+        unsigned files = 16;
+        bool text = false;         // 数据池填充为日志风格的文本 (可压缩), 而不是伪随机数据
+    };
+
+    struct Stats {
+        uint64_t generated = 0;
+        uint64_t completed = 0;
+        uint64_t failed = 0;
+        uint64_t bytes = 0;
+    };
+
+    explicit MockCtlChannel(const Options& opts) : opts_(opts) {}
+    ~MockCtlChannel() override;
+
+    bool open(std::string* err) override;
+    void close() override;
+    int fd() const override { return event_fd_; }
+
+    int ioctl(unsigned long cmd, void* arg) override;
+    void* map(size_t len, off_t offset) override;
+    int unmap(void* addr, size_t len) override;
+
+    std::string name() const override { return "mock"; }
+    bool exhausted() const override;
+    std::string save_state() const override;
+    bool restore_state(const std::string& state, std::string* err) override;
+
+    Stats stats() const;
+
+private:
+    // 数据池大小, 各传输的数据按ID错开起始位置
+    static const size_t kPoolSize = 16u << 20;
+
+    int fetch(tfs_xfer_batch* batch);
+    int complete(const tfs_xfer_done* done);
+    int meta_batch(tfs_meta_batch* batch);
+    // 根据剩余工作设置描述符的可读状态, 需持有mutex_
+    void update_readiness();
+    off_t pool_offset(uint64_t id) const;
+
+    Options opts_;
+    size_t map_size_ = 0;
+    int event_fd_ = -1;
+    int data_fd_ = -1;
+    bool readable_ = false;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, tfs_xfer_info> inflight_;
+    std::unordered_map<uint64_t, uint64_t> file_size_;
+    uint64_t next_id_ = 1;
+    unsigned next_meta_ = 0;
+    Stats stats_;
+};
+
+#endif // TFSD_CTL_CHANNEL_H
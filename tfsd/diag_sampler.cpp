@@ -0,0 +1,134 @@
+#include "diag_sampler.h"
+
+DiagSampler::DiagSampler() {
+    for (size_t i = 0; i < kMaxInodes; i++) {
+        inodes_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void DiagSampler::set_every(uint32_t n) {
+    every_.store(n, std::memory_order_relaxed);
+    update_active();
+}
+
+bool DiagSampler::watch_inode(uint64_t ino) {
+    if (ino == 0) {
+        return false;
+    }
+    size_t free_slot = kMaxInodes;
+    for (size_t i = 0; i < kMaxInodes; i++) {
+        uint64_t cur = inodes_[i].load(std::memory_order_relaxed);
+        if (cur == ino) {
+            return true;
+        }
+        if (cur == 0 && free_slot == kMaxInodes) {
+            free_slot = i;
+        }
+    }
+    if (free_slot == kMaxInodes) {
+        return false;
+    }
+    inodes_[free_slot].store(ino, std::memory_order_relaxed);
+    nr_inodes_.fetch_add(1, std::memory_order_relaxed);
+    update_active();
+    return true;
+}
+
+bool DiagSampler::unwatch_inode(uint64_t ino) {
+    for (size_t i = 0; i < kMaxInodes; i++) {
+        if (ino != 0 && inodes_[i].load(std::memory_order_relaxed) == ino) {
+            inodes_[i].store(0, std::memory_order_relaxed);
+            nr_inodes_.fetch_sub(1, std::memory_order_relaxed);
+            update_active();
+            return true;
+        }
+    }
+    return false;
+}
+
+void DiagSampler::request(uint32_t count) {
+    requested_.fetch_add(count, std::memory_order_relaxed);
+    update_active();
+}
+
+void DiagSampler::clear() {
+    every_.store(0, std::memory_order_relaxed);
+    requested_.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < kMaxInodes; i++) {
+        inodes_[i].store(0, std::memory_order_relaxed);
+    }
+    nr_inodes_.store(0, std::memory_order_relaxed);
+    update_active();
+}
+
+// 只在主线程调用; requested_被worker消耗到0后active_可能仍为true, 下次检查时才清除
+void DiagSampler::update_active() {
+    active_.store(every_.load(std::memory_order_relaxed) != 0 ||
+                  requested_.load(std::memory_order_relaxed) != 0 ||
+                  nr_inodes_.load(std::memory_order_relaxed) != 0,
+                  std::memory_order_relaxed);
+}
+
+DiagSampler::Reason DiagSampler::should_sample(uint64_t ino) {
+    if (!active_.load(std::memory_order_relaxed)) {
+        return Reason::None;
+    }
+
+    if (nr_inodes_.load(std::memory_order_relaxed) != 0) {
+        for (size_t i = 0; i < kMaxInodes; i++) {
+            if (inodes_[i].load(std::memory_order_relaxed) == ino) {
+                return Reason::Inode;
+            }
+        }
+    }
+
+    uint32_t left = requested_.load(std::memory_order_relaxed);
+    while (left != 0) {
+        if (requested_.compare_exchange_weak(left, left - 1, std::memory_order_relaxed)) {
+            return Reason::Requested;
+        }
+    }
+
+    // 每个worker各自计数, 避免所有worker争用同一个计数器
+    uint32_t n = every_.load(std::memory_order_relaxed);
+    if (n != 0) {
+        thread_local uint64_t counter = 0;
+        if (++counter % n == 0) {
+            return Reason::EveryN;
+        }
+    }
+    return Reason::None;
+}
+
+std::string DiagSampler::describe() const {
+    std::string out = "every=" + std::to_string(every_.load(std::memory_order_relaxed)) +
+                      " pending=" + std::to_string(requested_.load(std::memory_order_relaxed)) +
+                      " on_error=" + (on_error() ? "on" : "off") + " inodes=";
+    bool first = true;
+    for (size_t i = 0; i < kMaxInodes; i++) {
+        uint64_t ino = inodes_[i].load(std::memory_order_relaxed);
+        if (ino != 0) {
+            out += (first ? "" : ",") + std::to_string(ino);
+            first = false;
+        }
+    }
+    if (first) {
+        out += "none";
+    }
+    return out;
+}
+
+const char* DiagSampler::reason_name(Reason reason) {
+    switch (reason) {
+    case Reason::EveryN:
+        return "1-in-N";
+    case Reason::Inode:
+        return "inode";
+    case Reason::Requested:
+        return "requested";
+    case Reason::Error:
+        return "error";
+    default:
+        return "none";
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef TFSD_DIAG_SAMPLER_H
+#define TFSD_DIAG_SAMPLER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 传输内容诊断 (预览和十六进制dump) 的采样策略
+// 每个传输都要问一次should_sample(), 所有策略关闭时只有一次relaxed load;
+// 策略由主线程 (命令行参数或管理套接字) 修改, worker只读, 全程无锁。
+class DiagSampler {
+public:
+    enum class Reason {
+        None,
+        EveryN,        // 每N个传输取一个 (按worker计数)
+        Inode,         // 命中关注的inode
+        Requested,     // 管理命令要求的接下来若干个传输
+        Error,         // 持久化失败或校验不一致, 由调用方直接使用
+    };
+
+    static const size_t kMaxInodes = 16;
+
+    DiagSampler();
+
+    // 0表示关闭
+    void set_every(uint32_t n);
+    uint32_t every() const { return every_.load(std::memory_order_relaxed); }
+
+    // 关注的inode, 最多kMaxInodes个, 满了返回false
+    bool watch_inode(uint64_t ino);
+    bool unwatch_inode(uint64_t ino);
+
+    // 对接下来count个传输做诊断 (累加)
+    void request(uint32_t count);
+
+    // 关闭所有采样策略
+    void clear();
+
+    // 失败的传输总是诊断, 可关闭
+    void set_on_error(bool on) { on_error_.store(on, std::memory_order_relaxed); }
+    bool on_error() const { return on_error_.load(std::memory_order_relaxed); }
+
+    Reason should_sample(uint64_t ino);
+
+    // 当前策略, 用于日志和管理命令的回复
+    std::string describe() const;
+
+    static const char* reason_name(Reason reason);
+
+private:
+    void update_active();
+
+    std::atomic<bool> active_{false};
+    std::atomic<uint32_t> every_{0};
+    std::atomic<uint32_t> requested_{0};
+    std::atomic<uint32_t> nr_inodes_{0};
+    std::atomic<uint64_t> inodes_[kMaxInodes];   // 0表示空位
+    std::atomic<bool> on_error_{true};
+};
+
+#endif // TFSD_DIAG_SAMPLER_H
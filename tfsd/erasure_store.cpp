@@ -0,0 +1,508 @@
+#include "erasure_store.h"
+#include "crc32c.h"
+#include "event_loop.h"
+#include "gf256.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+const uint32_t kShardMagic = 0x45534654;          // "TFSE"
+const uint32_t kShardVersion = 1;
+const uint64_t kAlign = 4096;
+const size_t kBatchBytes = 4u << 20;              // 每批读取编码的段数据量
+
+// 分片文件头部, 随后是每个条带一个块的CRC32C, 块数据从header_len开始
+struct ShardHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seg;
+    uint32_t index;                               // 分片编号, 0..k-1为数据, 其余为校验
+    uint32_t k;
+    uint32_t m;
+    uint32_t chunk_size;
+    uint32_t nr_stripes;
+    uint64_t generation;                          // 编码时段的代数
+    uint64_t length;
+    uint64_t header_len;
+    uint32_t crc_sum;                             // CRC数组的校验
+    uint32_t header_sum;                          // 头部校验, 计算时该字段为0
+};
+
+uint64_t align_up(uint64_t v) {
+    return (v + kAlign - 1) & ~(kAlign - 1);
+}
+
+uint32_t header_sum(const ShardHeader& hdr) {
+    ShardHeader tmp = hdr;
+    tmp.header_sum = 0;
+    return crc32c(0, &tmp, sizeof(tmp));
+}
+
+struct AlignedFree {
+    void operator()(char* p) const { free(p); }
+};
+using AlignedBuf = std::unique_ptr<char, AlignedFree>;
+
+char* alloc_aligned(size_t len) {
+    void* p = nullptr;
+    if (posix_memalign(&p, kAlign, len) != 0) {
+        return nullptr;
+    }
+    return static_cast<char*>(p);
+}
+
+bool pread_full(int fd, char* out, size_t len, uint64_t pos) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, out + got, len - got, pos + got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        got += n;
+    }
+    return true;
+}
+
+bool pwrite_full(int fd, const char* buf, size_t len, uint64_t pos) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, pos + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+bool fsync_dir(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+} // namespace
+
+ErasureStore::Archive::~Archive() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+}
+
+ErasureStore::ErasureStore(const Options& opts) : opts_(opts) {}
+
+bool ErasureStore::open(std::string* err) {
+    unsigned n = opts_.k + opts_.m;
+    if (opts_.k == 0 || opts_.m == 0 || n > 255) {
+        *err = "invalid erasure code geometry";
+        return false;
+    }
+    if (opts_.targets.size() != n) {
+        *err = "erasure code " + std::to_string(opts_.k) + "+" + std::to_string(opts_.m) + " needs " +
+               std::to_string(n) + " targets, got " + std::to_string(opts_.targets.size());
+        return false;
+    }
+    if (opts_.chunk_size == 0 || opts_.chunk_size % kAlign != 0) {
+        *err = "chunk size must be a multiple of 4096";
+        return false;
+    }
+    for (const std::string& t : opts_.targets) {
+        mkdir(t.c_str(), 0755);
+    }
+
+    // 前k行为单位阵 (数据块原样存放), 之后m行为Cauchy矩阵 1 / (x_i + y_j),
+    // x_i = k + i, y_j = j 互不相同, 任取k行组成的方阵都可逆
+    matrix_.assign(n * opts_.k, 0);
+    for (unsigned i = 0; i < opts_.k; i++) {
+        matrix_[i * opts_.k + i] = 1;
+    }
+    for (unsigned i = 0; i < opts_.m; i++) {
+        for (unsigned j = 0; j < opts_.k; j++) {
+            matrix_[(opts_.k + i) * opts_.k + j] = gf_inv(static_cast<uint8_t>((opts_.k + i) ^ j));
+        }
+    }
+    return true;
+}
+
+std::string ErasureStore::shard_path(unsigned target, uint32_t seg) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/seg-%06u.ec", seg);
+    return opts_.targets[target] + name;
+}
+
+bool ErasureStore::scan(std::map<uint32_t, ArchivePtr>* archives, std::string* err, bool cleanup) {
+    struct Found {
+        int fd;
+        ShardHeader hdr;
+        std::vector<uint32_t> crcs;
+    };
+    std::map<uint32_t, std::vector<Found>> found;
+    unsigned n = opts_.k + opts_.m;
+
+    for (unsigned t = 0; t < n; t++) {
+        DIR* d = opendir(opts_.targets[t].c_str());
+        if (d == nullptr) {
+            continue;
+        }
+        std::vector<std::string> stale;
+        std::vector<uint32_t> ids;
+        while (struct dirent* de = readdir(d)) {
+            unsigned id;
+            char tail;
+            int fields = sscanf(de->d_name, "seg-%6u.ec%c", &id, &tail);
+            if (fields == 2 && strcmp(strchr(de->d_name, '.'), ".ec.tmp") == 0) {
+                stale.push_back(opts_.targets[t] + "/" + de->d_name);
+            } else if (fields == 1) {
+                ids.push_back(id);
+            }
+        }
+        closedir(d);
+        // 编码中途崩溃留下的临时分片; 不清理时可能是另一个进程正在写入的
+        for (size_t i = 0; cleanup && i < stale.size(); i++) {
+            unlink(stale[i].c_str());
+        }
+
+        for (uint32_t id : ids) {
+            int fd = ::open(shard_path(t, id).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            Found f;
+            f.fd = fd;
+            bool ok = pread_full(fd, reinterpret_cast<char*>(&f.hdr), sizeof(f.hdr), 0) &&
+                      f.hdr.magic == kShardMagic && f.hdr.version == kShardVersion &&
+                      f.hdr.header_sum == header_sum(f.hdr) && f.hdr.seg == id && f.hdr.index < n &&
+                      f.hdr.k == opts_.k && f.hdr.m == opts_.m && f.hdr.chunk_size == opts_.chunk_size &&
+                      f.hdr.header_len >= sizeof(f.hdr) + 4ull * f.hdr.nr_stripes;
+            if (ok) {
+                f.crcs.resize(f.hdr.nr_stripes);
+                ok = pread_full(fd, reinterpret_cast<char*>(f.crcs.data()), 4ull * f.hdr.nr_stripes,
+                                sizeof(f.hdr)) &&
+                     crc32c(0, f.crcs.data(), 4ull * f.hdr.nr_stripes) == f.hdr.crc_sum;
+            }
+            if (!ok) {
+                ::close(fd);
+                continue;
+            }
+            found[id].push_back(std::move(f));
+        }
+    }
+
+    // 每个段取代数最新的一组分片, 至少k个不同分片才能读出
+    for (auto& entry : found) {
+        uint64_t generation = 0;
+        for (const Found& f : entry.second) {
+            generation = std::max(generation, f.hdr.generation);
+        }
+        std::shared_ptr<Archive> ar(new Archive);
+        ar->seg = entry.first;
+        ar->generation = generation;
+        ar->fds.assign(n, -1);
+        ar->crcs.resize(n);
+        unsigned have = 0;
+        for (Found& f : entry.second) {
+            bool same = have == 0 || (f.hdr.length == ar->length && f.hdr.header_len == ar->header_len);
+            if (f.hdr.generation != generation || ar->fds[f.hdr.index] >= 0 || !same) {
+                ::close(f.fd);
+                continue;
+            }
+            ar->length = f.hdr.length;
+            ar->header_len = f.hdr.header_len;
+            ar->nr_stripes = f.hdr.nr_stripes;
+            ar->fds[f.hdr.index] = f.fd;
+            ar->crcs[f.hdr.index] = std::move(f.crcs);
+            have++;
+        }
+        if (have < opts_.k) {
+            *err = "segment " + std::to_string(entry.first) + " has " + std::to_string(have) + " of " +
+                   std::to_string(opts_.k) + " erasure-coded shards needed";
+            return false;
+        }
+        (*archives)[entry.first] = ar;
+    }
+    return true;
+}
+
+// 按批处理: 从段中读入若干条带的数据块并算出校验块, 上一批的分片写入在途时
+// 就开始下一批的读取和编码, 全部写完后补写分片头部, fdatasync后改名生效
+ErasureStore::ArchivePtr ErasureStore::encode(uint32_t seg, uint64_t generation, uint64_t len,
+                                              const ReadFn& read, std::string* err) {
+    const size_t k = opts_.k;
+    const size_t m = opts_.m;
+    const size_t n = k + m;
+    const size_t unit = opts_.chunk_size;
+    const uint64_t stripe_bytes = k * unit;
+    const uint32_t nr = (len + stripe_bytes - 1) / stripe_bytes;
+    const uint64_t header_len = align_up(sizeof(ShardHeader) + 4ull * nr);
+    const size_t group = std::max<size_t>(1, kBatchBytes / stripe_bytes);
+
+    std::shared_ptr<Archive> ar(new Archive);
+    ar->seg = seg;
+    ar->generation = generation;
+    ar->length = len;
+    ar->header_len = header_len;
+    ar->nr_stripes = nr;
+    ar->fds.assign(n, -1);
+    ar->crcs.assign(n, std::vector<uint32_t>(nr));
+
+    std::vector<std::string> tmp_paths(n);
+    auto fail = [&](const std::string& msg) -> ArchivePtr {
+        for (size_t i = 0; i < n; i++) {
+            if (ar->fds[i] >= 0) {
+                ::close(ar->fds[i]);
+                ar->fds[i] = -1;
+                unlink(tmp_paths[i].c_str());
+            }
+        }
+        encode_failures_++;
+        *err = msg;
+        return nullptr;
+    };
+
+    for (size_t i = 0; i < n; i++) {
+        tmp_paths[i] = shard_path(i, seg) + ".tmp";
+        ar->fds[i] = ::open(tmp_paths[i].c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (ar->fds[i] < 0) {
+            return fail("open " + tmp_paths[i] + ": " + strerror(errno));
+        }
+    }
+
+    EventLoop loop;
+    if (!loop.init(group * n, err)) {
+        return fail(*err);
+    }
+    // 每批的缓冲区: 前面是连续的数据块 (即段内容), 后面是各条带的校验块
+    size_t data_bytes = group * stripe_bytes;
+    AlignedBuf bufs[2] = {AlignedBuf(alloc_aligned(group * n * unit)), AlignedBuf(alloc_aligned(group * n * unit))};
+    if (!bufs[0] || !bufs[1]) {
+        return fail("out of memory");
+    }
+
+    int write_err = 0;
+    auto drain = [&]() {
+        while (loop.pending() > 0 && loop.run_once(-1) >= 0) {
+        }
+    };
+    std::vector<const uint8_t*> in(k);
+    std::vector<uint8_t*> out(m);
+    int cur = 0;
+    for (uint32_t s0 = 0; s0 < nr; s0 += group) {
+        size_t cnt = std::min<size_t>(group, nr - s0);
+        char* data = bufs[cur].get();
+        char* parity = data + data_bytes;
+
+        uint64_t pos = s0 * stripe_bytes;
+        size_t want = std::min<uint64_t>(cnt * stripe_bytes, len - pos);
+        ssize_t got = read(data, want, pos);
+        if (got != static_cast<ssize_t>(want)) {
+            drain();
+            return fail("read segment: " + std::string(strerror(got < 0 ? -got : EIO)));
+        }
+        memset(data + want, 0, cnt * stripe_bytes - want);
+
+        for (size_t s = 0; s < cnt; s++) {
+            for (size_t j = 0; j < k; j++) {
+                in[j] = reinterpret_cast<const uint8_t*>(data + (s * k + j) * unit);
+                ar->crcs[j][s0 + s] = crc32c(0, in[j], unit);
+            }
+            for (size_t i = 0; i < m; i++) {
+                out[i] = reinterpret_cast<uint8_t*>(parity + (s * m + i) * unit);
+            }
+            gf_encode(matrix_.data() + k * k, m, k, in.data(), out.data(), unit);
+            for (size_t i = 0; i < m; i++) {
+                ar->crcs[k + i][s0 + s] = crc32c(0, out[i], unit);
+            }
+        }
+
+        // 上一批写完后它的缓冲区才能复用
+        drain();
+        if (write_err != 0) {
+            return fail("write shard: " + std::string(strerror(-write_err)));
+        }
+        for (size_t s = 0; s < cnt; s++) {
+            for (size_t i = 0; i < n; i++) {
+                const char* chunk = i < k ? data + (s * k + i) * unit : parity + (s * m + i - k) * unit;
+                bool queued = loop.write(ar->fds[i], chunk, unit, header_len + (s0 + s) * unit,
+                                         [&write_err, unit](int res) {
+                                             if (res != static_cast<int>(unit) && write_err == 0) {
+                                                 write_err = res < 0 ? res : -EIO;
+                                             }
+                                         });
+                if (!queued && write_err == 0) {
+                    write_err = -EIO;
+                }
+            }
+        }
+        cur ^= 1;
+    }
+    drain();
+    if (write_err != 0) {
+        return fail("write shard: " + std::string(strerror(-write_err)));
+    }
+
+    // 分片头部在全部块写完后写入, 与块数据一起fdatasync
+    std::vector<char> head(header_len, 0);
+    for (size_t i = 0; i < n; i++) {
+        ShardHeader hdr = {};
+        hdr.magic = kShardMagic;
+        hdr.version = kShardVersion;
+        hdr.seg = seg;
+        hdr.index = i;
+        hdr.k = k;
+        hdr.m = m;
+        hdr.chunk_size = unit;
+        hdr.nr_stripes = nr;
+        hdr.generation = generation;
+        hdr.length = len;
+        hdr.header_len = header_len;
+        hdr.crc_sum = crc32c(0, ar->crcs[i].data(), 4ull * nr);
+        hdr.header_sum = header_sum(hdr);
+        memcpy(head.data(), &hdr, sizeof(hdr));
+        memcpy(head.data() + sizeof(hdr), ar->crcs[i].data(), 4ull * nr);
+        if (!pwrite_full(ar->fds[i], head.data(), header_len, 0)) {
+            return fail("write " + tmp_paths[i] + ": " + strerror(errno));
+        }
+        if (!loop.fsync(ar->fds[i], true, [&write_err](int res) {
+                if (res < 0 && write_err == 0) {
+                    write_err = res;
+                }
+            })) {
+            write_err = -EIO;
+        }
+    }
+    drain();
+    if (write_err != 0) {
+        return fail("fdatasync shard: " + std::string(strerror(-write_err)));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (rename(tmp_paths[i].c_str(), shard_path(i, seg).c_str()) != 0) {
+            std::string msg = "rename " + tmp_paths[i] + ": " + strerror(errno);
+            remove(seg);
+            return fail(msg);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!fsync_dir(opts_.targets[i])) {
+            std::string msg = "fsync " + opts_.targets[i] + ": " + strerror(errno);
+            remove(seg);
+            return fail(msg);
+        }
+    }
+
+    encoded_segments_++;
+    encoded_bytes_ += len;
+    return ar;
+}
+
+bool ErasureStore::read_chunk(const Archive& archive, unsigned index, uint32_t stripe, char* out) {
+    int fd = archive.fds[index];
+    return fd >= 0 && stripe < archive.crcs[index].size() &&
+           pread_full(fd, out, opts_.chunk_size, archive.header_len + uint64_t(stripe) * opts_.chunk_size) &&
+           crc32c(0, out, opts_.chunk_size) == archive.crcs[index][stripe];
+}
+
+// 取同一条带中任意k个完好的块, 对生成矩阵中这k行求逆,
+// 逆矩阵的第index行与这k个块相乘即得丢失的数据块
+bool ErasureStore::reconstruct(const Archive& archive, unsigned index, uint32_t stripe, char* out) {
+    const size_t k = opts_.k;
+    const size_t n = k + opts_.m;
+    const size_t unit = opts_.chunk_size;
+
+    std::vector<char> chunks(k * unit);
+    std::vector<uint8_t> sub(k * k);
+    std::vector<const uint8_t*> in(k);
+    size_t have = 0;
+    for (size_t i = 0; i < n && have < k; i++) {
+        if (i == index || !read_chunk(archive, i, stripe, chunks.data() + have * unit)) {
+            continue;
+        }
+        memcpy(&sub[have * k], &matrix_[i * k], k);
+        in[have] = reinterpret_cast<const uint8_t*>(chunks.data() + have * unit);
+        have++;
+    }
+    if (have < k) {
+        return false;
+    }
+
+    std::vector<uint8_t> inv(k * k);
+    if (!gf_invert_matrix(sub.data(), inv.data(), k)) {
+        return false;
+    }
+    uint8_t* dst = reinterpret_cast<uint8_t*>(out);
+    gf_encode(inv.data() + index * k, 1, k, in.data(), &dst, unit);
+    return true;
+}
+
+ssize_t ErasureStore::read(const Archive& archive, char* out, size_t len, uint64_t pos) {
+    if (pos >= archive.length) {
+        return 0;
+    }
+    len = std::min<uint64_t>(len, archive.length - pos);
+
+    const size_t unit = opts_.chunk_size;
+    std::vector<char> chunk(unit);
+    bool degraded = false;
+    size_t done = 0;
+    while (done < len) {
+        uint64_t p = pos + done;
+        uint64_t c = p / unit;
+        uint32_t stripe = c / opts_.k;
+        unsigned index = c % opts_.k;
+        size_t skip = p % unit;
+        size_t n = std::min(unit - skip, len - done);
+
+        if (!read_chunk(archive, index, stripe, chunk.data())) {
+            if (!degraded) {
+                degraded = true;
+                degraded_reads_++;
+            }
+            if (!reconstruct(archive, index, stripe, chunk.data())) {
+                unrecoverable_reads_++;
+                return -EIO;
+            }
+            reconstructed_chunks_++;
+        }
+        memcpy(out + done, chunk.data() + skip, n);
+        done += n;
+    }
+    return len;
+}
+
+void ErasureStore::remove(uint32_t seg) {
+    for (unsigned t = 0; t < opts_.targets.size(); t++) {
+        std::string path = shard_path(t, seg);
+        unlink(path.c_str());
+        unlink((path + ".tmp").c_str());
+    }
+}
+
+ErasureStore::Stats ErasureStore::stats() const {
+    Stats st;
+    st.encoded_segments = encoded_segments_.load();
+    st.encoded_bytes = encoded_bytes_.load();
+    st.encode_failures = encode_failures_.load();
+    st.degraded_reads = degraded_reads_.load();
+    st.reconstructed_chunks = reconstructed_chunks_.load();
+    st.unrecoverable_reads = unrecoverable_reads_.load();
+    return st;
+}
+
+std::string ErasureStore::describe() const {
+    return std::to_string(opts_.k) + "+" + std::to_string(opts_.m) + " over " +
+           std::to_string(opts_.targets.size()) + " targets, " + std::to_string(opts_.chunk_size >> 10) +
+           "KB chunks, gf " + gf_impl();
+}
@@ -0,0 +1,98 @@
+#ifndef TFSD_ERASURE_STORE_H
+#define TFSD_ERASURE_STORE_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 冷数据的纠删码存储: 把一个封存的数据段按Reed-Solomon k+m编码到k+m个目标目录
+// (每个目录视为一个存储节点, 可以挂在不同的盘上), 任意m个目标丢失仍可读出。
+// 段内容按条带切分, 每个条带k个数据块和m个校验块, 第i个块写入第i个目标的分片文件
+// <target>/seg-NNNNNN.ec, 分片头部保存段号、代数和每个块的CRC32C。
+// 数据块原样存放, 正常读取直接读对应数据块; 块不可读或校验不符时用同一条带的
+// 其他k个块现场重建 (降级读)。生成矩阵为单位阵加Cauchy矩阵, 任意k行可逆。
+class ErasureStore {
+public:
+    struct Options {
+        std::vector<std::string> targets;   // k+m个目录, 顺序即分片编号
+        unsigned k = 0;
+        unsigned m = 0;
+        size_t chunk_size = 64 << 10;       // 每个块的大小, 4KB的整数倍
+    };
+
+    struct Stats {
+        uint64_t encoded_segments = 0;
+        uint64_t encoded_bytes = 0;
+        uint64_t encode_failures = 0;
+        uint64_t degraded_reads = 0;         // 需要重建的读取
+        uint64_t reconstructed_chunks = 0;
+        uint64_t unrecoverable_reads = 0;    // 可用的块不足k个
+    };
+
+    // 一个已编码的段, 打开后只读, 可被多个读取者共享
+    struct Archive {
+        uint32_t seg = 0;
+        uint64_t generation = 0;
+        uint64_t length = 0;                 // 编码的段内容长度
+        uint64_t header_len = 0;             // 分片中第一个块的位置
+        uint32_t nr_stripes = 0;
+        std::vector<int> fds;                // 按分片编号, 缺失的分片为-1
+        std::vector<std::vector<uint32_t>> crcs;
+
+        ~Archive();
+    };
+    using ArchivePtr = std::shared_ptr<const Archive>;
+
+    // 从段中读取[pos, pos + len)的函数, 返回读到的字节数或负的errno
+    using ReadFn = std::function<ssize_t(char* out, size_t len, uint64_t pos)>;
+
+    explicit ErasureStore(const Options& opts);
+
+    ErasureStore(const ErasureStore&) = delete;
+    ErasureStore& operator=(const ErasureStore&) = delete;
+
+    // 检查参数并创建目标目录, 个别目标不可用不算失败 (读取时降级, 编码时报错)
+    bool open(std::string* err);
+
+    // 扫描各目标上的分片, cleanup时删除写了一半的临时分片
+    // 有段的一致分片不足k个时失败 (目标所在的盘可能只是暂时未挂载, 不能把该段当作不存在)
+    bool scan(std::map<uint32_t, ArchivePtr>* archives, std::string* err, bool cleanup = true);
+
+    // 把段内容[0, len)编码写入所有目标, 全部落盘后返回; 读取、编码与分片写入流水线进行
+    // 任一目标写入失败时删除已写的分片并返回空
+    ArchivePtr encode(uint32_t seg, uint64_t generation, uint64_t len, const ReadFn& read, std::string* err);
+
+    // 读取已编码段的[pos, pos + len), 返回读到的字节数或负的errno (-EIO表示无法重建)
+    ssize_t read(const Archive& archive, char* out, size_t len, uint64_t pos);
+
+    // 删除一个段的所有分片
+    void remove(uint32_t seg);
+
+    Stats stats() const;
+    std::string describe() const;
+
+private:
+    std::string shard_path(unsigned target, uint32_t seg) const;
+    // 读取并校验分片index中条带stripe的块
+    bool read_chunk(const Archive& archive, unsigned index, uint32_t stripe, char* out);
+    // 用其他分片重建条带stripe中分片index的块
+    bool reconstruct(const Archive& archive, unsigned index, uint32_t stripe, char* out);
+
+    Options opts_;
+    std::vector<uint8_t> matrix_;           // (k+m) x k生成矩阵
+
+    std::atomic<uint64_t> encoded_segments_{0};
+    std::atomic<uint64_t> encoded_bytes_{0};
+    std::atomic<uint64_t> encode_failures_{0};
+    std::atomic<uint64_t> degraded_reads_{0};
+    std::atomic<uint64_t> reconstructed_chunks_{0};
+    std::atomic<uint64_t> unrecoverable_reads_{0};
+};
+
+#endif // TFSD_ERASURE_STORE_H
@@ -0,0 +1,323 @@
+#include "event_loop.h"
+
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+EventLoop::~EventLoop() {
+#ifndef NO_IO_URING
+    if (use_uring_) {
+        // 退出前关闭ring会让内核取消所有未完成的请求, 此后不再回调
+        io_uring_queue_exit(&ring_);
+        for (Op* op : uring_ops_) {
+            delete op;
+        }
+    }
+#endif
+    for (Op* op : io_queue_) {
+        delete op;
+    }
+    for (Op* op : polls_) {
+        delete op;
+    }
+}
+
+bool EventLoop::init(unsigned entries, std::string* err) {
+#ifndef NO_IO_URING
+    int ret = io_uring_queue_init(entries, &ring_, 0);
+    if (ret == 0) {
+        use_uring_ = true;
+        initialized_ = true;
+        return true;
+    }
+    // 内核未开启或禁止io_uring (例如容器的seccomp策略), 退化为poll
+    if (ret != -ENOSYS && ret != -EPERM) {
+        *err = "io_uring_queue_init: " + std::string(strerror(-ret));
+        return false;
+    }
+#else
+    (void)entries;
+    (void)err;
+#endif
+    use_uring_ = false;
+    initialized_ = true;
+    return true;
+}
+
+EventLoop::Op* EventLoop::new_op(Kind kind, int fd, Callback cb, unsigned flags) {
+    Op* op = new Op();
+    op->kind = kind;
+    op->fd = fd;
+    op->events = 0;
+    op->buf = nullptr;
+    op->len = 0;
+    op->off = 0;
+    op->datasync = false;
+    op->flags = flags;
+    op->cancelled = false;
+    op->cb = std::move(cb);
+    return op;
+}
+
+uint64_t EventLoop::poll_add(int fd, short events, Callback cb) {
+    Op* op = new_op(Kind::Poll, fd, std::move(cb), 0);
+    op->events = events;
+    return submit(op) ? reinterpret_cast<uint64_t>(op) : 0;
+}
+
+bool EventLoop::read(int fd, void* buf, size_t len, off_t off, Callback cb, unsigned flags) {
+    Op* op = new_op(Kind::Read, fd, std::move(cb), flags);
+    op->buf = buf;
+    op->len = len;
+    op->off = off;
+    return submit(op);
+}
+
+bool EventLoop::write(int fd, const void* buf, size_t len, off_t off, Callback cb, unsigned flags) {
+    Op* op = new_op(Kind::Write, fd, std::move(cb), flags);
+    op->buf = const_cast<void*>(buf);
+    op->len = len;
+    op->off = off;
+    return submit(op);
+}
+
+bool EventLoop::fsync(int fd, bool datasync, Callback cb, unsigned flags) {
+    Op* op = new_op(Kind::Fsync, fd, std::move(cb), flags);
+    op->datasync = datasync;
+    return submit(op);
+}
+
+void EventLoop::complete(Op* op, int res) {
+    inflight_--;
+    Callback cb = std::move(op->cb);
+    delete op;
+    if (cb) {
+        cb(res);
+    }
+}
+
+#ifndef NO_IO_URING
+// SQ满时先把已有的提交出去
+io_uring_sqe* EventLoop::get_sqe() {
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    if (sqe == nullptr) {
+        io_uring_submit(&ring_);
+        sqe = io_uring_get_sqe(&ring_);
+    }
+    return sqe;
+}
+#endif
+
+bool EventLoop::submit(Op* op) {
+    if (!initialized_) {
+        delete op;
+        return false;
+    }
+
+#ifndef NO_IO_URING
+    if (use_uring_) {
+        io_uring_sqe* sqe = get_sqe();
+        if (sqe == nullptr) {
+            delete op;
+            return false;
+        }
+        switch (op->kind) {
+        case Kind::Poll:
+            io_uring_prep_poll_add(sqe, op->fd, op->events);
+            break;
+        case Kind::Read:
+            io_uring_prep_read(sqe, op->fd, op->buf, op->len, op->off);
+            break;
+        case Kind::Write:
+            io_uring_prep_write(sqe, op->fd, op->buf, op->len, op->off);
+            break;
+        case Kind::Fsync:
+            io_uring_prep_fsync(sqe, op->fd, op->datasync ? IORING_FSYNC_DATASYNC : 0);
+            break;
+        }
+        if (op->flags & kLinkNext) {
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        }
+        io_uring_sqe_set_data(sqe, op);
+        uring_ops_.insert(op);
+        inflight_++;
+        return true;
+    }
+#endif
+
+    if (op->kind == Kind::Poll) {
+        polls_.push_back(op);
+    } else {
+        io_queue_.push_back(op);
+    }
+    inflight_++;
+    return true;
+}
+
+void EventLoop::cancel(uint64_t token) {
+    Op* target = reinterpret_cast<Op*>(token);
+    if (target == nullptr) {
+        return;
+    }
+
+#ifndef NO_IO_URING
+    if (use_uring_) {
+        if (uring_ops_.count(target) == 0) {
+            return;
+        }
+        io_uring_sqe* sqe = get_sqe();
+        if (sqe != nullptr) {
+            // 取消请求本身不需要回调
+            io_uring_prep_cancel(sqe, target, 0);
+            io_uring_sqe_set_data(sqe, nullptr);
+        }
+        return;
+    }
+#endif
+
+    for (Op* op : polls_) {
+        if (op == target) {
+            op->cancelled = true;
+        }
+    }
+}
+
+int EventLoop::run_once(int timeout_ms) {
+#ifndef NO_IO_URING
+    if (use_uring_) {
+        return run_uring(timeout_ms);
+    }
+#endif
+    return run_fallback(timeout_ms);
+}
+
+#ifndef NO_IO_URING
+int EventLoop::run_uring(int timeout_ms) {
+    int ret = io_uring_submit(&ring_);
+    if (ret < 0 && ret != -EBUSY && ret != -EAGAIN) {
+        return ret;
+    }
+
+    io_uring_cqe* cqe = nullptr;
+    if (timeout_ms < 0) {
+        ret = io_uring_wait_cqe(&ring_, &cqe);
+    } else {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+        ret = io_uring_wait_cqe_timeout(&ring_, &cqe, &ts);
+    }
+    if (ret == -ETIME || ret == -EINTR) {
+        return 0;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    // 一次取完所有已完成的事件, 回调中可以继续提交新操作
+    int done = 0;
+    while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+        Op* op = static_cast<Op*>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring_, cqe);
+        if (op == nullptr) {
+            continue;
+        }
+        uring_ops_.erase(op);
+        complete(op, res);
+        done++;
+    }
+    return done;
+}
+#endif
+
+// 同步执行一个I/O操作, 返回值与io_uring的cqe->res含义相同
+int EventLoop::execute(const Op& op) {
+    ssize_t n;
+    switch (op.kind) {
+    case Kind::Read:
+        do {
+            n = pread(op.fd, op.buf, op.len, op.off);
+        } while (n < 0 && errno == EINTR);
+        return n < 0 ? -errno : static_cast<int>(n);
+    case Kind::Write: {
+        const char* p = static_cast<const char*>(op.buf);
+        size_t done = 0;
+        while (done < op.len) {
+            n = pwrite(op.fd, p + done, op.len - done, op.off + done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return done ? static_cast<int>(done) : -errno;
+            }
+            done += n;
+        }
+        return static_cast<int>(done);
+    }
+    case Kind::Fsync:
+        return (op.datasync ? fdatasync(op.fd) : ::fsync(op.fd)) < 0 ? -errno : 0;
+    case Kind::Poll:
+        break;
+    }
+    return -EINVAL;
+}
+
+int EventLoop::run_fallback(int timeout_ms) {
+    int done = 0;
+
+    // 按提交顺序执行I/O, 链接的操作在前一个失败时取消 (与IOSQE_IO_LINK一致)
+    std::deque<Op*> io;
+    io.swap(io_queue_);
+    bool cancel_next = false;
+    for (Op* op : io) {
+        int res = cancel_next ? -ECANCELED : execute(*op);
+        bool failed = res < 0 ||
+                      ((op->kind == Kind::Read || op->kind == Kind::Write) &&
+                       static_cast<size_t>(res) < op->len);
+        cancel_next = (op->flags & kLinkNext) && failed;
+        complete(op, res);
+        done++;
+    }
+
+    // 已取消的poll直接完成
+    std::vector<Op*> waiting;
+    for (Op* op : polls_) {
+        if (op->cancelled) {
+            complete(op, -ECANCELED);
+            done++;
+        } else {
+            waiting.push_back(op);
+        }
+    }
+    polls_.clear();
+
+    std::vector<struct pollfd> pfds;
+    pfds.reserve(waiting.size());
+    for (Op* op : waiting) {
+        pfds.push_back({op->fd, op->events, 0});
+    }
+
+    // 有事件处理完就不再等待, 让调用方尽快处理结果
+    int wait = (done > 0 || !io_queue_.empty()) ? 0 : timeout_ms;
+    int ret = poll(pfds.data(), pfds.size(), wait);
+    if (ret < 0 && errno != EINTR) {
+        int err = -errno;
+        polls_.insert(polls_.end(), waiting.begin(), waiting.end());
+        return done ? done : err;
+    }
+
+    // 回调可能重新提交poll, 先把未就绪的放回去
+    std::vector<std::pair<Op*, int>> ready;
+    for (size_t i = 0; i < waiting.size(); i++) {
+        if (ret > 0 && pfds[i].revents) {
+            ready.emplace_back(waiting[i], pfds[i].revents);
+        } else {
+            polls_.push_back(waiting[i]);
+        }
+    }
+    for (auto& r : ready) {
+        complete(r.first, r.second);
+        done++;
+    }
+    return done;
+}
@@ -0,0 +1,96 @@
+#ifndef TFSD_EVENT_LOOP_H
+#define TFSD_EVENT_LOOP_H
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#ifndef NO_IO_URING
+#include <liburing.h>
+#endif
+
+// tfsd主线程的事件循环
+// 控制设备的可读等待与本地存储的读/写/fsync在同一个提交/完成循环中处理,
+// 有liburing时基于io_uring (IORING_OP_POLL_ADD/READ/WRITE/FSYNC),
+// 编译时没有liburing或运行时内核拒绝io_uring, 则退化为poll()加同步I/O。
+// 非线程安全: 只能在创建它的线程中使用。
+class EventLoop {
+public:
+    // 回调参数: poll为revents, 读写为字节数, fsync为0, 失败时为负的errno
+    using Callback = std::function<void(int res)>;
+
+    // 本操作完成后才开始下一个提交的操作, 本操作失败则下一个以-ECANCELED完成
+    static const unsigned kLinkNext = 1u << 0;
+
+    EventLoop() = default;
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool init(unsigned entries, std::string* err);
+
+    // 单次触发: 事件就绪后回调一次, 需要继续等待则重新提交
+    // 返回的令牌可用于cancel(), 失败返回0
+    uint64_t poll_add(int fd, short events, Callback cb);
+    // 取消尚未完成的poll, 其回调以-ECANCELED执行
+    void cancel(uint64_t token);
+
+    // buf在回调执行前必须保持有效
+    bool read(int fd, void* buf, size_t len, off_t off, Callback cb, unsigned flags = 0);
+    bool write(int fd, const void* buf, size_t len, off_t off, Callback cb, unsigned flags = 0);
+    bool fsync(int fd, bool datasync, Callback cb, unsigned flags = 0);
+
+    // 提交积压的操作并处理已完成的, 没有完成事件时最多等待timeout_ms (负数表示一直等)
+    // 返回处理的完成事件数, 出错返回负的errno
+    int run_once(int timeout_ms);
+
+    // 已提交未完成的操作数
+    size_t pending() const { return inflight_; }
+    bool uses_io_uring() const { return use_uring_; }
+
+private:
+    enum class Kind { Poll, Read, Write, Fsync };
+
+    struct Op {
+        Kind kind;
+        int fd;
+        short events;
+        void* buf;
+        size_t len;
+        off_t off;
+        bool datasync;
+        unsigned flags;
+        bool cancelled;
+        Callback cb;
+    };
+
+    Op* new_op(Kind kind, int fd, Callback cb, unsigned flags);
+    bool submit(Op* op);
+    void complete(Op* op, int res);
+
+    int run_fallback(int timeout_ms);
+    static int execute(const Op& op);
+
+#ifndef NO_IO_URING
+    int run_uring(int timeout_ms);
+    io_uring_sqe* get_sqe();
+
+    struct io_uring ring_;
+    std::unordered_set<Op*> uring_ops_;     // 已交给内核的操作
+#endif
+    bool use_uring_ = false;
+    bool initialized_ = false;
+    size_t inflight_ = 0;
+
+    // 退化模式下的等待队列
+    std::deque<Op*> io_queue_;
+    std::vector<Op*> polls_;
+};
+
+#endif // TFSD_EVENT_LOOP_H
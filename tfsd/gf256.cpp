@@ -0,0 +1,248 @@
+#include "gf256.h"
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const unsigned kPoly = 0x11d;
+
+// 编码时每次处理的块大小: 各输入的同一块在L1中, 输出只写一遍
+const size_t kBlock = 4096;
+
+struct Tables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+    // 按常数展开的高低4位表, pshufb的查表源
+    alignas(32) uint8_t lo[256][16];
+    alignas(32) uint8_t hi[256][16];
+
+    Tables() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= kPoly;
+            }
+        }
+        // 指数表加倍, 乘法时不必对255取模
+        for (int i = 255; i < 512; i++) {
+            exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+        for (int a = 0; a < 256; a++) {
+            for (int b = 0; b < 256; b++) {
+                mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+            }
+        }
+        for (int c = 0; c < 256; c++) {
+            for (int n = 0; n < 16; n++) {
+                lo[c][n] = mul[c][n];
+                hi[c][n] = mul[c][n << 4];
+            }
+        }
+    }
+};
+
+const Tables& tables() {
+    static const Tables t;
+    return t;
+}
+
+void encode_sw(const uint8_t* matrix, size_t rows, size_t k, const uint8_t* const* in, uint8_t* const* out,
+               size_t len) {
+    const Tables& t = tables();
+    for (size_t off = 0; off < len; off += kBlock) {
+        size_t n = len - off < kBlock ? len - off : kBlock;
+        for (size_t r = 0; r < rows; r++) {
+            uint8_t* dst = out[r] + off;
+            memset(dst, 0, n);
+            for (size_t j = 0; j < k; j++) {
+                uint8_t c = matrix[r * k + j];
+                if (c == 0) {
+                    continue;
+                }
+                const uint8_t* row = t.mul[c];
+                const uint8_t* src = in[j] + off;
+                for (size_t i = 0; i < n; i++) {
+                    dst[i] ^= row[src[i]];
+                }
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3")))
+void encode_ssse3(const uint8_t* matrix, size_t rows, size_t k, const uint8_t* const* in, uint8_t* const* out,
+                  size_t len) {
+    const Tables& t = tables();
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t vec_len = len & ~static_cast<size_t>(15);
+
+    for (size_t off = 0; off < vec_len; off += kBlock) {
+        size_t end = off + kBlock < vec_len ? off + kBlock : vec_len;
+        for (size_t r = 0; r < rows; r++) {
+            const uint8_t* coef = matrix + r * k;
+            for (size_t p = off; p < end; p += 16) {
+                __m128i acc = _mm_setzero_si128();
+                for (size_t j = 0; j < k; j++) {
+                    __m128i tlo = _mm_load_si128(reinterpret_cast<const __m128i*>(t.lo[coef[j]]));
+                    __m128i thi = _mm_load_si128(reinterpret_cast<const __m128i*>(t.hi[coef[j]]));
+                    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in[j] + p));
+                    __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(x, mask));
+                    __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+                    acc = _mm_xor_si128(acc, _mm_xor_si128(l, h));
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out[r] + p), acc);
+            }
+        }
+    }
+    if (vec_len < len) {
+        std::vector<const uint8_t*> tail_in(k);
+        std::vector<uint8_t*> tail_out(rows);
+        for (size_t j = 0; j < k; j++) {
+            tail_in[j] = in[j] + vec_len;
+        }
+        for (size_t r = 0; r < rows; r++) {
+            tail_out[r] = out[r] + vec_len;
+        }
+        encode_sw(matrix, rows, k, tail_in.data(), tail_out.data(), len - vec_len);
+    }
+}
+
+__attribute__((target("avx2")))
+void encode_avx2(const uint8_t* matrix, size_t rows, size_t k, const uint8_t* const* in, uint8_t* const* out,
+                 size_t len) {
+    const Tables& t = tables();
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t vec_len = len & ~static_cast<size_t>(31);
+
+    for (size_t off = 0; off < vec_len; off += kBlock) {
+        size_t end = off + kBlock < vec_len ? off + kBlock : vec_len;
+        for (size_t r = 0; r < rows; r++) {
+            const uint8_t* coef = matrix + r * k;
+            for (size_t p = off; p < end; p += 32) {
+                __m256i acc = _mm256_setzero_si256();
+                for (size_t j = 0; j < k; j++) {
+                    // 16字节的表复制到两个128位通道, vpshufb在各通道内查表
+                    __m256i tlo = _mm256_broadcastsi128_si256(
+                        _mm_load_si128(reinterpret_cast<const __m128i*>(t.lo[coef[j]])));
+                    __m256i thi = _mm256_broadcastsi128_si256(
+                        _mm_load_si128(reinterpret_cast<const __m128i*>(t.hi[coef[j]])));
+                    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in[j] + p));
+                    __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(x, mask));
+                    __m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask));
+                    acc = _mm256_xor_si256(acc, _mm256_xor_si256(l, h));
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[r] + p), acc);
+            }
+        }
+    }
+    if (vec_len < len) {
+        std::vector<const uint8_t*> tail_in(k);
+        std::vector<uint8_t*> tail_out(rows);
+        for (size_t j = 0; j < k; j++) {
+            tail_in[j] = in[j] + vec_len;
+        }
+        for (size_t r = 0; r < rows; r++) {
+            tail_out[r] = out[r] + vec_len;
+        }
+        encode_sw(matrix, rows, k, tail_in.data(), tail_out.data(), len - vec_len);
+    }
+}
+#endif
+
+using EncodeFn = void (*)(const uint8_t*, size_t, size_t, const uint8_t* const*, uint8_t* const*, size_t);
+
+struct Dispatch {
+    EncodeFn fn = encode_sw;
+    const char* name = "table";
+
+    Dispatch() {
+        tables();
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+            fn = encode_avx2;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("ssse3")) {
+            fn = encode_ssse3;
+            name = "ssse3";
+        }
+#endif
+    }
+};
+
+const Dispatch& dispatch() {
+    static const Dispatch d;
+    return d;
+}
+
+} // namespace
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return tables().mul[a][b];
+}
+
+uint8_t gf_inv(uint8_t a) {
+    const Tables& t = tables();
+    return a == 0 ? 0 : t.exp[255 - t.log[a]];
+}
+
+void gf_encode(const uint8_t* matrix, size_t rows, size_t k, const uint8_t* const* in, uint8_t* const* out,
+               size_t len) {
+    dispatch().fn(matrix, rows, k, in, out, len);
+}
+
+// 高斯-约当消元, 在[in | I]上把左半部化为单位阵
+bool gf_invert_matrix(const uint8_t* in, uint8_t* out, size_t k) {
+    std::vector<uint8_t> a(in, in + k * k);
+    for (size_t i = 0; i < k; i++) {
+        for (size_t j = 0; j < k; j++) {
+            out[i * k + j] = i == j ? 1 : 0;
+        }
+    }
+    for (size_t col = 0; col < k; col++) {
+        size_t pivot = col;
+        while (pivot < k && a[pivot * k + col] == 0) {
+            pivot++;
+        }
+        if (pivot == k) {
+            return false;
+        }
+        if (pivot != col) {
+            for (size_t j = 0; j < k; j++) {
+                std::swap(a[pivot * k + j], a[col * k + j]);
+                std::swap(out[pivot * k + j], out[col * k + j]);
+            }
+        }
+        uint8_t inv = gf_inv(a[col * k + col]);
+        for (size_t j = 0; j < k; j++) {
+            a[col * k + j] = gf_mul(a[col * k + j], inv);
+            out[col * k + j] = gf_mul(out[col * k + j], inv);
+        }
+        for (size_t row = 0; row < k; row++) {
+            uint8_t f = a[row * k + col];
+            if (row == col || f == 0) {
+                continue;
+            }
+            for (size_t j = 0; j < k; j++) {
+                a[row * k + j] ^= gf_mul(f, a[col * k + j]);
+                out[row * k + j] ^= gf_mul(f, out[col * k + j]);
+            }
+        }
+    }
+    return true;
+}
+
+const char* gf_impl() {
+    return dispatch().name;
+}
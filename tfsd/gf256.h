@@ -0,0 +1,26 @@
+#ifndef TFSD_GF256_H
+#define TFSD_GF256_H
+
+#include <cstddef>
+#include <cstdint>
+
+// GF(2^8)运算 (生成多项式0x11d), 用于Reed-Solomon纠删码的编码和重建
+// 区域乘法把常数c的乘法拆成高低两个4位查表: c*x = lo[x & 0xf] ^ hi[x >> 4],
+// x86-64上CPU支持AVX2/SSSE3时用pshufb一条指令查32/16个字节,
+// 否则按整张乘法表逐字节查, 实现在首次调用前按CPU特性选定。
+
+uint8_t gf_mul(uint8_t a, uint8_t b);
+uint8_t gf_inv(uint8_t a);
+
+// 矩阵乘: out[i] = sum_j matrix[i * k + j] * in[j], i < rows, 每个输入输出都是len字节
+// 各输出在寄存器中累加k个输入后只写一次
+void gf_encode(const uint8_t* matrix, size_t rows, size_t k, const uint8_t* const* in, uint8_t* const* out,
+               size_t len);
+
+// k x k矩阵求逆, 不可逆时返回false
+bool gf_invert_matrix(const uint8_t* in, uint8_t* out, size_t k);
+
+// 当前使用的区域乘法实现, 用于日志
+const char* gf_impl();
+
+#endif // TFSD_GF256_H
@@ -0,0 +1,199 @@
+#include "handover.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+// 设备状态的上限, 超过视为损坏的应答
+const uint32_t kMaxState = 64u << 20;
+
+bool make_addr(const std::string& path, struct sockaddr_un* addr, std::string* err) {
+    memset(addr, 0, sizeof(*addr));
+    if (path.size() >= sizeof(addr->sun_path)) {
+        *err = "socket path too long: " + path;
+        return false;
+    }
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// 交接期间对端随时可能退出, 读写都带超时
+void set_timeout(int fd, int seconds) {
+    struct timeval tv = {seconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+bool read_info(int fd, HandoverInfo* info, std::string* err) {
+    ssize_t n;
+    do {
+        n = recv(fd, info, sizeof(*info), MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    if (n != static_cast<ssize_t>(sizeof(*info))) {
+        *err = n < 0 ? "recv: " + std::string(strerror(errno)) : "short handover message";
+        return false;
+    }
+    if (info->magic != kHandoverMagic || info->version != kHandoverVersion) {
+        *err = "handover protocol mismatch";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int handover_listen(const std::string& path, std::string* err) {
+    struct sockaddr_un addr;
+    if (!make_addr(path, &addr, err)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *err = "socket: " + std::string(strerror(errno));
+        return -1;
+    }
+    unlink(path.c_str());
+    // 描述符能直接操作内核队列, 只允许同一用户连接
+    mode_t old_mask = umask(077);
+    int ret = bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(old_mask);
+    if (ret != 0 || listen(fd, 1) != 0) {
+        *err = "bind/listen " + path + ": " + std::string(strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool handover_send(int conn, int ctl_fd, const HandoverInfo& reply, const std::string& state,
+                   HandoverInfo* peer, std::string* err) {
+    set_timeout(conn, 5);
+    if (!read_info(conn, peer, err)) {
+        return false;
+    }
+
+    HandoverInfo info = reply;
+    info.state_len = static_cast<uint32_t>(state.size());
+    struct iovec iov[2] = {{&info, sizeof(info)}, {const_cast<char*>(state.data()), state.size()}};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = state.empty() ? 1 : 2;
+    if (ctl_fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &ctl_fd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < static_cast<ssize_t>(sizeof(info))) {
+        *err = "sendmsg: " + std::string(n < 0 ? strerror(errno) : "short write");
+        return false;
+    }
+    // 描述符随第一段数据发出, 状态中没发完的部分接着写
+    for (size_t sent = n - sizeof(info); sent < state.size(); sent += n) {
+        do {
+            n = send(conn, state.data() + sent, state.size() - sent, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            *err = "send state: " + std::string(n < 0 ? strerror(errno) : "short write");
+            return false;
+        }
+    }
+    return true;
+}
+
+int handover_request(const std::string& path, HandoverInfo* reply, std::string* state, std::string* err) {
+    struct sockaddr_un addr;
+    if (!make_addr(path, &addr, err)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *err = "socket: " + std::string(strerror(errno));
+        return -1;
+    }
+    // 旧进程要先等在途传输完成, 应答的超时比请求宽松
+    set_timeout(fd, 30);
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        *err = "connect " + path + ": " + std::string(strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    HandoverInfo req = {};
+    req.magic = kHandoverMagic;
+    req.version = kHandoverVersion;
+    req.pid = getpid();
+    if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(req))) {
+        *err = "send: " + std::string(strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    struct iovec iov = {reply, sizeof(*reply)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    int recv_errno = errno;
+    state->clear();
+    if (n == static_cast<ssize_t>(sizeof(*reply)) && reply->state_len > 0 && reply->state_len <= kMaxState) {
+        state->resize(reply->state_len);
+        ssize_t got;
+        do {
+            got = recv(fd, &(*state)[0], state->size(), MSG_WAITALL);
+        } while (got < 0 && errno == EINTR);
+        if (got != static_cast<ssize_t>(state->size())) {
+            recv_errno = got < 0 ? errno : EPROTO;
+            n = -1;
+        }
+    }
+    close(fd);
+
+    int ctl_fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n > 0 && cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&ctl_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n != static_cast<ssize_t>(sizeof(*reply)) || reply->magic != kHandoverMagic ||
+        reply->version != kHandoverVersion || reply->state_len > kMaxState) {
+        *err = n < 0 ? "recvmsg: " + std::string(strerror(recv_errno)) : "invalid handover reply";
+    } else if (reply->status != 0) {
+        *err = "peer refused: " + std::string(strerror(-reply->status));
+    } else if (ctl_fd < 0) {
+        *err = "reply carried no descriptor";
+    } else {
+        return ctl_fd;
+    }
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+    }
+    return -1;
+}
@@ -0,0 +1,47 @@
+#ifndef TFSD_HANDOVER_H
+#define TFSD_HANDOVER_H
+
+#include <cstdint>
+#include <string>
+
+// tfsd热升级: 运行中的tfsd把控制设备描述符交给新启动的进程, 文件不经过关闭,
+// 内核中排队的传输项原样保留, 写者感知不到守护进程的切换。
+// 流程 (Unix域套接字, 一次请求一次应答):
+//   0. 新进程预扫描段文件 (StorageEngine::prescan) 并预先重放元数据 (MetaStore::prescan)
+//   1. 新进程连接旧进程的交接套接字, 发送请求 (HandoverInfo, pid为新进程)
+//   2. 旧进程停止领取, 等已领取的传输全部完成、元数据日志落盘、存储引擎停止写入
+//   3. 旧进程在应答中用SCM_RIGHTS附带控制设备描述符和设备状态 (模拟设备用), 然后退出
+//   4. 新进程只补上预扫描之后的元数据日志和段尾 (此时不再有其他写入者), 继续领取
+// 已领取的传输在第2步排空而不是把ID交给新进程, 这是有意的: worker正把它们写进旧进程的存储引擎和
+// 复制连接, 中途交出要么重复写入要么丢掉一半。排空量有上限 (每个worker最多4个, 每个不超过一个段),
+// 因此旧进程交出时inflight为0; 新进程在交接完成前崩溃时, 描述符随套接字关闭,
+// 内核把残留的inflight放回队列, 不会丢失。
+
+struct HandoverInfo {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    int32_t status;          // 应答: 0或负的errno, 非0时不附带描述符
+    uint64_t meta_seq;       // 应答: 旧进程最后应用的元数据序号
+    uint64_t transfers;      // 应答: 旧进程处理的传输数
+    uint64_t inflight;       // 应答: 交出时已领取未完成的传输数
+    uint32_t state_len;      // 应答: 紧随其后的设备状态字节数
+    uint32_t reserved;
+};
+
+const uint32_t kHandoverMagic = 0x48534654;  // "TFSH"
+const uint32_t kHandoverVersion = 2;
+
+// 旧进程: 监听交接套接字, 已存在的同名文件会被替换
+int handover_listen(const std::string& path, std::string* err);
+
+// 旧进程: 读取已接受的 (阻塞) 连接上的请求, 应答并附带ctl_fd和设备状态 (ctl_fd<0时只应答reply.status)
+// peer输出请求方的信息
+bool handover_send(int conn, int ctl_fd, const HandoverInfo& reply, const std::string& state,
+                   HandoverInfo* peer, std::string* err);
+
+// 新进程: 向path上的旧进程请求交接, 成功返回收到的控制设备描述符, 失败返回-1
+// state输出旧进程交来的设备状态
+int handover_request(const std::string& path, HandoverInfo* reply, std::string* state, std::string* err);
+
+#endif // TFSD_HANDOVER_H
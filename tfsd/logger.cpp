@@ -0,0 +1,198 @@
+#include "logger.h"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+namespace {
+
+const char* const kLevelNames[] = {"DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL"};
+
+void write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+} // namespace
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : slots_(new Slot[kSlots]) {
+    for (size_t i = 0; i < kSlots; i++) {
+        slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+// 进程退出时写出剩余记录
+Logger::~Logger() {
+    stop();
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    delete[] slots_;
+}
+
+bool Logger::open(const std::string& path) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return fd_ >= 0;
+}
+
+void Logger::start() {
+    if (running_.exchange(true)) {
+        return;
+    }
+    writer_ = std::thread(&Logger::writer_loop, this);
+}
+
+void Logger::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(wake_lock_);
+    }
+    wake_cv_.notify_one();
+    writer_.join();
+}
+
+bool Logger::parse_level(const std::string& name, LogLevel* level) {
+    for (int i = 0; i <= static_cast<int>(LogLevel::CRITICAL); i++) {
+        if (strcasecmp(name.c_str(), kLevelNames[i]) == 0) {
+            *level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Logger::log(LogLevel level, const char* msg, size_t len) {
+    // 有界MPMC队列的入队算法: 槽位序号等于位置时才可写
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &slots_[pos & (kSlots - 1)];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 写线程跟不上, 丢弃而不是等待
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    slot->ts_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    slot->level = static_cast<uint32_t>(level);
+    if (len > kSlotText) {
+        memcpy(slot->text, msg, kSlotText - 3);
+        memcpy(slot->text + kSlotText - 3, "...", 3);
+        len = kSlotText;
+    } else {
+        memcpy(slot->text, msg, len);
+    }
+    slot->len = len;
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    if (sleeping_.load(std::memory_order_relaxed)) {
+        wake_cv_.notify_one();
+    }
+}
+
+// 取出所有已就绪的记录并格式化, 返回条数
+size_t Logger::drain(std::string* out, std::string* echo) {
+    int echo_level = echo_level_.load(std::memory_order_relaxed);
+    size_t n = 0;
+    while (n < kSlots) {
+        Slot& slot = slots_[tail_ & (kSlots - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) {
+            break;
+        }
+
+        int64_t sec = slot.ts_ns / 1000000000ull;
+        if (sec != cached_sec_) {
+            time_t t = sec;
+            struct tm tm_now;
+            localtime_r(&t, &tm_now);
+            strftime(cached_ts_, sizeof(cached_ts_), "%Y-%m-%d %H:%M:%S", &tm_now);
+            cached_sec_ = sec;
+        }
+
+        size_t start = out->size();
+        out->append(cached_ts_);
+        out->append(" [");
+        out->append(kLevelNames[slot.level <= 4 ? slot.level : 4]);
+        out->append("] ");
+        out->append(slot.text, slot.len);
+        out->push_back('\n');
+        if (static_cast<int>(slot.level) >= echo_level) {
+            echo->append(*out, start, std::string::npos);
+        }
+
+        slot.seq.store(tail_ + kSlots, std::memory_order_release);
+        tail_++;
+        n++;
+    }
+    return n;
+}
+
+void Logger::writer_loop() {
+    std::string out;
+    std::string echo;
+    for (;;) {
+        bool stopping = !running_.load();
+        out.clear();
+        echo.clear();
+        size_t n = drain(&out, &echo);
+
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reported_dropped_) {
+            out += std::string(cached_sec_ >= 0 ? cached_ts_ : "") + " [WARNING] Logger dropped " +
+                   std::to_string(dropped - reported_dropped_) + " records\n";
+            reported_dropped_ = dropped;
+        }
+        if (!out.empty() && fd_ >= 0) {
+            write_all(fd_, out.data(), out.size());
+        }
+        if (!echo.empty()) {
+            write_all(STDOUT_FILENO, echo.data(), echo.size());
+        }
+        if (n > 0) {
+            continue;
+        }
+        if (stopping) {
+            return;
+        }
+
+        // 空闲时睡眠; 生产者看到sleeping_才唤醒, 漏掉的唤醒由超时兜底
+        std::unique_lock<std::mutex> lock(wake_lock_);
+        sleeping_.store(true);
+        wake_cv_.wait_for(lock, std::chrono::milliseconds(100));
+        sleeping_.store(false);
+    }
+}
+
+void Logger::emergency(const char* msg) {
+    int fd = fd_ >= 0 ? fd_ : STDERR_FILENO;
+    write_all(fd, msg, strlen(msg));
+}
@@ -0,0 +1,99 @@
+#ifndef TFSD_LOGGER_H
+#define TFSD_LOGGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum class LogLevel : int {
+    DEBUG = 0,
+    INFO,
+    WARNING,
+    ERROR,
+    CRITICAL,
+};
+
+// tfsd的异步日志
+// 调用方只把级别、时间戳和消息文本拷进固定大小的环形槽位 (无锁, 多生产者),
+// 后台写线程批量格式化时间并一次write写出; 环满时丢弃并计数, 从不阻塞调用方。
+class Logger {
+public:
+    static Logger& instance();
+
+    // 打开日志文件, 写线程由start()启动 (守护进程需在fork之后启动)
+    bool open(const std::string& path);
+    void start();
+    // 写完已入队的记录后停止写线程
+    void stop();
+
+    void set_level(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+    // 达到该级别的记录同时输出到标准输出
+    void set_echo_level(LogLevel level) { echo_level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+    bool enabled(LogLevel level) const {
+        return static_cast<int>(level) >= level_.load(std::memory_order_relaxed);
+    }
+
+    void log(LogLevel level, const char* msg, size_t len);
+    void log(LogLevel level, const std::string& msg) { log(level, msg.data(), msg.size()); }
+
+    // 直接写入日志文件, 不经过队列, 可在信号处理函数中调用
+    void emergency(const char* msg);
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    static bool parse_level(const std::string& name, LogLevel* level);
+
+private:
+    static const size_t kSlots = 4096;           // 必须是2的幂
+    static const size_t kSlotText = 480;
+
+    struct Slot {
+        std::atomic<uint64_t> seq;               // 槽位状态: == pos可写, == pos+1可读
+        uint64_t ts_ns;
+        uint32_t level;
+        uint32_t len;
+        char text[kSlotText];
+    };
+
+    Logger();
+    ~Logger();
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void writer_loop();
+    size_t drain(std::string* out, std::string* echo);
+
+    Slot* slots_;
+    alignas(64) std::atomic<uint64_t> head_{0};  // 生产者抢占的下一个位置
+    alignas(64) uint64_t tail_ = 0;              // 只由写线程访问
+    alignas(64) std::atomic<uint64_t> dropped_{0};
+
+    std::atomic<int> level_{static_cast<int>(LogLevel::INFO)};
+    std::atomic<int> echo_level_{static_cast<int>(LogLevel::ERROR)};
+
+    int fd_ = -1;
+    std::thread writer_;
+    std::atomic<bool> running_{false};
+    std::atomic<bool> sleeping_{false};
+    std::mutex wake_lock_;
+    std::condition_variable wake_cv_;
+
+    // 只由写线程访问: 时间戳按秒缓存
+    int64_t cached_sec_ = -1;
+    char cached_ts_[32];
+    uint64_t reported_dropped_ = 0;
+};
+
+// 先判断级别再求值消息表达式, 被过滤的日志不做任何格式化
+#define TFS_LOG(level, msg)                                              \
+    do {                                                                 \
+        if (Logger::instance().enabled(LogLevel::level)) {               \
+            Logger::instance().log(LogLevel::level, (msg));              \
+        }                                                                \
+    } while (0)
+
+#endif // TFSD_LOGGER_H
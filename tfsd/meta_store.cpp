@@ -0,0 +1,659 @@
+#include "meta_store.h"
+#include "crc32c.h"
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+const uint32_t kBatchMagic = 0x4d534654; // "TFSM"
+const uint32_t kLogMagic = 0x4c534654;   // "TFSL"
+const uint32_t kSnapMagic = 0x50534654;  // "TFSP"
+
+// 日志文件头; 没有文件头的旧日志直接从第一批开始, 代号为0
+struct LogHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t gen;
+};
+
+// 日志中每批操作的头部
+struct BatchHeader {
+    uint32_t magic;
+    uint32_t count;              // 本批操作数
+    uint32_t payload;            // 本批记录的总字节数
+    uint32_t crc;                // 记录的CRC32C, 旧日志为0 (不校验)
+};
+
+// 日志中的单条操作, 名字紧随其后 (日志本身按应用顺序排列)
+struct LogRecord {
+    uint64_t seq;
+    uint64_t ino;
+    uint64_t parent_ino;
+    uint64_t new_parent_ino;
+    uint64_t size;
+    uint32_t op;
+    uint32_t mode;
+    uint32_t attr_valid;
+    uint16_t name_len;
+    uint16_t new_name_len;
+};
+
+// 快照: 头部之后是nodes个SnapNode, 然后是entries个SnapEntry (名字紧随其后)
+struct SnapHeader {
+    uint32_t magic;
+    uint32_t crc;                // 头部之后全部内容的CRC32C
+    uint64_t gen;                // 快照之后应接的日志代号
+    uint64_t applied_seq;
+    uint64_t anomalies;
+    uint64_t nodes;
+    uint64_t entries;
+};
+
+struct SnapNode {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t parent;
+    uint64_t create_seq;
+    uint64_t trunc_seq;
+    uint32_t mode;
+    uint32_t nlink;
+};
+
+struct SnapEntry {
+    uint64_t dir;
+    uint64_t ino;
+    uint32_t name_len;
+    uint32_t reserved;
+};
+
+bool write_all(int fd, const char* data, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+// 读取文件从off开始的全部内容
+bool read_from(int fd, off_t off, std::string* out) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    out->assign(st.st_size > off ? st.st_size - off : 0, '\0');
+    size_t got = 0;
+    while (got < out->size()) {
+        ssize_t n = pread(fd, &(*out)[got], out->size() - got, off + got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+bool fsync_dir(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+} // namespace
+
+MetaStore::MetaStore(const std::string& data_dir)
+    : data_dir_(data_dir), log_path_(data_dir + "/meta.log"), snap_path_(data_dir + "/meta.snap") {
+    reset();
+}
+
+MetaStore::~MetaStore() {
+    if (log_fd_ >= 0) {
+        close(log_fd_);
+    }
+}
+
+void MetaStore::reset() {
+    nodes_.clear();
+    dirs_.clear();
+    dropped_.clear();
+    applied_seq_ = 0;
+    anomalies_ = 0;
+    // 根目录总是存在
+    nodes_[TFS_ROOT_INO] = Node{S_IFDIR | 0777, 0, 2, TFS_ROOT_INO};
+    dirs_[TFS_ROOT_INO];
+}
+
+bool MetaStore::open(std::string* err) {
+    if (prescanned_ && !same_log()) {
+        // 预扫描之后旧进程做了检查点, 已重放的位置不再对应当前日志
+        reset();
+        log_end_ = 0;
+        if (!load_snapshot(err)) {
+            return false;
+        }
+    } else if (!prescanned_ && !load_snapshot(err)) {
+        return false;
+    }
+    // 按显式偏移写入: 异步追加时多个批次可能同时在途
+    if (log_fd_ >= 0) {
+        close(log_fd_);
+    }
+    log_fd_ = ::open(log_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd_ < 0) {
+        *err = "open " + log_path_ + ": " + strerror(errno);
+        return false;
+    }
+    return replay(true, err);
+}
+
+bool MetaStore::prescan(std::string* err) {
+    reset();
+    log_end_ = 0;
+    if (!load_snapshot(err)) {
+        return false;
+    }
+    log_fd_ = ::open(log_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (log_fd_ < 0 && errno != ENOENT) {
+        *err = "open " + log_path_ + ": " + strerror(errno);
+        return false;
+    }
+    prescanned_ = true;
+    return log_fd_ < 0 || replay(false, err);
+}
+
+bool MetaStore::same_log() const {
+    SnapHeader sh = {};
+    int fd = ::open(snap_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        bool ok = pread(fd, &sh, sizeof(sh), 0) == static_cast<ssize_t>(sizeof(sh));
+        close(fd);
+        if (!ok) {
+            return false;
+        }
+    }
+    if (sh.gen != snap_gen_) {
+        return false;
+    }
+
+    fd = ::open(log_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return log_end_ == 0;
+    }
+    struct stat st;
+    LogHeader lh = {};
+    bool same = fstat(fd, &st) == 0 && st.st_size >= log_end_;
+    if (same && log_end_ > 0) {
+        same = pread(fd, &lh, sizeof(lh), 0) == static_cast<ssize_t>(sizeof(lh)) &&
+               (lh.magic == kLogMagic ? lh.gen == log_gen_ : log_gen_ == 0);
+    }
+    close(fd);
+    return same;
+}
+
+bool MetaStore::load_snapshot(std::string* err) {
+    snap_gen_ = 0;
+    int fd = ::open(snap_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        *err = "open " + snap_path_ + ": " + strerror(errno);
+        return false;
+    }
+    std::string data;
+    bool ok = read_from(fd, 0, &data);
+    int read_errno = errno;
+    close(fd);
+    if (!ok) {
+        *err = "read " + snap_path_ + ": " + strerror(read_errno);
+        return false;
+    }
+
+    // 快照只在完整写入后才改名生效, 校验失败说明文件已损坏, 日志中没有快照之前的操作, 不能继续
+    SnapHeader sh;
+    if (data.size() < sizeof(sh)) {
+        *err = snap_path_ + ": truncated";
+        return false;
+    }
+    memcpy(&sh, data.data(), sizeof(sh));
+    if (sh.magic != kSnapMagic ||
+        crc32c(0, data.data() + sizeof(sh), data.size() - sizeof(sh)) != sh.crc ||
+        sh.nodes > (data.size() - sizeof(sh)) / sizeof(SnapNode)) {
+        *err = snap_path_ + ": corrupt snapshot";
+        return false;
+    }
+
+    size_t pos = sizeof(sh);
+    for (uint64_t i = 0; i < sh.nodes; i++) {
+        SnapNode sn;
+        memcpy(&sn, &data[pos], sizeof(sn));
+        pos += sizeof(sn);
+        nodes_[sn.ino] = Node{sn.mode, sn.size, sn.nlink, sn.parent, sn.create_seq, sn.trunc_seq};
+        if (S_ISDIR(sn.mode)) {
+            dirs_[sn.ino];
+        }
+    }
+    for (uint64_t i = 0; i < sh.entries; i++) {
+        SnapEntry se;
+        if (pos + sizeof(se) > data.size()) {
+            *err = snap_path_ + ": corrupt snapshot";
+            return false;
+        }
+        memcpy(&se, &data[pos], sizeof(se));
+        pos += sizeof(se);
+        if (se.name_len > NAME_MAX || pos + se.name_len > data.size()) {
+            *err = snap_path_ + ": corrupt snapshot";
+            return false;
+        }
+        dirs_[se.dir][data.substr(pos, se.name_len)] = se.ino;
+        pos += se.name_len;
+    }
+    applied_seq_ = sh.applied_seq;
+    anomalies_ = sh.anomalies;
+    snap_gen_ = sh.gen;
+    return true;
+}
+
+// 从log_end_起重放日志中完整的批次
+// recover为true (open) 时截掉尾部不完整的批次 (崩溃时写了一半), 日志为空或已被快照包含时换成新日志;
+// 为false (prescan) 时旧进程还在追加, 只读, 停在第一个不完整的批次处, 交接后从那里继续
+bool MetaStore::replay(bool recover, std::string* err) {
+    const off_t base = log_end_;
+    std::string data;
+    if (!read_from(log_fd_, base, &data)) {
+        *err = "read " + log_path_ + ": " + strerror(errno);
+        return false;
+    }
+    replayed_ops_ = 0;
+
+    size_t pos = 0;
+    if (base == 0) {
+        LogHeader lh = {};
+        uint32_t magic = 0;
+        memcpy(&lh, data.data(), std::min(data.size(), sizeof(lh)));
+        memcpy(&magic, data.data(), std::min(data.size(), sizeof(magic)));
+        if (data.size() >= sizeof(lh) && lh.magic == kLogMagic) {
+            log_gen_ = lh.gen;
+            pos = sizeof(lh);
+        } else if (data.size() >= sizeof(magic) && magic == kBatchMagic) {
+            log_gen_ = 0;
+        } else {
+            return !recover || start_log(snap_gen_, err);
+        }
+        if (log_gen_ > snap_gen_) {
+            *err = log_path_ + ": log generation " + std::to_string(log_gen_) + " is newer than the snapshot";
+            return false;
+        }
+        if (log_gen_ < snap_gen_) {
+            // 检查点写好快照、换日志之前崩溃: 日志中的操作都已在快照里
+            return !recover || start_log(snap_gen_, err);
+        }
+    }
+
+    while (pos + sizeof(BatchHeader) <= data.size()) {
+        BatchHeader hdr;
+        memcpy(&hdr, &data[pos], sizeof(hdr));
+        if (hdr.magic != kBatchMagic || pos + sizeof(hdr) + hdr.payload > data.size()) {
+            break;
+        }
+        // 与在途的写入并发读取时可能读到只写了一部分的批次
+        if (hdr.crc != 0 && crc32c(0, &data[pos + sizeof(hdr)], hdr.payload) != hdr.crc) {
+            break;
+        }
+
+        size_t rec = pos + sizeof(hdr);
+        size_t end = rec + hdr.payload;
+        for (uint32_t i = 0; i < hdr.count && rec + sizeof(LogRecord) <= end; i++) {
+            LogRecord r;
+            memcpy(&r, &data[rec], sizeof(r));
+            rec += sizeof(r);
+            if (rec + r.name_len + r.new_name_len > end) {
+                break;
+            }
+
+            tfs_meta_op op = {};
+            op.seq = r.seq;
+            op.op = r.op;
+            op.mode = r.mode;
+            op.ino = r.ino;
+            op.parent_ino = r.parent_ino;
+            op.new_parent_ino = r.new_parent_ino;
+            op.size = r.size;
+            op.attr_valid = r.attr_valid;
+            op.name_len = std::min<uint32_t>(r.name_len, NAME_MAX);
+            op.new_name_len = std::min<uint32_t>(r.new_name_len, NAME_MAX);
+            memcpy(op.name, &data[rec], op.name_len);
+            rec += r.name_len;
+            memcpy(op.new_name, &data[rec], op.new_name_len);
+            rec += r.new_name_len;
+
+            apply_one(op);
+            replayed_ops_++;
+        }
+        pos += sizeof(hdr) + hdr.payload;
+    }
+
+    if (recover && pos < data.size() && ftruncate(log_fd_, base + pos) != 0) {
+        *err = "truncate " + log_path_ + ": " + strerror(errno);
+        return false;
+    }
+    log_end_ = base + pos;
+    // 重放期间删除的inode已不在副本中, 不需要再通知调用方
+    dropped_.clear();
+    return true;
+}
+
+bool MetaStore::start_log(uint64_t gen, std::string* err) {
+    LogHeader lh = {kLogMagic, 1, gen};
+    if (ftruncate(log_fd_, 0) != 0 ||
+        !write_all(log_fd_, reinterpret_cast<const char*>(&lh), sizeof(lh), 0) || fdatasync(log_fd_) != 0) {
+        *err = "reset " + log_path_ + ": " + strerror(errno);
+        return false;
+    }
+    log_gen_ = gen;
+    log_end_ = sizeof(lh);
+    return true;
+}
+
+bool MetaStore::checkpoint_due() const {
+    return checkpoint_bytes_ > 0 && static_cast<uint64_t>(log_end_) >= checkpoint_bytes_ &&
+           appends_inflight_ == 0;
+}
+
+// 先让快照生效再清空日志: 两步之间崩溃时旧日志的代号落后于快照, 打开时整个跳过;
+// 在途的异步追加会写到清空之后的位置上, 因此只在没有在途追加时进行
+bool MetaStore::checkpoint(std::string* err) {
+    std::string buf(sizeof(SnapHeader), '\0');
+    SnapHeader sh = {};
+    sh.magic = kSnapMagic;
+    sh.gen = log_gen_ + 1;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buf.reserve(sizeof(SnapHeader) + nodes_.size() * (sizeof(SnapNode) + sizeof(SnapEntry) + 16));
+        for (const auto& n : nodes_) {
+            SnapNode sn = {n.first, n.second.size, n.second.parent, n.second.create_seq, n.second.trunc_seq,
+                           n.second.mode, n.second.nlink};
+            buf.append(reinterpret_cast<const char*>(&sn), sizeof(sn));
+        }
+        for (const auto& dir : dirs_) {
+            for (const auto& child : dir.second) {
+                SnapEntry se = {dir.first, child.second, static_cast<uint32_t>(child.first.size()), 0};
+                buf.append(reinterpret_cast<const char*>(&se), sizeof(se));
+                buf.append(child.first);
+                sh.entries++;
+            }
+        }
+        sh.nodes = nodes_.size();
+        sh.applied_seq = applied_seq_;
+        sh.anomalies = anomalies_;
+    }
+    sh.crc = crc32c(0, buf.data() + sizeof(sh), buf.size() - sizeof(sh));
+    memcpy(&buf[0], &sh, sizeof(sh));
+
+    std::string tmp = snap_path_ + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && write_all(fd, buf.data(), buf.size(), 0) && fdatasync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok || rename(tmp.c_str(), snap_path_.c_str()) != 0 || !fsync_dir(data_dir_)) {
+        *err = "write " + snap_path_ + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    snap_gen_ = sh.gen;
+
+    // 旧日志的内容都已在快照里, 原地清空即可, 中途崩溃留下的空日志或旧代号日志在打开时被换掉
+    if (!start_log(sh.gen, err)) {
+        return false;
+    }
+    checkpoints_++;
+    return true;
+}
+
+void MetaStore::encode(const tfs_meta_op& op, std::string* buf) {
+    LogRecord r = {};
+    r.seq = op.seq;
+    r.ino = op.ino;
+    r.parent_ino = op.parent_ino;
+    r.new_parent_ino = op.new_parent_ino;
+    r.size = op.size;
+    r.op = op.op;
+    r.mode = op.mode;
+    r.attr_valid = op.attr_valid;
+    r.name_len = std::min<uint32_t>(op.name_len, NAME_MAX);
+    r.new_name_len = std::min<uint32_t>(op.new_name_len, NAME_MAX);
+
+    buf->append(reinterpret_cast<const char*>(&r), sizeof(r));
+    buf->append(op.name, r.name_len);
+    buf->append(op.new_name, r.new_name_len);
+}
+
+// 按内核分配的序号顺序逐条应用: 同一批内可能有删除后又复用的inode号, 不能重排
+bool MetaStore::apply_batch(const tfs_meta_op* ops, size_t n, std::string* err) {
+    std::string buf;
+    buf.resize(sizeof(BatchHeader));
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < n; i++) {
+            apply_one(ops[i]);
+            encode(ops[i], &buf);
+        }
+    }
+
+    BatchHeader hdr = {kBatchMagic, static_cast<uint32_t>(n),
+                       static_cast<uint32_t>(buf.size() - sizeof(BatchHeader)),
+                       crc32c(0, buf.data() + sizeof(BatchHeader), buf.size() - sizeof(BatchHeader))};
+    memcpy(&buf[0], &hdr, sizeof(hdr));
+
+    off_t off = log_end_;
+    log_end_ += buf.size();
+
+    // 整批只写一次日志; 有事件循环时写入和fdatasync链接提交, 由循环收割结果
+    // 崩溃时在途批次可能留下空洞, 重放在第一个无效批次处截断
+    if (loop_) {
+        auto data = std::make_shared<std::string>(std::move(buf));
+        size_t len = data->size();
+        bool ok = loop_->write(log_fd_, data->data(), len, off,
+                               [this, data, len](int res) {
+                                   if (res < 0 || static_cast<size_t>(res) != len) {
+                                       log_failures_++;
+                                   }
+                               }, EventLoop::kLinkNext) &&
+                  loop_->fsync(log_fd_, true, [this, data](int res) {
+                      // 写入失败时fsync以-ECANCELED完成, 失败已在写入回调中计数
+                      if (res < 0 && res != -ECANCELED) {
+                          log_failures_++;
+                      }
+                      appends_inflight_--;
+                  });
+        if (!ok) {
+            *err = "queue append " + log_path_;
+            return false;
+        }
+        appends_inflight_++;
+        return true;
+    }
+
+    if (!write_all(log_fd_, buf.data(), buf.size(), off)) {
+        *err = "append " + log_path_ + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void MetaStore::drop_link(uint64_t ino, bool is_dir) {
+    auto it = nodes_.find(ino);
+    if (it == nodes_.end()) {
+        anomalies_++;
+        return;
+    }
+    if (is_dir || it->second.nlink <= 1) {
+        nodes_.erase(it);
+        dropped_.push_back(ino);
+        // 非空目录只在卸载时出现 (内核删除挂载根目录), 其下的文件一起删除
+        std::vector<uint64_t> pending{ino};
+        while (!pending.empty()) {
+            auto dir = dirs_.find(pending.back());
+            pending.pop_back();
+            if (dir == dirs_.end()) {
+                continue;
+            }
+            for (const auto& child : dir->second) {
+                if (nodes_.erase(child.second) > 0) {
+                    dropped_.push_back(child.second);
+                    pending.push_back(child.second);
+                }
+            }
+            dirs_.erase(dir);
+        }
+    } else {
+        it->second.nlink--;
+    }
+}
+
+void MetaStore::apply_one(const tfs_meta_op& op) {
+    std::string name(op.name, std::min<uint32_t>(op.name_len, NAME_MAX));
+
+    switch (op.op) {
+    case TFS_META_CREATE:
+    case TFS_META_MKDIR: {
+        bool is_dir = op.op == TFS_META_MKDIR;
+        // 复用的inode号: 调用方按create丢弃残留数据, 之前的删除不能再作用到新文件上
+        dropped_.erase(std::remove(dropped_.begin(), dropped_.end(), op.ino), dropped_.end());
+        nodes_[op.ino] = Node{op.mode, 0, is_dir ? 2u : 1u, op.parent_ino, op.seq, 0};
+        dirs_[op.parent_ino][name] = op.ino;
+        if (is_dir) {
+            dirs_[op.ino];
+        }
+        break;
+    }
+    case TFS_META_LINK: {
+        auto it = nodes_.find(op.ino);
+        if (it == nodes_.end()) {
+            anomalies_++;
+            break;
+        }
+        it->second.nlink++;
+        dirs_[op.parent_ino][name] = op.ino;
+        break;
+    }
+    case TFS_META_UNLINK:
+    case TFS_META_RMDIR:
+        if (dirs_[op.parent_ino].erase(name) == 0) {
+            anomalies_++;
+        }
+        drop_link(op.ino, op.op == TFS_META_RMDIR);
+        break;
+    case TFS_META_RENAME: {
+        std::string new_name(op.new_name, std::min<uint32_t>(op.new_name_len, NAME_MAX));
+        auto& target_dir = dirs_[op.new_parent_ino];
+        auto target = target_dir.find(new_name);
+        if (target != target_dir.end() && target->second != op.ino) {
+            drop_link(target->second, dirs_.count(target->second) > 0);
+        }
+        if (dirs_[op.parent_ino].erase(name) == 0) {
+            anomalies_++;
+        }
+        dirs_[op.new_parent_ino][new_name] = op.ino;
+        auto it = nodes_.find(op.ino);
+        if (it != nodes_.end()) {
+            it->second.parent = op.new_parent_ino;
+        }
+        break;
+    }
+    case TFS_META_SETATTR: {
+        auto it = nodes_.find(op.ino);
+        if (it == nodes_.end()) {
+            anomalies_++;
+            break;
+        }
+        it->second.mode = op.mode;
+        if (op.attr_valid & TFS_ATTR_SIZE) {
+            it->second.size = op.size;
+            it->second.trunc_seq = op.seq;
+        }
+        break;
+    }
+    default:
+        anomalies_++;
+        break;
+    }
+
+    applied_seq_ = std::max(applied_seq_, op.seq);
+}
+
+bool MetaStore::lookup(uint64_t ino, Node* out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = nodes_.find(ino);
+    if (it == nodes_.end()) {
+        return false;
+    }
+    *out = it->second;
+    return true;
+}
+
+bool MetaStore::resolve(uint64_t root, const std::string& path, uint64_t* ino) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t cur = root;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        if (end > pos) {
+            auto dir = dirs_.find(cur);
+            if (dir == dirs_.end()) {
+                return false;
+            }
+            auto child = dir->second.find(path.substr(pos, end - pos));
+            if (child == dir->second.end()) {
+                return false;
+            }
+            cur = child->second;
+        }
+        pos = end + 1;
+    }
+    *ino = cur;
+    return true;
+}
+
+size_t MetaStore::node_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return nodes_.size();
+}
+
+uint64_t MetaStore::applied_seq() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return applied_seq_;
+}
+
+void MetaStore::take_dropped(std::vector<uint64_t>* out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out->swap(dropped_);
+    dropped_.clear();
+}
+
+uint64_t MetaStore::anomalies() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return anomalies_;
+}
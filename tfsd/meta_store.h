@@ -0,0 +1,107 @@
+#ifndef TFSD_META_STORE_H
+#define TFSD_META_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tfs_proto.h"
+
+class EventLoop;
+
+// tfsd侧的命名空间副本
+// 内核通过TFS_GET_META_BATCH批量转发create/mkdir/unlink/rmdir/rename/setattr,
+// 这里按序号顺序应用, 每批操作只追加一次元数据日志, 启动时加载快照并重放日志恢复。
+// 日志超过阈值后做检查点: 整个命名空间写入快照 (meta.snap), 换用一个代号加一的空日志,
+// 重放量因此有上限。每个挂载点的根目录是TFS_ROOT_INO下的一个目录, 卸载时连同其下的文件一起删除。
+class MetaStore {
+public:
+    struct Node {
+        uint32_t mode = 0;
+        uint64_t size = 0;
+        uint32_t nlink = 0;
+        uint64_t parent = 0;     // 最近一次链接所在的父目录
+        uint64_t create_seq = 0; // 创建该inode的操作序号, 区分复用的inode号
+        uint64_t trunc_seq = 0;  // 最近一次截断的操作序号
+    };
+
+    explicit MetaStore(const std::string& data_dir);
+    ~MetaStore();
+
+    MetaStore(const MetaStore&) = delete;
+    MetaStore& operator=(const MetaStore&) = delete;
+
+    // 加载快照并重放元数据日志; prescan之后只重放预扫描之后追加的批次
+    bool open(std::string* err);
+
+    // 热升级: 旧进程还在追加日志时预先加载快照、重放已完整写入的批次, 不修改任何文件。
+    // 交接之后的open只补上之后的批次; 期间旧进程做过检查点 (日志换代) 时open退回完整加载
+    bool prescan(std::string* err);
+
+    // 日志超过bytes后, 在没有在途追加时做检查点; 0表示不做
+    void set_checkpoint_bytes(uint64_t bytes) { checkpoint_bytes_ = bytes; }
+    bool checkpoint_due() const;
+    // 写快照并换用新日志, 在事件循环所在线程同步完成, 耗时与命名空间大小成正比
+    bool checkpoint(std::string* err);
+
+    // 设置后日志追加和fdatasync交给事件循环异步完成, 不再阻塞调用方
+    // 只能在事件循环所在线程调用apply_batch
+    void set_event_loop(EventLoop* loop) { loop_ = loop; }
+
+    // 按序号顺序应用一批操作并追加到日志
+    bool apply_batch(const tfs_meta_op* ops, size_t n, std::string* err);
+
+    bool lookup(uint64_t ino, Node* out) const;
+    // 相对root目录的路径 ("/"分隔, 空路径即root本身) 对应的inode
+    bool resolve(uint64_t root, const std::string& path, uint64_t* ino) const;
+    size_t node_count() const;
+    uint64_t applied_seq() const;
+    uint64_t anomalies() const;
+    // 取出自上次调用以来被删除的inode
+    void take_dropped(std::vector<uint64_t>* out);
+    // 异步追加/落盘失败的批次数
+    uint64_t log_failures() const { return log_failures_.load(); }
+    uint64_t checkpoints() const { return checkpoints_; }
+    // 最近一次open或prescan从日志重放的操作数, 不含快照中的
+    uint64_t replayed_ops() const { return replayed_ops_; }
+
+private:
+    void apply_one(const tfs_meta_op& op);
+    void drop_link(uint64_t ino, bool is_dir);
+    static void encode(const tfs_meta_op& op, std::string* buf);
+    // 清空命名空间, 只留根目录
+    void reset();
+    bool load_snapshot(std::string* err);
+    bool replay(bool recover, std::string* err);
+    // 清空日志, 写入代号为gen的文件头
+    bool start_log(uint64_t gen, std::string* err);
+    // 快照和日志仍是预扫描时的那一代, 日志也没有短于已重放的位置
+    bool same_log() const;
+
+    std::string data_dir_;
+    std::string log_path_;
+    std::string snap_path_;
+    int log_fd_ = -1;
+    off_t log_end_ = 0;            // 下一批写入的位置, 也是已重放到的位置
+    uint64_t log_gen_ = 0;         // 日志的代号, 每次检查点加一
+    uint64_t snap_gen_ = 0;        // 快照之后应接的日志代号, 没有快照时为0
+    bool prescanned_ = false;
+    EventLoop* loop_ = nullptr;
+    std::atomic<uint64_t> log_failures_{0};
+    unsigned appends_inflight_ = 0; // 已提交未落盘的异步追加
+    uint64_t checkpoint_bytes_ = 0;
+    uint64_t checkpoints_ = 0;
+    uint64_t replayed_ops_ = 0;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, Node> nodes_;
+    std::unordered_map<uint64_t, std::unordered_map<std::string, uint64_t>> dirs_;
+    uint64_t applied_seq_ = 0;
+    uint64_t anomalies_ = 0;      // 与本地副本不一致的操作数
+    std::vector<uint64_t> dropped_;
+};
+
+#endif // TFSD_META_STORE_H
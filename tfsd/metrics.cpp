@@ -0,0 +1,138 @@
+#include "metrics.h"
+
+#include <cstdio>
+#include <ctime>
+
+namespace {
+
+// 每个线程固定使用一个条带
+size_t stripe_index(size_t stripes) {
+    static std::atomic<size_t> next{0};
+    thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed);
+    return index % stripes;
+}
+
+} // namespace
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+LatencyHistogram::LatencyHistogram() {
+    for (Stripe& s : stripes_) {
+        for (auto& c : s.counts) {
+            c.store(0, std::memory_order_relaxed);
+        }
+        s.sum.store(0, std::memory_order_relaxed);
+        s.max.store(0, std::memory_order_relaxed);
+    }
+}
+
+// 小于16的值各占一个桶; 否则按最高位所在区间和其后4位定位
+size_t LatencyHistogram::bucket_of(uint64_t value) {
+    const uint64_t sub = 1ull << kSubBits;
+    if (value < sub) {
+        return value;
+    }
+    if (value >= (1ull << kMaxBits)) {
+        value = (1ull << kMaxBits) - 1;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - kSubBits;
+    return (static_cast<size_t>(shift + 1) << kSubBits) + ((value >> shift) & (sub - 1));
+}
+
+uint64_t LatencyHistogram::bucket_upper(size_t index) {
+    const uint64_t sub = 1ull << kSubBits;
+    if (index < sub) {
+        return index;
+    }
+    int shift = static_cast<int>(index >> kSubBits) - 1;
+    uint64_t lower = (sub + (index & (sub - 1))) << shift;
+    return lower + (1ull << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    Stripe& s = stripes_[stripe_index(kStripes)];
+    s.counts[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t cur = s.max.load(std::memory_order_relaxed);
+    while (ns > cur && !s.max.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {
+    }
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+    Snapshot snap;
+    snap.counts.assign(kBuckets, 0);
+    for (const Stripe& s : stripes_) {
+        for (size_t i = 0; i < kBuckets; i++) {
+            uint64_t c = s.counts[i].load(std::memory_order_relaxed);
+            snap.counts[i] += c;
+            snap.count += c;
+        }
+        snap.sum += s.sum.load(std::memory_order_relaxed);
+        uint64_t m = s.max.load(std::memory_order_relaxed);
+        if (m > snap.max) {
+            snap.max = m;
+        }
+    }
+    return snap;
+}
+
+uint64_t LatencyHistogram::Snapshot::quantile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count) + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t upper = bucket_upper(i);
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void PromWriter::header(const std::string& name, const char* type, const std::string& help) {
+    out_ += "# HELP " + name + " " + help + "\n";
+    out_ += "# TYPE " + name + " " + type + "\n";
+}
+
+void PromWriter::value(const std::string& name, const std::string& labels, double v) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.9g", v);
+    out_ += name;
+    if (!labels.empty()) {
+        out_ += "{" + labels + "}";
+    }
+    out_ += " ";
+    out_ += buf;
+    out_ += "\n";
+}
+
+void PromWriter::value(const std::string& name, const std::string& labels, uint64_t v) {
+    out_ += name;
+    if (!labels.empty()) {
+        out_ += "{" + labels + "}";
+    }
+    out_ += " " + std::to_string(v) + "\n";
+}
+
+void PromWriter::summary(const std::string& name, const std::string& labels,
+                         const LatencyHistogram::Snapshot& snap) {
+    static const char* const kQuantiles[] = {"0.5", "0.9", "0.99", "0.999", "1"};
+    static const double kValues[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    for (size_t i = 0; i < sizeof(kValues) / sizeof(kValues[0]); i++) {
+        value(name, prefix + "quantile=\"" + kQuantiles[i] + "\"", snap.quantile(kValues[i]) / 1e9);
+    }
+    value(name + "_sum", labels, snap.sum / 1e9);
+    value(name + "_count", labels, snap.count);
+}
@@ -0,0 +1,71 @@
+#ifndef TFSD_METRICS_H
+#define TFSD_METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// 单调时钟, 纳秒
+uint64_t monotonic_ns();
+
+// 无锁延迟直方图, HDR风格的对数-线性分桶:
+// 每个2的幂区间再等分为16个桶, 任意值的相对误差不超过1/16, 范围1ns到约36分钟。
+// 记录只是几次relaxed原子加, 按线程分条带以减少多个worker之间的缓存行争用;
+// 读取时合并所有条带, 与并发记录之间不保证原子快照。
+class LatencyHistogram {
+public:
+    static const int kSubBits = 4;
+    static const int kMaxBits = 41;
+    static const size_t kBuckets = (kMaxBits - kSubBits + 1) << kSubBits;
+
+    struct Snapshot {
+        std::vector<uint64_t> counts;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        // q取0到1, 返回所在桶的上界 (不超过max)
+        uint64_t quantile(double q) const;
+    };
+
+    LatencyHistogram();
+
+    void record(uint64_t ns);
+    Snapshot snapshot() const;
+
+    static size_t bucket_of(uint64_t value);
+    static uint64_t bucket_upper(size_t index);
+
+private:
+    static const size_t kStripes = 4;
+
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> counts[kBuckets];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+
+    Stripe stripes_[kStripes];
+};
+
+// Prometheus文本格式的输出
+class PromWriter {
+public:
+    // 每个指标族输出一次
+    void header(const std::string& name, const char* type, const std::string& help);
+    // labels为空或形如 stage="map"
+    void value(const std::string& name, const std::string& labels, double v);
+    void value(const std::string& name, const std::string& labels, uint64_t v);
+    // 以summary形式输出分位数、_sum和_count, 纳秒换算为秒
+    void summary(const std::string& name, const std::string& labels,
+                 const LatencyHistogram::Snapshot& snap);
+
+    const std::string& text() const { return out_; }
+
+private:
+    std::string out_;
+};
+
+#endif // TFSD_METRICS_H
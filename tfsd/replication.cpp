@@ -0,0 +1,836 @@
+#include "replication.h"
+
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
+#include "logger.h"
+#include "storage_engine.h"
+#include "work_pool.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+namespace {
+
+// 单帧负载上限, 超过视为协议错误 (数据帧不超过一个流式窗口)
+const uint32_t kMaxPayload = 256u << 20;
+
+// 拆分host:port, 没有冒号时整个字符串是端口; [v6地址]:port去掉方括号
+bool split_addr(const std::string& addr, std::string* host, std::string* port) {
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) {
+        host->clear();
+        *port = addr;
+    } else {
+        *host = addr.substr(0, colon);
+        *port = addr.substr(colon + 1);
+        if (host->size() >= 2 && host->front() == '[' && host->back() == ']') {
+            *host = host->substr(1, host->size() - 2);
+        }
+    }
+    return !port->empty();
+}
+
+bool send_all(int fd, const void* buf, size_t len, int flags) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = ::send(fd, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool read_all(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int connect_peer(const std::string& addr, unsigned timeout_ms, std::string* err) {
+    std::string host, port;
+    if (!split_addr(addr, &host, &port) || host.empty()) {
+        *err = "invalid peer address";
+        return -1;
+    }
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = nullptr;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) {
+        *err = gai_strerror(rc);
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        // 连接和发送都带超时 (发送阻塞说明对端不再读取, 由调用方判定失联)
+        struct timeval tv = {static_cast<time_t>(timeout_ms / 1000),
+                             static_cast<suseconds_t>(timeout_ms % 1000 * 1000)};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        *err = strerror(errno);
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+} // namespace
+
+// 一个对端连接; fd只在持有send_lock时关闭或替换, 其余状态受Replicator::mutex_保护
+struct Replicator::Peer {
+    std::string addr;
+    std::mutex send_lock;
+    std::thread receiver;
+    int fd = -1;
+    bool up = false;
+    bool connected_before = false;
+    bool warned = false;
+    bool zerocopy = false;
+    uint64_t epoch = 0;              // 每次连接或断开加一, 旧连接的确认和完成通知据此作废
+    uint64_t last_attempt_ns = 0;
+    unsigned inflight = 0;           // 已发送未确认的数据帧
+    uint32_t zc_next = 0;            // 本连接下一次零拷贝发送的编号 (内核按sendmsg调用计数)
+    uint32_t zc_done = 0;            // 已完成的零拷贝发送: 编号小于此值的都已完成
+    std::unordered_map<uint64_t, Ticket> waiting;
+};
+
+struct Replicator::Pending {
+    struct ZeroCopy {
+        size_t peer;
+        uint64_t epoch;
+        uint32_t seq;                // 需要zc_done达到的值
+    };
+
+    uint64_t id = 0;
+    unsigned sent = 0;
+    unsigned acks = 0;
+    unsigned failed = 0;
+    int status = 0;
+    std::vector<ZeroCopy> zc;
+};
+
+namespace {
+
+uint64_t now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+} // namespace
+
+Replicator::Replicator(const Options& opts) : opts_(opts) {
+    for (const std::string& addr : opts_.peers) {
+        std::unique_ptr<Peer> peer(new Peer);
+        peer->addr = addr;
+        peers_.push_back(std::move(peer));
+    }
+}
+
+Replicator::~Replicator() {
+    stop();
+}
+
+void Replicator::start() {
+    for (auto& peer : peers_) {
+        std::lock_guard<std::mutex> guard(peer->send_lock);
+        ensure_connected(*peer);
+    }
+}
+
+void Replicator::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        for (auto& peer : peers_) {
+            disconnect(*peer);
+        }
+        cv_.notify_all();
+    }
+    for (auto& peer : peers_) {
+        std::lock_guard<std::mutex> guard(peer->send_lock);
+        if (peer->receiver.joinable()) {
+            peer->receiver.join();
+        }
+        if (peer->fd >= 0) {
+            ::close(peer->fd);
+            peer->fd = -1;
+        }
+    }
+}
+
+bool Replicator::ensure_connected(Peer& peer) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (peer.up) {
+            return true;
+        }
+        // 断线的对端最多每秒重连一次, 期间的数据直接算作该对端失败
+        uint64_t now = now_ns();
+        if (stopping_ || (peer.last_attempt_ns != 0 && now - peer.last_attempt_ns < 1000000000ull)) {
+            return false;
+        }
+        peer.last_attempt_ns = now;
+    }
+
+    // 旧连接的接收线程在断开时已被唤醒, 回收后才能关闭描述符
+    if (peer.receiver.joinable()) {
+        peer.receiver.join();
+    }
+    if (peer.fd >= 0) {
+        ::close(peer.fd);
+        peer.fd = -1;
+    }
+
+    std::string err;
+    int fd = connect_peer(peer.addr, opts_.timeout_ms, &err);
+    if (fd < 0) {
+        if (!peer.warned) {
+            TFS_LOG(WARNING, "Replica " + peer.addr + " unreachable: " + err);
+            peer.warned = true;
+        }
+        return false;
+    }
+    set_nodelay(fd);
+    int one = 1;
+    bool zerocopy = opts_.zerocopy_min > 0 && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+
+    uint64_t epoch;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        peer.fd = fd;
+        peer.up = true;
+        peer.epoch++;
+        peer.zc_next = 0;
+        peer.zc_done = 0;
+        peer.zerocopy = zerocopy;
+        if (peer.connected_before) {
+            reconnects_++;
+        }
+        peer.connected_before = true;
+        peer.warned = false;
+        epoch = peer.epoch;
+    }
+    peer.receiver = std::thread(&Replicator::receive_loop, this, &peer, fd, epoch);
+    TFS_LOG(INFO, "Connected to replica " + peer.addr + (zerocopy ? " (zerocopy)" : ""));
+    return true;
+}
+
+void Replicator::disconnect(Peer& peer) {
+    if (!peer.up) {
+        return;
+    }
+    peer.up = false;
+    peer.epoch++;
+    for (auto& w : peer.waiting) {
+        w.second->failed++;
+        if (w.second->status == 0) {
+            w.second->status = -EIO;
+        }
+    }
+    peer.waiting.clear();
+    peer.inflight = 0;
+    // AF_UNSPEC的connect中止TCP连接并丢弃发送队列: 之后不再等待零拷贝完成,
+    // 缓冲区随即可能被改写, 不能让排队中的旧数据再发出去。描述符本身留给持有send_lock的一方关闭
+    struct sockaddr unspec = {};
+    unspec.sa_family = AF_UNSPEC;
+    connect(peer.fd, &unspec, sizeof(unspec));
+    shutdown(peer.fd, SHUT_RDWR);
+    cv_.notify_all();
+}
+
+void Replicator::mark_down(Peer& peer) {
+    if (!peer.up) {
+        return;
+    }
+    disconnect(peer);
+    failures_++;
+    TFS_LOG(WARNING, "Replica " + peer.addr + " marked down");
+}
+
+bool Replicator::send_frame(Peer& peer, const ReplicaHeader& hdr, const char* data, size_t len,
+                            uint32_t* zc_last, bool* used_zc) {
+    // 帧头在栈上, 必须拷贝发送; 只有负载走零拷贝
+    if (!send_all(peer.fd, &hdr, sizeof(hdr), len > 0 ? MSG_MORE : 0)) {
+        return false;
+    }
+    bool zc;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        zc = peer.zerocopy && len >= opts_.zerocopy_min;
+    }
+    while (len > 0) {
+        ssize_t n = ::send(peer.fd, data, len, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (zc && (errno == EFAULT || errno == ENOBUFS)) {
+                // EFAULT: 页无法固定 (内核按页帧映射的写者匿名页), 该连接改为拷贝发送
+                // ENOBUFS: 超出optmem限制, 仅本次拷贝发送
+                if (errno == EFAULT) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    peer.zerocopy = false;
+                    TFS_LOG(WARNING, "Zerocopy unsupported for this mapping, copying to replica " + peer.addr);
+                }
+                zc = false;
+                continue;
+            }
+            return false;
+        }
+        if (zc) {
+            // 部分发送也占用一个编号
+            std::lock_guard<std::mutex> lock(mutex_);
+            *zc_last = ++peer.zc_next;
+            *used_zc = true;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+Replicator::Ticket Replicator::send(uint64_t ino, uint64_t offset, const char* data, size_t len,
+                                    uint64_t meta_seq) {
+    if (peers_.empty()) {
+        return nullptr;
+    }
+    Ticket p = std::make_shared<Pending>();
+    p->id = next_id_++;
+
+    ReplicaHeader hdr = {};
+    hdr.magic = kReplicaMagic;
+    hdr.type = kReplicaData;
+    hdr.id = p->id;
+    hdr.ino = ino;
+    hdr.offset = offset;
+    hdr.meta_seq = meta_seq;
+    hdr.len = static_cast<uint32_t>(len);
+
+    const auto timeout = std::chrono::milliseconds(opts_.timeout_ms);
+    for (size_t i = 0; i < peers_.size(); i++) {
+        Peer& peer = *peers_[i];
+        std::lock_guard<std::mutex> guard(peer.send_lock);
+        if (!ensure_connected(peer)) {
+            continue;
+        }
+
+        uint64_t epoch;
+        {
+            // 每个对端最多window个未确认的帧, 慢对端在这里反压发送方
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!cv_.wait_for(lock, timeout, [&] {
+                    return stopping_ || !peer.up || peer.inflight < opts_.window;
+                })) {
+                mark_down(peer);
+            }
+            if (stopping_ || !peer.up) {
+                continue;
+            }
+            peer.inflight++;
+            peer.waiting[p->id] = p;
+            p->sent++;
+            epoch = peer.epoch;
+        }
+
+        uint32_t zc_last = 0;
+        bool used_zc = false;
+        bool ok = send_frame(peer, hdr, data, len, &zc_last, &used_zc);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!ok) {
+            if (peer.epoch == epoch) {
+                TFS_LOG(WARNING, "Send to replica " + peer.addr + " failed: " + std::string(strerror(errno)));
+                mark_down(peer);
+            }
+            continue;
+        }
+        if (used_zc) {
+            p->zc.push_back({i, epoch, zc_last});
+            zerocopy_sends_++;
+        }
+    }
+    frames_++;
+    bytes_ += len;
+    return p;
+}
+
+bool Replicator::settled(const Pending& p) const {
+    for (const Pending::ZeroCopy& z : p.zc) {
+        const Peer& peer = *peers_[z.peer];
+        if (peer.epoch == z.epoch && static_cast<int32_t>(peer.zc_done - z.seq) < 0) {
+            return false;
+        }
+    }
+    unsigned outstanding = p.sent - p.acks - p.failed;
+    return p.acks >= opts_.quorum || p.acks + outstanding < opts_.quorum;
+}
+
+int Replicator::wait(const Ticket& p) {
+    if (!p) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(opts_.timeout_ms);
+    if (!cv_.wait_until(lock, deadline, [&] { return stopping_ || settled(*p); })) {
+        // 超时: 还没确认或零拷贝还没发完的对端判为失联
+        for (size_t i = 0; i < peers_.size(); i++) {
+            Peer& peer = *peers_[i];
+            bool lagging = peer.waiting.count(p->id) != 0;
+            for (const Pending::ZeroCopy& z : p->zc) {
+                if (z.peer == i && peer.epoch == z.epoch && static_cast<int32_t>(peer.zc_done - z.seq) < 0) {
+                    lagging = true;
+                }
+            }
+            if (lagging) {
+                mark_down(peer);
+            }
+        }
+    }
+    if (p->acks >= opts_.quorum) {
+        return 0;
+    }
+    return p->status != 0 ? p->status : -EIO;
+}
+
+void Replicator::send_meta(const tfs_meta_op* ops, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    ReplicaHeader hdr = {};
+    hdr.magic = kReplicaMagic;
+    hdr.type = kReplicaMeta;
+    hdr.id = next_id_++;
+    hdr.len = static_cast<uint32_t>(n * sizeof(tfs_meta_op));
+    hdr.count = static_cast<uint32_t>(n);
+
+    for (auto& p : peers_) {
+        Peer& peer = *p;
+        std::lock_guard<std::mutex> guard(peer.send_lock);
+        if (!ensure_connected(peer)) {
+            continue;
+        }
+        uint64_t epoch;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            epoch = peer.epoch;
+        }
+        if (!send_all(peer.fd, &hdr, sizeof(hdr), MSG_MORE) || !send_all(peer.fd, ops, hdr.len, 0)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (peer.epoch == epoch) {
+                mark_down(peer);
+            }
+        }
+    }
+}
+
+void Replicator::receive_loop(Peer* peer, int fd, uint64_t epoch) {
+    char buf[sizeof(ReplicaAck) * 64];
+    size_t have = 0;
+
+    for (;;) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int n = poll(&pfd, 1, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (pfd.revents & POLLERR) {
+            // 零拷贝完成通知: [ee_info, ee_data]范围内的发送已完成, 页可以交还写者
+            unsigned notified = 0;
+            for (;;) {
+                char control[128];
+                struct msghdr msg = {};
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                    break;
+                }
+                for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+                    bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                                   (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+                    if (!recverr) {
+                        continue;
+                    }
+                    struct sock_extended_err ee;
+                    memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+                    if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                        continue;
+                    }
+                    notified++;
+                    if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                        zerocopy_copied_++;
+                    }
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    uint32_t done = ee.ee_data + 1;
+                    if (peer->epoch == epoch && static_cast<int32_t>(done - peer->zc_done) > 0) {
+                        peer->zc_done = done;
+                        cv_.notify_all();
+                    }
+                }
+            }
+            // 错误队列为空却报POLLERR, 是连接本身出错
+            if (notified == 0) {
+                break;
+            }
+        }
+
+        if (pfd.revents & POLLIN) {
+            ssize_t got = recv(fd, buf + have, sizeof(buf) - have, 0);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            have += static_cast<size_t>(got);
+            size_t used = 0;
+            bool bad = false;
+            std::lock_guard<std::mutex> lock(mutex_);
+            while (have - used >= sizeof(ReplicaAck)) {
+                ReplicaAck ack;
+                memcpy(&ack, buf + used, sizeof(ack));
+                used += sizeof(ack);
+                if (ack.magic != kReplicaMagic) {
+                    bad = true;
+                    break;
+                }
+                if (peer->epoch != epoch) {
+                    continue;
+                }
+                auto it = peer->waiting.find(ack.id);
+                if (it == peer->waiting.end()) {
+                    continue;
+                }
+                if (ack.status == 0) {
+                    it->second->acks++;
+                    acks_++;
+                } else {
+                    it->second->failed++;
+                    it->second->status = ack.status;
+                }
+                peer->waiting.erase(it);
+                peer->inflight--;
+            }
+            memmove(buf, buf + used, have - used);
+            have -= used;
+            cv_.notify_all();
+            if (bad) {
+                TFS_LOG(ERROR, "Invalid ack from replica " + peer->addr);
+                break;
+            }
+        } else if (pfd.revents & (POLLHUP | POLLNVAL)) {
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (peer->epoch == epoch) {
+        mark_down(*peer);
+    }
+}
+
+Replicator::Stats Replicator::stats() const {
+    Stats s;
+    s.frames = frames_.load();
+    s.bytes = bytes_.load();
+    s.zerocopy_sends = zerocopy_sends_.load();
+    s.zerocopy_copied = zerocopy_copied_.load();
+    s.acks = acks_.load();
+    s.failures = failures_.load();
+    s.reconnects = reconnects_.load();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& peer : peers_) {
+        if (peer->up) {
+            s.peers_up++;
+        }
+    }
+    return s;
+}
+
+// 一条入站连接; 描述符在最后一个引用 (读线程或待应答的写入任务) 释放时关闭
+struct ReplicaServer::Conn {
+    int fd = -1;
+    std::mutex send_lock;
+    std::mutex lock;
+    std::condition_variable idle;
+    unsigned inflight = 0;       // 已交给worker未应答的数据帧
+
+    ~Conn() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+ReplicaServer::ReplicaServer(StorageEngine& storage, size_t nworkers) : storage_(storage), nworkers_(nworkers) {}
+
+ReplicaServer::~ReplicaServer() {
+    close();
+}
+
+bool ReplicaServer::open(const std::string& addr, std::string* err) {
+    std::string host, port;
+    if (!split_addr(addr, &host, &port)) {
+        *err = "invalid listen address: " + addr;
+        return false;
+    }
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* res = nullptr;
+    int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) {
+        *err = addr + ": " + gai_strerror(rc);
+        return false;
+    }
+    for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+            listen_fd_ = fd;
+            break;
+        }
+        *err = "bind/listen " + addr + ": " + strerror(errno);
+        ::close(fd);
+    }
+    freeaddrinfo(res);
+    if (listen_fd_ < 0) {
+        return false;
+    }
+
+    meta_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (meta_fd_ < 0) {
+        *err = "eventfd: " + std::string(strerror(errno));
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    closing_ = false;
+    pool_.reset(new WorkerPool(nworkers_));
+    acceptor_ = std::thread(&ReplicaServer::accept_loop, this);
+    return true;
+}
+
+void ReplicaServer::close() {
+    if (listen_fd_ < 0) {
+        return;
+    }
+    closing_ = true;
+    // shutdown唤醒阻塞在accept上的线程
+    shutdown(listen_fd_, SHUT_RDWR);
+    if (acceptor_.joinable()) {
+        acceptor_.join();
+    }
+    ::close(listen_fd_);
+    listen_fd_ = -1;
+
+    std::vector<std::thread> threads;
+    std::deque<std::shared_ptr<MetaBatch>> batches;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& conn : conns_) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        threads.swap(threads_);
+        batches.swap(meta_queue_);
+    }
+    // 还没应用的元数据随连接一起放弃, 让等待的读线程退出
+    for (auto& b : batches) {
+        b->applied.set_value();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    pool_.reset();
+    ::close(meta_fd_);
+    meta_fd_ = -1;
+}
+
+void ReplicaServer::accept_loop() {
+    while (!closing_) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (!closing_) {
+                TFS_LOG(ERROR, "Replica accept failed: " + std::string(strerror(errno)));
+            }
+            break;
+        }
+        set_nodelay(fd);
+        auto conn = std::make_shared<Conn>();
+        conn->fd = fd;
+        std::lock_guard<std::mutex> lock(mutex_);
+        conns_.push_back(conn);
+        threads_.emplace_back(&ReplicaServer::conn_loop, this, conn);
+    }
+}
+
+void ReplicaServer::conn_loop(std::shared_ptr<Conn> conn) {
+    TFS_LOG(INFO, "Replica stream connected");
+    auto wait_idle = [&conn]() {
+        std::unique_lock<std::mutex> lock(conn->lock);
+        conn->idle.wait(lock, [&conn] { return conn->inflight == 0; });
+    };
+
+    for (;;) {
+        ReplicaHeader hdr;
+        if (!read_all(conn->fd, &hdr, sizeof(hdr))) {
+            break;
+        }
+        if (hdr.magic != kReplicaMagic || hdr.len > kMaxPayload ||
+            (hdr.type == kReplicaMeta && hdr.len != hdr.count * sizeof(tfs_meta_op))) {
+            TFS_LOG(ERROR, "Invalid replica frame, closing stream");
+            errors_++;
+            break;
+        }
+
+        if (hdr.type == kReplicaData) {
+            auto data = std::make_shared<std::vector<char>>(hdr.len);
+            if (!read_all(conn->fd, data->data(), hdr.len)) {
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(conn->lock);
+                conn->inflight++;
+            }
+            pool_->submit([this, conn, hdr, data]() {
+                int ret = storage_.append(hdr.ino, hdr.offset, data->data(), data->size(), hdr.meta_seq);
+                if (ret < 0) {
+                    errors_++;
+                    TFS_LOG(ERROR, "Failed to persist replica frame for inode " + std::to_string(hdr.ino) +
+                           " at offset " + std::to_string(hdr.offset) + ": " + std::string(strerror(-ret)));
+                } else {
+                    frames_++;
+                    bytes_ += data->size();
+                }
+                ReplicaAck ack = {kReplicaMagic, ret, hdr.id};
+                {
+                    std::lock_guard<std::mutex> guard(conn->send_lock);
+                    send_all(conn->fd, &ack, sizeof(ack), 0);
+                }
+                std::lock_guard<std::mutex> lock(conn->lock);
+                if (--conn->inflight == 0) {
+                    conn->idle.notify_all();
+                }
+            });
+        } else if (hdr.type == kReplicaMeta) {
+            auto batch = std::make_shared<MetaBatch>();
+            batch->ops.resize(hdr.count);
+            if (!read_all(conn->fd, batch->ops.data(), hdr.len)) {
+                break;
+            }
+            // 之前的数据写完再应用, 截断和删除不能越过先到的数据
+            wait_idle();
+            std::future<void> applied = batch->applied.get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (closing_) {
+                    break;
+                }
+                meta_queue_.push_back(batch);
+            }
+            uint64_t one = 1;
+            if (write(meta_fd_, &one, sizeof(one)) != sizeof(one)) {
+                TFS_LOG(WARNING, "Failed to signal replica metadata: " + std::string(strerror(errno)));
+            }
+            applied.wait();
+            meta_ops_ += hdr.count;
+        } else {
+            TFS_LOG(ERROR, "Unknown replica frame type " + std::to_string(hdr.type));
+            errors_++;
+            break;
+        }
+    }
+
+    wait_idle();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = conns_.begin(); it != conns_.end(); ++it) {
+            if (*it == conn) {
+                conns_.erase(it);
+                break;
+            }
+        }
+    }
+    TFS_LOG(INFO, "Replica stream closed");
+}
+
+void ReplicaServer::take_meta(std::deque<std::shared_ptr<MetaBatch>>* out) {
+    uint64_t value;
+    if (read(meta_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        TFS_LOG(WARNING, "Failed to read replica metadata event: " + std::string(strerror(errno)));
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    out->swap(meta_queue_);
+}
+
+ReplicaServer::Stats ReplicaServer::stats() const {
+    Stats s;
+    s.frames = frames_.load();
+    s.bytes = bytes_.load();
+    s.meta_ops = meta_ops_.load();
+    s.errors = errors_.load();
+    std::lock_guard<std::mutex> lock(mutex_);
+    s.connections = static_cast<unsigned>(conns_.size());
+    return s;
+}
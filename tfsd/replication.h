@@ -0,0 +1,195 @@
+#ifndef TFSD_REPLICATION_H
+#define TFSD_REPLICATION_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tfs_proto.h"
+
+class StorageEngine;
+class WorkerPool;
+
+// 传输数据复制到对端tfsd (TCP)
+// 每个对端一条连接, 帧在连接上流水线发送, 对端按帧ID应答, 应答顺序与发送顺序无关。
+// 帧: ReplicaHeader + 负载; kData负载为文件数据, kMeta负载为count个tfs_meta_op。
+// 元数据帧不应答, 与数据帧在同一连接上保序, 对端据此保持与本地一致的命名空间
+// (恢复时没有元数据的inode数据会被丢弃)。对端断线期间的元数据不补发。
+struct ReplicaHeader {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t reserved;
+    uint64_t id;
+    uint64_t ino;
+    uint64_t offset;
+    uint64_t meta_seq;
+    uint32_t len;            // 负载字节数
+    uint32_t count;          // kMeta: 操作条数
+};
+
+struct ReplicaAck {
+    uint32_t magic;
+    int32_t status;          // 0或负的errno
+    uint64_t id;
+};
+
+const uint32_t kReplicaMagic = 0x52534654;  // "TFSR"
+const uint16_t kReplicaData = 1;
+const uint16_t kReplicaMeta = 2;
+
+// 发送端: 本地持久化的同时把数据发给所有对端, 至少quorum个对端确认后才算完成
+// 负载不小于zerocopy_min时用MSG_ZEROCOPY直接从映射的页发送, 内核发完 (完成通知) 之前
+// 不能完成传输, 否则写者可能在数据发出前改写缓冲区。只有按页映射的段能被固定: 模拟设备的内存池,
+// 以及内核拷贝模式 (enable_zero_copy=0) 的folio; 内核零拷贝模式固定的是写者的匿名页, 只能按页帧
+// 映射给tfsd, sendmsg返回EFAULT, 该连接之后改为拷贝发送。
+class Replicator {
+public:
+    struct Options {
+        std::vector<std::string> peers;      // host:port
+        unsigned quorum = 0;                 // 需要的对端确认数, 0表示不等待 (异步复制)
+        unsigned window = 64;                // 每个对端最多未确认的帧数
+        size_t zerocopy_min = 16384;
+        unsigned timeout_ms = 10000;
+    };
+
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+        uint64_t zerocopy_sends = 0;
+        uint64_t zerocopy_copied = 0;    // 内核实际退回拷贝的零拷贝发送 (如回环)
+        uint64_t acks = 0;
+        uint64_t failures = 0;
+        uint64_t reconnects = 0;
+        unsigned peers_up = 0;
+    };
+
+    struct Pending;
+    using Ticket = std::shared_ptr<Pending>;
+
+    explicit Replicator(const Options& opts);
+    ~Replicator();
+
+    Replicator(const Replicator&) = delete;
+    Replicator& operator=(const Replicator&) = delete;
+
+    // 连接所有对端, 连不上的对端之后按需重连, 不视为错误
+    void start();
+    void stop();
+
+    // 发送一段数据, data在wait返回之前必须保持有效且不变
+    Ticket send(uint64_t ino, uint64_t offset, const char* data, size_t len, uint64_t meta_seq);
+    // 等待quorum个确认和零拷贝发送完成, 返回0或负的errno
+    int wait(const Ticket& ticket);
+    // 元数据批次, 只发给在线的对端, 不等待
+    void send_meta(const tfs_meta_op* ops, size_t n);
+
+    unsigned quorum() const { return opts_.quorum; }
+    Stats stats() const;
+
+private:
+    struct Peer;
+
+    bool ensure_connected(Peer& peer);
+    void receive_loop(Peer* peer, int fd, uint64_t epoch);
+    // 以下两个需持有mutex_; mark_down计为一次失联
+    void disconnect(Peer& peer);
+    void mark_down(Peer& peer);
+    bool send_frame(Peer& peer, const ReplicaHeader& hdr, const char* data, size_t len,
+                    uint32_t* zc_last, bool* used_zc);
+    bool settled(const Pending& p) const;
+
+    Options opts_;
+    std::vector<std::unique_ptr<Peer>> peers_;
+    std::atomic<uint64_t> next_id_{1};
+    bool stopping_ = false;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+
+    std::atomic<uint64_t> frames_{0};
+    std::atomic<uint64_t> bytes_{0};
+    std::atomic<uint64_t> zerocopy_sends_{0};
+    std::atomic<uint64_t> zerocopy_copied_{0};
+    std::atomic<uint64_t> acks_{0};
+    std::atomic<uint64_t> failures_{0};
+    std::atomic<uint64_t> reconnects_{0};
+};
+
+// 接收端: 接受对端tfsd的连接, 数据帧交给自己的worker写入本地存储后应答,
+// 不与传输worker共用: 传输worker会阻塞等待对端应答, 两端互为对端时会互相等死。
+// 元数据帧等该连接之前的数据写完后交给主线程应用, 应用完再继续读取, 保持与发送端相同的顺序。
+class ReplicaServer {
+public:
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+        uint64_t meta_ops = 0;
+        uint64_t errors = 0;
+        unsigned connections = 0;
+    };
+
+    // nworkers: 写入复制数据的worker数
+    ReplicaServer(StorageEngine& storage, size_t nworkers);
+    ~ReplicaServer();
+
+    ReplicaServer(const ReplicaServer&) = delete;
+    ReplicaServer& operator=(const ReplicaServer&) = delete;
+
+    // addr为host:port或port (监听所有地址)
+    bool open(const std::string& addr, std::string* err);
+    void close();
+
+    // 有待应用的元数据时可读, 由主线程的事件循环等待
+    int meta_fd() const { return meta_fd_; }
+    // 主线程调用: 逐批应用收到的元数据
+    template <typename Apply>
+    void apply_meta(Apply apply) {
+        std::deque<std::shared_ptr<MetaBatch>> batches;
+        take_meta(&batches);
+        for (auto& b : batches) {
+            apply(b->ops.data(), b->ops.size());
+            b->applied.set_value();
+        }
+    }
+
+    Stats stats() const;
+
+private:
+    struct Conn;
+    struct MetaBatch {
+        std::vector<tfs_meta_op> ops;
+        std::promise<void> applied;
+    };
+
+    void accept_loop();
+    void conn_loop(std::shared_ptr<Conn> conn);
+    void take_meta(std::deque<std::shared_ptr<MetaBatch>>* out);
+
+    StorageEngine& storage_;
+    size_t nworkers_;
+    std::unique_ptr<WorkerPool> pool_;
+    int listen_fd_ = -1;
+    int meta_fd_ = -1;
+    std::atomic<bool> closing_{false};
+    std::thread acceptor_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::shared_ptr<Conn>> conns_;
+    std::vector<std::thread> threads_;
+    std::deque<std::shared_ptr<MetaBatch>> meta_queue_;
+
+    std::atomic<uint64_t> frames_{0};
+    std::atomic<uint64_t> bytes_{0};
+    std::atomic<uint64_t> meta_ops_{0};
+    std::atomic<uint64_t> errors_{0};
+};
+
+#endif // TFSD_REPLICATION_H
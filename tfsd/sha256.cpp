@@ -0,0 +1,176 @@
+#include "sha256.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+
+alignas(16) const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+inline uint32_t load_be32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+void blocks_sw(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + i * 4);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// 状态按指令要求重排为ABEF/CDGH两个寄存器, 每组4轮:
+// 消息字加上轮常数后, sha256rnds2的两次调用各完成2轮, 同时由msg1/msg2推出后续消息字
+__attribute__((target("sha,ssse3,sse4.1")))
+void blocks_ni(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);                 // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1b);           // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);   // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);        // CDGH
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+        for (int i = 0; i < 16; i++) {
+            __m128i& cur = w[i & 3];
+            if (i < 4) {
+                cur = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16)), mask);
+            } else {
+                // w[i]的旧值是第i-4组, 与第i-3组做msg1, 再加上第i-2、i-1组拼出的W[t-7]
+                __m128i prev = w[(i - 1) & 3];
+                cur = _mm_sha256msg1_epu32(cur, w[(i - 3) & 3]);
+                cur = _mm_add_epi32(cur, _mm_alignr_epi8(prev, w[(i - 2) & 3], 4));
+                cur = _mm_sha256msg2_epu32(cur, prev);
+            }
+            __m128i msg = _mm_add_epi32(cur, _mm_load_si128(reinterpret_cast<const __m128i*>(&K[i * 4])));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);              // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);           // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);        // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);           // HGFE
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+bool cpu_has_sha() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ebx & bit_SHA) != 0 && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+using BlocksFn = void (*)(uint32_t*, const uint8_t*, size_t);
+
+struct Dispatch {
+    BlocksFn fn = blocks_sw;
+    const char* name = "generic";
+
+    Dispatch() {
+#if defined(__x86_64__)
+        if (cpu_has_sha()) {
+            fn = blocks_ni;
+            name = "sha-ni";
+        }
+#endif
+    }
+};
+
+const Dispatch& dispatch() {
+    static const Dispatch d;
+    return d;
+}
+
+} // namespace
+
+void sha256(const void* data, size_t len, uint8_t out[32]) {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    BlocksFn fn = dispatch().fn;
+
+    size_t full = len / 64;
+    fn(state, p, full);
+
+    // 末尾补1位、补零, 最后8字节为位长度 (大端)
+    uint8_t tail[128] = {};
+    size_t rest = len - full * 64;
+    memcpy(tail, p + full * 64, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest + 9 <= 64 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(len) * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+    }
+    fn(state, tail, tail_len / 64);
+
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = static_cast<uint8_t>(state[i] >> 24);
+        out[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+        out[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+        out[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+    }
+}
+
+const char* sha256_impl() {
+    return dispatch().name;
+}
@@ -0,0 +1,16 @@
+#ifndef TFSD_SHA256_H
+#define TFSD_SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+
+// SHA-256, 用作去重时数据块的指纹 (CRC32C碰撞太容易, 不能据此判定内容相同)
+// x86-64上CPU支持SHA扩展时用sha256rnds2/sha256msg指令, 否则用通用实现,
+// 实现在首次调用前按CPU特性选定。
+
+void sha256(const void* data, size_t len, uint8_t out[32]);
+
+// 当前使用的实现, 用于日志
+const char* sha256_impl();
+
+#endif // TFSD_SHA256_H
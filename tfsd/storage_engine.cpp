@@ -0,0 +1,1848 @@
+#include "storage_engine.h"
+#include "cdc.h"
+#include "crc32c.h"
+#include "event_loop.h"
+#include "meta_store.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <unordered_set>
+
+namespace {
+
+const uint64_t kBlock = 4096;                     // O_DIRECT对齐单位, 也是记录的对齐单位
+const uint32_t kSegMagic = 0x47534654;            // "TFSG"
+const uint32_t kRecMagic = 0x52534654;            // "TFSR"
+const uint32_t kSegVersion = 2;
+const size_t kMaxRecordData = 4u << 20;           // 单条记录最大数据量, 更大的追加被拆分
+const size_t kMaxRoundBytes = 64u << 20;          // 写线程每轮最多在途的字节数
+const size_t kMaxRoundReqs = 256;
+const size_t kScanWindow = 1u << 20;              // 扫描段时一次顺序读入的字节数
+
+// 段文件第一个块
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    uint64_t segment_size;
+};
+
+// 记录头, 数据紧随其后, 整条记录补齐到kBlock
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t header_sum;                          // 头部校验, 计算时该字段为0
+    uint64_t seq;
+    uint64_t generation;                          // 必须与所在段的代数一致
+    uint64_t ino;
+    uint64_t offset;
+    uint64_t meta_seq;
+    uint32_t length;
+    uint32_t flags;
+    uint32_t data_sum;                            // 数据的CRC32C
+    uint32_t nr_chunks;                           // 记录头之后的块列表项数, 0表示普通记录
+};
+
+const uint32_t kRecRefs = 1;                      // 引用记录: 只有引用列表, 没有数据
+const uint32_t kRecCompressed = 2;                // 数据经过压缩, 块列表之后有一项CompressDesc
+
+// 去重数据记录中的一个块, 数据在列表之后依次存放, 第一块从记录头的offset开始
+struct ChunkDesc {
+    uint64_t fp[2];
+    uint32_t len;
+    uint32_t reserved;
+};
+
+// 引用记录中的一项: 文件[offset, offset+len) 是seg段chunk_pos处的块中从skip开始的部分
+struct RefDesc {
+    uint64_t fp[2];
+    uint64_t offset;
+    uint64_t generation;                          // 被引用段的代数, 段复用后引用失效
+    uint64_t chunk_pos;
+    uint64_t rec_pos;
+    uint32_t seg;
+    uint32_t chunk_len;
+    uint32_t skip;
+    uint32_t len;
+};
+
+// 压缩记录: 记录头的length和data_sum描述压缩后的数据, 区间按解压后的数据计算偏移
+struct CompressDesc {
+    uint32_t raw_len;
+    uint16_t codec;                               // enum Codec
+    int16_t level;                                // 搬迁时按同样的方式重新压缩
+    uint64_t reserved;
+};
+
+// 列表和记录头一起放在记录的第一个块内, 随记录头一起校验
+const size_t kMaxChunkDescs = (kBlock - sizeof(RecordHeader) - sizeof(CompressDesc)) / sizeof(ChunkDesc);
+const size_t kMaxRefDescs = (kBlock - sizeof(RecordHeader)) / sizeof(RefDesc);
+
+uint64_t align_up(uint64_t v) {
+    return (v + kBlock - 1) & ~(kBlock - 1);
+}
+
+size_t desc_bytes(const RecordHeader& hdr) {
+    return static_cast<size_t>(hdr.nr_chunks) * (hdr.flags & kRecRefs ? sizeof(RefDesc) : sizeof(ChunkDesc)) +
+           (hdr.flags & kRecCompressed ? sizeof(CompressDesc) : 0);
+}
+
+// block为记录的第一个块, 记录必须带kRecCompressed
+CompressDesc load_compress_desc(const RecordHeader& hdr, const char* block) {
+    CompressDesc d;
+    memcpy(&d, block + sizeof(RecordHeader) + desc_bytes(hdr) - sizeof(d), sizeof(d));
+    return d;
+}
+
+// 解压后的数据长度
+uint32_t raw_length(const RecordHeader& hdr, const char* block) {
+    return hdr.flags & kRecCompressed ? load_compress_desc(hdr, block).raw_len : hdr.length;
+}
+
+size_t record_len(size_t data_len, size_t desc_len = 0) {
+    return align_up(sizeof(RecordHeader) + desc_len + data_len);
+}
+
+size_t record_len(const RecordHeader& hdr) {
+    return record_len(hdr.length, desc_bytes(hdr));
+}
+
+// descs为记录头之后的块列表
+uint32_t header_sum(const RecordHeader& hdr, const char* descs) {
+    RecordHeader tmp = hdr;
+    tmp.header_sum = 0;
+    return crc32c(crc32c(0, &tmp, sizeof(tmp)), descs, desc_bytes(hdr));
+}
+
+// block为记录的第一个块
+bool header_valid(const RecordHeader& hdr, const char* block) {
+    return hdr.magic == kRecMagic && hdr.length <= kMaxRecordData &&
+           desc_bytes(hdr) <= kBlock - sizeof(RecordHeader) &&
+           hdr.header_sum == header_sum(hdr, block + sizeof(RecordHeader)) &&
+           raw_length(hdr, block) <= kMaxRecordData;
+}
+
+// 引用记录在段中只占很小的空间, 按列表项的大小计入存活比例;
+// 存活量按原始数据计, 压缩记录多出的部分也计入已用量 (inflated)
+double live_ratio(uint64_t live_bytes, uint64_t refs, uint64_t used, uint64_t inflated) {
+    return static_cast<double>(live_bytes + refs * sizeof(RefDesc)) / (used + inflated);
+}
+
+Fingerprint load_fp(const uint64_t fp[2]) {
+    Fingerprint f;
+    f.w[0] = fp[0];
+    f.w[1] = fp[1];
+    return f;
+}
+
+char* alloc_aligned(size_t len) {
+    void* p = nullptr;
+    if (posix_memalign(&p, kBlock, len) != 0) {
+        return nullptr;
+    }
+    return static_cast<char*>(p);
+}
+
+struct AlignedFree {
+    void operator()(char* p) const { free(p); }
+};
+using AlignedBuf = std::unique_ptr<char, AlignedFree>;
+
+} // namespace
+
+StorageEngine::StorageEngine(const std::string& data_dir, const Options& opts)
+    : dir_(data_dir + "/segments"), opts_(opts) {
+    opts_.segment_size = std::max<uint64_t>(align_up(opts_.segment_size), kBlock + record_len(kMaxRecordData));
+    if (opts_.ec_k > 0) {
+        ErasureStore::Options ec_opts;
+        ec_opts.targets = opts_.ec_targets;
+        ec_opts.k = opts_.ec_k;
+        ec_opts.m = opts_.ec_m;
+        ec_.reset(new ErasureStore(ec_opts));
+    }
+    if (opts_.cache_bytes > 0) {
+        cache_.reset(new BlockCache(opts_.cache_bytes));
+    }
+}
+
+StorageEngine::~StorageEngine() {
+    close();
+}
+
+void StorageEngine::close() {
+    if (compactor_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(compact_lock_);
+            compact_stop_ = true;
+        }
+        compact_cv_.notify_all();
+        compactor_.join();
+    }
+    if (writer_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(queue_lock_);
+            stopping_ = true;
+        }
+        queue_cv_.notify_all();
+        writer_.join();
+    }
+    for (auto& seg : segments_) {
+        if (seg->fd >= 0) {
+            ::close(seg->fd);
+            seg->fd = -1;
+        }
+    }
+}
+
+std::string StorageEngine::segment_path(uint32_t id) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/seg-%06u.dat", id);
+    return dir_ + name;
+}
+
+int StorageEngine::open_segment_file(uint32_t id, bool create) {
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0) | (direct_io_ ? O_DIRECT : 0);
+    return ::open(segment_path(id).c_str(), flags, 0644);
+}
+
+bool StorageEngine::prepare(std::string* err) {
+    if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+        *err = "mkdir " + dir_ + ": " + strerror(errno);
+        return false;
+    }
+
+    // tmpfs等不支持O_DIRECT, 退化为带缓存的写入加fdatasync
+    std::string probe = dir_ + "/.direct_probe";
+    int fd = ::open(probe.c_str(), O_RDWR | O_CREAT | O_DIRECT | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EINVAL) {
+        direct_io_ = false;
+    } else if (fd >= 0) {
+        ::close(fd);
+    }
+    unlink(probe.c_str());
+
+    return !ec_ || ec_->open(err);
+}
+
+// 上次预扫描的结果, 段文件被删除重建或改为以分片存放的不能沿用; 段复用由scan_segment按代数识别
+const StorageEngine::Prescanned* StorageEngine::prescanned(const Segment& seg) const {
+    auto p = prescanned_.find(seg.id);
+    if (p == prescanned_.end()) {
+        return nullptr;
+    }
+    struct stat st;
+    bool same = seg.archive ? p->second.file == 0 : fstat(seg.fd, &st) == 0 && st.st_ino == p->second.file;
+    return same ? &p->second : nullptr;
+}
+
+// 写入者仍在运行: 段尾可能有写了一半的记录, 段也可能随时被复用或编码,
+// 因此只记下各段确定不变的前缀, 不修改数据目录, 也不保留段表。
+// 再次调用时沿用上次的结果, 只扫描期间变化的部分
+bool StorageEngine::prescan(std::string* err) {
+    if (!prepare(err) || !open_segments(err, false)) {
+        segments_.clear();
+        prescanned_.clear();
+        return false;
+    }
+
+    bool ok = true;
+    std::map<uint32_t, Prescanned> result;
+    std::vector<Scanned> recs;
+    for (auto& seg : segments_) {
+        if (seg->fd < 0 && !seg->archive) {
+            continue;
+        }
+        Prescanned p;
+        struct stat st;
+        if (!seg->archive) {
+            if (fstat(seg->fd, &st) != 0) {
+                continue;
+            }
+            p.file = st.st_ino;
+        }
+        recs.clear();
+        if (!scan_segment(*seg, &recs, err, prescanned(*seg), &p)) {
+            ok = false;
+            break;
+        }
+        if (p.resume > kBlock) {
+            result[seg->id] = std::move(p);
+        }
+    }
+
+    for (auto& seg : segments_) {
+        if (seg->fd >= 0) {
+            ::close(seg->fd);
+        }
+    }
+    segments_.clear();
+    prescanned_ = ok ? std::move(result) : std::map<uint32_t, Prescanned>();
+    return ok;
+}
+
+bool StorageEngine::open(const MetaStore& meta, std::string* err) {
+    if (!prepare(err) || !open_segments(err)) {
+        return false;
+    }
+
+    std::vector<Scanned> recs;
+    for (auto& seg : segments_) {
+        if (seg->fd < 0 && !seg->archive) {
+            continue;
+        }
+        if (!scan_segment(*seg, &recs, err, prescanned(*seg))) {
+            return false;
+        }
+    }
+    prescanned_.clear();
+
+    // 按数据版本顺序重放, 后写的覆盖先写的
+    std::sort(recs.begin(), recs.end(),
+              [](const Scanned& a, const Scanned& b) { return a.ext.seq < b.ext.seq; });
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const Scanned& r : recs) {
+            next_seq_ = std::max(next_seq_, r.ext.seq + 1);
+
+            // 引用的段已被复用或已没有有效记录
+            if (r.ext.ref_seg != UINT32_MAX &&
+                (r.ext.seg >= segments_.size() || segments_[r.ext.seg]->state == SegState::Free ||
+                 segments_[r.ext.seg]->generation != r.target_gen)) {
+                continue;
+            }
+
+            // inode已删除, 或数据属于复用该inode号之前的文件
+            MetaStore::Node node;
+            if (!meta.lookup(r.ino, &node) || r.ext.meta_seq < node.create_seq) {
+                continue;
+            }
+            Extent ext = r.ext;
+            // 最近一次截断之前写入的数据不能越过截断点
+            // (只保留了最后一次截断, 更早截断之后又被更晚截断放大的区间无法识别)
+            if (ext.meta_seq < node.trunc_seq) {
+                if (r.offset >= node.size) {
+                    continue;
+                }
+                ext.len = std::min<uint64_t>(ext.len, node.size - r.offset);
+            }
+            if (r.has_fp) {
+                ext.chunk = resolve_chunk(r.fp, ext.seg, r.chunk_pos, ext.rec_pos, r.chunk_len);
+            }
+            insert_extent(r.ino, r.offset, ext);
+        }
+    }
+
+    writer_ = std::thread(&StorageEngine::writer_loop, this);
+    compactor_ = std::thread(&StorageEngine::compact_loop, this);
+    return true;
+}
+
+bool StorageEngine::open_segments(std::string* err, bool repair) {
+    DIR* d = opendir(dir_.c_str());
+    if (d == nullptr) {
+        *err = "opendir " + dir_ + ": " + strerror(errno);
+        return false;
+    }
+    std::set<uint32_t> ids;
+    while (struct dirent* de = readdir(d)) {
+        unsigned id;
+        char tail;
+        if (sscanf(de->d_name, "seg-%6u.dat%c", &id, &tail) == 1) {
+            ids.insert(id);
+        }
+    }
+    closedir(d);
+
+    // 编码完成到删除本地文件之间崩溃时两者都在, 以本地段文件为准
+    std::map<uint32_t, ErasureStore::ArchivePtr> archives;
+    if (ec_) {
+        if (!ec_->scan(&archives, err, repair)) {
+            return false;
+        }
+        for (auto it = archives.begin(); it != archives.end();) {
+            if (ids.count(it->first)) {
+                if (repair) {
+                    ec_->remove(it->first);
+                }
+                it = archives.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // 段号即段表下标, 缺失的段号留作空闲槽位, 使用时再创建文件
+    uint32_t max_id = 0;
+    if (!ids.empty()) {
+        max_id = *ids.rbegin() + 1;
+    }
+    if (!archives.empty()) {
+        max_id = std::max(max_id, archives.rbegin()->first + 1);
+    }
+    segments_.resize(max_id);
+    for (uint32_t id = 0; id < segments_.size(); id++) {
+        segments_[id].reset(new Segment);
+        segments_[id]->id = id;
+        auto ar = archives.find(id);
+        if (ar != archives.end()) {
+            segments_[id]->archive = ar->second;
+            segments_[id]->generation = ar->second->generation;
+            continue;
+        }
+        if (ids.count(id) == 0) {
+            continue;
+        }
+        segments_[id]->fd = open_segment_file(id, false);
+        if (segments_[id]->fd < 0) {
+            *err = "open " + segment_path(id) + ": " + strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+// 扫描段内记录: 有效记录整条跳过, 无效块逐块前进
+// 写线程每轮全部写完才应答, 失败或崩溃留下的空洞不超过一轮的大小
+// 预扫描时写入者仍在运行, 跳过的块和撕裂的记录之后都可能被写完, 补扫从其中最早的位置开始
+bool StorageEngine::scan_segment(Segment& seg, std::vector<Scanned>* recs, std::string* err,
+                                 const Prescanned* from, Prescanned* save) {
+    Source src = source(seg);
+    if (seg.archive) {
+        seg.size = seg.archive->length & ~(kBlock - 1);
+    } else {
+        struct stat st;
+        if (fstat(seg.fd, &st) != 0) {
+            *err = "fstat " + segment_path(seg.id) + ": " + strerror(errno);
+            return false;
+        }
+        seg.size = st.st_size & ~(kBlock - 1);
+    }
+    seg.write_pos = kBlock;
+    seg.inflated = 0;
+    seg.state = SegState::Free;
+
+    // 顺序读段时一次读入一个窗口, 记录头和段尾复核的记录都从窗口中取, 不必逐条发起直接I/O;
+    // ahead为窗口不命中时读入的字节数, 只需要头部的大记录之间只读一个块
+    AlignedBuf window(alloc_aligned(kScanWindow));
+    if (!window) {
+        *err = "out of memory";
+        return false;
+    }
+    uint64_t win_pos = 0;
+    uint64_t win_len = 0;
+    auto fetch = [&](uint64_t at, uint64_t len, uint64_t ahead) -> const char* {
+        if (len > kScanWindow) {
+            return nullptr;
+        }
+        if (at < win_pos || at + len > win_pos + win_len) {
+            ssize_t n = read_source(src, window.get(), std::min(std::max(len, ahead), seg.size - at), at);
+            win_pos = at;
+            win_len = n > 0 ? n : 0;
+        }
+        return at + len <= win_pos + win_len ? window.get() + (at - win_pos) : nullptr;
+    };
+
+    const char* block = seg.size < kBlock ? nullptr : fetch(0, kBlock, kBlock);
+    if (!block) {
+        return true;
+    }
+    SegmentHeader sh;
+    memcpy(&sh, block, sizeof(sh));
+    if (sh.magic != kSegMagic || sh.version != kSegVersion) {
+        return true;
+    }
+    seg.generation = sh.generation;
+
+    uint64_t pos = kBlock;
+    size_t first = recs->size();
+    // 预扫描之后段没有被复用, resume之前的记录不变, 预扫描时也已复核过
+    if (from && from->generation == seg.generation && from->resume > kBlock) {
+        recs->insert(recs->end(), from->recs.begin(), from->recs.end());
+        seg.inflated = from->inflated;
+        pos = from->resume;
+    }
+    uint64_t verified = pos;
+    uint64_t valid_end = pos;
+    uint64_t gap = UINT64_MAX;     // 第一个跳过的块
+    std::vector<std::pair<uint64_t, uint64_t>> inflated;   // 预扫描: 压缩记录的位置和膨胀量
+
+    // 复核一条记录的数据校验; 比窗口大的记录和读不出的记录单独读取
+    std::vector<char> data;
+    size_t data_off;
+    auto check = [&](uint64_t rec_pos) {
+        RecordHeader hdr;
+        const char* rec = fetch(rec_pos, kBlock, kScanWindow);
+        if (rec) {
+            memcpy(&hdr, rec, sizeof(hdr));
+            rec = header_valid(hdr, rec) ? fetch(rec_pos, record_len(hdr), kScanWindow) : nullptr;
+        }
+        int ret = rec ? decode_record(rec, &data, &data_off, nullptr) : load_record(src, rec_pos, &data, &data_off);
+        return ret == 0 || ret == -EOPNOTSUPP;
+    };
+    // 离段尾不到一轮的记录必定要复核, 趁还在窗口中时先复核, 不必再读一遍
+    std::unordered_map<uint64_t, bool> checked;
+    uint64_t ahead = kScanWindow;
+    while (pos + kBlock <= seg.size && pos - valid_end <= kMaxRoundBytes) {
+        block = fetch(pos, kBlock, ahead);
+        if (!block) {
+            break;
+        }
+        RecordHeader hdr;
+        memcpy(&hdr, block, sizeof(hdr));
+        if (hdr.generation != seg.generation || !header_valid(hdr, block) ||
+            pos + record_len(hdr) > seg.size) {
+            gap = std::min(gap, pos);
+            pos += kBlock;
+            continue;
+        }
+        scan_record(block, seg.id, pos, recs);
+        ahead = record_len(hdr) <= kScanWindow / 8 ? kScanWindow : kBlock;
+        uint64_t extra = raw_length(hdr, block) - hdr.length;
+        seg.inflated += extra;
+        if (save && extra > 0) {
+            inflated.emplace_back(pos, extra);
+        }
+        if (pos >= verified && pos + kMaxRoundBytes >= seg.size) {
+            checked[pos] = check(pos);
+        }
+        pos += record_len(hdr);
+        valid_end = pos;
+    }
+
+    // 只有最后一轮的写入可能没写完 (之前的轮次都已落盘并应答),
+    // 对段尾一轮范围内的记录复核数据校验, 撕裂的记录不能覆盖旧数据;
+    // 引用记录没有数据, 只有一个块, 已由头部校验覆盖; 编码不可用的压缩记录校验已通过, 照样保留
+    uint64_t checked_pos = 0;
+    bool checked_ok = false;
+    uint64_t torn = UINT64_MAX;
+    for (size_t i = first; i < recs->size();) {
+        const Extent& ext = (*recs)[i].ext;
+        if (ext.ref_seg == UINT32_MAX && ext.rec_pos >= verified &&
+            ext.rec_pos + kMaxRoundBytes >= valid_end) {
+            if (ext.rec_pos != checked_pos) {
+                auto c = checked.find(ext.rec_pos);
+                checked_ok = c != checked.end() ? c->second : check(ext.rec_pos);
+                checked_pos = ext.rec_pos;
+            }
+            if (!checked_ok) {
+                torn = std::min(torn, ext.rec_pos);
+                recs->erase(recs->begin() + i);
+                continue;
+            }
+        }
+        i++;
+    }
+
+    if (save) {
+        save->generation = seg.generation;
+        save->resume = std::min({gap, torn, valid_end});
+        save->inflated = seg.inflated;
+        for (const auto& c : inflated) {
+            if (c.first >= save->resume) {
+                save->inflated -= c.second;
+            }
+        }
+        for (size_t i = first; i < recs->size(); i++) {
+            if ((*recs)[i].pos < save->resume) {
+                save->recs.push_back((*recs)[i]);
+            }
+        }
+    }
+
+    seg.write_pos = valid_end;
+    if (valid_end > kBlock) {
+        seg.state = SegState::Sealed;
+        seg.sealed_at = std::chrono::steady_clock::now();
+    } else if (seg.archive && !save) {
+        ec_->remove(seg.id);
+        seg.archive.reset();
+    }
+    return true;
+}
+
+// 把一条有效记录展开为区间: 普通记录一个, 去重数据记录每块一个, 引用记录每项一个
+void StorageEngine::scan_record(const char* block, uint32_t seg, uint64_t pos, std::vector<Scanned>* recs) {
+    RecordHeader hdr;
+    memcpy(&hdr, block, sizeof(hdr));
+    const char* descs = block + sizeof(RecordHeader);
+    if (hdr.flags & kRecRefs) {
+        for (uint32_t i = 0; i < hdr.nr_chunks; i++) {
+            RefDesc d;
+            memcpy(&d, descs + i * sizeof(d), sizeof(d));
+            if (d.len == 0) {
+                continue;
+            }
+            Extent ext = {d.seg, d.len, d.chunk_pos + d.skip, d.rec_pos, hdr.seq, hdr.meta_seq, seg};
+            recs->push_back(Scanned{hdr.ino, d.offset, ext, true, load_fp(d.fp), d.chunk_pos, d.chunk_len,
+                                    d.generation, pos});
+        }
+        return;
+    }
+    // 压缩记录的区间位置按解压后的数据计算, 只用于在记录中定位
+    uint64_t data_pos = pos + sizeof(RecordHeader) + desc_bytes(hdr);
+    uint32_t length = raw_length(hdr, block);
+    Extent ext = {seg, length, data_pos, pos, hdr.seq, hdr.meta_seq};
+    if (hdr.nr_chunks == 0) {
+        if (length > 0) {
+            recs->push_back(Scanned{hdr.ino, hdr.offset, ext, false, {}, 0, 0, 0, pos});
+        }
+        return;
+    }
+
+    std::vector<ChunkDesc> list(hdr.nr_chunks);
+    memcpy(list.data(), descs, list.size() * sizeof(ChunkDesc));
+    uint64_t total = 0;
+    for (const ChunkDesc& d : list) {
+        total += d.len;
+    }
+    if (total != length) {
+        return;
+    }
+    uint64_t offset = hdr.offset;
+    for (const ChunkDesc& d : list) {
+        ext.len = d.len;
+        ext.data_pos = data_pos;
+        recs->push_back(Scanned{hdr.ino, offset, ext, true, load_fp(d.fp), data_pos, d.len, 0, pos});
+        data_pos += d.len;
+        offset += d.len;
+    }
+}
+
+// 复用或启用一个段: 代数加一并重写段头, 之前的记录随之失效
+bool StorageEngine::activate(Segment& seg) {
+    if (seg.fd < 0) {
+        seg.fd = open_segment_file(seg.id, true);
+        if (seg.fd < 0) {
+            return false;
+        }
+        // 预分配整段, 追加时不再分配块; 不支持fallocate的文件系统用ftruncate
+        int ret = fallocate(seg.fd, 0, 0, opts_.segment_size);
+        if (ret != 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+            ret = ftruncate(seg.fd, opts_.segment_size);
+        }
+        if (ret != 0) {
+            ::close(seg.fd);
+            seg.fd = -1;
+            unlink(segment_path(seg.id).c_str());
+            return false;
+        }
+        seg.size = opts_.segment_size;
+    }
+
+    AlignedBuf block(alloc_aligned(kBlock));
+    if (!block) {
+        return false;
+    }
+    memset(block.get(), 0, kBlock);
+    SegmentHeader sh = {kSegMagic, kSegVersion, seg.generation + 1, seg.size};
+    memcpy(block.get(), &sh, sizeof(sh));
+    if (pwrite(seg.fd, block.get(), kBlock, 0) != static_cast<ssize_t>(kBlock) || fdatasync(seg.fd) != 0) {
+        return false;
+    }
+
+    seg.generation = sh.generation;
+    seg.write_pos = kBlock;
+    seg.live_bytes = 0;
+    seg.refs = 0;
+    seg.inflated = 0;
+    seg.state = SegState::Active;
+    return true;
+}
+
+// 在当前段中分配一条记录的位置, 当前段放不下时封存并切换到空闲段
+bool StorageEngine::reserve(size_t rec_len, uint32_t* seg, uint64_t* pos) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (active_ != UINT32_MAX) {
+        Segment& cur = *segments_[active_];
+        if (cur.write_pos + rec_len <= cur.size) {
+            *seg = cur.id;
+            *pos = cur.write_pos;
+            cur.write_pos += rec_len;
+            cur.inflight++;
+            return true;
+        }
+        cur.state = SegState::Sealed;
+        cur.sealed_at = std::chrono::steady_clock::now();
+        active_ = UINT32_MAX;
+        compact_cv_.notify_one();
+    }
+
+    Segment* next = nullptr;
+    for (auto& s : segments_) {
+        if (s->state == SegState::Free) {
+            next = s.get();
+            break;
+        }
+    }
+    if (next == nullptr) {
+        segments_.emplace_back(new Segment);
+        next = segments_.back().get();
+        next->id = segments_.size() - 1;
+    }
+    if (!activate(*next) || next->write_pos + rec_len > next->size) {
+        if (next->state == SegState::Active) {
+            next->state = SegState::Free;
+        }
+        return false;
+    }
+
+    active_ = next->id;
+    *seg = next->id;
+    *pos = next->write_pos;
+    next->write_pos += rec_len;
+    next->inflight++;
+    return true;
+}
+
+// 压缩在调用线程中进行: 只有压缩后至少省下一个块才采用, 否则 (或熵太高时) 照原样存放
+std::unique_ptr<StorageEngine::Request> StorageEngine::make_request(
+    uint64_t ino, uint64_t offset, const char* data, size_t len, uint64_t meta_seq, size_t desc_len,
+    const CompressPolicy& policy) {
+    std::unique_ptr<Request> req(new Request());
+    req->ino = ino;
+    req->data_sum = 0;
+    req->offset = offset;
+    req->len = len;
+    req->stored = len;
+    req->compressed = false;
+    req->data_off = sizeof(RecordHeader) + desc_len;
+    req->seq = 0;
+    req->meta_seq = meta_seq;
+    req->rec_len = record_len(len, desc_len);
+    req->buf = alloc_aligned(req->rec_len);
+    req->relocate = false;
+    req->src_ref = UINT32_MAX;
+    req->refs = false;
+    req->result = 0;
+    if (req->buf == nullptr) {
+        return nullptr;
+    }
+
+    if (policy.codec != Codec::None && req->rec_len > kBlock) {
+        size_t head = req->data_off + sizeof(CompressDesc);
+        size_t cap = req->rec_len - kBlock - std::min(req->rec_len - kBlock, head);
+        size_t n = cap > 0 && compressible(data, len) ? compress(policy, data, len, req->buf + head, cap) : 0;
+        if (n > 0) {
+            // 块列表由调用方填写
+            memset(req->buf, 0, req->data_off);
+            CompressDesc d = {static_cast<uint32_t>(len), static_cast<uint16_t>(policy.codec),
+                              static_cast<int16_t>(policy.level), 0};
+            memcpy(req->buf + req->data_off, &d, sizeof(d));
+            req->data_off = head;
+            req->stored = n;
+            req->compressed = true;
+            req->rec_len = record_len(n, desc_len + sizeof(CompressDesc));
+            req->data_sum = crc32c(0, req->buf + head, n);
+            memset(req->buf + head + n, 0, req->rec_len - head - n);
+            compress_in_ += len;
+            compress_out_ += n;
+            return req;
+        }
+        compress_skipped_ += len;
+    }
+
+    // 块列表由调用方填写
+    size_t head = req->data_off;
+    memset(req->buf, 0, head);
+    req->data_sum = crc32c_copy(0, req->buf + head, data, len);
+    memset(req->buf + head + len, 0, req->rec_len - head - len);
+    return req;
+}
+
+// data为第一块的数据, 各块连续存放
+std::unique_ptr<StorageEngine::Request> StorageEngine::make_chunk_request(
+    uint64_t ino, const char* data, std::vector<ChunkRef> chunks, uint64_t meta_seq, const CompressPolicy& policy) {
+    size_t len = 0;
+    for (const ChunkRef& c : chunks) {
+        len += c.len;
+    }
+    auto req = make_request(ino, chunks[0].offset, data, len, meta_seq, chunks.size() * sizeof(ChunkDesc), policy);
+    if (!req) {
+        return nullptr;
+    }
+    char* p = req->buf + sizeof(RecordHeader);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        ChunkDesc d = {{chunks[i].fp.w[0], chunks[i].fp.w[1]}, chunks[i].len, 0};
+        memcpy(p + i * sizeof(d), &d, sizeof(d));
+    }
+    req->chunks = std::move(chunks);
+    return req;
+}
+
+std::unique_ptr<StorageEngine::Request> StorageEngine::make_ref_request(uint64_t ino, std::vector<ChunkRef> refs,
+                                                                        uint64_t meta_seq) {
+    auto req = make_request(ino, refs[0].offset, nullptr, 0, meta_seq, refs.size() * sizeof(RefDesc));
+    if (!req) {
+        return nullptr;
+    }
+    char* p = req->buf + sizeof(RecordHeader);
+    for (size_t i = 0; i < refs.size(); i++) {
+        const ChunkRef& c = refs[i];
+        RefDesc d = {{c.fp.w[0], c.fp.w[1]}, c.offset, c.generation, c.chunk_pos, c.rec_pos,
+                     c.seg, c.chunk_len, c.skip, c.len};
+        memcpy(p + i * sizeof(d), &d, sizeof(d));
+    }
+    req->refs = true;
+    req->chunks = std::move(refs);
+    return req;
+}
+
+int StorageEngine::submit_and_wait(std::vector<std::unique_ptr<Request>>& reqs) {
+    std::vector<std::future<int>> results;
+    results.reserve(reqs.size());
+    {
+        std::lock_guard<std::mutex> lock(queue_lock_);
+        if (stopping_) {
+            return -ESHUTDOWN;
+        }
+        for (auto& req : reqs) {
+            results.push_back(req->done.get_future());
+            queue_.push_back(req.get());
+        }
+    }
+    queue_cv_.notify_one();
+
+    int ret = 0;
+    for (auto& f : results) {
+        int r = f.get();
+        if (r < 0 && ret == 0) {
+            ret = r;
+        }
+    }
+    for (auto& req : reqs) {
+        free(req->buf);
+    }
+    return ret;
+}
+
+int StorageEngine::append(uint64_t ino, uint64_t offset, const char* data, size_t len, uint64_t meta_seq,
+                          uint32_t* crc, const CompressPolicy* policy) {
+    const CompressPolicy& comp = policy ? *policy : opts_.compress;
+    if (opts_.dedup) {
+        // 引用的块在提交前被回收时整段改为写入数据, 序号更大, 恢复时覆盖失效的引用
+        int ret = append_chunks(ino, offset, data, len, meta_seq, true, comp, crc);
+        if (ret == -ESTALE) {
+            ret = append_chunks(ino, offset, data, len, meta_seq, false, comp, crc);
+        }
+        if (ret == 0) {
+            appended_bytes_ += len;
+        }
+        return ret;
+    }
+
+    std::vector<std::unique_ptr<Request>> reqs;
+    uint32_t total_crc = 0;
+    for (size_t done = 0; done < len; done += kMaxRecordData) {
+        size_t n = std::min(kMaxRecordData, len - done);
+        // 在调用线程中拷贝 (或压缩) 到对齐缓冲区并计算校验, 多个worker可以并行
+        auto req = make_request(ino, offset + done, data + done, n, meta_seq, 0, comp);
+        if (!req) {
+            for (auto& r : reqs) {
+                free(r->buf);
+            }
+            return -ENOMEM;
+        }
+        // 压缩记录的校验是对压缩后数据的, 需要时原始数据另算一遍
+        uint32_t sum = !req->compressed ? req->data_sum : (crc ? crc32c(0, data + done, n) : 0);
+        total_crc = done ? crc32c_combine(total_crc, sum, n) : sum;
+        reqs.push_back(std::move(req));
+    }
+    if (crc) {
+        *crc = total_crc;
+    }
+    if (reqs.empty()) {
+        return 0;
+    }
+    int ret = submit_and_wait(reqs);
+    if (ret == 0) {
+        appended_bytes_ += len;
+    }
+    return ret;
+}
+
+int StorageEngine::append_chunks(uint64_t ino, uint64_t offset, const char* data, size_t len,
+                                 uint64_t meta_seq, bool use_refs, const CompressPolicy& policy, uint32_t* crc) {
+    std::vector<uint32_t> sizes;
+    cdc_chunk(reinterpret_cast<const uint8_t*>(data), len, &sizes);
+    size_t n = sizes.size();
+    std::vector<ChunkRef> chunks(n);
+    std::vector<size_t> starts(n);
+    size_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+        ChunkRef& c = chunks[i];
+        c = ChunkRef{};
+        c.fp = fingerprint(data + off, sizes[i]);
+        c.offset = offset + off;
+        c.len = sizes[i];
+        c.id = ChunkIndex::kNone;
+        starts[i] = off;
+        off += sizes[i];
+    }
+    // 引用的块不再拷贝, 整段单独计算一次校验
+    if (crc) {
+        *crc = crc32c(0, data, len);
+    }
+
+    // 同一次追加中重复的块, 第一次出现的写为数据, 其余推迟到下一轮, 等它提交后写为引用
+    std::vector<bool> done(n, false);
+    uint64_t ref_bytes = 0;
+    for (int pass = 0;; pass++) {
+        std::vector<bool> hit(n, false);
+        std::vector<bool> defer(n, false);
+        if (use_refs) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < n; i++) {
+                uint32_t id = done[i] ? ChunkIndex::kNone : chunks_.find(chunks[i].fp);
+                if (id == ChunkIndex::kNone) {
+                    continue;
+                }
+                const ChunkIndex::Chunk& ch = chunks_.at(id);
+                ChunkRef& c = chunks[i];
+                c.id = id;
+                c.seg = ch.seg;
+                c.generation = segments_[ch.seg]->generation;
+                c.chunk_pos = ch.data_pos;
+                c.rec_pos = ch.rec_pos;
+                c.chunk_len = ch.len;
+                c.skip = 0;
+                hit[i] = true;
+            }
+        }
+        if (use_refs && pass == 0) {
+            std::unordered_set<uint64_t> seen;
+            for (size_t i = 0; i < n; i++) {
+                if (!hit[i] && !seen.insert(chunks[i].fp.w[0]).second) {
+                    defer[i] = true;
+                }
+            }
+        }
+
+        // 连续的同类块合并为一条记录
+        std::vector<std::unique_ptr<Request>> reqs;
+        bool pending = false;
+        for (size_t i = 0; i < n;) {
+            if (done[i] || defer[i]) {
+                pending |= defer[i];
+                i++;
+                continue;
+            }
+            size_t j = i + 1;
+            std::unique_ptr<Request> req;
+            if (hit[i]) {
+                while (j < n && !done[j] && !defer[j] && hit[j] && j - i < kMaxRefDescs) {
+                    j++;
+                }
+                req = make_ref_request(ino, std::vector<ChunkRef>(chunks.begin() + i, chunks.begin() + j),
+                                       meta_seq);
+            } else {
+                size_t bytes = sizes[i];
+                while (j < n && !done[j] && !defer[j] && !hit[j] && j - i < kMaxChunkDescs &&
+                       bytes + sizes[j] <= kMaxRecordData) {
+                    bytes += sizes[j++];
+                }
+                req = make_chunk_request(ino, data + starts[i],
+                                         std::vector<ChunkRef>(chunks.begin() + i, chunks.begin() + j), meta_seq,
+                                         policy);
+            }
+            if (!req) {
+                for (auto& r : reqs) {
+                    free(r->buf);
+                }
+                return -ENOMEM;
+            }
+            for (; i < j; i++) {
+                done[i] = true;
+                ref_bytes += hit[i] ? sizes[i] : 0;
+            }
+            reqs.push_back(std::move(req));
+        }
+        if (!reqs.empty()) {
+            int ret = submit_and_wait(reqs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (!pending) {
+            break;
+        }
+    }
+    dedup_bytes_ += ref_bytes;
+    return 0;
+}
+
+void StorageEngine::writer_loop() {
+    EventLoop loop;
+    std::string err;
+    bool loop_ok = loop.init(kMaxRoundReqs * 2, &err);
+
+    for (;;) {
+        std::vector<Request*> round;
+        size_t bytes = 0;
+        {
+            std::unique_lock<std::mutex> lock(queue_lock_);
+            queue_cv_.wait(lock, [&] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            // 组提交窗口: 以延迟换取每次fdatasync覆盖更多记录
+            if (opts_.commit_delay_us > 0 && queue_.size() < opts_.commit_batch) {
+                auto deadline = std::chrono::steady_clock::now() +
+                                std::chrono::microseconds(opts_.commit_delay_us);
+                queue_cv_.wait_until(lock, deadline, [&] {
+                    return stopping_ || queue_.size() >= opts_.commit_batch;
+                });
+            }
+            // 把积压的请求尽量放进同一轮, 共用一次fdatasync
+            while (!queue_.empty() && round.size() < kMaxRoundReqs &&
+                   (round.empty() || bytes + queue_.front()->rec_len <= kMaxRoundBytes)) {
+                bytes += queue_.front()->rec_len;
+                round.push_back(queue_.front());
+                queue_.pop_front();
+            }
+        }
+
+        if (!loop_ok) {
+            for (Request* req : round) {
+                write_errors_++;
+                req->done.set_value(-EIO);
+            }
+            continue;
+        }
+        write_round(loop, round);
+    }
+}
+
+// 一轮写入: 按到达顺序分配位置, 全部写入同时在途,
+// 写完后每个涉及的段fdatasync一次, 之后更新索引并应答
+void StorageEngine::write_round(EventLoop& loop, std::vector<Request*>& round) {
+    std::set<uint32_t> touched;
+    std::set<uint32_t> failed_segs;
+
+    for (Request* req : round) {
+        req->seg = UINT32_MAX;
+        if (!reserve(req->rec_len, &req->seg, &req->pos)) {
+            req->result = -ENOSPC;
+            continue;
+        }
+
+        RecordHeader hdr = {};
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (req->seq == 0) {
+                req->seq = next_seq_++;
+            }
+            hdr.generation = segments_[req->seg]->generation;
+            fd = segments_[req->seg]->fd;
+        }
+        hdr.magic = kRecMagic;
+        hdr.seq = req->seq;
+        hdr.ino = req->ino;
+        hdr.offset = req->offset;
+        hdr.meta_seq = req->meta_seq;
+        hdr.length = req->stored;
+        hdr.flags = (req->refs ? kRecRefs : 0) | (req->compressed ? kRecCompressed : 0);
+        hdr.data_sum = req->refs ? 0 : req->data_sum;
+        hdr.nr_chunks = static_cast<uint32_t>(req->chunks.size());
+        hdr.header_sum = header_sum(hdr, req->buf + sizeof(RecordHeader));
+        memcpy(req->buf, &hdr, sizeof(hdr));
+
+        req->result = -EINPROGRESS;
+        bool queued = loop.write(fd, req->buf, req->rec_len, req->pos, [req](int res) {
+            req->result = res == static_cast<int>(req->rec_len) ? 0 : (res < 0 ? res : -EIO);
+        });
+        if (!queued) {
+            req->result = -EIO;
+            continue;
+        }
+        touched.insert(req->seg);
+    }
+    while (loop.pending() > 0 && loop.run_once(-1) >= 0) {
+    }
+
+    for (uint32_t id : touched) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fd = segments_[id]->fd;
+        }
+        if (!loop.fsync(fd, true, [&failed_segs, id](int res) {
+                if (res < 0) {
+                    failed_segs.insert(id);
+                }
+            })) {
+            failed_segs.insert(id);
+        }
+    }
+    while (loop.pending() > 0 && loop.run_once(-1) >= 0) {
+    }
+    commit_rounds_++;
+    commit_requests_ += round.size();
+    commit_syncs_ += touched.size();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (Request* req : round) {
+            if (req->seg != UINT32_MAX) {
+                segments_[req->seg]->inflight--;
+            }
+            if (req->result == -EINPROGRESS || (req->result == 0 && failed_segs.count(req->seg))) {
+                req->result = -EIO;
+            }
+            if (req->result < 0) {
+                write_errors_++;
+                continue;
+            }
+            // 记录已经落盘, 无论区间是否采用都占用段空间
+            segments_[req->seg]->inflated += req->len - req->stored;
+            if (req->refs) {
+                commit_refs(req);
+                continue;
+            }
+            if (!req->chunks.empty()) {
+                commit_chunks(req);
+                continue;
+            }
+
+            Extent ext = {req->seg, req->len, req->pos + req->data_off, req->pos, req->seq, req->meta_seq};
+            if (!req->relocate) {
+                insert_extent(req->ino, req->offset, ext);
+                continue;
+            }
+
+            // 搬迁期间该区间可能被覆盖、截断或删除, 此时新副本直接作废
+            auto it = index_.find(req->ino);
+            if (it == index_.end()) {
+                continue;
+            }
+            auto cur = it->second.find(req->offset);
+            if (cur == it->second.end() || cur->second.seg != req->src_seg ||
+                cur->second.data_pos != req->src_pos || cur->second.len != req->len ||
+                cur->second.ref_seg != req->src_ref) {
+                continue;
+            }
+            release(cur->second, cur->second.len);
+            drop_ref(cur->second);
+            cur->second = ext;
+            segments_[ext.seg]->live_bytes += ext.len;
+            relocated_bytes_ += ext.len;
+        }
+    }
+
+    for (Request* req : round) {
+        // set_value之后请求可能已被提交方释放
+        req->done.set_value(req->result);
+    }
+}
+
+// 引用的块在查找之后可能已被回收, 段也可能已被复用
+bool StorageEngine::ref_valid(const ChunkRef& ref) const {
+    if (!chunks_.alive(ref.id)) {
+        return false;
+    }
+    const ChunkIndex::Chunk& ch = chunks_.at(ref.id);
+    return ch.fp == ref.fp && ch.seg == ref.seg && ch.data_pos == ref.chunk_pos && ch.len == ref.chunk_len &&
+           segments_[ch.seg]->generation == ref.generation;
+}
+
+// 引用记录落盘后: 新写入的引用全部有效才更新索引, 否则整条作废 (-ESTALE), 由append改写数据;
+// 回收时重写的引用只在区间未变时改由新记录描述
+void StorageEngine::commit_refs(Request* req) {
+    if (!req->relocate) {
+        for (const ChunkRef& c : req->chunks) {
+            if (!ref_valid(c)) {
+                req->result = -ESTALE;
+                return;
+            }
+        }
+        for (const ChunkRef& c : req->chunks) {
+            Extent ext = {c.seg, c.len, c.chunk_pos + c.skip, c.rec_pos, req->seq, req->meta_seq, req->seg, c.id};
+            insert_extent(req->ino, c.offset, ext);
+        }
+        return;
+    }
+
+    auto it = index_.find(req->ino);
+    if (it == index_.end()) {
+        return;
+    }
+    for (const ChunkRef& c : req->chunks) {
+        auto cur = it->second.find(c.offset);
+        if (cur == it->second.end() || cur->second.seg != c.seg || cur->second.data_pos != c.chunk_pos + c.skip ||
+            cur->second.len != c.len || cur->second.ref_seg != req->src_seg || cur->second.chunk != c.id) {
+            continue;
+        }
+        Extent ext = cur->second;
+        ext.ref_seg = req->seg;
+        add_ref(ext);
+        drop_ref(cur->second);
+        cur->second = ext;
+    }
+}
+
+// 去重数据记录落盘后: 每块一个区间, 新块登记到去重索引
+void StorageEngine::commit_chunks(Request* req) {
+    uint64_t data_pos = req->pos + req->data_off;
+    for (const ChunkRef& c : req->chunks) {
+        Extent ext = {req->seg, c.len, data_pos, req->pos, req->seq, req->meta_seq};
+        ext.chunk = resolve_chunk(c.fp, req->seg, data_pos, req->pos, c.len);
+        insert_extent(req->ino, c.offset, ext);
+        data_pos += c.len;
+    }
+}
+
+// 指纹已在索引中但位置不同 (并发写入了相同的块) 时, 该区间不作为块共享
+uint32_t StorageEngine::resolve_chunk(const Fingerprint& fp, uint32_t seg, uint64_t chunk_pos, uint64_t rec_pos,
+                                      uint32_t len) {
+    uint32_t id = chunks_.find(fp);
+    if (id == ChunkIndex::kNone) {
+        return chunks_.insert(ChunkIndex::Chunk{fp, chunk_pos, rec_pos, seg, len, 0});
+    }
+    const ChunkIndex::Chunk& ch = chunks_.at(id);
+    return ch.seg == seg && ch.data_pos == chunk_pos && ch.len == len ? id : ChunkIndex::kNone;
+}
+
+void StorageEngine::insert_extent(uint64_t ino, uint64_t offset, const Extent& ext) {
+    ExtentMap& map = index_[ino];
+    // 先加引用, 覆盖同一块的旧区间时块不会先降到0被删除
+    add_ref(ext);
+    punch(map, offset, offset + ext.len);
+    map[offset] = ext;
+    segments_[ext.seg]->live_bytes += ext.len;
+    // 搬迁不经过这里: 内容不变, 缓存的块仍然有效
+    if (cache_ && ext.len > 0) {
+        uint64_t first = offset / BlockCache::kBlockSize;
+        cache_->invalidate(ino, first, (offset + ext.len - 1) / BlockCache::kBlockSize - first + 1);
+    }
+}
+
+// 从区间索引中挖掉[start, end), 跨边界的区间被裁剪或拆成两段
+void StorageEngine::punch(ExtentMap& map, uint64_t start, uint64_t end) {
+    auto it = map.lower_bound(start);
+    if (it != map.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second.len > start) {
+            it = prev;
+        }
+    }
+
+    while (it != map.end() && it->first < end) {
+        uint64_t e_start = it->first;
+        Extent e = it->second;
+        uint64_t e_end = e_start + e.len;
+
+        release(e, std::min(e_end, end) - std::max(e_start, start));
+        if (e_end > end) {
+            Extent right = e;
+            right.data_pos += end - e_start;
+            right.len = e_end - end;
+            map[end] = right;
+            // 一分为二时多出一个引用
+            if (e_start < start) {
+                add_ref(right);
+            }
+        }
+        if (e_start < start) {
+            it->second.len = start - e_start;
+            ++it;
+        } else {
+            it = map.erase(it);
+            if (e_end <= end) {
+                drop_ref(e);
+            }
+        }
+    }
+}
+
+void StorageEngine::release(const Extent& ext, uint64_t bytes) {
+    Segment& seg = *segments_[ext.seg];
+    seg.live_bytes -= std::min(seg.live_bytes, bytes);
+}
+
+void StorageEngine::add_ref(const Extent& ext) {
+    if (ext.ref_seg != UINT32_MAX) {
+        segments_[ext.ref_seg]->refs++;
+    }
+    if (ext.chunk != ChunkIndex::kNone) {
+        chunks_.ref(ext.chunk);
+    }
+}
+
+void StorageEngine::drop_ref(const Extent& ext) {
+    if (ext.ref_seg != UINT32_MAX) {
+        Segment& seg = *segments_[ext.ref_seg];
+        seg.refs -= std::min<uint64_t>(seg.refs, 1);
+    }
+    if (ext.chunk != ChunkIndex::kNone) {
+        chunks_.unref(ext.chunk);
+    }
+}
+
+void StorageEngine::drop_inode(uint64_t ino) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(ino);
+    if (it == index_.end()) {
+        return;
+    }
+    for (auto& e : it->second) {
+        release(e.second, e.second.len);
+        drop_ref(e.second);
+    }
+    index_.erase(it);
+    // 缓存中的块没有区间覆盖后不会再被读到, 只需拦下正在进行的读取
+    if (cache_) {
+        cache_->invalidate(ino, 0, 0);
+    }
+}
+
+void StorageEngine::truncate(uint64_t ino, uint64_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(ino);
+    if (it == index_.end()) {
+        return;
+    }
+    punch(it->second, size, UINT64_MAX);
+    if (it->second.empty()) {
+        index_.erase(it);
+    }
+    // 截断点之后的整块不再被区间覆盖; 截断点所在的块内容变了
+    if (cache_) {
+        cache_->invalidate(ino, size / BlockCache::kBlockSize, size % BlockCache::kBlockSize ? 1 : 0);
+    }
+}
+
+// O_DIRECT要求偏移、长度和缓冲区都按块对齐, 读取覆盖范围后再拷出
+ssize_t StorageEngine::pread_aligned(int fd, char* out, size_t len, uint64_t pos) {
+    if (!direct_io_ && len > 0) {
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = pread(fd, out + got, len - got, pos + got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return -errno;
+            if (n == 0) break;
+            got += n;
+        }
+        return got;
+    }
+
+    uint64_t start = pos & ~(kBlock - 1);
+    uint64_t end = align_up(pos + len);
+    bool aligned = start == pos && end == pos + len && (reinterpret_cast<uintptr_t>(out) & (kBlock - 1)) == 0;
+    AlignedBuf tmp(aligned ? nullptr : alloc_aligned(end - start));
+    char* dst = aligned ? out : tmp.get();
+    if (dst == nullptr) {
+        return -ENOMEM;
+    }
+
+    size_t got = 0;
+    while (got < end - start) {
+        ssize_t n = pread(fd, dst + got, end - start - got, start + got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) break;
+        got += n;
+    }
+    size_t avail = got > pos - start ? std::min<size_t>(len, got - (pos - start)) : 0;
+    if (!aligned) {
+        memcpy(out, dst + (pos - start), avail);
+    }
+    return avail;
+}
+
+ssize_t StorageEngine::read_source(const Source& src, char* out, size_t len, uint64_t pos) {
+    if (src.archive) {
+        return ec_->read(*src.archive, out, len, pos);
+    }
+    return pread_aligned(src.fd, out, len, pos);
+}
+
+int StorageEngine::load_record(const Source& src, uint64_t rec_pos, std::vector<char>* data, size_t* data_off,
+                               CompressPolicy* policy) {
+    AlignedBuf block(alloc_aligned(kBlock));
+    if (!block) {
+        return -ENOMEM;
+    }
+    ssize_t n = read_source(src, block.get(), kBlock, rec_pos);
+    if (n < 0) {
+        return n;
+    }
+    RecordHeader hdr;
+    memcpy(&hdr, block.get(), sizeof(hdr));
+    if (n != static_cast<ssize_t>(kBlock) || !header_valid(hdr, block.get())) {
+        checksum_errors_++;
+        return -EBADMSG;
+    }
+
+    size_t rec_len = record_len(hdr);
+    AlignedBuf rec;
+    if (rec_len > kBlock) {
+        rec.reset(alloc_aligned(rec_len));
+        if (!rec) {
+            return -ENOMEM;
+        }
+        n = read_source(src, rec.get(), rec_len, rec_pos);
+        if (n < 0) {
+            return n;
+        }
+        if (n != static_cast<ssize_t>(rec_len)) {
+            return -EIO;
+        }
+    } else {
+        rec = std::move(block);
+    }
+    return decode_record(rec.get(), data, data_off, policy);
+}
+
+int StorageEngine::decode_record(const char* rec, std::vector<char>* data, size_t* data_off,
+                                 CompressPolicy* policy) {
+    RecordHeader hdr;
+    memcpy(&hdr, rec, sizeof(hdr));
+    *data_off = sizeof(RecordHeader) + desc_bytes(hdr);
+    const char* payload = rec + *data_off;
+    if (crc32c(0, payload, hdr.length) != hdr.data_sum) {
+        checksum_errors_++;
+        return -EBADMSG;
+    }
+    if (!(hdr.flags & kRecCompressed)) {
+        data->assign(payload, payload + hdr.length);
+        if (policy) {
+            *policy = CompressPolicy();
+        }
+        return 0;
+    }
+
+    // 校验通过后解压失败说明写入时就已损坏
+    CompressDesc d = load_compress_desc(hdr, rec);
+    Codec codec = static_cast<Codec>(d.codec);
+    if (!codec_available(codec)) {
+        return -EOPNOTSUPP;
+    }
+    data->resize(d.raw_len);
+    if (!decompress(codec, payload, hdr.length, data->data(), d.raw_len)) {
+        checksum_errors_++;
+        return -EBADMSG;
+    }
+    if (policy) {
+        policy->codec = codec;
+        policy->level = d.level;
+    }
+    return 0;
+}
+
+ssize_t StorageEngine::read(uint64_t ino, uint64_t offset, char* buf, size_t len) {
+    struct Piece {
+        uint64_t file_off;
+        uint64_t len;
+        uint64_t pos;
+        uint64_t rec_pos;
+        uint32_t seg;
+        Source src;
+    };
+    std::vector<Piece> pieces;
+
+    // 启用读缓存时按整块查找和填充, 区间也按块对齐后的范围收集
+    const uint64_t kCacheBlock = BlockCache::kBlockSize;
+    uint64_t start = offset;
+    uint64_t end = offset + len;
+    if (cache_) {
+        start = offset & ~(kCacheBlock - 1);
+        end = (end + kCacheBlock - 1) & ~(kCacheBlock - 1);
+    }
+    uint64_t epoch = 0;
+
+    // 读取期间不允许回收线程复用段
+    std::shared_lock<std::shared_mutex> reclaim(reclaim_lock_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // 与索引同时取得, 此后的写入和截断会让本次读到的块不再放入缓存
+        if (cache_) {
+            epoch = cache_->epoch(ino);
+        }
+        auto it = index_.find(ino);
+        if (it != index_.end()) {
+            const ExtentMap& map = it->second;
+            auto e = map.upper_bound(start);
+            if (e != map.begin()) {
+                --e;
+            }
+            for (; e != map.end() && e->first < end; ++e) {
+                uint64_t s = std::max(e->first, start);
+                uint64_t t = std::min(e->first + e->second.len, end);
+                if (s >= t) {
+                    continue;
+                }
+                pieces.push_back({s, t - s, e->second.data_pos + (s - e->first), e->second.rec_pos,
+                                  e->second.seg, source(*segments_[e->second.seg])});
+            }
+        }
+    }
+
+    memset(buf, 0, len);
+    ssize_t result = 0;
+    for (const Piece& p : pieces) {
+        uint64_t s = std::max(p.file_off, offset);
+        uint64_t t = std::min(p.file_off + p.len, offset + len);
+        if (s < t) {
+            result = std::max<ssize_t>(result, t - offset);
+        }
+    }
+
+    // 只查找仍有区间覆盖的块: 删除和截断之后残留在缓存中的块因此不会再被读到,
+    // 之后写入同一位置时insert_extent会让它们失效
+    char* out = buf;
+    uint64_t base = offset;
+    std::vector<uint8_t> missed;
+    std::vector<char> blocks;
+    if (cache_) {
+        missed.assign((end - start) / kCacheBlock, 0);
+        std::vector<uint8_t> covered(missed.size(), 0);
+        for (const Piece& p : pieces) {
+            for (uint64_t b = (p.file_off - start) / kCacheBlock; b <= (p.file_off + p.len - 1 - start) / kCacheBlock;
+                 b++) {
+                covered[b] = 1;
+            }
+        }
+        bool any = false;
+        for (size_t b = 0; b < covered.size(); b++) {
+            if (!covered[b]) {
+                continue;
+            }
+            uint64_t bs = start + b * kCacheBlock;
+            uint64_t s = std::max(bs, offset);
+            uint64_t t = std::min(bs + kCacheBlock, offset + len);
+            if (!cache_->lookup(ino, bs / kCacheBlock, s - bs, t - s, buf + (s - offset))) {
+                missed[b] = 1;
+                any = true;
+            }
+        }
+        if (!any) {
+            return result;
+        }
+        // 未命中的块整块读出, 放入缓存后再拷出请求的部分
+        blocks.assign(end - start, 0);
+        out = blocks.data();
+        base = start;
+    }
+
+    // 校验以整条记录为单位, 同一记录的多个片段只读一次
+    std::vector<char> data;
+    size_t data_off = 0;
+    uint32_t loaded_seg = UINT32_MAX;
+    uint64_t loaded_pos = 0;
+    for (const Piece& p : pieces) {
+        if (cache_) {
+            bool needed = false;
+            for (uint64_t b = (p.file_off - start) / kCacheBlock;
+                 !needed && b <= (p.file_off + p.len - 1 - start) / kCacheBlock; b++) {
+                needed = missed[b];
+            }
+            if (!needed) {
+                continue;
+            }
+        }
+        if (p.seg != loaded_seg || p.rec_pos != loaded_pos) {
+            int ret = load_record(p.src, p.rec_pos, &data, &data_off);
+            if (ret < 0) {
+                return ret;
+            }
+            loaded_seg = p.seg;
+            loaded_pos = p.rec_pos;
+        }
+        uint64_t skip = p.pos - p.rec_pos - data_off;
+        if (skip + p.len > data.size()) {
+            return -EIO;
+        }
+        memcpy(out + (p.file_off - base), data.data() + skip, p.len);
+    }
+
+    for (size_t b = 0; b < missed.size(); b++) {
+        if (!missed[b]) {
+            continue;
+        }
+        uint64_t bs = start + b * kCacheBlock;
+        cache_->insert(ino, bs / kCacheBlock, blocks.data() + b * kCacheBlock, epoch);
+        uint64_t s = std::max(bs, offset);
+        uint64_t t = std::min(bs + kCacheBlock, offset + len);
+        memcpy(buf + (s - offset), blocks.data() + (s - start), t - s);
+    }
+    return result;
+}
+
+void StorageEngine::compact_loop() {
+    std::unique_lock<std::mutex> lock(compact_lock_);
+    while (!compact_stop_) {
+        compact_cv_.wait_for(lock, std::chrono::seconds(opts_.compact_interval));
+        if (compact_stop_) {
+            break;
+        }
+        lock.unlock();
+
+        // 每次回收存活比例最低的封存段, 直到没有低于阈值的段
+        for (;;) {
+            uint32_t victim = UINT32_MAX;
+            double best = 1.0;
+            {
+                std::lock_guard<std::mutex> g(mutex_);
+                for (auto& s : segments_) {
+                    if (s->state != SegState::Sealed || s->write_pos <= kBlock || s->inflight > 0) {
+                        continue;
+                    }
+                    double ratio = live_ratio(s->live_bytes, s->refs, s->write_pos - kBlock, s->inflated);
+                    if (ratio * 100 < opts_.compact_threshold && ratio < best) {
+                        best = ratio;
+                        victim = s->id;
+                    }
+                }
+            }
+            if (victim == UINT32_MAX || !compact_segment(victim)) {
+                break;
+            }
+            std::lock_guard<std::mutex> g(compact_lock_);
+            if (compact_stop_) {
+                break;
+            }
+        }
+        if (ec_) {
+            archive_cold();
+        }
+        lock.lock();
+    }
+}
+
+// 把封存段中仍被引用的区间搬到当前段, 全部搬走后段变为空闲
+// 数据在本段的区间 (包括其他段中引用本段去重块的区间) 各自拷贝一份数据;
+// 只有引用记录在本段的区间重写引用, 数据留在原处
+bool StorageEngine::compact_segment(uint32_t id) {
+    struct MovedRef {
+        uint64_t ino;
+        uint64_t seq;
+        uint64_t meta_seq;
+        ChunkRef ref;
+    };
+    std::vector<Scanned> live;
+    std::vector<MovedRef> refs;
+    std::map<uint32_t, Source> sources;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& f : index_) {
+            for (auto& e : f.second) {
+                const Extent& ext = e.second;
+                if (ext.seg != id && ext.ref_seg != id) {
+                    continue;
+                }
+                if (ext.seg != id && ext.chunk != ChunkIndex::kNone) {
+                    const ChunkIndex::Chunk& ch = chunks_.at(ext.chunk);
+                    ChunkRef c = {ch.fp, e.first, ext.len, ext.chunk, ext.seg, ch.len,
+                                  static_cast<uint32_t>(ext.data_pos - ch.data_pos),
+                                  segments_[ext.seg]->generation, ch.data_pos, ch.rec_pos};
+                    refs.push_back(MovedRef{f.first, ext.seq, ext.meta_seq, c});
+                    continue;
+                }
+                live.push_back(Scanned{f.first, e.first, ext, false, {}, 0, 0, 0});
+                if (sources.count(ext.seg) == 0) {
+                    sources[ext.seg] = source(*segments_[ext.seg]);
+                }
+            }
+        }
+    }
+
+    // 按记录排序, 同一记录的多个区间只读取校验一次
+    std::sort(live.begin(), live.end(), [](const Scanned& a, const Scanned& b) {
+        return a.ext.seg != b.ext.seg ? a.ext.seg < b.ext.seg : a.ext.data_pos < b.ext.data_pos;
+    });
+
+    std::vector<char> data;
+    size_t data_off = 0;
+    CompressPolicy policy;
+    uint32_t loaded_seg = UINT32_MAX;
+    uint64_t loaded_pos = 0;
+    bool loaded = false;
+    std::vector<std::unique_ptr<Request>> batch;
+    size_t batch_bytes = 0;
+    auto flush = [&]() {
+        if (!batch.empty()) {
+            submit_and_wait(batch);
+            batch.clear();
+            batch_bytes = 0;
+        }
+    };
+
+    for (const Scanned& r : live) {
+        // 校验失败的区间留在原段, 该段也就不会被复用
+        if (!loaded || loaded_seg != r.ext.seg || loaded_pos != r.ext.rec_pos) {
+            loaded = load_record(sources[r.ext.seg], r.ext.rec_pos, &data, &data_off, &policy) == 0;
+            loaded_seg = r.ext.seg;
+            loaded_pos = r.ext.rec_pos;
+        }
+        uint64_t skip = r.ext.data_pos - r.ext.rec_pos - data_off;
+        if (!loaded || skip + r.ext.len > data.size()) {
+            continue;
+        }
+        auto req = make_request(r.ino, r.offset, data.data() + skip, r.ext.len, r.ext.meta_seq, 0, policy);
+        if (!req) {
+            break;
+        }
+        // 保留原数据版本, 恢复时不会压过之后的覆盖写
+        req->seq = r.ext.seq;
+        req->relocate = true;
+        req->src_seg = r.ext.seg;
+        req->src_pos = r.ext.data_pos;
+        req->src_ref = r.ext.ref_seg;
+        batch_bytes += req->rec_len;
+        batch.push_back(std::move(req));
+        if (batch_bytes >= kMaxRoundBytes) {
+            flush();
+        }
+    }
+
+    // 同一inode、同一数据版本的引用合并到一条引用记录
+    for (size_t i = 0; i < refs.size();) {
+        const MovedRef& first = refs[i];
+        std::vector<ChunkRef> list;
+        for (; i < refs.size() && list.size() < kMaxRefDescs && refs[i].ino == first.ino &&
+               refs[i].seq == first.seq && refs[i].meta_seq == first.meta_seq;
+             i++) {
+            list.push_back(refs[i].ref);
+        }
+        auto req = make_ref_request(first.ino, std::move(list), first.meta_seq);
+        if (!req) {
+            break;
+        }
+        req->seq = first.seq;
+        req->relocate = true;
+        req->src_seg = id;
+        batch_bytes += req->rec_len;
+        batch.push_back(std::move(req));
+        if (batch_bytes >= kMaxRoundBytes) {
+            flush();
+        }
+    }
+    flush();
+
+    std::unique_lock<std::shared_mutex> reclaim(reclaim_lock_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Segment& seg = *segments_[id];
+    if (seg.state != SegState::Sealed || seg.live_bytes != 0 || seg.refs != 0) {
+        return false;
+    }
+    seg.state = SegState::Free;
+    seg.write_pos = kBlock;
+    // 已编码的段复用时重新创建本地文件, 分片不再需要
+    if (seg.archive) {
+        ec_->remove(id);
+        seg.archive.reset();
+    }
+    reclaimed_segments_++;
+    return true;
+}
+
+// 每次编码封存最久的一个冷段, 直到没有符合条件的段; 存活比例低于回收阈值的段
+// 很快会被回收, 不值得编码。编码失败的段留到下一次检查再试
+void StorageEngine::archive_cold() {
+    auto cold_before = std::chrono::steady_clock::now() - std::chrono::seconds(opts_.ec_after);
+    for (;;) {
+        uint32_t victim = UINT32_MAX;
+        {
+            std::lock_guard<std::mutex> g(mutex_);
+            auto oldest = cold_before;
+            for (auto& s : segments_) {
+                if (s->state != SegState::Sealed || s->archive || s->fd < 0 || s->write_pos <= kBlock ||
+                    s->inflight > 0 || s->sealed_at > oldest) {
+                    continue;
+                }
+                double ratio = live_ratio(s->live_bytes, s->refs, s->write_pos - kBlock, s->inflated);
+                if (ratio * 100 >= opts_.compact_threshold) {
+                    oldest = s->sealed_at;
+                    victim = s->id;
+                }
+            }
+        }
+        if (victim == UINT32_MAX || !archive_segment(victim)) {
+            break;
+        }
+        std::lock_guard<std::mutex> g(compact_lock_);
+        if (compact_stop_) {
+            break;
+        }
+    }
+}
+
+// 封存段不再写入, 只有回收线程会复用它, 因此编码期间可以直接读本地文件;
+// 分片落盘后在独占锁下把读取来源切换到分片并删除本地文件
+bool StorageEngine::archive_segment(uint32_t id) {
+    int fd;
+    uint64_t generation;
+    uint64_t len;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const Segment& seg = *segments_[id];
+        fd = seg.fd;
+        generation = seg.generation;
+        len = seg.write_pos;
+    }
+
+    std::string err;
+    ErasureStore::ArchivePtr archive = ec_->encode(
+        id, generation, len,
+        [this, fd](char* out, size_t n, uint64_t pos) { return pread_aligned(fd, out, n, pos); }, &err);
+    if (!archive) {
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> reclaim(reclaim_lock_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Segment& seg = *segments_[id];
+    seg.archive = archive;
+    seg.size = len;
+    ::close(seg.fd);
+    seg.fd = -1;
+    unlink(segment_path(id).c_str());
+    return true;
+}
+
+StorageEngine::Stats StorageEngine::stats() const {
+    Stats st;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& s : segments_) {
+            if (s->fd < 0 && !s->archive) {
+                continue;
+            }
+            st.segments++;
+            if (s->archive) {
+                st.archived_segments++;
+                st.archived_bytes += s->archive->length;
+            }
+            if (s->state == SegState::Free) {
+                st.free_segments++;
+                continue;
+            }
+            st.live_bytes += s->live_bytes;
+            st.used_bytes += s->write_pos - kBlock;
+        }
+        st.dedup_chunks = chunks_.size();
+        st.dedup_index_bytes = chunks_.memory();
+    }
+    st.appended_bytes = appended_bytes_.load();
+    st.relocated_bytes = relocated_bytes_.load();
+    st.reclaimed_segments = reclaimed_segments_.load();
+    st.write_errors = write_errors_.load();
+    st.checksum_errors = checksum_errors_.load();
+    st.commit_rounds = commit_rounds_.load();
+    st.commit_requests = commit_requests_.load();
+    st.commit_syncs = commit_syncs_.load();
+    st.dedup_bytes = dedup_bytes_.load();
+    st.compress_in_bytes = compress_in_.load();
+    st.compress_out_bytes = compress_out_.load();
+    st.compress_skipped_bytes = compress_skipped_.load();
+    return st;
+}
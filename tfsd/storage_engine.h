@@ -0,0 +1,331 @@
+#ifndef TFSD_STORAGE_ENGINE_H
+#define TFSD_STORAGE_ENGINE_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "block_cache.h"
+#include "chunk_index.h"
+#include "compress.h"
+#include "erasure_store.h"
+
+class EventLoop;
+class MetaStore;
+
+// tfsd的本地数据存储
+// 传输数据以记录形式追加到预分配的段文件 (<data_dir>/segments/seg-NNNNNN.dat),
+// 记录按4KB对齐并以O_DIRECT写入。写线程把并发提交的追加按到达顺序分配位置,
+// 一轮内的写入经io_uring同时在途, 写完后对涉及的段做一次fdatasync再统一应答 (组提交),
+// 段文件本身就是预写日志: 记录落盘之后append才返回, tfsd随后才完成传输。
+// 内存中按inode维护 文件偏移 -> (段, 位置) 的区间索引, 覆盖写会裁剪旧区间;
+// 后台回收线程把存活数据少的已封存段中的有效区间搬到当前段, 然后复用该段。
+// 启动时扫描所有段重建索引, 并按元数据副本丢弃已删除/已截断的数据。
+// 热升级时新进程在旧进程仍在写入时预扫描 (prescan), 交接后open只补扫之后变化的段尾。
+// 每条记录保存数据的CRC32C, 读取和搬迁时整条复核, 不一致返回-EBADMSG。
+// 配置了纠删码目标时, 封存超过ec_after秒且存活比例不低于回收阈值的冷段由回收线程
+// 编码到k+m个目标 (见ErasureStore) 后删除本地段文件, 之后该段的读取和搬迁都经由分片。
+// 启用去重时追加的数据按内容分块 (见cdc.h), 以SHA-256指纹查找已有的块 (见ChunkIndex):
+// 新块以带指纹列表的数据记录写入, 已有的块只写引用记录 (指向块所在的段、代数和位置)。
+// 区间对数据所在段按字节计入存活量, 块因此在仍被引用时不会被回收; 回收引用记录所在的段
+// 时重写引用, 回收块所在的段时引用它的区间各自得到一份拷贝。
+// 配置了压缩时记录的数据在调用append的线程中压缩后存放, 省不下至少一个块的照原样存放;
+// 区间仍按原始数据描述, 读取和搬迁时整条解压。搬迁沿用原记录的压缩方式。
+// 配置了读缓存时read按4KB文件块查找BlockCache, 未命中的块读盘后放入; 写入和截断使涉及的块失效。
+class StorageEngine {
+public:
+    struct Options {
+        uint64_t segment_size = 64ull << 20;    // 每个段文件的预分配大小
+        unsigned compact_threshold = 50;        // 存活比例低于该百分比的封存段会被回收
+        unsigned compact_interval = 5;          // 回收线程的检查间隔 (秒)
+        // 组提交窗口: 一轮开始前最多再等这么久, 让更多并发写入共用一次fdatasync;
+        // 0表示只合并已经排队的请求。攒够commit_batch个请求时提前开始
+        unsigned commit_delay_us = 0;
+        unsigned commit_batch = 64;
+        // 冷段纠删码, ec_k为0时不启用; ec_targets须为ec_k + ec_m个目录
+        std::vector<std::string> ec_targets;
+        unsigned ec_k = 0;
+        unsigned ec_m = 0;
+        unsigned ec_after = 600;                // 段封存多少秒后编码
+        bool dedup = false;                     // 按内容分块去重
+        CompressPolicy compress;                // append未指定时的压缩方式
+        size_t cache_bytes = 0;                 // 读缓存大小, 0表示不启用
+    };
+
+    struct Stats {
+        uint64_t segments = 0;
+        uint64_t free_segments = 0;
+        uint64_t live_bytes = 0;
+        uint64_t used_bytes = 0;
+        uint64_t appended_bytes = 0;
+        uint64_t relocated_bytes = 0;
+        uint64_t reclaimed_segments = 0;
+        uint64_t write_errors = 0;
+        uint64_t checksum_errors = 0;
+        uint64_t commit_rounds = 0;            // 组提交轮数
+        uint64_t commit_requests = 0;          // 各轮提交的记录数之和
+        uint64_t commit_syncs = 0;             // fdatasync次数
+        uint64_t archived_segments = 0;        // 只以纠删码分片存放的段
+        uint64_t archived_bytes = 0;
+        uint64_t dedup_chunks = 0;             // 去重索引中的块数
+        uint64_t dedup_index_bytes = 0;        // 去重索引占用的内存
+        uint64_t dedup_bytes = 0;              // 以引用方式写入 (未再次存储) 的字节
+        uint64_t compress_in_bytes = 0;        // 压缩存放的记录的原始数据量 (包括搬迁时重新压缩的)
+        uint64_t compress_out_bytes = 0;       // 这些记录压缩后的数据量
+        uint64_t compress_skipped_bytes = 0;   // 启用了压缩但照原样存放的数据量
+    };
+
+    StorageEngine(const std::string& data_dir, const Options& opts);
+    ~StorageEngine();
+
+    StorageEngine(const StorageEngine&) = delete;
+    StorageEngine& operator=(const StorageEngine&) = delete;
+
+    // 打开段文件并重建索引, meta用于丢弃已删除inode和截断点之后的旧数据
+    bool open(const MetaStore& meta, std::string* err);
+    // 在另一个进程仍在写入数据目录时预先扫描段文件, 不修改数据目录;
+    // 之后的prescan和open只从各段确定不变的位置补扫, 段被复用或编码过的重新全量扫描。
+    // 失败不影响open, 只是退回全量扫描
+    bool prescan(std::string* err);
+    // 停止回收和写线程并关闭段文件, 之后不能再调用append; 析构时自动调用
+    void close();
+
+    // 追加一段文件数据, 持久化后返回0, 失败返回负的errno
+    // meta_seq为数据到达时已应用的元数据序号, 用于恢复时判断截断/删除的先后
+    // crc非空时输出整段数据的CRC32C; policy为空时按Options::compress压缩; 可在任意线程并发调用
+    int append(uint64_t ino, uint64_t offset, const char* data, size_t len, uint64_t meta_seq,
+               uint32_t* crc = nullptr, const CompressPolicy* policy = nullptr);
+
+    // 读取文件区间, 空洞补零, 返回读到的字节数 (到最后一个区间结尾为止) 或负的errno
+    // 所涉及的记录校验失败时返回-EBADMSG
+    ssize_t read(uint64_t ino, uint64_t offset, char* buf, size_t len);
+
+    // 元数据变化: inode删除/复用, 截断
+    void drop_inode(uint64_t ino);
+    void truncate(uint64_t ino, uint64_t size);
+
+    Stats stats() const;
+    bool direct_io() const { return direct_io_; }
+    // 未启用纠删码时为空
+    const ErasureStore* erasure_store() const { return ec_.get(); }
+    bool dedup() const { return opts_.dedup; }
+    const CompressPolicy& compression() const { return opts_.compress; }
+    // 未启用读缓存时为空
+    const BlockCache* block_cache() const { return cache_.get(); }
+
+private:
+    enum class SegState { Free, Active, Sealed };
+
+    struct Segment {
+        uint32_t id = 0;
+        int fd = -1;
+        uint64_t generation = 0;   // 每次复用递增, 旧记录因代数不符而失效
+        uint64_t size = 0;
+        uint64_t write_pos = 0;
+        uint64_t live_bytes = 0;   // 仍被索引引用的数据字节
+        uint64_t refs = 0;         // 引用记录在本段中的区间数
+        uint32_t inflight = 0;     // 已分配位置、还未提交的记录数, 为0之前存活量不完整
+        uint64_t inflated = 0;     // 压缩记录的原始数据比存放的多出的字节, 存活比例按原始数据计
+        SegState state = SegState::Free;
+        std::chrono::steady_clock::time_point sealed_at;
+        ErasureStore::ArchivePtr archive;  // 非空时段内容在纠删码分片中, 没有本地文件
+    };
+
+    // 读取段内容的来源, 在mutex_下取得, 读取期间持有reclaim_lock_共享锁
+    struct Source {
+        int fd = -1;
+        ErasureStore::ArchivePtr archive;
+    };
+
+    // 索引中的一个区间: 文件[offset, offset+len) 位于段seg的data_pos处
+    struct Extent {
+        uint32_t seg;
+        uint32_t len;
+        uint64_t data_pos;
+        uint64_t rec_pos;          // 所在记录的起始位置, 校验时整条读取
+        uint64_t seq;              // 数据版本, 搬迁时保持不变
+        uint64_t meta_seq;
+        uint32_t ref_seg = UINT32_MAX;        // 由引用记录描述时, 引用记录所在的段
+        uint32_t chunk = ChunkIndex::kNone;   // 数据属于去重索引中的块
+    };
+
+    using ExtentMap = std::map<uint64_t, Extent>;  // 以文件偏移为键
+
+    // 去重记录中的一个块, 或引用记录中的一项 (引用块chunk_pos处长chunk_len的数据中
+    // [skip, skip + len)的部分)
+    struct ChunkRef {
+        Fingerprint fp;
+        uint64_t offset;           // 文件偏移
+        uint32_t len;
+        uint32_t id;
+        uint32_t seg;
+        uint32_t chunk_len;
+        uint32_t skip;
+        uint64_t generation;
+        uint64_t chunk_pos;
+        uint64_t rec_pos;
+    };
+
+    struct Scanned {
+        uint64_t ino;
+        uint64_t offset;
+        Extent ext;
+        bool has_fp;               // 来自去重记录, 恢复时按指纹重建块索引
+        Fingerprint fp;
+        uint64_t chunk_pos;
+        uint32_t chunk_len;
+        uint64_t target_gen;       // 引用记录所指段的代数
+        uint64_t pos;              // 所在记录在本段中的位置
+    };
+
+    // 预扫描的结果: 段内resume之前的记录在写入者停止之前就已确定
+    struct Prescanned {
+        uint64_t generation = 0;
+        ino_t file = 0;            // 段文件的inode号, 以纠删码分片存放时为0
+        uint64_t resume = 0;       // 补扫的起点, 0表示没有可用的记录
+        uint64_t inflated = 0;     // resume之前记录的压缩膨胀量
+        std::vector<Scanned> recs;
+    };
+
+    struct Request {
+        uint64_t ino;
+        uint64_t offset;
+        uint32_t len;              // 原始数据长度
+        uint32_t stored;           // 记录中存放的数据长度, 压缩时小于len
+        bool compressed;
+        size_t data_off;           // 数据在记录中的偏移
+        uint64_t seq;              // 0表示新数据, 由写线程分配
+        uint64_t meta_seq;
+        uint32_t data_sum;
+        char* buf;                 // 对齐的记录缓冲区, 头部由写线程填写
+        size_t rec_len;
+        bool relocate;             // 回收搬迁: 只在原区间未变时更新索引
+        uint32_t src_seg;
+        uint64_t src_pos;
+        uint32_t src_ref;
+        bool refs;                 // 引用记录, chunks为各项引用
+        std::vector<ChunkRef> chunks;   // 去重数据记录中的各块, 或引用记录中的各项
+        uint32_t seg;
+        uint64_t pos;
+        int result;
+        std::promise<int> done;
+    };
+
+    // 创建段目录, 探测O_DIRECT并打开纠删码目标
+    bool prepare(std::string* err);
+    // 可以沿用的预扫描结果, 没有时为空
+    const Prescanned* prescanned(const Segment& seg) const;
+    // repair为false时不删除与本地段重复的分片, 用于预扫描
+    bool open_segments(std::string* err, bool repair = true);
+    // from非空时沿用其中的记录, 从from->resume开始补扫; save非空时输出预扫描结果
+    bool scan_segment(Segment& seg, std::vector<Scanned>* recs, std::string* err,
+                      const Prescanned* from = nullptr, Prescanned* save = nullptr);
+    // block为一条有效记录的第一个块
+    static void scan_record(const char* block, uint32_t seg, uint64_t pos, std::vector<Scanned>* recs);
+    int open_segment_file(uint32_t id, bool create);
+    bool activate(Segment& seg);
+    bool reserve(size_t rec_len, uint32_t* seg, uint64_t* pos);
+
+    // desc_len为记录头和数据之间块列表的长度, 压缩时列表之后还有一项压缩描述
+    std::unique_ptr<Request> make_request(uint64_t ino, uint64_t offset, const char* data,
+                                          size_t len, uint64_t meta_seq, size_t desc_len = 0,
+                                          const CompressPolicy& policy = CompressPolicy());
+    // 去重记录: 连续的新块写成带指纹列表的数据记录, 已有的块写成引用记录
+    std::unique_ptr<Request> make_chunk_request(uint64_t ino, const char* data, std::vector<ChunkRef> chunks,
+                                                uint64_t meta_seq, const CompressPolicy& policy);
+    std::unique_ptr<Request> make_ref_request(uint64_t ino, std::vector<ChunkRef> refs, uint64_t meta_seq);
+    // 去重追加; use_refs为false时全部写为数据, 用于引用的块在提交前失效后重写
+    int append_chunks(uint64_t ino, uint64_t offset, const char* data, size_t len, uint64_t meta_seq,
+                      bool use_refs, const CompressPolicy& policy, uint32_t* crc);
+    int submit_and_wait(std::vector<std::unique_ptr<Request>>& reqs);
+    void writer_loop();
+    void write_round(EventLoop& loop, std::vector<Request*>& round);
+
+    // 以下需持有mutex_
+    void insert_extent(uint64_t ino, uint64_t offset, const Extent& ext);
+    void punch(ExtentMap& map, uint64_t start, uint64_t end);
+    void release(const Extent& ext, uint64_t bytes);
+    // 区间对引用记录所在段和去重块的引用
+    void add_ref(const Extent& ext);
+    void drop_ref(const Extent& ext);
+    uint32_t resolve_chunk(const Fingerprint& fp, uint32_t seg, uint64_t chunk_pos, uint64_t rec_pos,
+                           uint32_t len);
+    bool ref_valid(const ChunkRef& ref) const;
+    void commit_refs(Request* req);
+    void commit_chunks(Request* req);
+
+    void compact_loop();
+    bool compact_segment(uint32_t id);
+    // 编码封存已久的段, 在回收线程中执行
+    void archive_cold();
+    bool archive_segment(uint32_t id);
+
+    static Source source(const Segment& seg) { return Source{seg.fd, seg.archive}; }
+    ssize_t pread_aligned(int fd, char* out, size_t len, uint64_t pos);
+    ssize_t read_source(const Source& src, char* out, size_t len, uint64_t pos);
+    // 读取整条记录并校验, data输出记录中的全部数据 (已解压), data_off输出数据在记录中的偏移,
+    // policy非空时输出记录的压缩方式
+    int load_record(const Source& src, uint64_t rec_pos, std::vector<char>* data, size_t* data_off,
+                    CompressPolicy* policy = nullptr);
+    // 校验内存中头部已校验过的整条记录并解出数据, 参数同上
+    int decode_record(const char* rec, std::vector<char>* data, size_t* data_off, CompressPolicy* policy);
+    std::string segment_path(uint32_t id) const;
+
+    std::string dir_;
+    Options opts_;
+    bool direct_io_ = true;
+    std::unique_ptr<ErasureStore> ec_;
+    std::unique_ptr<BlockCache> cache_;
+
+    // 索引和段表
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Segment>> segments_;
+    std::unordered_map<uint64_t, ExtentMap> index_;
+    uint32_t active_ = UINT32_MAX;
+    uint64_t next_seq_ = 1;
+    ChunkIndex chunks_;
+    std::map<uint32_t, Prescanned> prescanned_;  // 按段号, open后清空
+
+    // 读取与段复用互斥: 读持共享锁, 回收段时持独占锁
+    std::shared_mutex reclaim_lock_;
+
+    // 写线程的提交队列
+    std::mutex queue_lock_;
+    std::condition_variable queue_cv_;
+    std::deque<Request*> queue_;
+    bool stopping_ = false;
+    std::thread writer_;
+
+    std::mutex compact_lock_;
+    std::condition_variable compact_cv_;
+    bool compact_stop_ = false;
+    std::thread compactor_;
+
+    std::atomic<uint64_t> appended_bytes_{0};
+    std::atomic<uint64_t> relocated_bytes_{0};
+    std::atomic<uint64_t> reclaimed_segments_{0};
+    std::atomic<uint64_t> write_errors_{0};
+    std::atomic<uint64_t> checksum_errors_{0};
+    std::atomic<uint64_t> commit_rounds_{0};
+    std::atomic<uint64_t> commit_requests_{0};
+    std::atomic<uint64_t> commit_syncs_{0};
+    std::atomic<uint64_t> dedup_bytes_{0};
+    std::atomic<uint64_t> compress_in_{0};
+    std::atomic<uint64_t> compress_out_{0};
+    std::atomic<uint64_t> compress_skipped_{0};
+};
+
+#endif // TFSD_STORAGE_ENGINE_H
@@ -0,0 +1,101 @@
+#ifndef TFS_PROTO_H
+#define TFS_PROTO_H
+
+// tfsd与tfs_client内核模块之间的控制通道协议
+// 布局必须与 tfs_client/tfs_client.c 中的定义保持一致
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <climits>
+#include <cstdint>
+
+// IOCTL信息结构体
+struct tfs_xfer_info {
+    off_t offset;                // 文件偏移
+    size_t size;                 // 数据大小
+    unsigned long pfn;           // 物理页帧号 (仅用于调试)
+    unsigned int page_offset;    // 数据在映射区域内的起始偏移
+    unsigned int map_size;       // mmap需要映射的长度 (页对齐)
+    unsigned long ino;           // 所属文件的inode号
+    unsigned long id;            // 领取后的传输ID, 旧接口为0
+};
+
+// TFS_FETCH_XFERS参数: 一次领取最多max_xfers个传输项
+struct tfs_xfer_batch {
+    uint64_t infos;                      // struct tfs_xfer_info数组地址
+    uint32_t max_xfers;
+    uint32_t nr_xfers;                   // 输出: 实际领取的个数
+};
+
+// TFS_COMPLETE_XFER参数: 按ID完成传输项, 与领取顺序无关
+struct tfs_xfer_done {
+    uint64_t id;
+    int32_t status;                      // 0或负的errno, 负值会作为write的返回值
+    uint32_t reserved;
+};
+
+// 已领取传输项的mmap偏移 = id << TFS_XFER_MMAP_SHIFT, 加上页对齐的窗口偏移可只映射其中一部分
+#define TFS_XFER_MMAP_SHIFT 32
+#define TFS_XFER_BATCH_MAX 256
+
+#define TFS_META_BATCH_MAX 256
+#define TFS_ROOT_INO 1
+
+// SETATTR的attr_valid位 (与内核ATTR_*一致)
+#define TFS_ATTR_MODE (1u << 0)
+#define TFS_ATTR_SIZE (1u << 3)
+
+// 元数据操作类型
+enum tfs_meta_op_type {
+    TFS_META_CREATE = 1,
+    TFS_META_MKDIR,
+    TFS_META_UNLINK,
+    TFS_META_RMDIR,
+    TFS_META_RENAME,
+    TFS_META_SETATTR,
+    TFS_META_LINK,
+};
+
+// 单条元数据操作
+struct tfs_meta_op {
+    uint64_t seq;                        // 全局递增序号
+    uint32_t op;                         // enum tfs_meta_op_type
+    uint32_t mode;
+    uint64_t ino;
+    uint64_t parent_ino;
+    uint64_t new_parent_ino;             // 仅RENAME
+    uint64_t size;                       // 仅SETATTR
+    uint32_t attr_valid;                 // 仅SETATTR
+    uint32_t name_len;
+    uint32_t new_name_len;               // 仅RENAME
+    char name[NAME_MAX + 1];
+    char new_name[NAME_MAX + 1];
+};
+
+// TFS_GET_META_BATCH参数
+struct tfs_meta_batch {
+    uint64_t ops;                        // struct tfs_meta_op数组地址
+    uint32_t max_ops;
+    uint32_t nr_ops;                     // 输出: 实际返回的条数
+};
+
+// TFS_SET_CAPACITY参数: tfsd推送的容量信息, 内核缓存后供statfs使用
+struct tfs_capacity {
+    uint64_t total_bytes;
+    uint64_t free_bytes;
+    uint64_t avail_bytes;
+    uint32_t ttl_ms;                     // 缓存有效期
+    uint32_t reserved;
+};
+
+// 控制命令定义
+#define TFS_MAGIC 'T'
+#define TFS_GET_XFER_COUNT _IOR(TFS_MAGIC, 0, int)
+#define TFS_GET_XFER_INFO _IOWR(TFS_MAGIC, 1, struct tfs_xfer_info)
+#define TFS_RELEASE_XFER _IO(TFS_MAGIC, 2)
+#define TFS_GET_META_BATCH _IOWR(TFS_MAGIC, 3, struct tfs_meta_batch)
+#define TFS_SET_CAPACITY _IOW(TFS_MAGIC, 4, struct tfs_capacity)
+#define TFS_FETCH_XFERS _IOWR(TFS_MAGIC, 5, struct tfs_xfer_batch)
+#define TFS_COMPLETE_XFER _IOW(TFS_MAGIC, 6, struct tfs_xfer_done)
+
+#endif // TFS_PROTO_H
@@ -4,19 +4,42 @@
 #include <sys/poll.h>
 #include <unistd.h>
 #include <iostream>
+#include <sstream>
 #include <cstring>
+#include <cstdio>
 #include <iomanip>
 #include <cctype>
 #include <string>
 #include <vector>
-#include <fstream>
 #include <ctime>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+
+#include "tfs_proto.h"
+#include "ctl_channel.h"
+#include "handover.h"
+#include "meta_store.h"
+#include "work_pool.h"
+#include "event_loop.h"
+#include "storage_engine.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include "logger.h"
+#include "diag_sampler.h"
+#include "admin_socket.h"
+#include "metrics.h"
+#include "replication.h"
 
 // 日志文件路径
 #define LOG_FILE "./tfsd.log"
-std::ofstream log_file;
 
 // 是否启用详细日志
 bool verbose = false;
@@ -24,18 +47,92 @@ bool verbose = false;
 // 控制是否继续运行
 volatile bool running = true;
 
-// IOCTL信息结构体
-struct tfs_xfer_info {
-    off_t offset;                // 文件偏移
-    size_t size;                 // 数据大小
-    unsigned long pfn;           // 物理页帧号 (仅用于调试)
+// 收到的终止信号, 由主循环退出后记录
+// SIGTERM/SIGINT被阻塞并通过signalfd在事件循环中读取, signalfd不可用时才由信号处理函数设置
+volatile sig_atomic_t stop_signal = 0;
+
+// 数据目录 (元数据日志等)
+std::string data_dir = "./tfsd_data";
+
+// 传输处理线程数, 0表示按CPU数
+unsigned int num_workers = 0;
+
+// 数据段文件大小 (MB)
+unsigned int segment_mb = 64;
+
+// 数据落盘的组提交窗口 (微秒) 和提前结束窗口的记录数, 0表示按worker数
+// (每个worker同时只有一个写入在等待落盘, 全部到齐后再等也不会有更多)
+unsigned int commit_delay_us = 0;
+unsigned int commit_batch = 0;
+
+// 读缓存大小 (MB), 0表示不启用; 内存随缓存的块按需分配
+unsigned int cache_mb = 64;
+
+// 元数据日志超过这么多MB后做检查点, 0表示不做
+unsigned int checkpoint_mb = 64;
+
+// 大传输按窗口流式处理: 每次只映射一个窗口, 处理当前窗口时已映射好下一个,
+// 因此每个worker最多同时映射两个窗口, 与传输大小无关
+// 默认等于内核的最大段 (2MB): 整段一个窗口, 内核才能把大folio按PMD映射进来
+size_t stream_window = 2 << 20;
+
+// 管理套接字路径, 空字符串表示不开启
+std::string admin_path = "./tfsd.sock";
+
+// 热升级的交接套接字路径, 空字符串表示不开启
+std::string handover_path = "./tfsd.handover";
+
+// 复制到对端tfsd: 各窗口先发给对端再写本地, 本地落盘且达到确认数后才完成传输
+// 未配置对端时为空
+Replicator* replicator = nullptr;
+
+// 作为其他tfsd的对端接收复制数据 (--replica-listen), 未开启时为空
+ReplicaServer* replica_server = nullptr;
+
+// 按目录的压缩策略 (--compress-dir), 对目录下各层的文件生效, 最近的祖先目录优先;
+// 都不匹配时使用挂载点的默认策略 (--compress)。路径相对挂载点根目录
+struct CompressRule {
+    std::string dir;
+    CompressPolicy policy;
 };
+std::vector<CompressRule> compress_rules;
+
+// 传输内容预览和十六进制dump的采样策略
+DiagSampler sampler;
 
-// 控制命令定义
-#define TFS_MAGIC 'T'
-#define TFS_GET_XFER_COUNT _IOR(TFS_MAGIC, 0, int)
-#define TFS_GET_XFER_INFO _IOWR(TFS_MAGIC, 1, struct tfs_xfer_info)
-#define TFS_RELEASE_XFER _IO(TFS_MAGIC, 2)
+// 诊断时最多保留的传输内容
+const size_t DIAG_CAPTURE_MAX = 1024;
+
+// Prometheus文本格式指标文件, 空字符串表示不输出
+std::string metrics_path;
+const int METRICS_WRITE_INTERVAL = 10; // 秒
+
+// 传输路径的各阶段延迟和计数, worker无锁更新
+// fetch:  一次TFS_FETCH_XFERS调用 (按批)
+// queue:  领取后在线程池中等待的时间
+// map:    mmap传输数据 (大传输按窗口计, 每个窗口一次)
+// persist: 拷贝并计算CRC32C、写入数据段并落盘 (校验与拷贝合并在一遍中完成, 按窗口计)
+// replicate: 本地落盘之后继续等待对端确认和零拷贝发送完成的时间 (按窗口计)
+// release: 解除映射并通过TFS_COMPLETE_XFER交还内核
+// total:  从领取到交还
+struct TransferMetrics {
+    LatencyHistogram fetch;
+    LatencyHistogram queue;
+    LatencyHistogram map;
+    LatencyHistogram persist;
+    LatencyHistogram replicate;
+    LatencyHistogram release;
+    LatencyHistogram total;
+
+    std::atomic<uint64_t> transfers{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> fetch_errors{0};
+    std::atomic<uint64_t> map_errors{0};
+    std::atomic<uint64_t> persist_errors{0};
+    std::atomic<uint64_t> replica_errors{0};
+    std::atomic<uint64_t> complete_errors{0};
+};
+TransferMetrics metrics;
 
 // 辅助函数：安全显示内容
 std::string safe_print(const char* data, size_t size) {
@@ -66,10 +163,10 @@ std::string safe_print(const char* data, size_t size) {
     return result;
 }
 
-// 辅助函数：十六进制dump
-void hex_dump(const char* data, size_t size) {
+// 辅助函数：十六进制dump, 每行一条
+void hex_dump(const char* data, size_t size, std::vector<std::string>* lines) {
     if (data == nullptr || size == 0) {
-        std::cout << "  [empty data]" << std::endl;
+        lines->push_back("  [empty data]");
         return;
     }
     
@@ -78,79 +175,55 @@ void hex_dump(const char* data, size_t size) {
     
     try {
         for (size_t i = 0; i < size && i / bytes_per_line < max_lines; i += bytes_per_line) {
+            std::ostringstream line;
             // 地址偏移
-            std::cout << "  " << std::hex << std::setw(4) << std::setfill('0') 
-                      << i << ": ";
+            line << "  " << std::hex << std::setw(4) << std::setfill('0') 
+                 << i << ": ";
             
             // 十六进制字节
             for (size_t j = 0; j < bytes_per_line; j++) {
                 if (i + j < size) {
-                    std::cout << std::hex << std::setw(2) << std::setfill('0') 
-                              << static_cast<unsigned>(static_cast<unsigned char>(data[i + j])) << " ";
+                    line << std::hex << std::setw(2) << std::setfill('0') 
+                         << static_cast<unsigned>(static_cast<unsigned char>(data[i + j])) << " ";
                 } else {
-                    std::cout << "   ";
+                    line << "   ";
                 }
             }
             
-            std::cout << "  ";
+            line << "  ";
             // ASCII字符表示
             for (size_t j = 0; j < bytes_per_line && i + j < size; j++) {
                 unsigned char c = static_cast<unsigned char>(data[i + j]);
                 if (isprint(c) && !isspace(c)) {
-                    std::cout << static_cast<char>(c);
+                    line << static_cast<char>(c);
                 } else {
-                    std::cout << '.';
+                    line << '.';
                 }
             }
-            std::cout << std::endl;
+            lines->push_back(line.str());
         }
         
         if (size > bytes_per_line * max_lines) {
-            std::cout << "  [output truncated, " << (size - bytes_per_line * max_lines) 
-                      << " more bytes not shown]" << std::endl;
+            lines->push_back("  [output truncated, " + std::to_string(size - bytes_per_line * max_lines) +
+                             " more bytes not shown]");
         }
-        
-        std::cout << std::dec; // 恢复十进制输出
     } catch (const std::exception& e) {
-        std::cout << "  [error during hex dump: " << e.what() << "]" << std::endl;
-    }
-}
-
-// 日志函数
-void log_message(const std::string& level, const std::string& message) {
-    time_t now = time(0);
-    char timestamp[30];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    
-    std::string log_entry = std::string(timestamp) + " [" + level + "] " + message;
-    
-    // 写入日志文件
-    if (log_file.is_open()) {
-        log_file << log_entry << std::endl;
-        log_file.flush();
-    }
-    
-    // 如果是错误或启用了详细模式，也输出到标准输出
-    if (level == "ERROR" || verbose) {
-        std::cout << log_entry << std::endl;
+        lines->push_back("  [error during hex dump: " + std::string(e.what()) + "]");
     }
 }
 
-// 信号处理函数
+// 信号处理函数: 严重错误信号, 以及signalfd不可用时的终止信号
 void signal_handler(int sig) {
     if (sig == SIGTERM || sig == SIGINT) {
-        log_message("INFO", "Received termination signal (" + std::to_string(sig) + "), shutting down...");
+        stop_signal = sig;
         running = false;
     } else if (sig == SIGSEGV || sig == SIGBUS || sig == SIGFPE || sig == SIGILL) {
-        // 严重错误信号
-        log_message("CRITICAL", "Received critical signal: " + std::to_string(sig) + 
-                   ", attempting graceful shutdown");
-        
-        // 尝试关闭日志文件
-        if (log_file.is_open()) {
-            log_file.flush();
-            log_file.close();
-        }
+        // 严重错误信号: 只能用异步信号安全的方式直接写日志文件
+        char msg[] = "[CRITICAL] Received critical signal: 00, attempting graceful shutdown\n";
+        char* digits = strstr(msg, "00");
+        digits[0] = '0' + (sig / 10) % 10;
+        digits[1] = '0' + sig % 10;
+        Logger::instance().emergency(msg);
         
         // 重新抛出信号以允许核心转储
         signal(sig, SIG_DFL);
@@ -158,25 +231,713 @@ void signal_handler(int sig) {
     }
 }
 
+// 把一批元数据操作应用到本地命名空间, 同时丢弃被删除或截断的数据
+// 内核转发的和对端复制来的元数据都经过这里, 只能在主线程调用
+void apply_metadata(const tfs_meta_op* ops, size_t n, MetaStore& meta, StorageEngine& storage) {
+    static std::vector<uint64_t> dropped;
+
+    std::string err;
+    if (!meta.apply_batch(ops, n, &err)) {
+        TFS_LOG(ERROR, "Failed to persist metadata batch: " + err);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const tfs_meta_op& op = ops[i];
+        if (op.op == TFS_META_CREATE) {
+            // inode号可能被复用, 之前文件残留的数据不能出现在新文件里
+            storage.drop_inode(op.ino);
+        } else if (op.op == TFS_META_SETATTR && (op.attr_valid & TFS_ATTR_SIZE)) {
+            storage.truncate(op.ino, op.size);
+        }
+    }
+    meta.take_dropped(&dropped);
+    for (uint64_t ino : dropped) {
+        storage.drop_inode(ino);
+    }
+    if (verbose) {
+        TFS_LOG(DEBUG, "Applied " + std::to_string(n) + " metadata ops, last seq " +
+               std::to_string(meta.applied_seq()));
+    }
+}
+
+// 批量取走内核转发的元数据操作并应用, 应用后转发给对端
+// 返回本轮处理的操作数, 出错返回-1
+int drain_metadata(CtlChannel& ctl, MetaStore& meta, StorageEngine& storage) {
+    static std::vector<tfs_meta_op> ops(TFS_META_BATCH_MAX);
+    int total = 0;
+
+    for (;;) {
+        struct tfs_meta_batch batch = {};
+        batch.ops = reinterpret_cast<uint64_t>(ops.data());
+        batch.max_ops = ops.size();
+
+        if (ctl.ioctl(TFS_GET_META_BATCH, &batch) < 0) {
+            TFS_LOG(ERROR, "ioctl TFS_GET_META_BATCH failed: " + std::string(strerror(errno)));
+            return -1;
+        }
+        if (batch.nr_ops == 0) {
+            return total;
+        }
+
+        apply_metadata(ops.data(), batch.nr_ops, meta, storage);
+        // 在领取之后的传输之前发出, 对端按同样的先后应用
+        if (replicator != nullptr) {
+            replicator->send_meta(ops.data(), batch.nr_ops);
+        }
+        total += batch.nr_ops;
+
+        if (batch.nr_ops < batch.max_ops) {
+            return total;
+        }
+    }
+}
+
+// 容量缓存有效期和推送间隔: 内核在有效期内直接用缓存回答statfs
+const unsigned int CAPACITY_TTL_MS = 5000;
+const int CAPACITY_PUSH_INTERVAL = 2; // 秒
+
+// 周期任务的定时器: timerfd挂在主线程的事件循环上, 到期只置位due,
+// 由主循环在安全的位置处理, 空闲时主线程一直睡到有传输、信号或定时器到期
+struct PeriodicTimer {
+    int fd = -1;
+    uint64_t poll = 0;
+    bool due = false;
+};
+
+bool start_timer(PeriodicTimer& timer, int interval_s) {
+    timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer.fd < 0) {
+        return false;
+    }
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = interval_s;
+    spec.it_value.tv_sec = interval_s;
+    return timerfd_settime(timer.fd, 0, &spec, nullptr) == 0;
+}
+
+void arm_timer(EventLoop& loop, PeriodicTimer& timer) {
+    if (timer.fd < 0 || timer.poll != 0) {
+        return;
+    }
+    timer.poll = loop.poll_add(timer.fd, POLLIN, [&loop, &timer](int res) {
+        timer.poll = 0;
+        if (res < 0) {
+            return;
+        }
+        uint64_t expirations;
+        if (read(timer.fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            timer.due = true;
+        }
+        arm_timer(loop, timer);
+    });
+}
+
+void stop_timer(EventLoop& loop, PeriodicTimer& timer) {
+    if (timer.poll != 0) {
+        loop.cancel(timer.poll);
+    }
+}
+
+// 统计数据目录所在文件系统的容量并推送给内核
+bool push_capacity(CtlChannel& ctl) {
+    struct statvfs vfs;
+    if (statvfs(data_dir.c_str(), &vfs) != 0) {
+        TFS_LOG(ERROR, "statvfs " + data_dir + " failed: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    struct tfs_capacity cap = {};
+    cap.total_bytes = static_cast<uint64_t>(vfs.f_blocks) * vfs.f_frsize;
+    cap.free_bytes = static_cast<uint64_t>(vfs.f_bfree) * vfs.f_frsize;
+    cap.avail_bytes = static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize;
+    cap.ttl_ms = CAPACITY_TTL_MS;
+
+    if (ctl.ioctl(TFS_SET_CAPACITY, &cap) < 0) {
+        TFS_LOG(ERROR, "ioctl TFS_SET_CAPACITY failed: " + std::string(strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+// 通知内核传输项处理完毕, status为0或负的errno
+bool complete_transfer(CtlChannel& ctl, unsigned long id, int status) {
+    struct tfs_xfer_done done = {};
+    done.id = id;
+    done.status = status;
+    if (ctl.ioctl(TFS_COMPLETE_XFER, &done) < 0) {
+        metrics.complete_errors.fetch_add(1, std::memory_order_relaxed);
+        TFS_LOG(ERROR, "ioctl TFS_COMPLETE_XFER failed for transfer " + std::to_string(id) +
+               ": " + std::string(strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+// 文件适用的目录压缩规则, 没有时返回nullptr (使用存储引擎的默认策略)
+// 规则每次按路径解析, 目录改名或重建后随之生效; 沿最近一次链接所在的父目录向上查找
+// 规则路径相对文件所在挂载点的根目录, 即TFS_ROOT_INO下的那一层 (模拟设备的文件直接建在TFS_ROOT_INO下)
+const CompressPolicy* compress_policy_for(const MetaStore& meta, uint64_t ino) {
+    if (compress_rules.empty()) {
+        return nullptr;
+    }
+    std::vector<uint64_t> parents;
+    MetaStore::Node node;
+    uint64_t cur = ino;
+    for (int depth = 0; depth < 4096 && meta.lookup(cur, &node) && node.parent != 0; depth++) {
+        parents.push_back(node.parent);
+        if (node.parent == cur || node.parent == TFS_ROOT_INO) {
+            break;
+        }
+        cur = node.parent;
+    }
+    uint64_t root = TFS_ROOT_INO;
+    if (parents.size() >= 2 && parents.back() == TFS_ROOT_INO) {
+        root = parents[parents.size() - 2];
+    }
+
+    std::vector<uint64_t> dirs(compress_rules.size(), 0);
+    for (size_t i = 0; i < compress_rules.size(); i++) {
+        if (!meta.resolve(root, compress_rules[i].dir, &dirs[i])) {
+            dirs[i] = 0;
+        }
+    }
+    for (uint64_t parent : parents) {
+        for (size_t i = 0; i < dirs.size(); i++) {
+            if (dirs[i] == parent) {
+                return &compress_rules[i].policy;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool compression_configured(const StorageEngine& storage) {
+    return storage.compression().codec != Codec::None || !compress_rules.empty();
+}
+
+// 处理一个已领取的传输项, 在worker线程中执行: 映射、校验并写入本地存储
+// 返回0或负的errno, 由调用方通过TFS_COMPLETE_XFER交还内核
+// 被采样的传输把开头的内容拷到sample, 由调用方在完成传输之后再格式化输出
+// persisted_at返回持久化结束的时间, 用于统计release阶段
+int process_transfer(CtlChannel& ctl, struct tfs_xfer_info info, StorageEngine& storage, uint64_t meta_seq,
+                     const CompressPolicy* policy, DiagSampler::Reason* reason, std::string* sample,
+                     uint64_t* persisted_at) {
+    TFS_LOG(DEBUG, "Processing transfer " + std::to_string(info.id) +
+                  " - Offset: " + std::to_string(info.offset) + 
+                  ", Size: " + std::to_string(info.size) + 
+                  ", Inode: " + std::to_string(info.ino) +
+                  ", PFN: 0x" + std::to_string(info.pfn) +
+                  ", Map size: " + std::to_string(info.map_size));
+
+    // 处理空文件的特殊情况
+    if (info.size == 0 || info.pfn == 0) {
+        TFS_LOG(INFO, "Empty file detected (size=" + std::to_string(info.size) + 
+               ", pfn=" + std::to_string(info.pfn) + "), skipping memory mapping");
+        return 0;
+    }
+    
+    // 使用mmap映射共享内存 (零拷贝关键)
+    // 已领取的传输项按ID映射, 多个worker可以同时映射各自的传输;
+    // 偏移的低位是窗口在映射区域内的位置, 大传输逐个窗口映射、持久化、解除映射
+    const off_t map_base = static_cast<off_t>(info.id) << TFS_XFER_MMAP_SHIFT;
+    const size_t map_size = info.map_size;
+    const size_t data_end = info.page_offset + info.size;
+    const size_t nr_windows = (map_size + stream_window - 1) / stream_window;
+
+    auto map_window = [&](size_t index, size_t* len) -> void* {
+        size_t start = index * stream_window;
+        *len = std::min(stream_window, map_size - start);
+        uint64_t map_start = monotonic_ns();
+        void* mem = ctl.map(*len, map_base + static_cast<off_t>(start));
+        metrics.map.record(monotonic_ns() - map_start);
+        if (mem == MAP_FAILED) {
+            int err = errno;
+            metrics.map_errors.fetch_add(1, std::memory_order_relaxed);
+            TFS_LOG(ERROR, "mmap failed: " + std::string(strerror(err)) +
+                   ", size: " + std::to_string(*len) +
+                   ", offset: " + std::to_string(info.offset) +
+                   ", window: " + std::to_string(index));
+            errno = err;
+        }
+        return mem;
+    };
+
+    size_t cur_len = 0;
+    void* cur = map_window(0, &cur_len);
+    if (cur == MAP_FAILED) {
+        return -errno;
+    }
+
+    // 诊断按采样进行, 默认全部关闭, 每个传输只多一次原子读; 只保留开头部分
+    *reason = sampler.should_sample(info.ino);
+    if (*reason != DiagSampler::Reason::None) {
+        size_t avail = std::min(cur_len, data_end) - info.page_offset;
+        sample->assign(static_cast<const char*>(cur) + info.page_offset, std::min(avail, DIAG_CAPTURE_MAX));
+    }
+
+    int ret = 0;
+    for (size_t index = 0; index < nr_windows; index++) {
+        // 先映射下一个窗口, 再持久化当前窗口
+        size_t next_len = 0;
+        void* next = MAP_FAILED;
+        if (index + 1 < nr_windows) {
+            next = map_window(index + 1, &next_len);
+            if (next == MAP_FAILED) {
+                ret = -errno;
+            }
+        }
+
+        // 当前窗口中的数据范围 (首窗口跳过页内偏移, 末窗口截到数据结尾)
+        size_t win_start = index * stream_window;
+        size_t from = std::max(win_start, static_cast<size_t>(info.page_offset));
+        size_t to = std::min(win_start + cur_len, data_end);
+        const char* data_ptr = static_cast<const char*>(cur) + (from - win_start);
+        uint64_t file_offset = info.offset + (from - info.page_offset);
+
+        // 持久化后才能完成传输; 数据拷入记录时同时计算CRC32C, 随记录保存并在读取时复核
+        // 配置了对端时先把窗口发出去, 与本地落盘重叠, 映射要保持到对端发送完成
+        if (ret == 0 && to > from) {
+            Replicator::Ticket ticket;
+            if (replicator != nullptr) {
+                ticket = replicator->send(info.ino, file_offset, data_ptr, to - from, meta_seq);
+            }
+            uint32_t crc = 0;
+            uint64_t persist_start = monotonic_ns();
+            ret = storage.append(info.ino, file_offset, data_ptr, to - from, meta_seq, &crc, policy);
+            *persisted_at = monotonic_ns();
+            metrics.persist.record(*persisted_at - persist_start);
+            if (ret < 0) {
+                metrics.persist_errors.fetch_add(1, std::memory_order_relaxed);
+                TFS_LOG(ERROR, "Failed to persist transfer " + std::to_string(info.id) + " at offset " +
+                       std::to_string(file_offset) + ": " + std::string(strerror(-ret)));
+                if (*reason == DiagSampler::Reason::None && sampler.on_error()) {
+                    *reason = DiagSampler::Reason::Error;
+                    sample->assign(data_ptr, std::min(to - from, DIAG_CAPTURE_MAX));
+                }
+            } else if (Logger::instance().enabled(LogLevel::DEBUG)) {
+                char data_hash[16];
+                snprintf(data_hash, sizeof(data_hash), "%08x", crc);
+                TFS_LOG(DEBUG, "Verification: crc32c " + std::string(data_hash) + " OK (offset " +
+                       std::to_string(file_offset) + ", " + std::to_string(to - from) + " bytes)");
+            }
+            // 本地写入失败也要等: 零拷贝发送完成之前不能解除映射
+            if (replicator != nullptr) {
+                int replica_ret = replicator->wait(ticket);
+                uint64_t replicated_at = monotonic_ns();
+                metrics.replicate.record(replicated_at - *persisted_at);
+                *persisted_at = replicated_at;
+                if (replica_ret < 0) {
+                    metrics.replica_errors.fetch_add(1, std::memory_order_relaxed);
+                    TFS_LOG(ERROR, "Transfer " + std::to_string(info.id) + " at offset " +
+                           std::to_string(file_offset) + " not acknowledged by " +
+                           std::to_string(replicator->quorum()) + " replicas: " +
+                           std::string(strerror(-replica_ret)));
+                    if (ret == 0) {
+                        ret = replica_ret;
+                    }
+                }
+            }
+        }
+
+        // 解除映射
+        if (ctl.unmap(cur, cur_len) != 0) {
+            TFS_LOG(WARNING, "munmap failed: " + std::string(strerror(errno)));
+        }
+        if (ret < 0) {
+            if (next != MAP_FAILED) {
+                ctl.unmap(next, next_len);
+            }
+            break;
+        }
+        cur = next;
+        cur_len = next_len;
+    }
+    return ret;
+}
+
+// 输出被采样传输的内容预览和十六进制dump (不超过1KB时完整显示, 否则只显示前64字节)
+// 每行一条日志, 带上传输ID以免多个worker的输出交错后无法区分
+void log_sample(const struct tfs_xfer_info& info, DiagSampler::Reason reason, const std::string& sample) {
+    std::string tag = "[xfer " + std::to_string(info.id) + "] ";
+    TFS_LOG(INFO, tag + "Sampled (" + DiagSampler::reason_name(reason) + "): inode " +
+            std::to_string(info.ino) + ", offset " + std::to_string(info.offset) +
+            ", size " + std::to_string(info.size));
+
+    size_t preview_size = std::min(sample.size(), static_cast<size_t>(128));
+    std::string content_preview = safe_print(sample.data(), preview_size);
+    if (info.size > preview_size) {
+        content_preview += "... [" + std::to_string(info.size - preview_size) + " more bytes]";
+    }
+    TFS_LOG(INFO, tag + "Content Preview: \"" + content_preview + "\"");
+
+    size_t dump_size = info.size <= DIAG_CAPTURE_MAX ? sample.size() : std::min(sample.size(), static_cast<size_t>(64));
+    std::vector<std::string> lines;
+    hex_dump(sample.data(), dump_size, &lines);
+    if (info.size > dump_size) {
+        lines.push_back("  <" + std::to_string(info.size - dump_size) + " more bytes...>");
+    }
+    for (const std::string& line : lines) {
+        TFS_LOG(INFO, tag + line);
+    }
+}
+
+// 管理命令参数: 十进制无符号整数
+bool parse_num(const std::string& text, uint64_t* value) {
+    char* end = nullptr;
+    errno = 0;
+    *value = strtoull(text.c_str(), &end, 10);
+    return errno == 0 && end != text.c_str() && *end == '\0';
+}
+
+// 管理命令: 调整内容诊断的采样策略
+std::string sample_command(const std::vector<std::string>& args) {
+    uint64_t value = 0;
+
+    if (args.empty()) {
+        // 仅查询
+    } else if (args[0] == "off" && args.size() == 1) {
+        sampler.clear();
+    } else if (args[0] == "every" && args.size() == 2 && parse_num(args[1], &value) && value <= UINT32_MAX) {
+        sampler.set_every(static_cast<uint32_t>(value));
+    } else if (args[0] == "next" && args.size() == 2 && parse_num(args[1], &value) && value <= UINT32_MAX) {
+        sampler.request(static_cast<uint32_t>(value));
+    } else if (args[0] == "inode" && args.size() == 3 && parse_num(args[2], &value) &&
+               (args[1] == "add" || args[1] == "del")) {
+        bool ok = args[1] == "add" ? sampler.watch_inode(value) : sampler.unwatch_inode(value);
+        if (!ok) {
+            return args[1] == "add" ? "error: too many watched inodes" : "error: inode not watched";
+        }
+    } else if (args[0] == "errors" && args.size() == 2 && (args[1] == "on" || args[1] == "off")) {
+        sampler.set_on_error(args[1] == "on");
+    } else {
+        return "usage: sample [off | every N | next N | inode add|del INO | errors on|off]";
+    }
+
+    std::string state = sampler.describe();
+    if (!args.empty()) {
+        TFS_LOG(INFO, "Diagnostic sampling changed: " + state);
+    }
+    return state;
+}
+
+// 管理命令: 经StorageEngine::read (和读缓存) 读出文件区间, 回复读到的字节数和CRC32C
+// 在worker线程上执行 (可能读盘), 只用于诊断和测试
+std::string read_command(StorageEngine& storage, const std::vector<std::string>& args) {
+    const uint64_t kMaxLen = 64u << 20;
+    uint64_t ino = 0, offset = 0, len = 0;
+    if (args.size() != 3 || !parse_num(args[0], &ino) || !parse_num(args[1], &offset) ||
+        !parse_num(args[2], &len) || len > kMaxLen) {
+        return "usage: read INO OFFSET LEN (LEN <= " + std::to_string(kMaxLen) + ")";
+    }
+    std::vector<char> buf(len);
+    ssize_t n = storage.read(ino, offset, buf.data(), buf.size());
+    if (n < 0) {
+        return "error: " + std::string(strerror(static_cast<int>(-n)));
+    }
+    char crc[16];
+    snprintf(crc, sizeof(crc), "%08x", crc32c(0, buf.data(), static_cast<size_t>(n)));
+    return std::to_string(n) + " bytes, crc32c " + crc;
+}
+
+// 以Prometheus文本格式输出全部指标, 在主线程调用
+std::string render_metrics(CtlChannel& ctl, const MetaStore& meta, const StorageEngine& storage,
+                           const WorkerPool& pool, time_t start_time) {
+    PromWriter w;
+
+    w.header("tfsd_stage_latency_seconds", "summary", "Latency of each stage of the transfer path");
+    const std::pair<const char*, const LatencyHistogram*> stages[] = {
+        {"fetch", &metrics.fetch}, {"queue", &metrics.queue}, {"map", &metrics.map},
+        {"persist", &metrics.persist}, {"replicate", &metrics.replicate},
+        {"release", &metrics.release}, {"total", &metrics.total},
+    };
+    for (const auto& stage : stages) {
+        w.summary("tfsd_stage_latency_seconds", std::string("stage=\"") + stage.first + "\"",
+                  stage.second->snapshot());
+    }
+
+    w.header("tfsd_transfers_total", "counter", "Transfers completed back to the kernel");
+    w.value("tfsd_transfers_total", "", metrics.transfers.load());
+    w.header("tfsd_transfer_bytes_total", "counter", "Bytes of transfer data persisted");
+    w.value("tfsd_transfer_bytes_total", "", metrics.bytes.load());
+    w.header("tfsd_errors_total", "counter", "Errors on the transfer path");
+    w.value("tfsd_errors_total", "stage=\"fetch\"", metrics.fetch_errors.load());
+    w.value("tfsd_errors_total", "stage=\"map\"", metrics.map_errors.load());
+    w.value("tfsd_errors_total", "stage=\"persist\"", metrics.persist_errors.load());
+    w.value("tfsd_errors_total", "stage=\"replicate\"", metrics.replica_errors.load());
+    w.value("tfsd_errors_total", "stage=\"release\"", metrics.complete_errors.load());
+
+    w.header("tfsd_queue_depth", "gauge", "Transfers waiting or in progress");
+    w.value("tfsd_queue_depth", "queue=\"workers\"", static_cast<uint64_t>(pool.outstanding()));
+    int kernel_queued = 0;
+    if (ctl.ioctl(TFS_GET_XFER_COUNT, &kernel_queued) == 0) {
+        w.value("tfsd_queue_depth", "queue=\"kernel\"", static_cast<uint64_t>(kernel_queued));
+    }
+
+    StorageEngine::Stats st = storage.stats();
+    w.header("tfsd_storage_bytes", "gauge", "Bytes in data segments");
+    w.value("tfsd_storage_bytes", "state=\"live\"", st.live_bytes);
+    w.value("tfsd_storage_bytes", "state=\"used\"", st.used_bytes);
+    w.header("tfsd_storage_segments", "gauge", "Data segment files");
+    w.value("tfsd_storage_segments", "", st.segments);
+    w.header("tfsd_storage_errors_total", "counter", "Storage engine errors");
+    w.value("tfsd_storage_errors_total", "kind=\"write\"", st.write_errors);
+    w.value("tfsd_storage_errors_total", "kind=\"checksum\"", st.checksum_errors);
+    w.header("tfsd_storage_commits_total", "counter", "Group commit rounds, records and fdatasync calls");
+    w.value("tfsd_storage_commits_total", "kind=\"rounds\"", st.commit_rounds);
+    w.value("tfsd_storage_commits_total", "kind=\"records\"", st.commit_requests);
+    w.value("tfsd_storage_commits_total", "kind=\"syncs\"", st.commit_syncs);
+    if (const ErasureStore* ec = storage.erasure_store()) {
+        ErasureStore::Stats es = ec->stats();
+        w.header("tfsd_ec_segments", "gauge", "Segments stored only as erasure-coded shards");
+        w.value("tfsd_ec_segments", "", st.archived_segments);
+        w.header("tfsd_ec_bytes", "gauge", "Segment bytes stored as erasure-coded shards");
+        w.value("tfsd_ec_bytes", "", st.archived_bytes);
+        w.header("tfsd_ec_encoded_bytes_total", "counter", "Segment bytes erasure-coded since start");
+        w.value("tfsd_ec_encoded_bytes_total", "", es.encoded_bytes);
+        w.header("tfsd_ec_events_total", "counter", "Erasure coding encodes, failures and degraded reads");
+        w.value("tfsd_ec_events_total", "kind=\"encoded\"", es.encoded_segments);
+        w.value("tfsd_ec_events_total", "kind=\"encode_failures\"", es.encode_failures);
+        w.value("tfsd_ec_events_total", "kind=\"degraded_reads\"", es.degraded_reads);
+        w.value("tfsd_ec_events_total", "kind=\"reconstructed_chunks\"", es.reconstructed_chunks);
+        w.value("tfsd_ec_events_total", "kind=\"unrecoverable_reads\"", es.unrecoverable_reads);
+    }
+    if (storage.dedup()) {
+        w.header("tfsd_dedup_chunks", "gauge", "Unique chunks in the deduplication index");
+        w.value("tfsd_dedup_chunks", "", st.dedup_chunks);
+        w.header("tfsd_dedup_index_bytes", "gauge", "Memory used by the deduplication index");
+        w.value("tfsd_dedup_index_bytes", "", st.dedup_index_bytes);
+        w.header("tfsd_dedup_bytes_total", "counter", "Appended bytes stored as references to existing chunks");
+        w.value("tfsd_dedup_bytes_total", "", st.dedup_bytes);
+    }
+    if (compression_configured(storage)) {
+        w.header("tfsd_compress_bytes_total", "counter",
+                 "Data passed to the compression stage: raw input, compressed output, stored uncompressed");
+        w.value("tfsd_compress_bytes_total", "kind=\"in\"", st.compress_in_bytes);
+        w.value("tfsd_compress_bytes_total", "kind=\"out\"", st.compress_out_bytes);
+        w.value("tfsd_compress_bytes_total", "kind=\"skipped\"", st.compress_skipped_bytes);
+    }
+    if (const BlockCache* cache = storage.block_cache()) {
+        BlockCache::Stats cs = cache->stats();
+        w.header("tfsd_block_cache_bytes", "gauge", "Block cache capacity and cached data");
+        w.value("tfsd_block_cache_bytes", "state=\"capacity\"", cs.capacity_bytes);
+        w.value("tfsd_block_cache_bytes", "state=\"resident\"", cs.resident_bytes);
+        w.header("tfsd_block_cache_lookups_total", "counter", "Block cache lookups by result");
+        w.value("tfsd_block_cache_lookups_total", "result=\"hit\"", cs.hits);
+        w.value("tfsd_block_cache_lookups_total", "result=\"miss\"", cs.misses);
+        w.header("tfsd_block_cache_events_total", "counter",
+                 "Block cache evictions, ghost-queue promotions and fills dropped after a concurrent write");
+        w.value("tfsd_block_cache_events_total", "kind=\"evictions\"", cs.evictions);
+        w.value("tfsd_block_cache_events_total", "kind=\"promotions\"", cs.promotions);
+        w.value("tfsd_block_cache_events_total", "kind=\"stale_fills\"", cs.stale_fills);
+    }
+
+    if (replicator != nullptr) {
+        Replicator::Stats rs = replicator->stats();
+        w.header("tfsd_replica_peers_up", "gauge", "Replication peers currently connected");
+        w.value("tfsd_replica_peers_up", "", static_cast<uint64_t>(rs.peers_up));
+        w.header("tfsd_replica_frames_total", "counter", "Data frames sent to replication peers");
+        w.value("tfsd_replica_frames_total", "mode=\"all\"", rs.frames);
+        w.value("tfsd_replica_frames_total", "mode=\"zerocopy\"", rs.zerocopy_sends);
+        w.value("tfsd_replica_frames_total", "mode=\"zerocopy_copied\"", rs.zerocopy_copied);
+        w.header("tfsd_replica_bytes_total", "counter", "Bytes of transfer data sent to replication peers");
+        w.value("tfsd_replica_bytes_total", "", rs.bytes);
+        w.header("tfsd_replica_events_total", "counter", "Replica acks, peer failures and reconnects");
+        w.value("tfsd_replica_events_total", "kind=\"acks\"", rs.acks);
+        w.value("tfsd_replica_events_total", "kind=\"failures\"", rs.failures);
+        w.value("tfsd_replica_events_total", "kind=\"reconnects\"", rs.reconnects);
+    }
+    if (replica_server != nullptr) {
+        ReplicaServer::Stats rs = replica_server->stats();
+        w.header("tfsd_replica_received_total", "counter", "Replicated frames, bytes and metadata ops received");
+        w.value("tfsd_replica_received_total", "kind=\"frames\"", rs.frames);
+        w.value("tfsd_replica_received_total", "kind=\"bytes\"", rs.bytes);
+        w.value("tfsd_replica_received_total", "kind=\"meta_ops\"", rs.meta_ops);
+        w.value("tfsd_replica_received_total", "kind=\"errors\"", rs.errors);
+    }
+
+    w.header("tfsd_meta_inodes", "gauge", "Inodes in the local namespace");
+    w.value("tfsd_meta_inodes", "", static_cast<uint64_t>(meta.node_count()));
+    w.header("tfsd_meta_log_failures_total", "counter", "Failed metadata log appends");
+    w.value("tfsd_meta_log_failures_total", "", meta.log_failures());
+    w.header("tfsd_log_dropped_total", "counter", "Log records dropped because the log ring was full");
+    w.value("tfsd_log_dropped_total", "", Logger::instance().dropped());
+    w.header("tfsd_uptime_seconds", "gauge", "Seconds since tfsd started");
+    w.value("tfsd_uptime_seconds", "", static_cast<uint64_t>(time(nullptr) - start_time));
+    return w.text();
+}
+
+// 写到临时文件再改名, 采集方 (如node_exporter的textfile) 不会读到写了一半的文件
+bool write_metrics_file(const std::string& path, const std::string& text) {
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < text.size()) {
+        ssize_t n = write(fd, text.data() + done, text.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        done += n;
+    }
+    close(fd);
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
 // 显示使用帮助
 void show_usage(const char* program_name) {
     std::cout << "Usage: " << program_name << " [options]\n"
               << "Options:\n"
               << "  -v, --verbose    Enable verbose logging\n"
+              << "  -l, --log-level  Minimum level written to the log: debug, info, warning, error (default: info)\n"
               << "  -d, --daemon     Run as daemon\n"
+              << "  -D, --data-dir   Data directory (default: ./tfsd_data)\n"
+              << "  -w, --workers    Number of transfer worker threads (default: CPU count)\n"
+              << "  -S, --segment-mb Size of each preallocated data segment in MB (default: 64)\n"
+              << "  -C, --commit-delay-us N  Wait up to N us for more writes to share one fdatasync (default: 0)\n"
+              << "      --commit-batch N     Start a commit early once N writes are queued (default: worker count)\n"
+              << "      --cache-mb N Cache up to N MB of read blocks in memory, 0 to disable (default: 64)\n"
+              << "      --checkpoint-mb N    Snapshot the namespace once the metadata log exceeds N MB, 0 to disable\n"
+              << "                   (default: 64)\n"
+              << "  -W, --window-kb  Map and persist large transfers in windows of this many KB (default: 2048)\n"
+              << "  -s, --sample N   Log a content preview and hex dump for 1 in N transfers (default: off, 1 with -v)\n"
+              << "  -M, --metrics-file PATH  Write Prometheus text metrics to PATH every 10 seconds\n"
+              << "  -A, --admin-socket PATH  Unix socket for admin commands, \"none\" to disable (default: ./tfsd.sock)\n"
+              << "  -H, --handover-socket PATH  Socket a new tfsd connects to for a hot upgrade, \"none\" to disable (default: ./tfsd.handover)\n"
+              << "  -T, --takeover   Take over the control device from the tfsd listening on the handover socket\n"
+              << "                   (with --mock, the synthetic workload continues where the old tfsd left it)\n"
+              << "      --mock N     Use an in-process control device generating N synthetic transfers, exit when done\n"
+              << "                   (0: an idle device, e.g. for a replica-only instance)\n"
+              << "      --mock-size BYTES  Size of each synthetic transfer (default: 4096)\n"
+              << "      --mock-files N     Number of synthetic files the transfers are spread over (default: 16)\n"
+              << "      --mock-text        Fill synthetic transfers with log-like text instead of random bytes\n"
+              << "      --replica HOST:PORT  Replicate transfers to the tfsd listening there (repeatable)\n"
+              << "      --replica-quorum K   Replica acks required before completing a transfer (default: all, 0: async)\n"
+              << "      --replica-listen [HOST:]PORT  Accept replicated transfers from other tfsd instances\n"
+              << "      --ec K+M     Erasure-code cold segments into K data and M parity shards (default: off)\n"
+              << "      --ec-target DIR    Directory holding one shard of each cold segment (repeat K+M times)\n"
+              << "      --ec-after SECONDS Encode segments sealed at least this long ago (default: 600)\n"
+              << "      --dedup      Deduplicate persisted data by content-defined chunks\n"
+              << "      --compress CODEC[:LEVEL]  Compress persisted data: lz4 (1-12), zstd (-7..22) or off (default: off)\n"
+              << "      --compress-dir DIR=CODEC[:LEVEL]  Compression for files under DIR, relative to the mount root\n"
+              << "                   (repeatable, the nearest directory wins)\n"
               << "  -h, --help       Show this help message\n";
 }
 
 int main(int argc, char* argv[]) {
     bool daemon_mode = false;
+    LogLevel log_level = LogLevel::INFO;
+    bool log_level_set = false;
+    long sample_every = -1;
+    bool takeover = false;
+    bool use_mock = false;
+    MockCtlChannel::Options mock_opts;
+    Replicator::Options replica_opts;
+    long replica_quorum = -1;
+    std::string replica_listen;
+    unsigned ec_k = 0;
+    unsigned ec_m = 0;
+    unsigned ec_after = 600;
+    std::vector<std::string> ec_targets;
+    bool dedup = false;
+    CompressPolicy compress;
     
     // 解析命令行参数
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
         if (arg == "-v" || arg == "--verbose") {
             verbose = true;
+        } else if ((arg == "-l" || arg == "--log-level") && i + 1 < argc) {
+            if (!Logger::parse_level(argv[++i], &log_level)) {
+                std::cerr << "Unknown log level: " << argv[i] << std::endl;
+                return 1;
+            }
+            log_level_set = true;
         } else if (arg == "-d" || arg == "--daemon") {
             daemon_mode = true;
+        } else if ((arg == "-D" || arg == "--data-dir") && i + 1 < argc) {
+            data_dir = argv[++i];
+        } else if ((arg == "-w" || arg == "--workers") && i + 1 < argc) {
+            num_workers = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if ((arg == "-S" || arg == "--segment-mb") && i + 1 < argc) {
+            segment_mb = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if ((arg == "-C" || arg == "--commit-delay-us") && i + 1 < argc) {
+            commit_delay_us = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--commit-batch" && i + 1 < argc) {
+            commit_batch = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--checkpoint-mb" && i + 1 < argc) {
+            checkpoint_mb = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--cache-mb" && i + 1 < argc) {
+            cache_mb = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if ((arg == "-W" || arg == "--window-kb") && i + 1 < argc) {
+            // 窗口必须按页对齐, 不足一页按一页
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t window = static_cast<size_t>(strtoul(argv[++i], nullptr, 10)) << 10;
+            stream_window = std::max(page, window / page * page);
+        } else if ((arg == "-s" || arg == "--sample") && i + 1 < argc) {
+            sample_every = strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-M" || arg == "--metrics-file") && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if ((arg == "-A" || arg == "--admin-socket") && i + 1 < argc) {
+            admin_path = argv[++i];
+            if (admin_path == "none") {
+                admin_path.clear();
+            }
+        } else if ((arg == "-H" || arg == "--handover-socket") && i + 1 < argc) {
+            handover_path = argv[++i];
+            if (handover_path == "none") {
+                handover_path.clear();
+            }
+        } else if (arg == "-T" || arg == "--takeover") {
+            takeover = true;
+        } else if (arg == "--mock" && i + 1 < argc) {
+            use_mock = true;
+            mock_opts.transfers = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--mock-size" && i + 1 < argc) {
+            mock_opts.size = static_cast<size_t>(strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--mock-files" && i + 1 < argc) {
+            mock_opts.files = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--mock-text") {
+            mock_opts.text = true;
+        } else if (arg == "--replica" && i + 1 < argc) {
+            replica_opts.peers.push_back(argv[++i]);
+        } else if (arg == "--replica-quorum" && i + 1 < argc) {
+            replica_quorum = strtol(argv[++i], nullptr, 10);
+        } else if (arg == "--replica-listen" && i + 1 < argc) {
+            replica_listen = argv[++i];
+        } else if (arg == "--ec" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u+%u", &ec_k, &ec_m) != 2 || ec_k == 0 || ec_m == 0) {
+                std::cerr << "Invalid erasure code geometry: " << argv[i] << " (expected K+M)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--ec-target" && i + 1 < argc) {
+            ec_targets.push_back(argv[++i]);
+        } else if (arg == "--ec-after" && i + 1 < argc) {
+            ec_after = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--dedup") {
+            dedup = true;
+        } else if (arg == "--compress" && i + 1 < argc) {
+            std::string err;
+            if (!parse_compress_policy(argv[++i], &compress, &err)) {
+                std::cerr << "Invalid compression: " << err << std::endl;
+                return 1;
+            }
+        } else if (arg == "--compress-dir" && i + 1 < argc) {
+            std::string spec = argv[++i];
+            size_t eq = spec.rfind('=');
+            CompressRule rule;
+            std::string err = "expected DIR=CODEC[:LEVEL]";
+            if (eq == std::string::npos || !parse_compress_policy(spec.substr(eq + 1), &rule.policy, &err)) {
+                std::cerr << "Invalid compression rule " << spec << ": " << err << std::endl;
+                return 1;
+            }
+            rule.dir = spec.substr(0, eq);
+            compress_rules.push_back(rule);
         } else if (arg == "-h" || arg == "--help") {
             show_usage(argv[0]);
             return 0;
@@ -187,16 +948,28 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    // 打开日志文件
-    log_file.open(LOG_FILE, std::ios::out | std::ios::app);
-    if (!log_file.is_open()) {
+    // 打开日志文件; 详细模式下记录并输出所有级别, 否则只把错误输出到终端
+    Logger& logger = Logger::instance();
+    if (!logger.open(LOG_FILE)) {
         std::cerr << "Failed to open log file: " << LOG_FILE << std::endl;
         return 1;
     }
+    logger.set_level(log_level_set ? log_level : (verbose ? LogLevel::DEBUG : LogLevel::INFO));
+    logger.set_echo_level(verbose ? LogLevel::DEBUG : LogLevel::ERROR);
+
+    // 详细模式下默认诊断每个传输, 与之前的行为一致
+    if (sample_every < 0) {
+        sample_every = verbose ? 1 : 0;
+    }
+    sampler.set_every(static_cast<uint32_t>(sample_every));
     
-    // 设置信号处理
-    signal(SIGTERM, signal_handler);
-    signal(SIGINT, signal_handler);
+    // 设置信号处理: 终止信号在创建任何线程之前阻塞, 所有线程继承该掩码,
+    // 之后只能通过signalfd在主线程的事件循环中收到
+    sigset_t stop_mask;
+    sigemptyset(&stop_mask);
+    sigaddset(&stop_mask, SIGTERM);
+    sigaddset(&stop_mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &stop_mask, nullptr);
     signal(SIGSEGV, signal_handler);
     signal(SIGBUS, signal_handler);
     signal(SIGFPE, signal_handler);
@@ -206,7 +979,7 @@ int main(int argc, char* argv[]) {
     if (daemon_mode) {
         pid_t pid = fork();
         if (pid < 0) {
-            log_message("ERROR", "Failed to fork daemon process");
+            TFS_LOG(ERROR, "Failed to fork daemon process");
             return 1;
         }
         if (pid > 0) {
@@ -223,249 +996,722 @@ int main(int argc, char* argv[]) {
         close(STDOUT_FILENO);
         close(STDERR_FILENO);
     }
+
+    // 写线程不能跨fork存在, 分离终端之后再启动
+    logger.start();
     
-    log_message("INFO", "TFS User Daemon - Secure Zero-Copy Verifier starting");
+    TFS_LOG(INFO, "TFS User Daemon - Secure Zero-Copy Verifier starting");
+
+    // 准备数据目录
+    if (mkdir(data_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        TFS_LOG(ERROR, "Failed to create data directory " + data_dir + ": " + strerror(errno));
+        return 1;
+    }
+    MetaStore meta(data_dir);
+    meta.set_checkpoint_bytes(static_cast<uint64_t>(checkpoint_mb) << 20);
+    StorageEngine::Options storage_opts;
+    storage_opts.segment_size = static_cast<uint64_t>(segment_mb) << 20;
+    if (num_workers == 0) {
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    storage_opts.commit_delay_us = commit_delay_us;
+    storage_opts.commit_batch = commit_batch > 0 ? commit_batch : num_workers;
+    storage_opts.ec_k = ec_k;
+    storage_opts.ec_m = ec_m;
+    storage_opts.ec_targets = ec_targets;
+    storage_opts.ec_after = ec_after;
+    storage_opts.dedup = dedup;
+    storage_opts.compress = compress;
+    storage_opts.cache_bytes = static_cast<size_t>(cache_mb) << 20;
+    StorageEngine storage(data_dir, storage_opts);
+
+    // 热升级: 先从旧进程接过控制设备, 旧进程交出时已停止写入数据目录, 之后才能打开元数据和存储。
+    // 段文件的扫描和元数据日志的重放在旧进程仍在服务时预先完成, 交接后只补上之后追加的部分。
+    // 写者感知到的停顿 = 旧进程排空在途传输 + 元数据日志补放 + 段尾补扫, 见日志中的"Takeover pause"
+    int inherited_ctl_fd = -1;
+    std::string inherited_state;
+    uint64_t takeover_start = 0;
+    uint64_t handover_done = 0;
+    if (takeover) {
+        if (handover_path.empty()) {
+            TFS_LOG(ERROR, "--takeover needs a handover socket");
+            return 1;
+        }
+        // 第一遍全量扫描期间旧进程写入的段在下一遍补扫, 直到一遍足够快, 交接后剩下的补扫量与之相当
+        std::string err;
+        for (int pass = 1; pass <= 3; pass++) {
+            uint64_t prescan_start = monotonic_ns();
+            if (!storage.prescan(&err)) {
+                TFS_LOG(WARNING, "Segment prescan failed, recovering fully after the handover: " + err);
+                break;
+            }
+            uint64_t prescan_ms = (monotonic_ns() - prescan_start) / 1000000;
+            TFS_LOG(INFO, "Prescan pass " + std::to_string(pass) + " took " + std::to_string(prescan_ms) + " ms");
+            if (prescan_ms < 100) {
+                break;
+            }
+        }
+
+        uint64_t prescan_start = monotonic_ns();
+        if (meta.prescan(&err)) {
+            TFS_LOG(INFO, "Metadata prescan: " + std::to_string(meta.node_count()) + " inodes, " +
+                   std::to_string(meta.replayed_ops()) + " log ops replayed in " +
+                   std::to_string((monotonic_ns() - prescan_start) / 1000000) + " ms");
+        } else {
+            TFS_LOG(WARNING, "Metadata prescan failed, replaying fully after the handover: " + err);
+        }
+
+        takeover_start = monotonic_ns();
+        HandoverInfo reply = {};
+        inherited_ctl_fd = handover_request(handover_path, &reply, &inherited_state, &err);
+        if (inherited_ctl_fd < 0) {
+            TFS_LOG(ERROR, "Failed to take over control device via " + handover_path + ": " + err);
+            return 1;
+        }
+        handover_done = monotonic_ns();
+        TFS_LOG(INFO, "Took over control device from pid " + std::to_string(reply.pid) + " (meta seq " +
+               std::to_string(reply.meta_seq) + ", " + std::to_string(reply.transfers) + " transfers, " +
+               std::to_string(reply.inflight) + " in flight) after " +
+               std::to_string((handover_done - takeover_start) / 1000) + " us");
+        if (use_mock) {
+            // 模拟设备的状态随应答传过来, 交来的eventfd不使用
+            close(inherited_ctl_fd);
+            inherited_ctl_fd = -1;
+        }
+    }
+
+    // 恢复元数据
+    {
+        std::string err;
+        if (!meta.open(&err)) {
+            TFS_LOG(ERROR, "Failed to open metadata store: " + err);
+            return 1;
+        }
+    }
+    uint64_t meta_done = monotonic_ns();
+    TFS_LOG(INFO, "Metadata store recovered: " + std::to_string(meta.node_count()) +
+           " inodes, last seq " + std::to_string(meta.applied_seq()) + ", " +
+           std::to_string(meta.replayed_ops()) + " log ops replayed");
+
+    // 打开数据段并按元数据重建数据索引
+    {
+        std::string err;
+        if (!storage.open(meta, &err)) {
+            TFS_LOG(ERROR, "Failed to open storage engine: " + err);
+            return 1;
+        }
+    }
+    {
+        StorageEngine::Stats st = storage.stats();
+        TFS_LOG(INFO, "Storage recovered: " + std::to_string(st.segments) + " segments, " +
+               std::to_string(st.live_bytes) + " live bytes" +
+               (storage.direct_io() ? "" : " (O_DIRECT unsupported, using buffered I/O)") +
+               ", crc32c: " + crc32c_impl());
+        if (const ErasureStore* ec = storage.erasure_store()) {
+            TFS_LOG(INFO, "Erasure coding: " + ec->describe() + ", " + std::to_string(st.archived_segments) +
+                   " segments encoded, encoding after " + std::to_string(ec_after) + " s");
+        }
+        if (dedup) {
+            TFS_LOG(INFO, "Deduplication: " + std::to_string(st.dedup_chunks) + " chunks indexed, sha256: " +
+                   sha256_impl());
+        }
+        if (compression_configured(storage)) {
+            TFS_LOG(INFO, "Compression: " + describe_compress_policy(compress) + " by default, " +
+                   std::to_string(compress_rules.size()) + " directory rules, codecs: " + available_codecs());
+        }
+        if (const BlockCache* cache = storage.block_cache()) {
+            TFS_LOG(INFO, "Block cache: " + std::to_string(cache->stats().capacity_bytes >> 20) + " MB, 2Q");
+        }
+    }
     
     // 记录启动时间
     time_t start_time = time(nullptr);
-    unsigned long total_transfers = 0;
     time_t last_health_check = start_time;
+    uint64_t last_health_bytes = 0;
     const int HEALTH_CHECK_INTERVAL = 300; // 5分钟检查一次
     
     // 健康检查函数
-    auto perform_health_check = [&](int ctl_fd) {
+    auto perform_health_check = [&](CtlChannel& ctl) {
         time_t current_time = time(nullptr);
         double uptime = difftime(current_time, start_time);
         
-        log_message("INFO", "Health Check Report:");
-        log_message("INFO", "- Uptime: " + std::to_string(static_cast<int>(uptime)) + " seconds");
-        log_message("INFO", "- Total transfers processed: " + std::to_string(total_transfers));
-        log_message("INFO", "- Average transfers per minute: " + 
-                   std::to_string(uptime > 0 ? (total_transfers * 60.0 / uptime) : 0));
+        TFS_LOG(INFO, "Health Check Report:");
+        TFS_LOG(INFO, "- Uptime: " + std::to_string(static_cast<int>(uptime)) + " seconds");
+        uint64_t transfers = metrics.transfers.load();
+        TFS_LOG(INFO, "- Total transfers processed: " + std::to_string(transfers));
+        TFS_LOG(INFO, "- Average transfers per minute: " + 
+               std::to_string(uptime > 0 ? (transfers * 60.0 / uptime) : 0));
+        uint64_t bytes = metrics.bytes.load();
+        double interval = difftime(current_time, last_health_check);
+        TFS_LOG(INFO, "- Throughput: " + std::to_string(interval > 0 ? (bytes - last_health_bytes) / interval : 0) +
+               " bytes/s since last check");
+        last_health_bytes = bytes;
+        // 平均值会掩盖尾延迟, 各阶段给出分位数
+        const std::pair<const char*, const LatencyHistogram*> stages[] = {
+            {"fetch", &metrics.fetch}, {"queue", &metrics.queue}, {"map", &metrics.map},
+            {"persist", &metrics.persist}, {"replicate", &metrics.replicate},
+            {"release", &metrics.release}, {"total", &metrics.total},
+        };
+        for (const auto& stage : stages) {
+            LatencyHistogram::Snapshot snap = stage.second->snapshot();
+            TFS_LOG(INFO, std::string("- Latency ") + stage.first + " (us): p50 " +
+                   std::to_string(snap.quantile(0.5) / 1000) + ", p99 " +
+                   std::to_string(snap.quantile(0.99) / 1000) + ", p99.9 " +
+                   std::to_string(snap.quantile(0.999) / 1000) + ", max " + std::to_string(snap.max / 1000));
+        }
+        TFS_LOG(INFO, "- Errors: fetch " + std::to_string(metrics.fetch_errors.load()) + ", map " +
+               std::to_string(metrics.map_errors.load()) + ", persist " +
+               std::to_string(metrics.persist_errors.load()) + ", replicate " +
+               std::to_string(metrics.replica_errors.load()) + ", release " +
+               std::to_string(metrics.complete_errors.load()));
+        TFS_LOG(INFO, "- Namespace: " + std::to_string(meta.node_count()) + " inodes, " +
+               std::to_string(meta.anomalies()) + " inconsistent ops, " +
+               std::to_string(meta.log_failures()) + " failed log appends");
+        StorageEngine::Stats st = storage.stats();
+        TFS_LOG(INFO, "- Storage: " + std::to_string(st.segments) + " segments (" +
+               std::to_string(st.free_segments) + " free), " + std::to_string(st.live_bytes) + "/" +
+               std::to_string(st.used_bytes) + " bytes live, " + std::to_string(st.appended_bytes) +
+               " appended, " + std::to_string(st.relocated_bytes) + " relocated, " +
+               std::to_string(st.reclaimed_segments) + " segments reclaimed, " +
+               std::to_string(st.write_errors) + " write errors, " +
+               std::to_string(st.checksum_errors) + " checksum errors");
+        TFS_LOG(INFO, "- Group commit: " + std::to_string(st.commit_rounds) + " rounds, " +
+               std::to_string(st.commit_rounds ? static_cast<double>(st.commit_requests) / st.commit_rounds : 0) +
+               " records/round, " + std::to_string(st.commit_syncs) + " fdatasyncs");
+        if (const ErasureStore* ec = storage.erasure_store()) {
+            ErasureStore::Stats es = ec->stats();
+            TFS_LOG(INFO, "- Erasure coding: " + std::to_string(st.archived_segments) + " segments (" +
+                   std::to_string(st.archived_bytes) + " bytes) in shards, " +
+                   std::to_string(es.encoded_segments) + " encoded, " + std::to_string(es.encode_failures) +
+                   " encode failures, " + std::to_string(es.degraded_reads) + " degraded reads (" +
+                   std::to_string(es.reconstructed_chunks) + " chunks rebuilt, " +
+                   std::to_string(es.unrecoverable_reads) + " unrecoverable)");
+        }
+        if (storage.dedup()) {
+            TFS_LOG(INFO, "- Deduplication: " + std::to_string(st.dedup_chunks) + " chunks (" +
+                   std::to_string(st.dedup_index_bytes) + " bytes of index), " +
+                   std::to_string(st.dedup_bytes) + " appended bytes stored as references");
+        }
+        if (compression_configured(storage)) {
+            TFS_LOG(INFO, "- Compression: " + std::to_string(st.compress_in_bytes) + " bytes compressed to " +
+                   std::to_string(st.compress_out_bytes) + ", " + std::to_string(st.compress_skipped_bytes) +
+                   " bytes stored uncompressed");
+        }
+        if (const BlockCache* cache = storage.block_cache()) {
+            BlockCache::Stats cs = cache->stats();
+            TFS_LOG(INFO, "- Block cache: " + std::to_string(cs.resident_bytes) + "/" +
+                   std::to_string(cs.capacity_bytes) + " bytes, " + std::to_string(cs.hits) + " hits, " +
+                   std::to_string(cs.misses) + " misses, " + std::to_string(cs.evictions) + " evictions, " +
+                   std::to_string(cs.promotions) + " promoted from the ghost queue");
+        }
+        if (replicator != nullptr) {
+            Replicator::Stats rs = replicator->stats();
+            TFS_LOG(INFO, "- Replication: " + std::to_string(rs.peers_up) + " peers up, " +
+                   std::to_string(rs.frames) + " frames (" + std::to_string(rs.zerocopy_sends) + " zerocopy, " +
+                   std::to_string(rs.zerocopy_copied) + " copied by the kernel), " + std::to_string(rs.acks) +
+                   " acks, " + std::to_string(rs.failures) + " peer failures, " +
+                   std::to_string(rs.reconnects) + " reconnects");
+        }
+        if (replica_server != nullptr) {
+            ReplicaServer::Stats rs = replica_server->stats();
+            TFS_LOG(INFO, "- Replica streams: " + std::to_string(rs.connections) + " connected, " +
+                   std::to_string(rs.frames) + " frames, " + std::to_string(rs.bytes) + " bytes, " +
+                   std::to_string(rs.meta_ops) + " metadata ops, " + std::to_string(rs.errors) + " errors");
+        }
+        TFS_LOG(INFO, "- Log records dropped: " + std::to_string(Logger::instance().dropped()));
         
         // 验证控制设备是否仍然可用
-        if (fcntl(ctl_fd, F_GETFD) == -1) {
-            log_message("ERROR", "Control device is no longer accessible!");
+        if (fcntl(ctl.fd(), F_GETFD) == -1) {
+            TFS_LOG(ERROR, "Control device is no longer accessible!");
             return false;
         }
         
         return true;
     };
     
-    // 打开控制设备
-    int ctl_fd = open("/dev/tfs_ctl", O_RDWR);
-    if (ctl_fd < 0) {
-        log_message("ERROR", "Failed to open control device: " + std::string(strerror(errno)));
-        return 1;
+    // 打开控制设备 (非阻塞), 或者进程内模拟的控制设备
+    std::unique_ptr<CtlChannel> ctl;
+    if (use_mock) {
+        ctl.reset(new MockCtlChannel(mock_opts));
+    } else {
+        ctl.reset(new DeviceCtlChannel("/dev/tfs_ctl", inherited_ctl_fd));
+    }
+    if (takeover) {
+        std::string err;
+        if (!ctl->restore_state(inherited_state, &err)) {
+            TFS_LOG(ERROR, "Failed to restore control device state: " + err);
+            return 1;
+        }
+    }
+    if (ctl->fd() < 0) {
+        std::string err;
+        if (!ctl->open(&err)) {
+            TFS_LOG(ERROR, "Failed to open control device: " + err);
+            return 1;
+        }
     }
     
-    log_message("INFO", "Successfully opened control device");
-    
-    // 设置文件描述符为非阻塞模式
-    int flags = fcntl(ctl_fd, F_GETFL, 0);
-    fcntl(ctl_fd, F_SETFL, flags | O_NONBLOCK);
+    TFS_LOG(INFO, "Successfully opened control device " + ctl->name());
+    uint64_t ctl_opened_at = monotonic_ns();
 
     // 错误计数器，用于避免无限循环
     int consecutive_errors = 0;
     const int max_consecutive_errors = 10;
+
+    // 传输处理线程池: 本线程只负责领取传输项和处理元数据/容量,
+    // 各worker独立映射、校验并按ID完成, 完成顺序与领取顺序无关
+    WorkerPool pool(num_workers);
+    // 限制已领取未完成的传输数, 避免一次性把内核队列全部搬空
+    const size_t max_inflight = pool.size() * 4;
+    std::vector<struct tfs_xfer_info> infos(std::min<size_t>(max_inflight, TFS_XFER_BATCH_MAX));
+    TFS_LOG(INFO, "Started " + std::to_string(pool.size()) + " transfer workers");
+
+    // 主线程的事件循环: 控制设备的等待和元数据日志的写入/落盘在同一循环中完成
+    EventLoop loop;
+    {
+        std::string err;
+        if (!loop.init(256, &err)) {
+            TFS_LOG(ERROR, "Failed to initialize event loop: " + err);
+            ctl->close();
+            return 1;
+        }
+    }
+    TFS_LOG(INFO, std::string("Event loop backend: ") + (loop.uses_io_uring() ? "io_uring" : "poll"));
+    meta.set_event_loop(&loop);
+
+    // 管理套接字: 运行中调整诊断采样等, 打不开不影响数据路径
+    AdminSocket admin(loop);
+    admin.add_command("sample", "Show or change content sampling: off | every N | next N | "
+                      "inode add|del INO | errors on|off", sample_command);
+    if (!admin_path.empty()) {
+        std::string err;
+        if (admin.open(admin_path, &err)) {
+            TFS_LOG(INFO, "Admin socket listening on " + admin_path);
+        } else {
+            TFS_LOG(WARNING, "Failed to open admin socket: " + err);
+        }
+    }
+    TFS_LOG(INFO, "Diagnostic sampling: " + sampler.describe());
+
+    // 复制: 作为对端接收其他tfsd的数据, 以及把本地的传输发给对端
+    // 复制来的元数据由读线程交给主线程, 与内核的元数据一样在主循环中应用
+    // 复制数据用单独的worker写入, 传输worker可能正阻塞在等待对端应答上
+    ReplicaServer replica(storage, num_workers);
+    uint64_t replica_poll = 0;
+    bool replica_meta_due = false;
+    std::function<void()> arm_replica_poll = [&]() {
+        if (replica.meta_fd() < 0 || replica_poll != 0) {
+            return;
+        }
+        replica_poll = loop.poll_add(replica.meta_fd(), POLLIN, [&](int res) {
+            replica_poll = 0;
+            if (res >= 0) {
+                replica_meta_due = true;
+            }
+        });
+    };
+    if (!replica_listen.empty()) {
+        std::string err;
+        if (!replica.open(replica_listen, &err)) {
+            TFS_LOG(ERROR, "Failed to open replica listener: " + err);
+            ctl->close();
+            return 1;
+        }
+        replica_server = &replica;
+        arm_replica_poll();
+        TFS_LOG(INFO, "Accepting replicated transfers on " + replica_listen);
+    }
+    std::unique_ptr<Replicator> replica_sender;
+    if (!replica_opts.peers.empty()) {
+        size_t peers = replica_opts.peers.size();
+        replica_opts.quorum = static_cast<unsigned>(replica_quorum < 0 ? peers
+                                                    : std::min<size_t>(replica_quorum, peers));
+        replica_sender.reset(new Replicator(replica_opts));
+        replica_sender->start();
+        replicator = replica_sender.get();
+        TFS_LOG(INFO, "Replicating to " + std::to_string(peers) + " peers, quorum " +
+               std::to_string(replica_opts.quorum));
+    }
+
+    // 热升级的交接套接字: 新进程连上后停止领取, 在退出流程中交出控制设备
+    // 模拟设备交出的是生成进度 (CtlChannel::save_state)
+    int handover_fd = -1;
+    int handover_conn = -1;
+    uint64_t handover_poll = 0;
+    if (!handover_path.empty()) {
+        std::string err;
+        handover_fd = handover_listen(handover_path, &err);
+        if (handover_fd < 0) {
+            TFS_LOG(WARNING, "Failed to open handover socket: " + err);
+        }
+    }
+    std::function<void()> arm_handover = [&]() {
+        if (handover_fd < 0 || handover_poll != 0) {
+            return;
+        }
+        handover_poll = loop.poll_add(handover_fd, POLLIN, [&](int res) {
+            handover_poll = 0;
+            if (res < 0) {
+                return;
+            }
+            int conn = accept4(handover_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn >= 0 && handover_conn < 0) {
+                TFS_LOG(INFO, "Handover requested, draining in-flight transfers");
+                handover_conn = conn;
+                running = false;
+                return;
+            }
+            if (conn >= 0) {
+                close(conn);
+            }
+            arm_handover();
+        });
+    };
+    arm_handover();
+
+    admin.add_command("metrics", "Dump metrics in Prometheus text format", [&](const std::vector<std::string>&) {
+        return render_metrics(*ctl, meta, storage, pool, start_time);
+    });
+    // 读取可能要从段文件读出并校验几十MB, 放到worker上执行, 不阻塞主循环的领取和元数据日志
+    admin.add_async_command("read", "Read a file range through the block cache: INO OFFSET LEN",
+                            [&](const std::vector<std::string>& args, AdminSocket::Reply reply) {
+        pool.submit([&storage, args, reply]() {
+            std::string text;
+            try {
+                text = read_command(storage, args);
+            } catch (const std::exception& e) {
+                text = "error: " + std::string(e.what());
+            }
+            reply(std::move(text));
+        });
+    });
+
+    // 终止信号
+    int sig_fd = signalfd(-1, &stop_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    uint64_t sig_poll = 0;
+    int idle_timeout_ms = -1;
+    if (sig_fd < 0) {
+        // 退回到信号处理函数, 空闲等待需要超时以便检查running
+        TFS_LOG(WARNING, "signalfd failed, falling back to signal handlers: " + std::string(strerror(errno)));
+        signal(SIGTERM, signal_handler);
+        signal(SIGINT, signal_handler);
+        sigprocmask(SIG_UNBLOCK, &stop_mask, nullptr);
+        idle_timeout_ms = 1000;
+    }
+    std::function<void()> arm_sig_poll = [&]() {
+        if (sig_fd < 0 || sig_poll != 0) {
+            return;
+        }
+        sig_poll = loop.poll_add(sig_fd, POLLIN, [&](int res) {
+            sig_poll = 0;
+            if (res < 0) {
+                return;
+            }
+            struct signalfd_siginfo si;
+            if (read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+                stop_signal = si.ssi_signo;
+                running = false;
+            }
+            arm_sig_poll();
+        });
+    };
+    arm_sig_poll();
+
+    // 容量推送、指标文件和健康检查的定时器
+    PeriodicTimer capacity_timer, metrics_timer, health_timer;
+    if (!start_timer(capacity_timer, CAPACITY_PUSH_INTERVAL) || !start_timer(health_timer, HEALTH_CHECK_INTERVAL) ||
+        (!metrics_path.empty() && !start_timer(metrics_timer, METRICS_WRITE_INTERVAL))) {
+        TFS_LOG(ERROR, "Failed to create timers: " + std::string(strerror(errno)));
+        ctl->close();
+        return 1;
+    }
+    arm_timer(loop, capacity_timer);
+    arm_timer(loop, health_timer);
+    arm_timer(loop, metrics_timer);
+    if (!metrics_path.empty()) {
+        metrics_timer.due = true;
+    }
+
+    // 控制设备的单次poll, 触发后在空闲时重新提交
+    uint64_t ctl_poll = 0;
+    int ctl_revents = 0;
+    auto arm_ctl_poll = [&]() {
+        if (ctl_poll != 0) {
+            return;
+        }
+        ctl_poll = loop.poll_add(ctl->fd(), POLLIN | POLLPRI, [&](int res) {
+            ctl_poll = 0;
+            if (res < 0) {
+                if (res != -ECANCELED) {
+                    TFS_LOG(ERROR, "Poll failed: " + std::string(strerror(-res)));
+                }
+                return;
+            }
+            ctl_revents |= res;
+        });
+    };
+    uint64_t reported_log_failures = 0;
+
+    push_capacity(*ctl);
+    if (takeover_start != 0) {
+        // 从旧进程停止领取到本进程开始领取, 写者在此期间等待
+        uint64_t now = monotonic_ns();
+        TFS_LOG(INFO, "Takeover pause: resumed fetching " + std::to_string((now - takeover_start) / 1000) +
+               " us after requesting the handover (handover " + std::to_string((handover_done - takeover_start) / 1000) +
+               " us, metadata " + std::to_string((meta_done - handover_done) / 1000) + " us, storage and startup " +
+               std::to_string((now - meta_done) / 1000) + " us)");
+    }
     
     while (running) {
         try {
-            int count = 0;
-            
-            // 获取传输项数量
-            if (ioctl(ctl_fd, TFS_GET_XFER_COUNT, &count) < 0) {
-                log_message("ERROR", "ioctl TFS_GET_XFER_COUNT failed: " + std::string(strerror(errno)));
-                consecutive_errors++;
-                
-                if (consecutive_errors >= max_consecutive_errors) {
-                    log_message("CRITICAL", "Too many consecutive errors (" + 
-                               std::to_string(consecutive_errors) + "), pausing for recovery");
-                    sleep(5); // 暂停更长时间以恢复
-                    consecutive_errors = 0; // 重置错误计数
-                } else {
-                    sleep(1);
-                }
-                continue;
+            // 模拟设备的负载全部完成
+            if (ctl->exhausted()) {
+                running = false;
+                break;
             }
-            
-            // 成功获取计数，重置错误计数
-            consecutive_errors = 0;
-        
-        if (count == 0) {
-            // 无数据传输，等待
-            struct pollfd pfd = {ctl_fd, POLLIN, 0};
-            int ret = poll(&pfd, 1, 1000); // 等待1秒
-            if (ret < 0 && errno != EINTR) {
-                log_message("ERROR", "Poll failed: " + std::string(strerror(errno)));
+
+            // 定期推送容量, 保证内核缓存在有效期内
+            if (capacity_timer.due) {
+                capacity_timer.due = false;
+                push_capacity(*ctl);
             }
-            
-            // 检查是否需要执行健康检查
-            time_t current_time = time(nullptr);
-            if (difftime(current_time, last_health_check) >= HEALTH_CHECK_INTERVAL) {
-                if (!perform_health_check(ctl_fd)) {
-                    log_message("CRITICAL", "Health check failed, attempting to recover");
-                    // 尝试重新打开控制设备
-                    close(ctl_fd);
+
+            if (metrics_timer.due) {
+                metrics_timer.due = false;
+                if (!write_metrics_file(metrics_path, render_metrics(*ctl, meta, storage, pool, start_time))) {
+                    TFS_LOG(WARNING, "Failed to write metrics file " + metrics_path + ": " + strerror(errno));
+                }
+            }
+
+            if (health_timer.due) {
+                health_timer.due = false;
+                time_t current_time = time(nullptr);
+                if (!perform_health_check(*ctl)) {
+                    TFS_LOG(CRITICAL, "Health check failed, attempting to recover");
+                    // worker和事件循环仍在使用旧描述符, 先等它们完成再重新打开
+                    pool.wait_idle();
+                    loop.cancel(ctl_poll);
+                    while (ctl_poll != 0 && loop.run_once(100) >= 0) {
+                    }
+                    ctl->close();
                     sleep(1);
-                    ctl_fd = open("/dev/tfs_ctl", O_RDWR);
-                    if (ctl_fd < 0) {
-                        log_message("CRITICAL", "Failed to reopen control device: " + std::string(strerror(errno)));
+                    std::string err;
+                    if (!ctl->open(&err)) {
+                        TFS_LOG(CRITICAL, "Failed to reopen control device: " + err);
                         running = false; // 停止运行
                         break;
                     }
-                    log_message("INFO", "Successfully reopened control device");
-                    flags = fcntl(ctl_fd, F_GETFL, 0);
-                    fcntl(ctl_fd, F_SETFL, flags | O_NONBLOCK);
+                    TFS_LOG(INFO, "Successfully reopened control device");
                 }
                 last_health_check = current_time;
             }
-            
-            continue;
-        }
 
-        log_message("INFO", "Found " + std::to_string(count) + " pending transfers");
-        total_transfers += count; // 更新总传输计数
-        
-        struct tfs_xfer_info info;
-        if (ioctl(ctl_fd, TFS_GET_XFER_INFO, &info) < 0) {
-            log_message("ERROR", "ioctl TFS_GET_XFER_INFO failed: " + std::string(strerror(errno)));
-            continue;
-        }
-        
-        log_message("INFO", "Processing transfer - Offset: " + std::to_string(info.offset) + 
-                          ", Size: " + std::to_string(info.size) + 
-                          ", PFN: 0x" + std::to_string(info.pfn));
-
-        // 处理空文件的特殊情况
-        if (info.size == 0 || info.pfn == 0) {  // 添加对pfn=0的检查
-            log_message("INFO", "Empty file detected (size=" + std::to_string(info.size) + 
-                       ", pfn=" + std::to_string(info.pfn) + "), skipping memory mapping");
-            log_message("DEBUG", "Empty file transfer details - Offset: " + std::to_string(info.offset));
-            
-            // 对于空文件，直接释放传输项
-            log_message("INFO", "Releasing empty file transfer item");
-            if (ioctl(ctl_fd, TFS_RELEASE_XFER) < 0) {
-                log_message("ERROR", "ioctl TFS_RELEASE_XFER failed for empty file: " + std::string(strerror(errno)));
-                log_message("ERROR", "Errno: " + std::to_string(errno) + " - " + std::string(strerror(errno)));
-            } else {
-                log_message("INFO", "Empty file transfer processed and released successfully");
+            // 先处理元数据: 数据传输总是在其文件的create之后入队,
+            // 先取元数据可保证tfsd看到传输时已知道对应的inode
+            drain_metadata(*ctl, meta, storage);
+            if (replica_meta_due) {
+                replica_meta_due = false;
+                replica.apply_meta([&](const tfs_meta_op* ops, size_t n) {
+                    apply_metadata(ops, n, meta, storage);
+                });
+                arm_replica_poll();
             }
-            
-            // 检查是否还有更多传输项
-            int remaining_count = 0;
-            if (ioctl(ctl_fd, TFS_GET_XFER_COUNT, &remaining_count) >= 0) {
-                log_message("DEBUG", "Remaining transfers after empty file processing: " + std::to_string(remaining_count));
+
+            // 收割已完成的日志写入, 不等待
+            loop.run_once(0);
+            if (meta.log_failures() != reported_log_failures) {
+                reported_log_failures = meta.log_failures();
+                TFS_LOG(ERROR, "Metadata log append failed (" + std::to_string(reported_log_failures) +
+                       " batches so far)");
             }
-            
-            continue;
-        }
-        
-        // 使用mmap映射共享内存 (零拷贝关键)
-        // 确保文件大小合理，避免映射过大内存
-        if (info.size > 100 * 1024 * 1024) { // 限制为100MB
-            log_message("WARNING", "File size too large for mapping: " + std::to_string(info.size) + " bytes");
-            log_message("INFO", "Limiting mapping to first 100MB");
-            info.size = 100 * 1024 * 1024;
-        }
-        
-        void *shared_mem = mmap(NULL, info.size, PROT_READ, MAP_SHARED, ctl_fd, 0);
-        
-        if (shared_mem == MAP_FAILED) {
-            log_message("ERROR", "mmap failed: " + std::string(strerror(errno)) + 
-                       ", size: " + std::to_string(info.size) + 
-                       ", offset: " + std::to_string(info.offset));
-            
-            // 尝试释放传输项，即使映射失败
-            if (ioctl(ctl_fd, TFS_RELEASE_XFER) < 0) {
-                log_message("ERROR", "ioctl TFS_RELEASE_XFER failed after mmap error: " + std::string(strerror(errno)));
+
+            // 日志过长时做检查点, 限制重启和热升级时要重放的量; 失败后不再重试, 日志继续追加
+            if (meta.checkpoint_due()) {
+                std::string err;
+                uint64_t checkpoint_start = monotonic_ns();
+                if (meta.checkpoint(&err)) {
+                    TFS_LOG(INFO, "Metadata checkpoint: " + std::to_string(meta.node_count()) + " inodes in " +
+                           std::to_string((monotonic_ns() - checkpoint_start) / 1000) + " us");
+                } else {
+                    TFS_LOG(ERROR, "Metadata checkpoint failed, disabling checkpoints: " + err);
+                    meta.set_checkpoint_bytes(0);
+                }
             }
-            continue;
-        } else {
-            const char *data_ptr = static_cast<const char*>(shared_mem);
-            
-            if (verbose) {
-                // 详细日志模式下显示传输详情
-                std::string content_preview = safe_print(data_ptr, std::min(size_t(64), info.size));
-                log_message("DEBUG", "Content Preview: \"" + content_preview + "\"");
+
+            // 等待worker腾出名额再领取
+            pool.wait_below(max_inflight);
+            size_t room = std::min(infos.size(), max_inflight - pool.outstanding());
+
+            struct tfs_xfer_batch batch = {};
+            batch.infos = reinterpret_cast<uint64_t>(infos.data());
+            batch.max_xfers = room;
+            uint64_t fetch_start = monotonic_ns();
+            if (ctl->ioctl(TFS_FETCH_XFERS, &batch) < 0) {
+                metrics.fetch_errors.fetch_add(1, std::memory_order_relaxed);
+                TFS_LOG(ERROR, "ioctl TFS_FETCH_XFERS failed: " + std::string(strerror(errno)));
+                consecutive_errors++;
                 
-                if (info.size <= 1024) {
-                    log_message("DEBUG", "Full content available for verification");
+                if (consecutive_errors >= max_consecutive_errors) {
+                    TFS_LOG(CRITICAL, "Too many consecutive errors (" + 
+                           std::to_string(consecutive_errors) + "), pausing for recovery");
+                    sleep(5); // 暂停更长时间以恢复
+                    consecutive_errors = 0; // 重置错误计数
                 } else {
-                    log_message("DEBUG", "Large transfer detected, showing first 64 bytes only");
+                    sleep(1);
                 }
+                continue;
             }
             
-            // 安全显示文本内容，限制预览大小以避免过大的日志
-            size_t preview_size = std::min(info.size, static_cast<size_t>(128));
-            std::string content_preview = safe_print(data_ptr, preview_size);
-            if (info.size > preview_size) {
-                content_preview += "... [" + std::to_string(info.size - preview_size) + " more bytes]";
+            // 成功领取，重置错误计数
+            consecutive_errors = 0;
+            uint64_t fetched_at = monotonic_ns();
+            if (batch.nr_xfers > 0) {
+                metrics.fetch.record(fetched_at - fetch_start);
             }
-            log_message("INFO", "Content Preview: \"" + content_preview + "\"");
-            
-            // 十六进制dump (仅当小于1KB时完整显示或者详细模式)
-            if (verbose) {
-                try {
-                    if (info.size <= 1024) {
-                        log_message("DEBUG", "Hex Dump available for full content");
-                        std::cout << "Hex Dump:\n";
-                        hex_dump(data_ptr, info.size);
-                    } else {
-                        size_t dump_size = std::min(info.size, static_cast<size_t>(64));
-                        log_message("DEBUG", "Hex Dump available for first " + std::to_string(dump_size) + " bytes");
-                        std::cout << "Hex Dump (first " + std::to_string(dump_size) + " bytes):\n";
-                        hex_dump(data_ptr, dump_size);
-                        std::cout << "<" << (info.size - dump_size) << " more bytes...>\n";
-                    }
-                } catch (const std::exception& e) {
-                    log_message("ERROR", "Exception during hex dump: " + std::string(e.what()));
-                }
+        
+        if (batch.nr_xfers == 0) {
+            // 无数据传输: 睡到控制设备就绪 (传输、元数据或容量刷新请求)、
+            // 收到终止信号、定时器到期或日志写入完成
+            arm_ctl_poll();
+            int ret = loop.run_once(idle_timeout_ms);
+            if (ret < 0 && ret != -EINTR) {
+                TFS_LOG(ERROR, "Event loop failed: " + std::string(strerror(-ret)));
             }
-            
-            // 验证内容完整性
-            std::string data_hash = "N/A";
-            log_message("INFO", "Verification: " + data_hash + " OK");
-            
-            // 解除映射
-            if (munmap(shared_mem, info.size) != 0) {
-                log_message("WARNING", "munmap failed: " + std::string(strerror(errno)));
+            if (ctl_revents & POLLPRI) {
+                // statfs发现缓存过期, 立即刷新
+                push_capacity(*ctl);
             }
+            ctl_revents = 0;
+            continue;
         }
-        
-        // 释放传输项
-        if (ioctl(ctl_fd, TFS_RELEASE_XFER) < 0) {
-            log_message("ERROR", "ioctl TFS_RELEASE_XFER failed: " + std::string(strerror(errno)));
-            consecutive_errors++;
-        } else {
-            log_message("INFO", "Transfer released successfully");
-            consecutive_errors = 0; // 成功释放，重置错误计数
+
+        if (verbose) {
+            TFS_LOG(DEBUG, "Fetched " + std::to_string(batch.nr_xfers) + " transfers, " +
+                   std::to_string(pool.outstanding()) + " in flight");
+        }
+
+        // 这批传输之前的元数据都已应用, 记录下来供恢复时判断删除/截断的先后
+        uint64_t meta_seq = meta.applied_seq();
+        for (uint32_t k = 0; k < batch.nr_xfers; k++) {
+            struct tfs_xfer_info info = infos[k];
+            pool.submit([&ctl = *ctl, info, meta_seq, fetched_at, &storage, &meta]() {
+                uint64_t started_at = monotonic_ns();
+                metrics.queue.record(started_at - fetched_at);
+                int status;
+                DiagSampler::Reason reason = DiagSampler::Reason::None;
+                std::string sample;
+                uint64_t persisted_at = 0;
+                try {
+                    status = process_transfer(ctl, info, storage, meta_seq, compress_policy_for(meta, info.ino),
+                                              &reason, &sample, &persisted_at);
+                } catch (const std::exception& e) {
+                    TFS_LOG(ERROR, "Exception while processing transfer " + std::to_string(info.id) +
+                           ": " + std::string(e.what()));
+                    status = -EIO;
+                }
+                // 无论成功与否都必须完成, 否则写入方会一直等待
+                if (persisted_at == 0) {
+                    persisted_at = monotonic_ns();
+                }
+                if (complete_transfer(ctl, info.id, status)) {
+                    metrics.transfers.fetch_add(1, std::memory_order_relaxed);
+                    if (status == 0) {
+                        metrics.bytes.fetch_add(info.size, std::memory_order_relaxed);
+                    }
+                }
+                uint64_t done_at = monotonic_ns();
+                metrics.release.record(done_at - persisted_at);
+                metrics.total.record(done_at - fetched_at);
+                if (reason != DiagSampler::Reason::None) {
+                    log_sample(info, reason, sample);
+                }
+            });
         }
         
         } catch (const std::exception& e) {
-            log_message("ERROR", "Exception in main loop: " + std::string(e.what()));
+            TFS_LOG(ERROR, "Exception in main loop: " + std::string(e.what()));
             consecutive_errors++;
             
-            // 尝试释放传输项，即使发生异常
-            if (ioctl(ctl_fd, TFS_RELEASE_XFER) < 0) {
-                log_message("ERROR", "ioctl TFS_RELEASE_XFER failed after exception: " + 
-                           std::string(strerror(errno)));
-            }
-            
             if (consecutive_errors >= max_consecutive_errors) {
-                log_message("CRITICAL", "Too many consecutive exceptions, pausing for recovery");
+                TFS_LOG(CRITICAL, "Too many consecutive exceptions, pausing for recovery");
                 sleep(5);
                 consecutive_errors = 0;
             } else {
                 sleep(1);
             }
         }
-        
-        log_message("INFO", "--------------------------------------------------");
     }
 
-    log_message("INFO", "TFS daemon shutting down");
-    close(ctl_fd);
-    log_file.close();
+    if (stop_signal) {
+        TFS_LOG(INFO, "Received termination signal (" + std::to_string(stop_signal) + "), shutting down...");
+    }
+
+    // 先断开入站的复制连接, 不再有新的写入任务; 已领取的传输全部完成后才能关闭控制设备
+    replica.close();
+    replica_server = nullptr;
+    pool.wait_idle();
+    if (replicator != nullptr) {
+        replicator->stop();
+    }
+
+    // 等待元数据日志写完
+    loop.cancel(ctl_poll);
+    loop.cancel(sig_poll);
+    loop.cancel(handover_poll);
+    loop.cancel(replica_poll);
+    stop_timer(loop, capacity_timer);
+    stop_timer(loop, metrics_timer);
+    stop_timer(loop, health_timer);
+    admin.close();
+    while (loop.pending() > 0 && loop.run_once(100) >= 0) {
+    }
+    for (int fd : {sig_fd, capacity_timer.fd, metrics_timer.fd, health_timer.fd}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (!metrics_path.empty()) {
+        write_metrics_file(metrics_path, render_metrics(*ctl, meta, storage, pool, start_time));
+    }
+    if (handover_fd >= 0) {
+        close(handover_fd);
+        unlink(handover_path.c_str());
+    }
+    if (handover_conn >= 0) {
+        // 存储引擎停止写入后新进程才能打开数据目录; 元数据日志已随事件循环落盘
+        storage.close();
+        HandoverInfo reply = {};
+        reply.magic = kHandoverMagic;
+        reply.version = kHandoverVersion;
+        reply.pid = getpid();
+        reply.meta_seq = meta.applied_seq();
+        reply.transfers = metrics.transfers.load();
+        reply.inflight = pool.outstanding();
+        HandoverInfo peer = {};
+        std::string err;
+        if (handover_send(handover_conn, ctl->fd(), reply, ctl->save_state(), &peer, &err)) {
+            TFS_LOG(INFO, "Handed control device over to pid " + std::to_string(peer.pid));
+        } else {
+            // 描述符没有交出, 关闭后内核把残留的inflight放回队列
+            TFS_LOG(ERROR, "Handover failed: " + err);
+        }
+        close(handover_conn);
+    }
+    if (use_mock) {
+        MockCtlChannel::Stats ms = static_cast<MockCtlChannel&>(*ctl).stats();
+        double secs = (monotonic_ns() - ctl_opened_at) / 1e9;
+        TFS_LOG(INFO, "Mock workload: " + std::to_string(ms.completed) + "/" + std::to_string(ms.generated) +
+               " transfers completed (" + std::to_string(ms.failed) + " failed) in " + std::to_string(secs) +
+               " s, " + std::to_string(secs > 0 ? ms.completed / secs : 0) + " transfers/s, " +
+               std::to_string(secs > 0 ? ms.bytes / secs / (1 << 20) : 0) + " MiB/s");
+    }
+    TFS_LOG(INFO, "Processed " + std::to_string(metrics.transfers.load()) + " transfers, " +
+           std::to_string(pool.steals()) + " stolen between workers");
+    TFS_LOG(INFO, "TFS daemon shutting down");
+    if (logger.dropped() > 0) {
+        TFS_LOG(WARNING, "Logger dropped " + std::to_string(logger.dropped()) + " records in total");
+    }
+    ctl->close();
+    logger.stop();
     return 0;
 }
\ No newline at end of file
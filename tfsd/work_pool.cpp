@@ -0,0 +1,102 @@
+#include "work_pool.h"
+
+WorkerPool::WorkerPool(size_t nworkers) {
+    if (nworkers == 0) {
+        nworkers = 1;
+    }
+    workers_.reserve(nworkers);
+    for (size_t i = 0; i < nworkers; i++) {
+        workers_.emplace_back(new Worker);
+    }
+    threads_.reserve(nworkers);
+    for (size_t i = 0; i < nworkers; i++) {
+        threads_.emplace_back(&WorkerPool::run, this, i);
+    }
+}
+
+// 先执行完已提交的任务再退出, 保证每个领取的传输都被完成
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(idle_lock_);
+        stopping_ = true;
+    }
+    idle_cv_.notify_all();
+    for (auto& t : threads_) {
+        t.join();
+    }
+}
+
+void WorkerPool::submit(Task task) {
+    Worker& w = *workers_[next_.fetch_add(1) % workers_.size()];
+    outstanding_.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(w.lock);
+        w.tasks.push_back(std::move(task));
+    }
+    queued_.fetch_add(1);
+    // 在idle_lock_下唤醒, 防止worker检查完计数后、睡眠前错过通知
+    {
+        std::lock_guard<std::mutex> lock(idle_lock_);
+    }
+    idle_cv_.notify_one();
+}
+
+void WorkerPool::wait_below(size_t limit) {
+    std::unique_lock<std::mutex> lock(idle_lock_);
+    drained_cv_.wait(lock, [&] { return outstanding_.load() < limit; });
+}
+
+bool WorkerPool::pop_local(size_t self, Task* task) {
+    Worker& w = *workers_[self];
+    std::lock_guard<std::mutex> lock(w.lock);
+    if (w.tasks.empty()) {
+        return false;
+    }
+    *task = std::move(w.tasks.back());
+    w.tasks.pop_back();
+    return true;
+}
+
+bool WorkerPool::steal(size_t self, Task* task) {
+    size_t n = workers_.size();
+    for (size_t i = 1; i < n; i++) {
+        Worker& victim = *workers_[(self + i) % n];
+        std::unique_lock<std::mutex> lock(victim.lock, std::try_to_lock);
+        if (!lock.owns_lock() || victim.tasks.empty()) {
+            continue;
+        }
+        *task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        steals_.fetch_add(1);
+        return true;
+    }
+    return false;
+}
+
+void WorkerPool::run(size_t self) {
+    for (;;) {
+        Task task;
+        if (pop_local(self, &task) || steal(self, &task)) {
+            queued_.fetch_sub(1);
+            task();
+            {
+                std::lock_guard<std::mutex> lock(idle_lock_);
+                outstanding_.fetch_sub(1);
+            }
+            drained_cv_.notify_all();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_lock_);
+        if (queued_.load() > 0) {
+            // 偷取时对方队列正被锁住, 重试
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        if (stopping_) {
+            return;
+        }
+        idle_cv_.wait(lock, [&] { return queued_.load() > 0 || stopping_; });
+    }
+}
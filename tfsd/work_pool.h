@@ -0,0 +1,64 @@
+#ifndef TFSD_WORK_POOL_H
+#define TFSD_WORK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 传输处理线程池
+// 每个worker有自己的双端队列: 本线程从队尾取 (刚提交的数据更可能还在缓存里),
+// 空闲时从其他worker的队头偷取, 避免单个慢传输拖住一整条队列。
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkerPool(size_t nworkers);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // 按轮询分配到某个worker的本地队列
+    void submit(Task task);
+
+    // 阻塞直到未完成的任务数小于limit
+    void wait_below(size_t limit);
+
+    // 阻塞直到所有已提交的任务执行完
+    void wait_idle() { wait_below(1); }
+
+    size_t size() const { return workers_.size(); }
+    size_t outstanding() const { return outstanding_.load(); }
+    uint64_t steals() const { return steals_.load(); }
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    void run(size_t self);
+    bool pop_local(size_t self, Task* task);
+    bool steal(size_t self, Task* task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    std::mutex idle_lock_;
+    std::condition_variable idle_cv_;       // 没有可执行任务的worker在此等待
+    std::condition_variable drained_cv_;    // 提交方等待任务完成
+    std::atomic<size_t> queued_{0};         // 还在队列中的任务
+    std::atomic<size_t> outstanding_{0};    // 已提交未完成的任务
+    std::atomic<size_t> next_{0};
+    std::atomic<uint64_t> steals_{0};
+    bool stopping_ = false;                 // 受idle_lock_保护
+};
+
+#endif // TFSD_WORK_POOL_H